@@ -0,0 +1,210 @@
+#include "block_cache.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct cache_entry {
+    uint64_t file;
+    uint64_t offset;
+    cache_block_t* block;
+    struct cache_entry* chain;          // Next in the hash bucket
+    struct cache_entry* newer;          // LRU list, most recent at the head
+    struct cache_entry* older;
+} cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t** buckets;
+    size_t num_buckets;                 // Power of two
+    size_t count;
+    size_t bytes;
+    size_t capacity;
+    cache_entry_t* newest;
+    cache_entry_t* oldest;
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) cache_shard_t;
+
+struct block_cache {
+    size_t capacity;
+    cache_shard_t shards[BLOCK_CACHE_SHARDS];
+};
+
+static inline uint64_t block_key_hash(uint64_t file, uint64_t offset) {
+    uint64_t h = (file * 0x9e3779b97f4a7c15ull) ^ offset;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    return h ^ (h >> 33);
+}
+
+cache_block_t* cache_block_alloc(size_t size) {
+    cache_block_t* block = malloc(sizeof(cache_block_t) + size);
+    if (!block) return NULL;
+    block->refs = 1;
+    block->size = size;
+    return block;
+}
+
+void block_cache_release(cache_block_t* block) {
+    if (block && __atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block);
+    }
+}
+
+block_cache_t* block_cache_create(size_t capacity) {
+    block_cache_t* cache = calloc(1, sizeof(block_cache_t));
+    if (!cache) return NULL;
+
+    cache->capacity = capacity;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = capacity / BLOCK_CACHE_SHARDS;
+    }
+    return cache;
+}
+
+void block_cache_destroy(block_cache_t* cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        cache_entry_t* entry = shard->newest;
+        while (entry) {
+            cache_entry_t* older = entry->older;
+            block_cache_release(entry->block);
+            free(entry);
+            entry = older;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+static void lru_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+    if (entry->newer) entry->newer->older = entry->older;
+    else shard->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else shard->oldest = entry->newer;
+}
+
+static void lru_push(cache_shard_t* shard, cache_entry_t* entry) {
+    entry->newer = NULL;
+    entry->older = shard->newest;
+    if (shard->newest) shard->newest->newer = entry;
+    shard->newest = entry;
+    if (!shard->oldest) shard->oldest = entry;
+}
+
+static cache_entry_t** bucket_find(cache_shard_t* shard, uint64_t h,
+                                   uint64_t file, uint64_t offset) {
+    cache_entry_t** link = &shard->buckets[(h >> 4) & (shard->num_buckets - 1)];
+    while (*link && ((*link)->file != file || (*link)->offset != offset)) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void shard_grow(cache_shard_t* shard) {
+    size_t num_buckets = shard->num_buckets ? shard->num_buckets * 2 : 256;
+    cache_entry_t** buckets = calloc(num_buckets, sizeof(cache_entry_t*));
+    if (!buckets) return;
+
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        cache_entry_t* entry = shard->buckets[i];
+        while (entry) {
+            cache_entry_t* chain = entry->chain;
+            size_t b = (block_key_hash(entry->file, entry->offset) >> 4) & (num_buckets - 1);
+            entry->chain = buckets[b];
+            buckets[b] = entry;
+            entry = chain;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+cache_block_t* block_cache_lookup(block_cache_t* cache, uint64_t file, uint64_t offset) {
+    uint64_t h = block_key_hash(file, offset);
+    cache_shard_t* shard = &cache->shards[h % BLOCK_CACHE_SHARDS];
+    cache_block_t* block = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t* entry = shard->num_buckets ? *bucket_find(shard, h, file, offset) : NULL;
+    if (entry) {
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        block = entry->block;
+        __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+void block_cache_insert(block_cache_t* cache, uint64_t file, uint64_t offset,
+                        cache_block_t* block) {
+    uint64_t h = block_key_hash(file, offset);
+    cache_shard_t* shard = &cache->shards[h % BLOCK_CACHE_SHARDS];
+    if (block->size > shard->capacity) return;
+
+    cache_entry_t* entry = malloc(sizeof(cache_entry_t));
+    if (!entry) return;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->count >= shard->num_buckets) shard_grow(shard);
+    if (!shard->num_buckets) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    cache_entry_t** link = bucket_find(shard, h, file, offset);
+    if (*link) {
+        // Another reader cached the same block first
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    entry->file = file;
+    entry->offset = offset;
+    entry->block = block;
+    entry->chain = NULL;
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    *link = entry;
+    lru_push(shard, entry);
+    shard->count++;
+    shard->bytes += block->size;
+
+    // Evict from the cold end; blocks still referenced live on until released
+    while (shard->bytes > shard->capacity && shard->oldest) {
+        cache_entry_t* victim = shard->oldest;
+        lru_unlink(shard, victim);
+        *bucket_find(shard, block_key_hash(victim->file, victim->offset),
+                     victim->file, victim->offset) = victim->chain;
+        shard->count--;
+        shard->bytes -= victim->block->size;
+        block_cache_release(victim->block);
+        free(victim);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void block_cache_get_stats(block_cache_t* cache, block_cache_stats_t* stats) {
+    stats->capacity = cache->capacity;
+    stats->bytes = 0;
+    stats->hits = 0;
+    stats->misses = 0;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->bytes += shard->bytes;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
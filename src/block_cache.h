@@ -0,0 +1,46 @@
+// Sharded LRU cache of SSTable data blocks
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_SHARDS 16
+
+// A block stays valid while the caller holds a reference to it
+typedef struct {
+    uint32_t refs;
+    size_t size;
+    char data[];
+} cache_block_t;
+
+typedef struct block_cache block_cache_t;
+
+// capacity 0 disables caching; blocks are then freed on release
+block_cache_t* block_cache_create(size_t capacity);
+void block_cache_destroy(block_cache_t* cache);
+
+cache_block_t* cache_block_alloc(size_t size);
+
+// Returns a referenced block, or NULL on a miss
+cache_block_t* block_cache_lookup(block_cache_t* cache, uint64_t file, uint64_t offset);
+
+// Add a freshly read block (refs 1, owned by the caller). The caller keeps
+// its reference and must release it.
+void block_cache_insert(block_cache_t* cache, uint64_t file, uint64_t offset,
+                        cache_block_t* block);
+
+void block_cache_release(cache_block_t* block);
+
+typedef struct {
+    size_t capacity;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+} block_cache_stats_t;
+
+void block_cache_get_stats(block_cache_t* cache, block_cache_stats_t* stats);
+
+#endif // BLOCK_CACHE_H
@@ -0,0 +1,47 @@
+#include "bloom.h"
+#include "hash.h"
+
+// Fixed seed: filters outlive the process that wrote them
+#define BLOOM_SEED 0x9e3779b97f4a7c15ull
+
+uint64_t bloom_hash(const char* key, size_t key_len) {
+    return kv_hash(key, key_len, BLOOM_SEED);
+}
+
+size_t bloom_filter_size(size_t num_keys) {
+    size_t bits = num_keys * BLOOM_BITS_PER_KEY;
+    if (bits < 64) bits = 64;
+    return (bits + 7) / 8 + 1;
+}
+
+// Probes are h1 + i * h2 (double hashing) over the filter's bits
+void bloom_filter_build(uint8_t* filter, size_t size, const uint64_t* hashes, size_t count) {
+    size_t bits = (size - 1) * 8;
+    int probes = (int)(BLOOM_BITS_PER_KEY * 0.69);  // ln 2 * bits per key
+    if (probes < 1) probes = 1;
+
+    memset(filter, 0, size - 1);
+    filter[size - 1] = (uint8_t)probes;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t h = hashes[i];
+        uint64_t delta = (h >> 33) | (h << 31);
+        for (int p = 0; p < probes; p++) {
+            size_t bit = h % bits;
+            filter[bit / 8] |= (uint8_t)(1u << (bit % 8));
+            h += delta;
+        }
+    }
+}
+
+bool bloom_filter_may_contain(const uint8_t* filter, size_t size, uint64_t h) {
+    if (size < 2) return true;
+    size_t bits = (size - 1) * 8;
+    int probes = filter[size - 1];
+    uint64_t delta = (h >> 33) | (h << 31);
+    for (int p = 0; p < probes; p++) {
+        size_t bit = h % bits;
+        if (!(filter[bit / 8] & (1u << (bit % 8)))) return false;
+        h += delta;
+    }
+    return true;
+}
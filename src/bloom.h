@@ -0,0 +1,20 @@
+// Bloom filters for SSTable lookups
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOOM_BITS_PER_KEY 10           // About 1% false positives
+
+// Serialized as the filter bits followed by one byte holding the probe count
+size_t bloom_filter_size(size_t num_keys);
+void bloom_filter_build(uint8_t* filter, size_t size, const uint64_t* hashes, size_t count);
+bool bloom_filter_may_contain(const uint8_t* filter, size_t size, uint64_t hash);
+
+// Hash to build and probe filters with; fixed so files stay readable
+uint64_t bloom_hash(const char* key, size_t key_len);
+
+#endif // BLOOM_H
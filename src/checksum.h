@@ -0,0 +1,12 @@
+// CRC32C (Castagnoli) checksums for on-disk records
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extend crc over data; start with crc = 0
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+#endif // CHECKSUM_H
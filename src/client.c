@@ -1,4 +1,8 @@
 #include "kv_store.h"
+#include "log.h"
+#include "near_cache.h"
+#include "protocol.h"
+#include "shm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,29 +11,393 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <ifaddrs.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define CLIENT_TIMEOUT_SEC 5            // For any one reply
+#define CLIENT_SHM_SPIN 4096            // Polls of an empty ring before sleeping, given CPUs to spare
+
+struct kv_client_shm {
+    shm_region_t* region;
+    int doorbell;                       // The server's eventfd
+    int wake;                           // Ours, rung by the server
+    unsigned spin;
+};
 
 kv_client_t* kv_client_create(void) {
     kv_client_t* client = (kv_client_t*)malloc(sizeof(kv_client_t));
     if (!client) {
-        perror("Failed to allocate client structure");
+        log_error("Failed to allocate client structure: %s", strerror(errno));
         return NULL;
     }
 
     client->socket = -1;
     client->is_connected = false;
+    client->protocol = KV_PROTO_V2;
+    client->next_id = 1;
+    client->transports = KV_TRANSPORT_TCP | KV_TRANSPORT_UNIX | KV_TRANSPORT_SHM;
+    client->transport = 0;
+    client->shm = NULL;
+    client->cache = NULL;
+    client->reading = NULL;
+    client->reading_stale = false;
     return client;
 }
 
+static bool recv_all(int fd, void* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data = (char*)data + n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool send_iov(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)count };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+// Sleep until the server rings. Fails if it hangs up or takes longer than
+// CLIENT_TIMEOUT_SEC.
+static bool shm_sleep(kv_client_t* client) {
+    struct pollfd fds[2] = {
+        { .fd = client->shm->wake, .events = POLLIN },
+        { .fd = client->socket, .events = POLLIN },  // Only ever EOF now
+    };
+    int n;
+    do {
+        n = poll(fds, 2, CLIENT_TIMEOUT_SEC * 1000);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) errno = ETIMEDOUT;
+    if (n <= 0 || fds[1].revents || !(fds[0].revents & POLLIN)) {
+        if (n > 0) errno = ECONNRESET;
+        return false;
+    }
+    uint64_t rung;
+    if (read(client->shm->wake, &rung, sizeof(rung)) < 0) {
+        // Rung again after the poll; read next time
+    }
+    return true;
+}
+
+static bool shm_send_iov(kv_client_t* client, const struct iovec* iov, int count) {
+    shm_ring_t* ring = &client->shm->region->requests;
+    for (int i = 0; i < count; i++) {
+        const char* data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        for (;;) {
+            size_t n = shm_ring_write(ring, data, len);
+            data += n;
+            len -= n;
+            if (len == 0) break;
+            // Full: get the server going on what is there, then wait for room
+            if (shm_ring_reader_asleep(ring)) shm_ring_bell(client->shm->doorbell);
+            if (shm_ring_wait_writable(ring) && !shm_sleep(client)) return false;
+        }
+    }
+    if (shm_ring_reader_asleep(ring)) shm_ring_bell(client->shm->doorbell);
+    return true;
+}
+
+static bool shm_recv_all(kv_client_t* client, void* data, size_t len) {
+    shm_ring_t* ring = &client->shm->region->replies;
+    unsigned spins = 0;
+    while (len > 0) {
+        size_t n = shm_ring_read(ring, data, len);
+        if (n > 0) {
+            data = (char*)data + n;
+            len -= n;
+            spins = 0;
+            // The server holds replies that did not fit
+            if (shm_ring_writer_asleep(ring)) shm_ring_bell(client->shm->doorbell);
+        } else if (spins < client->shm->spin) {
+            spins++;
+            cpu_relax();
+        } else if (shm_ring_wait_readable(ring) && !shm_sleep(client)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Over whichever transport the client is connected by
+static bool client_send(kv_client_t* client, struct iovec* iov, int count) {
+    return client->shm ? shm_send_iov(client, iov, count) : send_iov(client->socket, iov, count);
+}
+
+static bool client_recv(kv_client_t* client, void* data, size_t len) {
+    return client->shm ? shm_recv_all(client, data, len) : recv_all(client->socket, data, len);
+}
+
+// Read and drop len bytes
+static bool client_skip(kv_client_t* client, size_t len) {
+    char scratch[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (!client_recv(client, scratch, n)) return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Drop key, or with key_len 0 everything, from the near cache
+static bool apply_invalidation(kv_client_t* client, const char* key, size_t key_len) {
+    // The value of a GET awaiting its reply may predate the write
+    if (client->reading && (key_len == 0 || (strlen(client->reading) == key_len &&
+                                             memcmp(client->reading, key, key_len) == 0))) {
+        client->reading_stale = true;
+    }
+    if (!client->cache) return true;    // Pushed before MSG_TRACK stopped them
+    if (key_len == 0) {
+        near_cache_clear(client->cache, true);
+    } else {
+        near_cache_remove(client->cache, key, key_len, true);
+    }
+    return true;
+}
+
+// Apply a MSG_INVALIDATE the server pushed, whose header is frame
+static bool apply_push(kv_client_t* client, const kv_frame_t* frame) {
+    // Keys may be up to MAX_KEY_LENGTH long; most fit on the stack
+    char small[MAX_KEY_SIZE];
+    size_t key_len = frame->key_len;
+    char* key = key_len <= sizeof(small) ? small : malloc(key_len);
+    if (!key) {
+        // Forget everything rather than miss the key
+        if (!client_skip(client, key_len)) return false;
+        key_len = 0;
+    } else if (!client_recv(client, key, key_len)) {
+        if (key != small) free(key);
+        return false;
+    }
+    bool ok = apply_invalidation(client, key, key_len) && client_skip(client, frame->value_len);
+    if (key != small) free(key);
+    return ok;
+}
+
+// Read the header of the next reply, applying the invalidations the
+// server pushed ahead of it
+static bool recv_reply_header(kv_client_t* client, kv_frame_t* reply) {
+    char header[KV_FRAME_HEADER_SIZE];
+    for (;;) {
+        if (!client_recv(client, header, sizeof(header))) return false;
+        kv_frame_decode(header, reply);
+        if (reply->id != 0 || reply->code != MSG_INVALIDATE) return true;
+        if (!apply_push(client, reply)) return false;
+    }
+}
+
+// Send a v2 request and read the header of its reply, whose value is left
+// on the socket. extra must hold the opcode's extras. Returns the status.
+static kv_error_t frame_call(kv_client_t* client, uint8_t opcode, uint8_t flags,
+                             const char* key, const void* extra,
+                             const void* value, size_t value_len, kv_frame_t* reply) {
+    memset(reply, 0, sizeof(*reply));
+    size_t key_len = strlen(key);
+    if (key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+    if (value_len > KV_FRAME_MAX_VALUE) return KV_ERROR_VALUE_TOO_LARGE;
+
+    if (client->next_id == 0) client->next_id = 1;  // 0 marks pushes from the server
+    kv_frame_t frame = { .code = opcode, .flags = flags, .key_len = (uint16_t)key_len,
+                         .value_len = (uint32_t)value_len, .id = client->next_id++ };
+    char header[KV_FRAME_HEADER_SIZE];
+    kv_frame_encode(header, &frame);
+    struct iovec iov[] = {
+        { header, sizeof(header) },
+        { (void*)key, key_len },
+        { (void*)extra, kv_frame_extra_len(opcode) },
+        { (void*)value, value_len },
+    };
+    if (!client_send(client, iov, 4)) {
+        log_error("Failed to send request: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    if (!recv_reply_header(client, reply)) {
+        log_error("Failed to receive response: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+    if (reply->id != frame.id) {
+        log_error("Response to request %u, expected %u", reply->id, frame.id);
+        return KV_ERROR_NETWORK;
+    }
+    return (kv_error_t)reply->code;
+}
+
+// A v2 request whose reply is just a status
+static kv_error_t frame_status(kv_client_t* client, uint8_t opcode, const char* key,
+                               const void* extra, const char* value) {
+    kv_frame_t reply;
+    kv_error_t result = frame_call(client, opcode, 0, key, extra, value,
+                                   value ? strlen(value) : 0, &reply);
+    if (result != KV_ERROR_NETWORK && !client_skip(client, reply.value_len)) {
+        return KV_ERROR_NETWORK;
+    }
+    return result;
+}
+
+// Offer v2 on a fresh connection. A v1-only server never answers, so this
+// fails once the receive timeout runs out.
+static bool negotiate(kv_client_t* client) {
+    char hello[KV_HELLO_SIZE];
+    kv_hello_encode(hello, client->protocol);
+    if (send(client->socket, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+        !recv_all(client->socket, hello, sizeof(hello))) {
+        return false;
+    }
+    uint8_t version = kv_hello_decode(hello);
+    if (version == 0 || version > client->protocol) return false;
+    client->protocol = version;
+    return true;
+}
+
+// Open a socket to addr with the client's timeouts and settle the
+// protocol, dropping to v1 if the server does not answer a v2 hello.
+// Failing to connect is logged at level.
+static bool open_connection(kv_client_t* client, const struct sockaddr* addr,
+                            socklen_t addr_len, const char* name, int level) {
+    for (;;) {
+        client->socket = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (client->socket < 0) {
+            log_error("Socket creation failed: %s", strerror(errno));
+            return false;
+        }
+
+        // Set socket timeout
+        struct timeval tv = { .tv_sec = CLIENT_TIMEOUT_SEC };
+        setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // Connect to server
+        log_debug("Connecting to %s...", name);
+        if (connect(client->socket, addr, addr_len) < 0) {
+            log_at(level, "Connection to %s failed: %s", name, strerror(errno));
+            close(client->socket);
+            client->socket = -1;
+            return false;
+        }
+
+        if (client->protocol < KV_PROTO_V2 || negotiate(client)) return true;
+        log_info("Server does not speak protocol v2, using v1");
+        close(client->socket);
+        client->protocol = KV_PROTO_V1;
+    }
+}
+
+// Ask for shared-memory rings in place of the socket. Returns false if the
+// connection failed; a server that does not offer them leaves it as it was.
+static bool attach_shm(kv_client_t* client) {
+    kv_frame_t frame = { .code = MSG_SHM_ATTACH, .id = client->next_id++ };
+    char header[KV_FRAME_HEADER_SIZE];
+    kv_frame_encode(header, &frame);
+    if (send(client->socket, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+        return false;
+    }
+    int fds[3];
+    int count = shm_recv_fds(client->socket, header, sizeof(header), fds, 3);
+    if (count < 0) return false;
+
+    kv_frame_t reply;
+    kv_frame_decode(header, &reply);
+    struct kv_client_shm* shm = NULL;
+    bool granted = reply.id == frame.id && reply.value_len == 0 && reply.code == KV_SUCCESS;
+    if (granted && count == 3 && (shm = calloc(1, sizeof(*shm)))) {
+        shm->region = shm_region_map(fds[0]);
+    }
+    if (!shm || !shm->region) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        free(shm);
+        if (granted || reply.id != frame.id || reply.value_len != 0) return false;
+        log_debug("Server offers no shared memory, staying on the socket");
+        return true;
+    }
+
+    close(fds[0]);                      // The mapping keeps the memory
+    shm->doorbell = fds[1];
+    shm->wake = fds[2];
+    // Spinning only helps while the server runs on another CPU
+    shm->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CLIENT_SHM_SPIN : 0;
+    client->shm = shm;
+    return true;
+}
+
+static bool connect_unix(kv_client_t* client, const char* path, int level) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (!open_connection(client, (struct sockaddr*)&addr, sizeof(addr), path, level)) {
+        return false;
+    }
+
+    client->transport = KV_TRANSPORT_UNIX;
+    if ((client->transports & KV_TRANSPORT_SHM) && client->protocol >= KV_PROTO_V2) {
+        if (!attach_shm(client)) {
+            log_at(level, "Shared memory setup on %s failed", path);
+            close(client->socket);
+            client->socket = -1;
+            return false;
+        }
+        if (client->shm) client->transport = KV_TRANSPORT_SHM;
+    }
+    client->is_connected = true;
+    log_debug("Connected to %s (protocol v%u%s)", path, client->protocol,
+              client->shm ? ", shared memory" : "");
+    return true;
+}
+
+// Loopback, or the address of one of its interfaces
+bool kv_client_local_host(const char* host) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host, &addr) <= 0) return false;
+    if ((ntohl(addr.s_addr) >> 24) == 127) return true;
+
+    struct ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) < 0) return false;
+    bool local = false;
+    for (struct ifaddrs* i = interfaces; i && !local; i = i->ifa_next) {
+        local = i->ifa_addr && i->ifa_addr->sa_family == AF_INET &&
+                ((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == addr.s_addr;
+    }
+    freeifaddrs(interfaces);
+    return local;
+}
+
 bool kv_client_connect(kv_client_t* client, const char* host, int port) {
     if (!client || !host) {
-        fprintf(stderr, "Invalid client or host\n");
+        log_error("Invalid client or host");
         return false;
     }
 
-    // Create socket
-    client->socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->socket < 0) {
-        perror("Socket creation failed");
+    // A server on this machine is reached faster without TCP
+    char path[sizeof(((struct sockaddr_un*)NULL)->sun_path)];
+    if ((client->transports & (KV_TRANSPORT_UNIX | KV_TRANSPORT_SHM)) &&
+        kv_client_local_host(host) &&
+        snprintf(path, sizeof(path), KV_UNIX_PATH_FORMAT, port) < (int)sizeof(path) &&
+        access(path, F_OK) == 0 && connect_unix(client, path, LOG_DEBUG)) {
+        return true;
+    }
+    if (!(client->transports & KV_TRANSPORT_TCP)) {
+        log_error("No local transport to %s:%d", host, port);
         return false;
     }
 
@@ -41,40 +409,50 @@ bool kv_client_connect(kv_client_t* client, const char* host, int port) {
 
     // Convert IP address from string to binary form
     if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid address: %s\n", host);
-        close(client->socket);
+        log_error("Invalid address: %s", host);
         return false;
     }
 
-    // Set socket timeout
-    struct timeval tv;
-    tv.tv_sec = 5;  // 5 seconds timeout
-    tv.tv_usec = 0;
-    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-    // Connect to server
-    printf("Connecting to %s:%d...\n", host, port);
-    if (connect(client->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        fprintf(stderr, "Connection failed: %s\n", strerror(errno));
-        close(client->socket);
+    char name[INET_ADDRSTRLEN + 8];
+    snprintf(name, sizeof(name), "%s:%d", host, port);
+    if (!open_connection(client, (struct sockaddr*)&server_addr, sizeof(server_addr), name,
+                         LOG_ERROR)) {
         return false;
     }
-
+    client->transport = KV_TRANSPORT_TCP;
     client->is_connected = true;
-    printf("Connected successfully\n");
+    log_debug("Connected successfully (protocol v%u)", client->protocol);
     return true;
 }
 
+bool kv_client_connect_unix(kv_client_t* client, const char* path) {
+    if (!client || !path || strlen(path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+        log_error("Invalid client or path");
+        return false;
+    }
+    return connect_unix(client, path, LOG_ERROR);
+}
+
 void kv_client_disconnect(kv_client_t* client) {
     if (!client) return;
 
+    if (client->shm) {
+        shm_region_unmap(client->shm->region);
+        close(client->shm->doorbell);
+        close(client->shm->wake);
+        free(client->shm);
+        client->shm = NULL;
+    }
     if (client->socket != -1) {
         close(client->socket);
         client->socket = -1;
     }
+    // The server stops tracking with the connection
+    near_cache_destroy(client->cache);
+    client->cache = NULL;
     client->is_connected = false;
-    printf("Disconnected from server\n");
+    client->transport = 0;
+    log_debug("Disconnected from server");
 }
 
 void kv_client_destroy(kv_client_t* client) {
@@ -82,15 +460,61 @@ void kv_client_destroy(kv_client_t* client) {
 
     kv_client_disconnect(client);
     free(client);
-    printf("Client destroyed\n");
+    log_debug("Client destroyed");
+}
+
+// Apply the invalidations that have arrived, without waiting for more.
+// Nothing else is unread between calls, so anything there is a push.
+static bool cache_poll(kv_client_t* client) {
+    for (;;) {
+        if (client->shm) {
+            if (shm_ring_used(&client->shm->region->replies) == 0) return true;
+        } else {
+            char byte;
+            ssize_t n = recv(client->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+            if (n <= 0) {
+                log_error("Connection lost: %s", n == 0 ? "closed by server" : strerror(errno));
+                return false;
+            }
+        }
+        char header[KV_FRAME_HEADER_SIZE];
+        kv_frame_t frame;
+        if (!client_recv(client, header, sizeof(header))) {
+            log_error("Failed to receive invalidation: %s", strerror(errno));
+            return false;
+        }
+        kv_frame_decode(header, &frame);
+        if (frame.id != 0 || frame.code != MSG_INVALIDATE) {
+            log_error("Unexpected reply to request %u", frame.id);
+            return false;
+        }
+        if (!apply_push(client, &frame)) {
+            log_error("Failed to receive invalidation: %s", strerror(errno));
+            return false;
+        }
+    }
+}
+
+// A write through the client: its own entry goes at once
+static void cache_forget(kv_client_t* client, const char* key) {
+    if (client->cache) near_cache_remove(client->cache, key, strlen(key), false);
 }
 
 kv_error_t kv_client_put(kv_client_t* client, const char* key, const char* value) {
     if (!client || !client->is_connected || !key || !value) {
-        printf("Invalid parameters or client not connected\n");
+        log_warn("Invalid parameters or client not connected");
         return KV_ERROR_INVALID_KEY;
     }
 
+    if (client->protocol >= KV_PROTO_V2) {
+        log_debug("Sending PUT %s (%zu bytes)", key, strlen(value));
+        cache_forget(client, key);
+        kv_error_t result = frame_status(client, MSG_PUT, key, NULL, value);
+        log_debug("PUT operation result: %d", result);
+        return result;
+    }
+
     // Prepare message
     kv_message_t msg;
     msg.type = MSG_PUT;
@@ -99,62 +523,95 @@ kv_error_t kv_client_put(kv_client_t* client, const char* key, const char* value
     strncpy(msg.value, value, MAX_VALUE_SIZE - 1);
     msg.value[MAX_VALUE_SIZE - 1] = '\0';
 
-    printf("Sending PUT %s=%s\n", key, value);
+    log_debug("Sending PUT %s (%zu bytes)", key, strlen(value));
 
     // Send message
     if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
-        perror("Failed to send PUT message");
+        log_error("Failed to send PUT message: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
     // Receive response
     kv_error_t result;
     if (recv(client->socket, &result, sizeof(result), 0) != sizeof(result)) {
-        perror("Failed to receive response");
+        log_error("Failed to receive response: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
-    printf("PUT operation result: %d\n", result);
+    log_debug("PUT operation result: %d", result);
     return result;
 }
 
 kv_error_t kv_client_get(kv_client_t* client, const char* key, char* value) {
     if (!client || !client->is_connected || !key || !value) {
-        printf("Invalid parameters or client not connected\n");
+        log_warn("Invalid parameters or client not connected");
         return KV_ERROR_INVALID_KEY;
     }
 
+    if (client->protocol >= KV_PROTO_V2) {
+        size_t key_len = strlen(key);
+        if (client->cache) {
+            if (!cache_poll(client)) return KV_ERROR_NETWORK;
+            if (near_cache_get(client->cache, key, key_len, value)) {
+                log_debug("GET %s from the near cache", key);
+                return KV_SUCCESS;
+            }
+            client->reading = key;
+            client->reading_stale = false;
+        }
+        log_debug("Sending GET %s", key);
+        kv_frame_t reply;
+        kv_error_t result = frame_call(client, MSG_GET, 0, key, NULL, NULL, 0, &reply);
+        client->reading = NULL;
+        if (result == KV_ERROR_NETWORK) return result;
+
+        // Values the caller's MAX_VALUE_SIZE buffer cannot hold fail as in v1
+        if (result == KV_SUCCESS && reply.value_len < MAX_VALUE_SIZE) {
+            if (!client_recv(client, value, reply.value_len)) return KV_ERROR_NETWORK;
+            value[reply.value_len] = '\0';
+            if (client->cache && !client->reading_stale) {
+                near_cache_put(client->cache, key, key_len, value, reply.value_len);
+            }
+            log_debug("GET operation successful: %s", key);
+            return result;
+        }
+        if (!client_skip(client, reply.value_len)) return KV_ERROR_NETWORK;
+        if (result == KV_SUCCESS) result = KV_ERROR_VALUE_TOO_LARGE;
+        log_debug("GET operation failed: %d", result);
+        return result;
+    }
+
     // Prepare message
     kv_message_t msg;
     msg.type = MSG_GET;
     strncpy(msg.key, key, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
 
-    printf("Sending GET %s\n", key);
+    log_debug("Sending GET %s", key);
 
     // Send message
     if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
-        perror("Failed to send GET message");
+        log_error("Failed to send GET message: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
     // Receive response status
     kv_error_t result;
     if (recv(client->socket, &result, sizeof(result), 0) != sizeof(result)) {
-        perror("Failed to receive response status");
+        log_error("Failed to receive response status: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
     // If successful, receive value
     if (result == KV_SUCCESS) {
         if (recv(client->socket, value, MAX_VALUE_SIZE, 0) <= 0) {
-            perror("Failed to receive value");
+            log_error("Failed to receive value: %s", strerror(errno));
             return KV_ERROR_NETWORK;
         }
         value[MAX_VALUE_SIZE - 1] = '\0';
-        printf("GET operation successful: %s=%s\n", key, value);
+        log_debug("GET operation successful: %s", key);
     } else {
-        printf("GET operation failed: %d\n", result);
+        log_debug("GET operation failed: %d", result);
     }
 
     return result;
@@ -162,31 +619,808 @@ kv_error_t kv_client_get(kv_client_t* client, const char* key, char* value) {
 
 kv_error_t kv_client_delete(kv_client_t* client, const char* key) {
     if (!client || !client->is_connected || !key) {
-        printf("Invalid parameters or client not connected\n");
+        log_warn("Invalid parameters or client not connected");
         return KV_ERROR_INVALID_KEY;
     }
 
+    if (client->protocol >= KV_PROTO_V2) {
+        log_debug("Sending DELETE %s", key);
+        cache_forget(client, key);
+        kv_error_t result = frame_status(client, MSG_DELETE, key, NULL, NULL);
+        log_debug("DELETE operation result: %d", result);
+        return result;
+    }
+
     // Prepare message
     kv_message_t msg;
     msg.type = MSG_DELETE;
     strncpy(msg.key, key, MAX_KEY_SIZE - 1);
     msg.key[MAX_KEY_SIZE - 1] = '\0';
 
-    printf("Sending DELETE %s\n", key);
+    log_debug("Sending DELETE %s", key);
 
     // Send message
     if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
-        perror("Failed to send DELETE message");
+        log_error("Failed to send DELETE message: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
     // Receive response
     kv_error_t result;
     if (recv(client->socket, &result, sizeof(result), 0) != sizeof(result)) {
-        perror("Failed to receive response");
+        log_error("Failed to receive response: %s", strerror(errno));
         return KV_ERROR_NETWORK;
     }
 
-    printf("DELETE operation result: %d\n", result);
+    log_debug("DELETE operation result: %d", result);
     return result;
-}
\ No newline at end of file
+}
+
+kv_error_t kv_client_put_ttl(kv_client_t* client, const char* key, const char* value,
+                             uint64_t ttl_ms) {
+    if (!client || !client->is_connected || !key || !value) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol >= KV_PROTO_V2) {
+        log_debug("Sending PUT %s (%zu bytes) with TTL %llu ms", key, strlen(value),
+                  (unsigned long long)ttl_ms);
+        char extra[sizeof(ttl_ms)];
+        kv_put_u64(extra, ttl_ms);
+        cache_forget(client, key);
+        kv_error_t result = frame_status(client, MSG_PUT_TTL, key, extra, value);
+        log_debug("PUT operation result: %d", result);
+        return result;
+    }
+
+    // Prepare message, with the TTL right behind it
+    kv_message_t msg;
+    msg.type = MSG_PUT_TTL;
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    msg.key[MAX_KEY_SIZE - 1] = '\0';
+    strncpy(msg.value, value, MAX_VALUE_SIZE - 1);
+    msg.value[MAX_VALUE_SIZE - 1] = '\0';
+
+    char request[sizeof(msg) + sizeof(ttl_ms)];
+    memcpy(request, &msg, sizeof(msg));
+    memcpy(request + sizeof(msg), &ttl_ms, sizeof(ttl_ms));
+
+    log_debug("Sending PUT %s (%zu bytes) with TTL %llu ms", key, strlen(value),
+              (unsigned long long)ttl_ms);
+
+    // Send message
+    if (send(client->socket, request, sizeof(request), 0) != sizeof(request)) {
+        log_error("Failed to send PUT message: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    // Receive response
+    kv_error_t result;
+    if (recv(client->socket, &result, sizeof(result), 0) != sizeof(result)) {
+        log_error("Failed to receive response: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    log_debug("PUT operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_expire(kv_client_t* client, const char* key, uint64_t ttl_ms) {
+    if (!client || !client->is_connected || !key) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol >= KV_PROTO_V2) {
+        log_debug("Sending EXPIRE %s %llu ms", key, (unsigned long long)ttl_ms);
+        char extra[sizeof(ttl_ms)];
+        kv_put_u64(extra, ttl_ms);
+        cache_forget(client, key);
+        kv_error_t result = frame_status(client, MSG_EXPIRE, key, extra, NULL);
+        log_debug("EXPIRE operation result: %d", result);
+        return result;
+    }
+
+    // Prepare message
+    kv_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_EXPIRE;
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+    memcpy(msg.value, &ttl_ms, sizeof(ttl_ms));
+
+    log_debug("Sending EXPIRE %s %llu ms", key, (unsigned long long)ttl_ms);
+
+    // Send message
+    if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        log_error("Failed to send EXPIRE message: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    // Receive response
+    kv_error_t result;
+    if (recv(client->socket, &result, sizeof(result), 0) != sizeof(result)) {
+        log_error("Failed to receive response: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    log_debug("EXPIRE operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_ttl(kv_client_t* client, const char* key, int64_t* ttl_ms) {
+    if (!client || !client->is_connected || !key || !ttl_ms) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol >= KV_PROTO_V2) {
+        log_debug("Sending TTL %s", key);
+        kv_frame_t reply;
+        char left[sizeof(*ttl_ms)];
+        kv_error_t result = frame_call(client, MSG_TTL, 0, key, NULL, NULL, 0, &reply);
+        if (result == KV_ERROR_NETWORK) return result;
+        if (result == KV_SUCCESS && reply.value_len == sizeof(left)) {
+            if (!client_recv(client, left, sizeof(left))) return KV_ERROR_NETWORK;
+            *ttl_ms = (int64_t)kv_get_u64(left);
+        } else if (!client_skip(client, reply.value_len)) {
+            return KV_ERROR_NETWORK;
+        } else if (result == KV_SUCCESS) {
+            result = KV_ERROR_NETWORK;  // Malformed reply
+        }
+        log_debug("TTL operation result: %d", result);
+        return result;
+    }
+
+    // Prepare message
+    kv_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_TTL;
+    strncpy(msg.key, key, MAX_KEY_SIZE - 1);
+
+    log_debug("Sending TTL %s", key);
+
+    // Send message
+    if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        log_error("Failed to send TTL message: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    // Receive response status, then on success the time left
+    kv_error_t result;
+    if (recv(client->socket, &result, sizeof(result), MSG_WAITALL) != sizeof(result)) {
+        log_error("Failed to receive response status: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+    if (result == KV_SUCCESS &&
+        recv(client->socket, ttl_ms, sizeof(*ttl_ms), MSG_WAITALL) != sizeof(*ttl_ms)) {
+        log_error("Failed to receive TTL: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    log_debug("TTL operation result: %d", result);
+    return result;
+}
+
+// Lay out the items of a multi-key request in *request, which the caller
+// frees. values is NULL except for MSET.
+static kv_error_t batch_encode(kv_client_t* client, uint8_t opcode, const char* const* keys,
+                               const char* const* values, size_t count, char** request,
+                               size_t* request_len) {
+    size_t head = sizeof(uint16_t) + (values ? sizeof(uint32_t) : 0);
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strlen(keys[i]) > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+        len += head + strlen(keys[i]) + (values ? strlen(values[i]) : 0);
+    }
+
+    *request = malloc(len ? len : 1);
+    if (!*request) return KV_ERROR_NO_SPACE;
+    char* at = *request;
+    for (size_t i = 0; i < count; i++) {
+        size_t key_len = strlen(keys[i]);
+        size_t value_len = values ? strlen(values[i]) : 0;
+        kv_put_u16(at, (uint16_t)key_len);
+        if (values) kv_put_u32(at + 2, (uint32_t)value_len);
+        memcpy(at + head, keys[i], key_len);
+        memcpy(at + head + key_len, values ? values[i] : "", value_len);
+        at += head + key_len + value_len;
+        if (opcode != MSG_MGET) cache_forget(client, keys[i]);
+    }
+    *request_len = len;
+    return KV_SUCCESS;
+}
+
+// Send a multi-key request and read the whole reply value into *body,
+// which the caller frees
+static kv_error_t frame_batch(kv_client_t* client, uint8_t opcode, uint8_t flags,
+                              const char* const* keys, const char* const* values, size_t count,
+                              char** body, size_t* body_len) {
+    *body = NULL;
+    *body_len = 0;
+    char* request;
+    size_t len;
+    kv_error_t result = batch_encode(client, opcode, keys, values, count, &request, &len);
+    if (result != KV_SUCCESS) return result;
+
+    kv_frame_t reply;
+    result = frame_call(client, opcode, flags, "", NULL, request, len, &reply);
+    free(request);
+    if (result == KV_ERROR_NETWORK) return result;
+
+    *body = malloc(reply.value_len ? reply.value_len : 1);
+    if (!*body) return client_skip(client, reply.value_len) ? KV_ERROR_NO_SPACE
+                                                                  : KV_ERROR_NETWORK;
+    if (!client_recv(client, *body, reply.value_len)) {
+        free(*body);
+        *body = NULL;
+        return KV_ERROR_NETWORK;
+    }
+    *body_len = reply.value_len;
+    return result;
+}
+
+static kv_error_t batch_result(kv_error_t* statuses, size_t count, kv_error_t result) {
+    for (size_t i = 0; i < count; i++) {
+        if (result != KV_SUCCESS) {
+            statuses[i] = result;
+        } else if (statuses[i] != KV_SUCCESS) {
+            result = statuses[i];
+        }
+    }
+    return result;
+}
+
+// A reply of one status byte per key
+static kv_error_t batch_statuses(kv_error_t result, const char* body, size_t len,
+                                 kv_error_t* statuses, size_t count) {
+    if (result == KV_ERROR_NETWORK || len != count) {
+        return batch_result(statuses, count, result == KV_SUCCESS ? KV_ERROR_NETWORK : result);
+    }
+    for (size_t i = 0; i < count; i++) statuses[i] = (kv_error_t)(uint8_t)body[i];
+    return batch_result(statuses, count, KV_SUCCESS);
+}
+
+kv_error_t kv_client_mget(kv_client_t* client, const char* const* keys, size_t count,
+                          char** values, kv_error_t* statuses) {
+    if (!client || !client->is_connected || !keys || !values || !statuses ||
+        count > KV_BATCH_MAX_KEYS) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol < KV_PROTO_V2) {
+        for (size_t i = 0; i < count; i++) {
+            statuses[i] = kv_client_get(client, keys[i], values[i]);
+            if (statuses[i] == KV_ERROR_NETWORK) {
+                return batch_result(statuses, count, KV_ERROR_NETWORK);
+            }
+        }
+        return batch_result(statuses, count, KV_SUCCESS);
+    }
+
+    log_debug("Sending MGET of %zu keys", count);
+    char* body;
+    size_t len;
+    kv_error_t result = frame_batch(client, MSG_MGET, 0, keys, NULL, count, &body, &len);
+    size_t at = 0;
+    for (size_t i = 0; result == KV_SUCCESS && i < count; i++) {
+        if (len - at < 5 || len - at - 5 < kv_get_u32(body + at + 1)) {
+            result = KV_ERROR_NETWORK;  // Malformed reply
+            break;
+        }
+        statuses[i] = (kv_error_t)(uint8_t)body[at];
+        size_t value_len = kv_get_u32(body + at + 1);
+        // Values the caller's MAX_VALUE_SIZE buffers cannot hold fail as in GET
+        if (statuses[i] == KV_SUCCESS && value_len >= MAX_VALUE_SIZE) {
+            statuses[i] = KV_ERROR_VALUE_TOO_LARGE;
+        } else if (statuses[i] == KV_SUCCESS) {
+            memcpy(values[i], body + at + 5, value_len);
+            values[i][value_len] = '\0';
+        }
+        at += 5 + value_len;
+    }
+    free(body);
+    result = batch_result(statuses, count, result);
+    log_debug("MGET operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_mset(kv_client_t* client, const char* const* keys,
+                          const char* const* values, size_t count, bool atomic,
+                          kv_error_t* statuses) {
+    if (!client || !client->is_connected || !keys || !values || !statuses ||
+        count > KV_BATCH_MAX_KEYS) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol < KV_PROTO_V2) {
+        if (atomic) return batch_result(statuses, count, KV_ERROR_INVALID_KEY);
+        for (size_t i = 0; i < count; i++) {
+            statuses[i] = kv_client_put(client, keys[i], values[i]);
+            if (statuses[i] == KV_ERROR_NETWORK) {
+                return batch_result(statuses, count, KV_ERROR_NETWORK);
+            }
+        }
+        return batch_result(statuses, count, KV_SUCCESS);
+    }
+
+    log_debug("Sending MSET of %zu keys%s", count, atomic ? " (atomic)" : "");
+    char* body;
+    size_t len;
+    kv_error_t result = frame_batch(client, MSG_MSET, atomic ? KV_FRAME_ATOMIC : 0,
+                                    keys, values, count, &body, &len);
+    result = batch_statuses(result, body, len, statuses, count);
+    free(body);
+    log_debug("MSET operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_mdelete(kv_client_t* client, const char* const* keys, size_t count,
+                             kv_error_t* statuses) {
+    if (!client || !client->is_connected || !keys || !statuses ||
+        count > KV_BATCH_MAX_KEYS) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    if (client->protocol < KV_PROTO_V2) {
+        for (size_t i = 0; i < count; i++) {
+            statuses[i] = kv_client_delete(client, keys[i]);
+            if (statuses[i] == KV_ERROR_NETWORK) {
+                return batch_result(statuses, count, KV_ERROR_NETWORK);
+            }
+        }
+        return batch_result(statuses, count, KV_SUCCESS);
+    }
+
+    log_debug("Sending MDELETE of %zu keys", count);
+    char* body;
+    size_t len;
+    kv_error_t result = frame_batch(client, MSG_MDELETE, 0, keys, NULL, count, &body, &len);
+    result = batch_statuses(result, body, len, statuses, count);
+    free(body);
+    log_debug("MDELETE operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_cluster_nodes(kv_client_t* client, char** nodes, size_t* len) {
+    *nodes = NULL;
+    *len = 0;
+    if (!client || !client->is_connected || client->protocol < KV_PROTO_V2) {
+        log_warn("Cluster nodes need a connection speaking protocol v2");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    kv_frame_t reply;
+    kv_error_t result = frame_call(client, MSG_CLUSTER, 0, "", NULL, NULL, 0, &reply);
+    if (result == KV_ERROR_NETWORK) return result;
+    *nodes = malloc(reply.value_len ? reply.value_len : 1);
+    if (!*nodes) return client_skip(client, reply.value_len) ? KV_ERROR_NO_SPACE
+                                                                   : KV_ERROR_NETWORK;
+    if (!client_recv(client, *nodes, reply.value_len)) {
+        free(*nodes);
+        *nodes = NULL;
+        return KV_ERROR_NETWORK;
+    }
+    *len = reply.value_len;
+    log_debug("CLUSTER operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_client_replicate(kv_client_t* client, uint8_t flags, uint64_t offset,
+                               const void* value, size_t value_len, char* reply,
+                               size_t* reply_len) {
+    *reply_len = 0;
+    if (!client || !client->is_connected || client->protocol < KV_PROTO_V2) {
+        log_warn("Replication needs a connection speaking protocol v2");
+        return KV_ERROR_INVALID_KEY;
+    }
+
+    char extra[sizeof(uint64_t)];
+    kv_put_u64(extra, offset);
+    kv_frame_t frame;
+    kv_error_t result = frame_call(client, MSG_REPLICATE, flags, "", extra, value, value_len,
+                                   &frame);
+    if (result == KV_ERROR_NETWORK) return result;
+    if (frame.value_len > 2 * sizeof(uint64_t)) {
+        return client_skip(client, frame.value_len) ? KV_ERROR_INVALID_KEY : KV_ERROR_NETWORK;
+    }
+    if (!client_recv(client, reply, frame.value_len)) return KV_ERROR_NETWORK;
+    *reply_len = frame.value_len;
+    log_debug("REPLICATE operation result: %d", result);
+    return result;
+}
+
+kv_error_t kv_scan_range(kv_scan_t* scan, const char* start, const char* end) {
+    memset(scan, 0, sizeof(*scan));
+    size_t start_len = start ? strlen(start) : 0, end_len = end ? strlen(end) : 0;
+    if (start_len > MAX_KEY_SIZE || end_len > MAX_KEY_SIZE) {
+        scan->done = true;
+        return KV_ERROR_INVALID_KEY;
+    }
+    if (start) memcpy(scan->start, start, start_len);
+    if (end) memcpy(scan->bound, end, end_len);
+    return KV_SUCCESS;
+}
+
+kv_error_t kv_scan_prefix(kv_scan_t* scan, const char* prefix) {
+    memset(scan, 0, sizeof(*scan));
+    scan->flags = KV_SCAN_PREFIX;
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    if (prefix_len > MAX_KEY_SIZE) {
+        scan->done = true;
+        return KV_ERROR_INVALID_KEY;
+    }
+    if (prefix) memcpy(scan->bound, prefix, prefix_len);
+    return KV_SUCCESS;
+}
+
+// The next page from the v2 items, each a key length, value length, key
+// and value
+static kv_error_t frame_scan(kv_client_t* client, kv_scan_t* scan, kv_scan_item_t* items,
+                             size_t limit, size_t* count) {
+    char start[MAX_KEY_SIZE + 1] = { 0 }, bound[MAX_KEY_SIZE + 1] = { 0 };
+    memcpy(start, scan->start, MAX_KEY_SIZE);
+    memcpy(bound, scan->bound, MAX_KEY_SIZE);
+    char extra[sizeof(uint16_t)];
+    kv_put_u16(extra, (uint16_t)limit);
+
+    log_debug("Sending SCAN %s", start);
+    kv_frame_t reply;
+    kv_error_t result = frame_call(client, MSG_SCAN, scan->flags, start, extra,
+                                   bound, strlen(bound), &reply);
+    if (result != KV_SUCCESS) {
+        if (result != KV_ERROR_NETWORK && !client_skip(client, reply.value_len)) {
+            return KV_ERROR_NETWORK;
+        }
+        log_debug("SCAN operation failed: %d", result);
+        return result;
+    }
+
+    size_t left = reply.value_len, found = 0;
+    while (left > 0) {
+        char head[sizeof(uint16_t) + sizeof(uint32_t)];
+        if (left < sizeof(head) || found == limit ||
+            !client_recv(client, head, sizeof(head))) {
+            return KV_ERROR_NETWORK;
+        }
+        kv_scan_item_t* item = &items[found++];
+        memset(item, 0, sizeof(*item));
+        item->key_len = kv_get_u16(head);
+        item->value_len = kv_get_u32(head + 2);
+        size_t kept = item->value_len < MAX_VALUE_SIZE ? item->value_len : MAX_VALUE_SIZE;
+        if (item->key_len > MAX_KEY_SIZE ||
+            left - sizeof(head) < (size_t)item->key_len + item->value_len ||
+            !client_recv(client, item->key, item->key_len) ||
+            !client_recv(client, item->value, kept) ||
+            !client_skip(client, item->value_len - kept)) {
+            return KV_ERROR_NETWORK;
+        }
+        left -= sizeof(head) + item->key_len + item->value_len;
+    }
+
+    // The next page starts after the last key received
+    if (found > 0) {
+        const kv_scan_item_t* last = &items[found - 1];
+        memset(scan->start, 0, MAX_KEY_SIZE);
+        memcpy(scan->start, last->key, last->key_len);
+        scan->flags |= KV_SCAN_AFTER;
+    }
+    scan->done = !(reply.flags & KV_FRAME_MORE) || found == 0;
+    *count = found;
+
+    log_debug("SCAN operation returned %zu keys", found);
+    return KV_SUCCESS;
+}
+
+kv_error_t kv_client_scan(kv_client_t* client, kv_scan_t* scan,
+                          kv_scan_item_t* items, size_t max_items, size_t* count) {
+    *count = 0;
+    if (!client || !client->is_connected || !scan || !items || max_items == 0) {
+        log_warn("Invalid parameters or client not connected");
+        return KV_ERROR_INVALID_KEY;
+    }
+    if (scan->done) return KV_SUCCESS;
+
+    size_t limit = max_items < KV_SCAN_MAX_PAGE ? max_items : KV_SCAN_MAX_PAGE;
+    if (client->protocol >= KV_PROTO_V2) return frame_scan(client, scan, items, limit, count);
+
+    kv_scan_request_t request = { .flags = scan->flags, .limit = (uint16_t)limit };
+    memcpy(request.bound, scan->bound, MAX_KEY_SIZE);
+
+    // Prepare message
+    kv_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SCAN;
+    memcpy(msg.key, scan->start, MAX_KEY_SIZE);
+    memcpy(msg.value, &request, sizeof(request));
+
+    log_debug("Sending SCAN %.*s", MAX_KEY_SIZE, scan->start);
+
+    // Send message
+    if (send(client->socket, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        log_error("Failed to send SCAN message: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    // Receive response status
+    kv_error_t result;
+    if (recv(client->socket, &result, sizeof(result), MSG_WAITALL) != sizeof(result)) {
+        log_error("Failed to receive response status: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+    if (result != KV_SUCCESS) {
+        log_debug("SCAN operation failed: %d", result);
+        return result;
+    }
+
+    // Then the page
+    kv_scan_reply_t reply;
+    if (recv(client->socket, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) ||
+        reply.count > limit) {
+        log_error("Failed to receive scan reply: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+    ssize_t bytes = (ssize_t)(reply.count * sizeof(kv_scan_item_t));
+    if (bytes > 0 && recv(client->socket, items, (size_t)bytes, MSG_WAITALL) != bytes) {
+        log_error("Failed to receive scan items: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    // The next page starts after the last key received
+    if (reply.count > 0) {
+        const kv_scan_item_t* last = &items[reply.count - 1];
+        memset(scan->start, 0, MAX_KEY_SIZE);
+        memcpy(scan->start, last->key, last->key_len);
+        scan->flags |= KV_SCAN_AFTER;
+    }
+    scan->done = !reply.more || reply.count == 0;
+    *count = reply.count;
+
+    log_debug("SCAN operation returned %u keys", reply.count);
+    return KV_SUCCESS;
+}
+
+struct kv_pipeline {
+    kv_client_t* client;
+    char* out;                          // Requests not sent yet
+    size_t out_len;
+    size_t out_size;
+    uint32_t ids[KV_PIPELINE_MAX_DEPTH]; // Pending, oldest at head
+    size_t head;
+    size_t count;
+    char* value;                        // Of the last reply
+    size_t value_size;
+};
+
+kv_pipeline_t* kv_pipeline_create(kv_client_t* client) {
+    if (!client || !client->is_connected || client->protocol < KV_PROTO_V2) {
+        log_error("Pipelining needs a connection speaking protocol v2");
+        return NULL;
+    }
+    kv_pipeline_t* pipeline = calloc(1, sizeof(kv_pipeline_t));
+    if (!pipeline) {
+        log_error("Failed to allocate pipeline: %s", strerror(errno));
+        return NULL;
+    }
+    pipeline->client = client;
+    return pipeline;
+}
+
+void kv_pipeline_destroy(kv_pipeline_t* pipeline) {
+    if (!pipeline) return;
+    free(pipeline->out);
+    free(pipeline->value);
+    free(pipeline);
+}
+
+static bool grow(char** data, size_t* size, size_t needed) {
+    if (needed <= *size) return true;
+    size_t new_size = *size ? *size : 4096;
+    while (new_size < needed) new_size *= 2;
+    char* grown = realloc(*data, new_size);
+    if (!grown) return false;
+    *data = grown;
+    *size = new_size;
+    return true;
+}
+
+// Encode a v2 request behind those already queued
+static uint32_t pipeline_frame(kv_pipeline_t* pipeline, uint8_t opcode, uint8_t flags,
+                               const char* key, const char* value, size_t value_len) {
+    if (!key || pipeline->count == KV_PIPELINE_MAX_DEPTH) return 0;
+    size_t key_len = strlen(key);
+    if (key_len > MAX_KEY_LENGTH || value_len > KV_FRAME_MAX_VALUE) return 0;
+
+    size_t size = KV_FRAME_HEADER_SIZE + key_len + value_len;
+    if (!grow(&pipeline->out, &pipeline->out_size, pipeline->out_len + size)) return 0;
+
+    kv_client_t* client = pipeline->client;
+    if (client->next_id == 0) client->next_id = 1;  // 0 reports a full pipeline
+    if (client->cache && opcode != MSG_GET && key_len > 0) {
+        near_cache_remove(client->cache, key, key_len, false);
+    }
+    kv_frame_t frame = { .code = opcode, .flags = flags, .key_len = (uint16_t)key_len,
+                         .value_len = (uint32_t)value_len, .id = client->next_id++ };
+    char* request = pipeline->out + pipeline->out_len;
+    kv_frame_encode(request, &frame);
+    memcpy(request + KV_FRAME_HEADER_SIZE, key, key_len);
+    if (value_len > 0) memcpy(request + KV_FRAME_HEADER_SIZE + key_len, value, value_len);
+    pipeline->out_len += size;
+
+    pipeline->ids[(pipeline->head + pipeline->count) % KV_PIPELINE_MAX_DEPTH] = frame.id;
+    pipeline->count++;
+    return frame.id;
+}
+
+static uint32_t pipeline_queue(kv_pipeline_t* pipeline, uint8_t opcode, const char* key,
+                               const char* value) {
+    return pipeline_frame(pipeline, opcode, 0, key, value, value ? strlen(value) : 0);
+}
+
+// A multi-key request, with no key and its items as value
+static uint32_t pipeline_batch(kv_pipeline_t* pipeline, uint8_t opcode, uint8_t flags,
+                               const char* const* keys, const char* const* values,
+                               size_t count) {
+    if (!keys || (opcode == MSG_MSET && !values) || count > KV_BATCH_MAX_KEYS) return 0;
+    char* request;
+    size_t len;
+    if (batch_encode(pipeline->client, opcode, keys, values, count, &request, &len) !=
+        KV_SUCCESS) {
+        return 0;
+    }
+    uint32_t id = pipeline_frame(pipeline, opcode, flags, "", request, len);
+    free(request);
+    return id;
+}
+
+uint32_t kv_pipeline_put(kv_pipeline_t* pipeline, const char* key, const char* value) {
+    return value ? pipeline_queue(pipeline, MSG_PUT, key, value) : 0;
+}
+
+uint32_t kv_pipeline_get(kv_pipeline_t* pipeline, const char* key) {
+    return pipeline_queue(pipeline, MSG_GET, key, NULL);
+}
+
+uint32_t kv_pipeline_delete(kv_pipeline_t* pipeline, const char* key) {
+    return pipeline_queue(pipeline, MSG_DELETE, key, NULL);
+}
+
+uint32_t kv_pipeline_mget(kv_pipeline_t* pipeline, const char* const* keys, size_t count) {
+    return pipeline_batch(pipeline, MSG_MGET, 0, keys, NULL, count);
+}
+
+uint32_t kv_pipeline_mset(kv_pipeline_t* pipeline, const char* const* keys,
+                          const char* const* values, size_t count, bool atomic) {
+    return pipeline_batch(pipeline, MSG_MSET, atomic ? KV_FRAME_ATOMIC : 0, keys, values,
+                          count);
+}
+
+uint32_t kv_pipeline_mdelete(kv_pipeline_t* pipeline, const char* const* keys, size_t count) {
+    return pipeline_batch(pipeline, MSG_MDELETE, 0, keys, NULL, count);
+}
+
+bool kv_pipeline_send(kv_pipeline_t* pipeline) {
+    if (pipeline->out_len == 0) return true;
+    struct iovec iov = { pipeline->out, pipeline->out_len };
+    pipeline->out_len = 0;
+    if (!client_send(pipeline->client, &iov, 1)) {
+        log_error("Failed to send pipelined requests: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+kv_error_t kv_pipeline_recv(kv_pipeline_t* pipeline, kv_reply_t* reply) {
+    memset(reply, 0, sizeof(*reply));
+    if (pipeline->count == 0) return KV_ERROR_INVALID_KEY;
+    if (!kv_pipeline_send(pipeline)) return KV_ERROR_NETWORK;
+
+    kv_frame_t frame;
+    if (!recv_reply_header(pipeline->client, &frame)) {
+        log_error("Failed to receive response: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+
+    uint32_t expected = pipeline->ids[pipeline->head];
+    if (frame.id != expected) {
+        log_error("Response to request %u, expected %u", frame.id, expected);
+        return KV_ERROR_NETWORK;
+    }
+    pipeline->head = (pipeline->head + 1) % KV_PIPELINE_MAX_DEPTH;
+    pipeline->count--;
+
+    if (!grow(&pipeline->value, &pipeline->value_size, (size_t)frame.value_len + 1)) {
+        return KV_ERROR_NETWORK;
+    }
+    if (!client_recv(pipeline->client, pipeline->value, frame.value_len)) {
+        log_error("Failed to receive value: %s", strerror(errno));
+        return KV_ERROR_NETWORK;
+    }
+    pipeline->value[frame.value_len] = '\0';
+
+    reply->id = frame.id;
+    reply->status = (kv_error_t)frame.code;
+    reply->value = pipeline->value;
+    reply->value_len = frame.value_len;
+    return reply->status;
+}
+
+size_t kv_pipeline_pending(const kv_pipeline_t* pipeline) {
+    return pipeline->count;
+}
+
+void kv_cache_options_init(kv_cache_options_t* options) {
+    options->max_bytes = 16 * 1024 * 1024;
+    options->ttl_ms = 60000;
+    options->prefixes = NULL;
+    options->prefix_count = 0;
+}
+
+// Send MSG_TRACK with flags and value, and skip the reply's value
+static kv_error_t track_call(kv_client_t* client, uint8_t flags, const char* value,
+                             size_t len) {
+    kv_frame_t reply;
+    kv_error_t result = frame_call(client, MSG_TRACK, flags, "", NULL, value, len, &reply);
+    if (result != KV_ERROR_NETWORK && !client_skip(client, reply.value_len)) {
+        return KV_ERROR_NETWORK;
+    }
+    return result;
+}
+
+bool kv_client_cache_enable(kv_client_t* client, const kv_cache_options_t* options) {
+    if (!client || !client->is_connected || !options || client->protocol < KV_PROTO_V2 ||
+        options->prefix_count > KV_CACHE_MAX_PREFIXES) {
+        log_warn("A near cache needs a connection speaking protocol v2");
+        return false;
+    }
+    kv_client_cache_disable(client);
+
+    // Prefixes go as MDELETE items
+    char prefixes[KV_CACHE_MAX_PREFIXES * (sizeof(uint16_t) + MAX_KEY_LENGTH)];
+    size_t len = 0;
+    for (size_t i = 0; i < options->prefix_count; i++) {
+        size_t prefix_len = strlen(options->prefixes[i]);
+        if (prefix_len > MAX_KEY_LENGTH) return false;
+        kv_put_u16(prefixes + len, (uint16_t)prefix_len);
+        memcpy(prefixes + len + sizeof(uint16_t), options->prefixes[i], prefix_len);
+        len += sizeof(uint16_t) + prefix_len;
+    }
+
+    near_cache_t* cache = near_cache_create(options->max_bytes, options->ttl_ms);
+    if (!cache) return false;
+    kv_error_t result = track_call(client, options->prefix_count > 0 ? KV_FRAME_BCAST : 0,
+                                   prefixes, len);
+    if (result != KV_SUCCESS) {
+        log_warn("Server refused to track the connection: %d", result);
+        near_cache_destroy(cache);
+        return false;
+    }
+    client->cache = cache;
+    log_debug("Near cache enabled%s", options->prefix_count > 0 ? " by prefix" : "");
+    return true;
+}
+
+void kv_client_cache_disable(kv_client_t* client) {
+    if (!client || !client->cache) return;
+    if (client->is_connected) track_call(client, KV_FRAME_UNTRACK, NULL, 0);
+    near_cache_destroy(client->cache);
+    client->cache = NULL;
+}
+
+void kv_client_cache_stats(const kv_client_t* client, kv_cache_stats_t* stats) {
+    if (client && client->cache) {
+        near_cache_stats(client->cache, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+double kv_client_cache_hit_ratio(const kv_client_t* client) {
+    kv_cache_stats_t stats;
+    kv_client_cache_stats(client, &stats);
+    uint64_t lookups = stats.hits + stats.misses;
+    return lookups ? (double)stats.hits / (double)lookups : 0.0;
+}
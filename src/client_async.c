@@ -0,0 +1,640 @@
+#include "kv_store.h"
+#include "log.h"
+#include "protocol.h"
+#include "shm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define ASYNC_TICK_MS 10                // How often deadlines and reconnects are checked
+#define ASYNC_MAX_INFLIGHT KV_PIPELINE_MAX_DEPTH  // Sent and unanswered, per connection
+#define ASYNC_READ_SIZE (64 * 1024)     // Receive buffer grown by at least this
+#define ASYNC_MAX_EVENTS 64
+
+// A request from the thread that starts it to its completion
+typedef struct async_req {
+    struct async_req* next;
+    uint64_t deadline;                  // Monotonic ms
+    kv_async_fn fn;                     // NULL once completed
+    void* ctx;
+    uint32_t id;                        // On its connection, once sent
+    size_t len;
+    char frame[];                       // Header, key, value
+} async_req_t;
+
+typedef enum {
+    ASYNC_DOWN,                         // Waiting to reopen
+    ASYNC_CONNECTING,
+    ASYNC_HELLO,                        // Waiting for the server's hello
+    ASYNC_UP,
+} async_state_t;
+
+typedef struct {
+    int fd;
+    async_state_t state;
+    uint32_t events;                    // Registered with epoll
+    uint64_t retry_at;                  // Down: when to reopen
+    uint64_t ready_by;                  // Connecting: when to give up
+    unsigned backoff_ms;                // Before the next reopening
+    uint32_t next_id;
+    async_req_t* sent;                  // Awaiting replies, oldest first
+    async_req_t* sent_tail;
+    size_t inflight;
+    char* out;                          // Requests the socket has not taken
+    size_t out_len;
+    size_t out_size;
+    char* in;                           // A reply cut short
+    size_t in_len;
+    size_t in_size;
+} async_conn_t;
+
+struct kv_async {
+    kv_async_options_t options;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char name[108];
+    int epfd;
+    int wake_fd;                        // Rung when the queue fills or to stop
+    pthread_t thread;
+    pthread_mutex_t lock;               // Guards queue and stopping
+    async_req_t* queue;                 // Started, not yet taken by the loop
+    async_req_t* queue_tail;
+    bool stopping;
+    // The loop's own
+    async_req_t* waiting;               // For a connection with room
+    async_req_t* waiting_tail;
+    unsigned connected;                 // Read by kv_async_connected
+    unsigned next_conn;                 // Where the search for the least busy starts
+    async_conn_t* conns;
+};
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool reserve(char** data, size_t* size, size_t needed) {
+    if (needed <= *size) return true;
+    size_t new_size = *size ? *size : 4096;
+    while (new_size < needed) new_size *= 2;
+    char* grown = realloc(*data, new_size);
+    if (!grown) return false;
+    *data = grown;
+    *size = new_size;
+    return true;
+}
+
+static void complete(async_req_t* req, kv_error_t status, const char* value, size_t value_len) {
+    if (!req->fn) return;
+    kv_reply_t reply = { .id = req->id, .status = status, .value = value,
+                         .value_len = value_len };
+    req->fn(req->ctx, &reply);
+    req->fn = NULL;
+}
+
+static void fail_all(async_req_t* list, kv_error_t status) {
+    while (list) {
+        async_req_t* req = list;
+        list = req->next;
+        complete(req, status, NULL, 0);
+        free(req);
+    }
+}
+
+static bool conn_watch(kv_async_t* pool, async_conn_t* conn, uint32_t events) {
+    if (events == conn->events) return true;
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) return false;
+    conn->events = events;
+    return true;
+}
+
+// Close the connection and fail what was sent on it; it reopens after
+// its backoff
+static void conn_down(kv_async_t* pool, async_conn_t* conn, uint64_t now) {
+    if (conn->state == ASYNC_UP) {
+        log_warn("Lost connection to %s, reconnecting", pool->name);
+        __atomic_sub_fetch(&pool->connected, 1, __ATOMIC_RELAXED);
+    }
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->state = ASYNC_DOWN;
+    conn->retry_at = now + conn->backoff_ms;
+    conn->backoff_ms = conn->backoff_ms * 2 < KV_ASYNC_MAX_BACKOFF_MS ? conn->backoff_ms * 2
+                                                                     : KV_ASYNC_MAX_BACKOFF_MS;
+    fail_all(conn->sent, KV_ERROR_NETWORK);
+    conn->sent = conn->sent_tail = NULL;
+    conn->inflight = 0;
+    conn->out_len = conn->in_len = 0;
+}
+
+static void conn_open(kv_async_t* pool, async_conn_t* conn, uint64_t now) {
+    conn->fd = socket(pool->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        conn_down(pool, conn, now);
+        return;
+    }
+    int opt = 1;
+    if (pool->addr.ss_family == AF_INET) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = conn };
+    if ((connect(conn->fd, (struct sockaddr*)&pool->addr, pool->addr_len) < 0 &&
+         errno != EINPROGRESS) ||
+        epoll_ctl(pool->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        log_debug("Connection to %s failed: %s", pool->name, strerror(errno));
+        conn_down(pool, conn, now);
+        return;
+    }
+    conn->events = EPOLLOUT;
+    conn->state = ASYNC_CONNECTING;
+    conn->ready_by = now + pool->options.timeout_ms;
+}
+
+// Send what the socket takes, and wait to write while anything is left
+static bool conn_flush(kv_async_t* pool, async_conn_t* conn) {
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    return conn_watch(pool, conn, EPOLLIN | (conn->out_len > 0 ? EPOLLOUT : 0));
+}
+
+// Take the complete replies at the front of the input. Returns the bytes
+// used, or -1 if the server broke the protocol.
+static ssize_t conn_replies(kv_async_t* pool, async_conn_t* conn) {
+    size_t at = 0;
+    if (conn->state == ASYNC_HELLO) {
+        if (conn->in_len < KV_HELLO_SIZE) return 0;
+        if (kv_hello_decode(conn->in) != KV_PROTO_V2) {
+            log_error("%s does not speak protocol v2", pool->name);
+            return -1;
+        }
+        conn->state = ASYNC_UP;
+        conn->backoff_ms = pool->options.reconnect_ms;
+        __atomic_add_fetch(&pool->connected, 1, __ATOMIC_RELAXED);
+        log_debug("Connected to %s", pool->name);
+        at = KV_HELLO_SIZE;
+    }
+
+    while (conn->in_len - at >= KV_FRAME_HEADER_SIZE) {
+        kv_frame_t frame;
+        kv_frame_decode(conn->in + at, &frame);
+        size_t end = at + KV_FRAME_HEADER_SIZE + frame.value_len;
+        if (conn->in_len < end) break;
+        async_req_t* req = conn->sent;
+        if (!req || req->id != frame.id) {
+            log_error("Response to request %u from %s, expected %u", frame.id, pool->name,
+                      req ? req->id : 0);
+            return -1;
+        }
+        conn->sent = req->next;
+        if (!conn->sent) conn->sent_tail = NULL;
+        conn->inflight--;
+
+        // The value is terminated in place for the callback; the buffer
+        // always has a byte to spare
+        char* value = conn->in + at + KV_FRAME_HEADER_SIZE;
+        char saved = value[frame.value_len];
+        value[frame.value_len] = '\0';
+        complete(req, (kv_error_t)frame.code, value, frame.value_len);
+        value[frame.value_len] = saved;
+        free(req);
+        at = end;
+    }
+    return (ssize_t)at;
+}
+
+static bool conn_readable(kv_async_t* pool, async_conn_t* conn) {
+    for (;;) {
+        if (!reserve(&conn->in, &conn->in_size, conn->in_len + ASYNC_READ_SIZE + 1)) {
+            return false;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                         conn->in_size - conn->in_len - 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        conn->in_len += (size_t)n;
+
+        ssize_t used = conn_replies(pool, conn);
+        if (used < 0) return false;
+        memmove(conn->in, conn->in + used, conn->in_len - (size_t)used);
+        conn->in_len -= (size_t)used;
+    }
+}
+
+static bool conn_event(kv_async_t* pool, async_conn_t* conn, uint32_t events) {
+    if (conn->state == ASYNC_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            log_debug("Connection to %s failed: %s", pool->name, strerror(error));
+            return false;
+        }
+        char hello[KV_HELLO_SIZE];
+        kv_hello_encode(hello, KV_PROTO_V2);
+        if (!reserve(&conn->out, &conn->out_size, sizeof(hello))) return false;
+        memcpy(conn->out, hello, sizeof(hello));
+        conn->out_len = sizeof(hello);
+        conn->state = ASYNC_HELLO;
+        return conn_flush(pool, conn);
+    }
+    if ((events & EPOLLOUT) && !conn_flush(pool, conn)) return false;
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !conn_readable(pool, conn)) return false;
+    return true;
+}
+
+// The open connection with the fewest requests out, if any has room
+static async_conn_t* least_busy(kv_async_t* pool) {
+    async_conn_t* best = NULL;
+    unsigned count = pool->options.connections;
+    for (unsigned i = 0; i < count; i++) {
+        async_conn_t* conn = &pool->conns[(pool->next_conn + i) % count];
+        if (conn->state == ASYNC_UP && conn->inflight < ASYNC_MAX_INFLIGHT &&
+            (!best || conn->inflight < best->inflight)) {
+            best = conn;
+        }
+    }
+    pool->next_conn = (pool->next_conn + 1) % count;
+    return best;
+}
+
+// Hand waiting requests to connections, then send each connection's lot
+// at once
+static void dispatch(kv_async_t* pool, uint64_t now) {
+    while (pool->waiting) {
+        async_req_t* req = pool->waiting;
+        async_conn_t* conn = least_busy(pool);
+        if (!conn || !reserve(&conn->out, &conn->out_size, conn->out_len + req->len)) break;
+        pool->waiting = req->next;
+        if (!pool->waiting) pool->waiting_tail = NULL;
+
+        kv_frame_t frame;
+        kv_frame_decode(req->frame, &frame);
+        if (conn->next_id == 0) conn->next_id = 1;
+        frame.id = req->id = conn->next_id++;
+        kv_frame_encode(req->frame, &frame);
+        memcpy(conn->out + conn->out_len, req->frame, req->len);
+        conn->out_len += req->len;
+
+        req->next = NULL;
+        if (conn->sent_tail) {
+            conn->sent_tail->next = req;
+        } else {
+            conn->sent = req;
+        }
+        conn->sent_tail = req;
+        conn->inflight++;
+    }
+
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        async_conn_t* conn = &pool->conns[i];
+        if (conn->state == ASYNC_UP && conn->out_len > 0 &&
+            (conn->events & EPOLLOUT) == 0 && !conn_flush(pool, conn)) {
+            conn_down(pool, conn, now);
+        }
+    }
+}
+
+// Time out requests past their deadline, give up on connections that
+// take too long to open, and reopen those due. A request sent already
+// stays in line for its reply, which is dropped when it comes.
+static void tick(kv_async_t* pool, uint64_t now) {
+    async_req_t** link = &pool->waiting;
+    pool->waiting_tail = NULL;
+    while (*link) {
+        async_req_t* req = *link;
+        if (req->deadline <= now) {
+            *link = req->next;
+            complete(req, KV_ERROR_TIMEOUT, NULL, 0);
+            free(req);
+        } else {
+            pool->waiting_tail = req;
+            link = &req->next;
+        }
+    }
+
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        async_conn_t* conn = &pool->conns[i];
+        for (async_req_t* req = conn->sent; req; req = req->next) {
+            if (req->deadline <= now) complete(req, KV_ERROR_TIMEOUT, NULL, 0);
+        }
+        if ((conn->state == ASYNC_CONNECTING || conn->state == ASYNC_HELLO) &&
+            conn->ready_by <= now) {
+            log_debug("Connection to %s timed out", pool->name);
+            conn_down(pool, conn, now);
+        } else if (conn->state == ASYNC_UP && conn->sent &&
+                   conn->sent->deadline + pool->options.timeout_ms <= now) {
+            // A full timeout past the oldest request's deadline, the
+            // server is presumed gone
+            log_warn("No reply from %s in %u ms", pool->name, pool->options.timeout_ms);
+            conn_down(pool, conn, now);
+        } else if (conn->state == ASYNC_DOWN && conn->retry_at <= now) {
+            conn_open(pool, conn, now);
+        }
+    }
+}
+
+// Whether anything needs the loop to wake up on its own
+static bool pool_busy(const kv_async_t* pool) {
+    if (pool->waiting) return true;
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        if (pool->conns[i].state != ASYNC_UP || pool->conns[i].inflight > 0) return true;
+    }
+    return false;
+}
+
+static void* async_loop(void* arg) {
+    kv_async_t* pool = arg;
+    struct epoll_event events[ASYNC_MAX_EVENTS];
+    uint64_t next_tick = 0;
+
+    for (;;) {
+        int n = epoll_wait(pool->epfd, events, ASYNC_MAX_EVENTS,
+                           pool_busy(pool) ? ASYNC_TICK_MS : -1);
+        if (n < 0 && errno != EINTR) {
+            log_error("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        uint64_t now = monotonic_ms();
+        for (int i = 0; i < n; i++) {
+            async_conn_t* conn = events[i].data.ptr;
+            if (!conn) {
+                uint64_t rung;
+                if (read(pool->wake_fd, &rung, sizeof(rung)) < 0) {
+                    // Rung again since; read next time round
+                }
+            } else if (conn->state != ASYNC_DOWN && !conn_event(pool, conn, events[i].events)) {
+                conn_down(pool, conn, now);
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        async_req_t* queue = pool->queue;
+        async_req_t* queue_tail = pool->queue_tail;
+        pool->queue = pool->queue_tail = NULL;
+        bool stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (queue) {
+            if (pool->waiting_tail) {
+                pool->waiting_tail->next = queue;
+            } else {
+                pool->waiting = queue;
+            }
+            pool->waiting_tail = queue_tail;
+        }
+        if (stopping) break;
+
+        if (now >= next_tick) {
+            tick(pool, now);
+            next_tick = now + ASYNC_TICK_MS;
+        }
+        dispatch(pool, now);
+    }
+
+    fail_all(pool->waiting, KV_ERROR_NETWORK);
+    pool->waiting = pool->waiting_tail = NULL;
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        async_conn_t* conn = &pool->conns[i];
+        fail_all(conn->sent, KV_ERROR_NETWORK);
+        conn->sent = conn->sent_tail = NULL;
+    }
+    return NULL;
+}
+
+void kv_async_options_init(kv_async_options_t* options) {
+    options->connections = 4;
+    options->timeout_ms = 5000;
+    options->reconnect_ms = 100;
+    options->transports = KV_TRANSPORT_TCP | KV_TRANSPORT_UNIX;
+}
+
+// The server's Unix socket when it is on this machine and allowed, else
+// TCP
+static bool resolve(kv_async_t* pool, const char* host, int port) {
+    uint8_t transports = pool->options.transports;
+    struct sockaddr_un* local = (struct sockaddr_un*)&pool->addr;
+    if ((transports & KV_TRANSPORT_UNIX) && kv_client_local_host(host) &&
+        snprintf(local->sun_path, sizeof(local->sun_path), KV_UNIX_PATH_FORMAT, port) <
+            (int)sizeof(local->sun_path) &&
+        access(local->sun_path, F_OK) == 0) {
+        local->sun_family = AF_UNIX;
+        pool->addr_len = sizeof(*local);
+        snprintf(pool->name, sizeof(pool->name), "%s", local->sun_path);
+        return true;
+    }
+
+    memset(&pool->addr, 0, sizeof(pool->addr));
+    struct sockaddr_in* remote = (struct sockaddr_in*)&pool->addr;
+    if (!(transports & KV_TRANSPORT_TCP) || inet_pton(AF_INET, host, &remote->sin_addr) <= 0) {
+        log_error("No transport to %s:%d", host, port);
+        return false;
+    }
+    remote->sin_family = AF_INET;
+    remote->sin_port = htons(port);
+    pool->addr_len = sizeof(*remote);
+    snprintf(pool->name, sizeof(pool->name), "%s:%d", host, port);
+    return true;
+}
+
+kv_async_t* kv_async_create(const char* host, int port, const kv_async_options_t* options) {
+    if (!host) return NULL;
+    kv_async_t* pool = calloc(1, sizeof(kv_async_t));
+    if (!pool) return NULL;
+    if (options) {
+        pool->options = *options;
+    } else {
+        kv_async_options_init(&pool->options);
+    }
+    if (pool->options.connections == 0) pool->options.connections = 1;
+    if (pool->options.timeout_ms == 0) pool->options.timeout_ms = 5000;
+    if (pool->options.reconnect_ms == 0) pool->options.reconnect_ms = 1;
+    pool->epfd = pool->wake_fd = -1;
+    if (!resolve(pool, host, port)) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->conns = calloc(pool->options.connections, sizeof(async_conn_t));
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (!pool->conns || pool->epfd < 0 || pool->wake_fd < 0 ||
+        epoll_ctl(pool->epfd, EPOLL_CTL_ADD, pool->wake_fd, &ev) < 0) {
+        log_error("Failed to set up the client loop: %s", strerror(errno));
+        if (pool->epfd >= 0) close(pool->epfd);
+        if (pool->wake_fd >= 0) close(pool->wake_fd);
+        free(pool->conns);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+
+    uint64_t now = monotonic_ms();
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        pool->conns[i].fd = -1;
+        pool->conns[i].backoff_ms = pool->options.reconnect_ms;
+        conn_open(pool, &pool->conns[i], now);
+    }
+    if (pthread_create(&pool->thread, NULL, async_loop, pool) != 0) {
+        log_error("Failed to start the client loop");
+        pool->stopping = true;
+        async_loop(pool);               // Only fails and closes
+        kv_async_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void kv_async_destroy(kv_async_t* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    bool running = !pool->stopping;
+    pool->stopping = true;
+    pthread_mutex_unlock(&pool->lock);
+    if (running) {
+        shm_ring_bell(pool->wake_fd);
+        pthread_join(pool->thread, NULL);
+    }
+
+    fail_all(pool->queue, KV_ERROR_NETWORK);
+    for (unsigned i = 0; i < pool->options.connections; i++) {
+        async_conn_t* conn = &pool->conns[i];
+        if (conn->fd >= 0) close(conn->fd);
+        free(conn->out);
+        free(conn->in);
+    }
+    close(pool->epfd);
+    close(pool->wake_fd);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->conns);
+    free(pool);
+}
+
+// Encode the request and queue it for the loop, waking it if the queue
+// was empty
+static bool async_start(kv_async_t* pool, uint8_t opcode, const char* key, const char* value,
+                        unsigned timeout_ms, kv_async_fn fn, void* ctx) {
+    if (!pool || !key || !fn) return false;
+    size_t key_len = strlen(key);
+    size_t value_len = value ? strlen(value) : 0;
+    if (key_len > MAX_KEY_LENGTH || value_len > KV_FRAME_MAX_VALUE) return false;
+
+    size_t len = KV_FRAME_HEADER_SIZE + key_len + value_len;
+    async_req_t* req = malloc(sizeof(async_req_t) + len);
+    if (!req) return false;
+    kv_frame_t frame = { .code = opcode, .key_len = (uint16_t)key_len,
+                         .value_len = (uint32_t)value_len };
+    kv_frame_encode(req->frame, &frame);
+    memcpy(req->frame + KV_FRAME_HEADER_SIZE, key, key_len);
+    if (value_len > 0) memcpy(req->frame + KV_FRAME_HEADER_SIZE + key_len, value, value_len);
+    req->next = NULL;
+    req->deadline = monotonic_ms() + (timeout_ms ? timeout_ms : pool->options.timeout_ms);
+    req->fn = fn;
+    req->ctx = ctx;
+    req->id = 0;
+    req->len = len;
+
+    pthread_mutex_lock(&pool->lock);
+    bool stopping = pool->stopping;
+    bool wake = !pool->queue;
+    if (!stopping) {
+        if (pool->queue_tail) {
+            pool->queue_tail->next = req;
+        } else {
+            pool->queue = req;
+        }
+        pool->queue_tail = req;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stopping) {
+        free(req);
+        return false;
+    }
+    if (wake) shm_ring_bell(pool->wake_fd);
+    return true;
+}
+
+bool kv_async_put(kv_async_t* pool, const char* key, const char* value,
+                  unsigned timeout_ms, kv_async_fn fn, void* ctx) {
+    return value && async_start(pool, MSG_PUT, key, value, timeout_ms, fn, ctx);
+}
+
+bool kv_async_get(kv_async_t* pool, const char* key, unsigned timeout_ms,
+                  kv_async_fn fn, void* ctx) {
+    return async_start(pool, MSG_GET, key, NULL, timeout_ms, fn, ctx);
+}
+
+bool kv_async_delete(kv_async_t* pool, const char* key, unsigned timeout_ms,
+                     kv_async_fn fn, void* ctx) {
+    return async_start(pool, MSG_DELETE, key, NULL, timeout_ms, fn, ctx);
+}
+
+unsigned kv_async_connected(kv_async_t* pool) {
+    return pool ? __atomic_load_n(&pool->connected, __ATOMIC_RELAXED) : 0;
+}
+
+void kv_future_init(kv_future_t* future) {
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    future->done = false;
+    future->status = KV_SUCCESS;
+    future->value = NULL;
+    future->value_len = 0;
+}
+
+void kv_future_complete(void* ctx, const kv_reply_t* reply) {
+    kv_future_t* future = ctx;
+    char* value = NULL;
+    if (reply->status == KV_SUCCESS && reply->value && (value = malloc(reply->value_len + 1))) {
+        memcpy(value, reply->value, reply->value_len);
+        value[reply->value_len] = '\0';
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->status = reply->status;
+    future->value = value;
+    future->value_len = value ? reply->value_len : 0;
+    future->done = true;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+kv_error_t kv_future_wait(kv_future_t* future) {
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) pthread_cond_wait(&future->cond, &future->lock);
+    kv_error_t status = future->status;
+    pthread_mutex_unlock(&future->lock);
+    return status;
+}
+
+void kv_future_destroy(kv_future_t* future) {
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->cond);
+    free(future->value);
+    future->value = NULL;
+}
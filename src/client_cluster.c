@@ -0,0 +1,437 @@
+#include "kv_store.h"
+#include "cluster.h"
+#include "log.h"
+#include "protocol.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CLUSTER_HOST_SIZE 256
+
+typedef struct {
+    char host[CLUSTER_HOST_SIZE];
+    int port;
+    kv_client_t* client;                // NULL until first used, and after failing
+    kv_pipeline_t* pipeline;            // Protocol v2 only
+} cluster_node_t;
+
+struct kv_cluster {
+    cluster_map_t* map;
+    cluster_node_t* nodes;              // In the map's order
+    kv_cluster_options_t options;
+    kv_cluster_stats_t stats;
+};
+
+// Multi-key commands in flight: the keys grouped by node
+typedef struct {
+    uint8_t opcode;
+    bool atomic;
+    const char* const* keys;
+    const char* const* values;          // MSET
+    char** out;                         // MGET: the caller's buffers
+    kv_error_t* statuses;
+    size_t count;
+    unsigned* owners;                   // Per key
+    size_t* order;                      // Key indexes sorted by owner
+    size_t* start;                      // Per node, its run of order; one more at the end
+    const char** group_keys;            // Keys and values in order
+    const char** group_values;
+    char** group_out;
+} cluster_batch_t;
+
+void kv_cluster_options_init(kv_cluster_options_t* options) {
+    options->placement = KV_PLACEMENT_RING;
+    options->vnodes = KV_CLUSTER_VNODES;
+    options->transports = KV_TRANSPORT_TCP | KV_TRANSPORT_UNIX | KV_TRANSPORT_SHM;
+}
+
+static void node_close(cluster_node_t* node) {
+    kv_pipeline_destroy(node->pipeline);
+    node->pipeline = NULL;
+    if (node->client) {
+        kv_client_disconnect(node->client);
+        kv_client_destroy(node->client);
+        node->client = NULL;
+    }
+}
+
+// The connection to node, opened if it is not
+static kv_client_t* node_client(kv_cluster_t* cluster, unsigned index) {
+    cluster_node_t* node = &cluster->nodes[index];
+    if (node->client) return node->client;
+    kv_client_t* client = kv_client_create();
+    if (!client) return NULL;
+    client->transports = cluster->options.transports;
+    if (!kv_client_connect(client, node->host, node->port)) {
+        kv_client_destroy(client);
+        return NULL;
+    }
+    node->client = client;
+    if (client->protocol >= KV_PROTO_V2) node->pipeline = kv_pipeline_create(client);
+    return client;
+}
+
+// Nodes for map, keeping the connections of those already known by name
+static cluster_node_t* nodes_for(const cluster_map_t* map, cluster_node_t* old,
+                                 const cluster_map_t* old_map) {
+    size_t count = cluster_map_count(map);
+    cluster_node_t* nodes = calloc(count, sizeof(*nodes));
+    if (!nodes) return NULL;
+    for (size_t i = 0; i < count; i++) {
+        const char* name = cluster_map_node(map, (unsigned)i);
+        cluster_parse_node(name, nodes[i].host, sizeof(nodes[i].host), &nodes[i].port);
+        int known = old_map ? cluster_map_find(old_map, name) : -1;
+        if (known >= 0) {
+            nodes[i].client = old[known].client;
+            nodes[i].pipeline = old[known].pipeline;
+            old[known].client = NULL;
+            old[known].pipeline = NULL;
+        }
+    }
+    return nodes;
+}
+
+kv_cluster_t* kv_cluster_create(const char* const* nodes, size_t count,
+                                const kv_cluster_options_t* options) {
+    kv_cluster_options_t defaults;
+    if (!options) {
+        kv_cluster_options_init(&defaults);
+        options = &defaults;
+    }
+    if (!nodes) return NULL;
+
+    kv_cluster_t* cluster = calloc(1, sizeof(kv_cluster_t));
+    if (!cluster) {
+        log_error("Failed to allocate cluster: %s", strerror(errno));
+        return NULL;
+    }
+    cluster->options = *options;
+    cluster->map = cluster_map_create(nodes, count, options->placement, options->vnodes);
+    if (!cluster->map) {
+        log_error("Invalid cluster of %zu nodes", count);
+        free(cluster);
+        return NULL;
+    }
+    cluster->nodes = nodes_for(cluster->map, NULL, NULL);
+    if (!cluster->nodes) {
+        cluster_map_destroy(cluster->map);
+        free(cluster);
+        return NULL;
+    }
+    return cluster;
+}
+
+void kv_cluster_destroy(kv_cluster_t* cluster) {
+    if (!cluster) return;
+    for (size_t i = 0; i < cluster_map_count(cluster->map); i++) node_close(&cluster->nodes[i]);
+    free(cluster->nodes);
+    cluster_map_destroy(cluster->map);
+    free(cluster);
+}
+
+const char* kv_cluster_node_of(const kv_cluster_t* cluster, const char* key) {
+    if (!cluster || !key) return NULL;
+    return cluster_map_node(cluster->map, cluster_map_owner(cluster->map, key, strlen(key)));
+}
+
+void kv_cluster_stats(const kv_cluster_t* cluster, kv_cluster_stats_t* stats) {
+    *stats = cluster->stats;
+}
+
+// Take the node list from the node that answered KV_ERROR_MOVED
+static bool refresh(kv_cluster_t* cluster, unsigned from) {
+    kv_client_t* client = node_client(cluster, from);
+    char* data = NULL;
+    size_t len;
+    if (!client || kv_client_cluster_nodes(client, &data, &len) != KV_SUCCESS) {
+        log_warn("No node list from %s", cluster_map_node(cluster->map, from));
+        free(data);
+        return false;
+    }
+    cluster_map_t* map = cluster_map_decode(data, len);
+    free(data);
+    cluster_node_t* nodes = map ? nodes_for(map, cluster->nodes, cluster->map) : NULL;
+    if (!nodes) {
+        cluster_map_destroy(map);
+        return false;
+    }
+
+    for (size_t i = 0; i < cluster_map_count(cluster->map); i++) node_close(&cluster->nodes[i]);
+    free(cluster->nodes);
+    cluster_map_destroy(cluster->map);
+    cluster->map = map;
+    cluster->nodes = nodes;
+    cluster->stats.refreshes++;
+    log_debug("Cluster now has %zu nodes", cluster_map_count(map));
+    return true;
+}
+
+// A single-key command, run where the map places key and retried there
+// after a move
+static kv_error_t cluster_call(kv_cluster_t* cluster, uint8_t opcode, const char* key,
+                               const char* value, uint64_t ttl_ms, char* out) {
+    if (!cluster || !key) return KV_ERROR_INVALID_KEY;
+    for (unsigned redirects = 0;; redirects++) {
+        unsigned owner = cluster_map_owner(cluster->map, key, strlen(key));
+        kv_client_t* client = node_client(cluster, owner);
+        if (!client) return KV_ERROR_NETWORK;
+
+        kv_error_t result;
+        switch (opcode) {
+            case MSG_PUT:     result = kv_client_put(client, key, value); break;
+            case MSG_GET:     result = kv_client_get(client, key, out); break;
+            case MSG_DELETE:  result = kv_client_delete(client, key); break;
+            default:          result = kv_client_put_ttl(client, key, value, ttl_ms); break;
+        }
+        if (result == KV_ERROR_NETWORK) node_close(&cluster->nodes[owner]);
+        if (result != KV_ERROR_MOVED) return result;
+
+        cluster->stats.moved++;
+        if (redirects == KV_CLUSTER_MAX_REDIRECTS || !refresh(cluster, owner)) return result;
+    }
+}
+
+kv_error_t kv_cluster_put(kv_cluster_t* cluster, const char* key, const char* value) {
+    return cluster_call(cluster, MSG_PUT, key, value, 0, NULL);
+}
+
+kv_error_t kv_cluster_get(kv_cluster_t* cluster, const char* key, char* value) {
+    return cluster_call(cluster, MSG_GET, key, NULL, 0, value);
+}
+
+kv_error_t kv_cluster_delete(kv_cluster_t* cluster, const char* key) {
+    return cluster_call(cluster, MSG_DELETE, key, NULL, 0, NULL);
+}
+
+kv_error_t kv_cluster_put_ttl(kv_cluster_t* cluster, const char* key, const char* value,
+                              uint64_t ttl_ms) {
+    return cluster_call(cluster, MSG_PUT_TTL, key, value, ttl_ms, NULL);
+}
+
+// Sort the keys still KV_ERROR_MOVED by owner. Returns how many nodes
+// they are on.
+static size_t batch_group(kv_cluster_t* cluster, cluster_batch_t* batch) {
+    size_t nodes = cluster_map_count(cluster->map);
+    memset(batch->start, 0, (nodes + 1) * sizeof(*batch->start));
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->statuses[i] != KV_ERROR_MOVED) continue;
+        batch->owners[i] = cluster_map_owner(cluster->map, batch->keys[i],
+                                             strlen(batch->keys[i]));
+        batch->start[batch->owners[i] + 1]++;
+    }
+    size_t used = 0;
+    for (size_t n = 0; n < nodes; n++) {
+        if (batch->start[n + 1] > 0) used++;
+        batch->start[n + 1] += batch->start[n];
+    }
+
+    // Counting sort, which leaves each node's keys in request order
+    size_t* next = batch->start + nodes + 1;
+    memcpy(next, batch->start, nodes * sizeof(*next));
+    for (size_t i = 0; i < batch->count; i++) {
+        if (batch->statuses[i] != KV_ERROR_MOVED) continue;
+        size_t at = next[batch->owners[i]]++;
+        batch->order[at] = i;
+        batch->group_keys[at] = batch->keys[i];
+        batch->group_values[at] = batch->values ? batch->values[i] : NULL;
+        batch->group_out[at] = batch->out ? batch->out[i] : NULL;
+    }
+    return used;
+}
+
+// Hand a node's reply out to its keys
+static void batch_reply(cluster_batch_t* batch, size_t first, size_t count,
+                        const kv_reply_t* reply) {
+    kv_error_t* statuses = batch->statuses;
+    const char* body = reply->value;
+    size_t len = reply->value_len;
+    bool whole = batch->opcode == MSG_MGET ? reply->status != KV_SUCCESS : len != count;
+    if (reply->status == KV_ERROR_NETWORK || whole) {
+        kv_error_t status = reply->status == KV_SUCCESS ? KV_ERROR_NETWORK : reply->status;
+        for (size_t i = 0; i < count; i++) statuses[batch->order[first + i]] = status;
+        return;
+    }
+
+    size_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t index = batch->order[first + i];
+        if (batch->opcode != MSG_MGET) {
+            statuses[index] = (kv_error_t)(uint8_t)body[i];
+            continue;
+        }
+        if (len - at < 5 || len - at - 5 < kv_get_u32(body + at + 1)) {
+            statuses[index] = KV_ERROR_NETWORK;  // Malformed reply
+            continue;
+        }
+        size_t value_len = kv_get_u32(body + at + 1);
+        statuses[index] = (kv_error_t)(uint8_t)body[at];
+        // Values the caller's MAX_VALUE_SIZE buffers cannot hold fail as in GET
+        if (statuses[index] == KV_SUCCESS && value_len >= MAX_VALUE_SIZE) {
+            statuses[index] = KV_ERROR_VALUE_TOO_LARGE;
+        } else if (statuses[index] == KV_SUCCESS) {
+            memcpy(batch->out[index], body + at + 5, value_len);
+            batch->out[index][value_len] = '\0';
+        }
+        at += 5 + value_len;
+    }
+}
+
+// A group on a v1 connection, run as kv_client_mget and the rest do there.
+// Returns their result.
+static kv_error_t batch_direct(cluster_batch_t* batch, kv_client_t* client, size_t first,
+                         size_t count) {
+    kv_error_t statuses[count];
+    kv_error_t result;
+    switch (batch->opcode) {
+        case MSG_MGET:
+            result = kv_client_mget(client, batch->group_keys + first, count, batch->group_out + first,
+                           statuses);
+            break;
+        case MSG_MSET:
+            result = kv_client_mset(client, batch->group_keys + first, batch->group_values + first,
+                           count, batch->atomic, statuses);
+            break;
+        default:
+            result = kv_client_mdelete(client, batch->group_keys + first, count, statuses);
+            break;
+    }
+    for (size_t i = 0; i < count; i++) batch->statuses[batch->order[first + i]] = statuses[i];
+    return result;
+}
+
+// Queue a node's keys on its pipeline. Returns the request id, or 0.
+static uint32_t batch_queue(cluster_batch_t* batch, kv_pipeline_t* pipeline, size_t first,
+                            size_t count) {
+    const char** keys = batch->group_keys + first;
+    switch (batch->opcode) {
+        case MSG_MGET:
+            return kv_pipeline_mget(pipeline, keys, count);
+        case MSG_MSET:
+            return kv_pipeline_mset(pipeline, keys, batch->group_values + first, count,
+                                    batch->atomic);
+        default:
+            return kv_pipeline_mdelete(pipeline, keys, count);
+    }
+}
+
+// Send every node its keys, then read the replies, so the nodes work on
+// them side by side. Returns a node that answered KV_ERROR_MOVED, or -1.
+static int batch_round(kv_cluster_t* cluster, cluster_batch_t* batch) {
+    size_t nodes = cluster_map_count(cluster->map);
+    uint32_t ids[nodes];
+    for (size_t n = 0; n < nodes; n++) {
+        size_t first = batch->start[n], count = batch->start[n + 1] - first;
+        ids[n] = 0;
+        if (count == 0) continue;
+        kv_client_t* client = node_client(cluster, (unsigned)n);
+        kv_reply_t failed = { .status = KV_ERROR_NETWORK };
+        if (client && !cluster->nodes[n].pipeline) {
+            if (batch_direct(batch, client, first, count) == KV_ERROR_NETWORK) {
+                node_close(&cluster->nodes[n]);
+            }
+            continue;
+        }
+        if (client && (ids[n] = batch_queue(batch, cluster->nodes[n].pipeline, first, count))) {
+            continue;
+        }
+        if (client) failed.status = KV_ERROR_INVALID_KEY;  // Could not be encoded
+        batch_reply(batch, first, count, &failed);
+    }
+    for (size_t n = 0; n < nodes; n++) {
+        if (ids[n] == 0 || kv_pipeline_send(cluster->nodes[n].pipeline)) continue;
+        kv_reply_t failed = { .status = KV_ERROR_NETWORK };
+        batch_reply(batch, batch->start[n], batch->start[n + 1] - batch->start[n], &failed);
+        node_close(&cluster->nodes[n]);
+        ids[n] = 0;
+    }
+
+    int moved = -1;
+    for (size_t n = 0; n < nodes; n++) {
+        if (ids[n] == 0) continue;
+        kv_reply_t reply;
+        kv_pipeline_recv(cluster->nodes[n].pipeline, &reply);
+        batch_reply(batch, batch->start[n], batch->start[n + 1] - batch->start[n], &reply);
+        if (reply.status == KV_ERROR_NETWORK) node_close(&cluster->nodes[n]);
+        if (reply.status == KV_ERROR_MOVED && moved < 0) moved = (int)n;
+    }
+    return moved;
+}
+
+// Multi-key commands: keys are KV_ERROR_MOVED until a node has answered
+// for them
+static kv_error_t cluster_batch(kv_cluster_t* cluster, cluster_batch_t* batch) {
+    size_t count = batch->count;
+    for (size_t i = 0; i < count; i++) batch->statuses[i] = KV_ERROR_MOVED;
+
+    size_t nodes = KV_CLUSTER_MAX_NODES;
+    batch->owners = malloc((count ? count : 1) * sizeof(*batch->owners));
+    batch->order = malloc((count ? count : 1) * sizeof(*batch->order));
+    batch->start = malloc((2 * nodes + 1) * sizeof(*batch->start));
+    batch->group_keys = malloc((count ? count : 1) * sizeof(*batch->group_keys));
+    batch->group_values = malloc((count ? count : 1) * sizeof(*batch->group_values));
+    batch->group_out = malloc((count ? count : 1) * sizeof(*batch->group_out));
+    kv_error_t result = KV_SUCCESS;
+    if (!batch->owners || !batch->order || !batch->start || !batch->group_keys ||
+        !batch->group_values || !batch->group_out) {
+        result = KV_ERROR_NO_SPACE;
+    }
+
+    for (unsigned redirects = 0; result == KV_SUCCESS; redirects++) {
+        size_t used = batch_group(cluster, batch);
+        if (used > 1 && batch->atomic) {
+            result = KV_ERROR_INVALID_KEY;  // One write cannot span nodes
+            break;
+        }
+        if (used > 1 && redirects == 0) cluster->stats.fanouts++;
+        int moved = batch_round(cluster, batch);
+        if (moved < 0) break;
+        cluster->stats.moved++;
+        if (redirects == KV_CLUSTER_MAX_REDIRECTS || !refresh(cluster, (unsigned)moved)) break;
+    }
+
+    free(batch->owners);
+    free(batch->order);
+    free(batch->start);
+    free(batch->group_keys);
+    free(batch->group_values);
+    free(batch->group_out);
+    for (size_t i = 0; i < count; i++) {
+        if (result != KV_SUCCESS) {
+            batch->statuses[i] = result;
+        } else if (batch->statuses[i] != KV_SUCCESS) {
+            result = batch->statuses[i];
+        }
+    }
+    return result;
+}
+
+kv_error_t kv_cluster_mget(kv_cluster_t* cluster, const char* const* keys, size_t count,
+                           char** values, kv_error_t* statuses) {
+    if (!cluster || !keys || !values || !statuses || count > KV_BATCH_MAX_KEYS) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    cluster_batch_t batch = { .opcode = MSG_MGET, .keys = keys, .out = values,
+                              .statuses = statuses, .count = count };
+    return cluster_batch(cluster, &batch);
+}
+
+kv_error_t kv_cluster_mset(kv_cluster_t* cluster, const char* const* keys,
+                           const char* const* values, size_t count, bool atomic,
+                           kv_error_t* statuses) {
+    if (!cluster || !keys || !values || !statuses || count > KV_BATCH_MAX_KEYS) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    cluster_batch_t batch = { .opcode = MSG_MSET, .atomic = atomic, .keys = keys,
+                              .values = values, .statuses = statuses, .count = count };
+    return cluster_batch(cluster, &batch);
+}
+
+kv_error_t kv_cluster_mdelete(kv_cluster_t* cluster, const char* const* keys, size_t count,
+                              kv_error_t* statuses) {
+    if (!cluster || !keys || !statuses || count > KV_BATCH_MAX_KEYS) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    cluster_batch_t batch = { .opcode = MSG_MDELETE, .keys = keys, .statuses = statuses,
+                              .count = count };
+    return cluster_batch(cluster, &batch);
+}
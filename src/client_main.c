@@ -1,11 +1,18 @@
 #include "kv_store.h"
+#include "log.h"
+#include "protocol.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <stdarg.h>  // Add this for va_start, va_end
+#include <pthread.h>
+#include <time.h>
 
 #define DEFAULT_HOST "127.0.0.1"
 #define DEFAULT_PORT 8080
+#define BENCH_CONNECTIONS 64
+#define BENCH_REQUESTS 10000            // Per connection
 
 // Colors for output
 #define COLOR_GREEN "\033[0;32m"
@@ -14,13 +21,28 @@
 
 void print_usage(const char* program) {
     printf("Usage:\n");
-    printf("  %s put <key> <value>    Store a key-value pair\n", program);
+    printf("  %s put <key> <value> [ttl_ms]  Store a key-value pair\n", program);
     printf("  %s get <key>            Retrieve a value by key\n", program);
     printf("  %s delete <key>         Delete a key-value pair\n", program);
+    printf("  %s expire <key> <ttl_ms>  Expire a key (0: never)\n", program);
+    printf("  %s ttl <key>            Show the time left before a key expires\n", program);
+    printf("  %s mget <key>...        Retrieve several values in one request\n", program);
+    printf("  %s scan [start] [end]   List keys in [start, end)\n", program);
+    printf("  %s prefix <prefix>      List keys starting with prefix\n", program);
     printf("  %s test                 Run tests\n", program);
+    printf("  %s test-resync          Cut a full sync short, as the server's primary\n", program);
+    printf("  %s test-restart <write|check>\n", program);
+    printf("                         Write keys, or check them after a server restart\n");
+    printf("  %s bench [conns] [reqs] [depth]\n", program);
+    printf("                         PUT/GET load over many connections, depth\n");
+    printf("                         requests in flight on each (v2)\n");
+    printf("\nEnvironment: KV_HOST, KV_PORT, KV_PROTOCOL (1 or 2), KV_TRANSPORT (tcp,\n");
+    printf("unix or shm; the fastest the server offers by default), KV_LOG_LEVEL,\n");
+    printf("KV_BACKUP_PORT (test: the server's backup, on KV_HOST)\n");
     printf("\nExamples:\n");
     printf("  %s put mykey \"my value\"\n", program);
     printf("  %s get mykey\n", program);
+    printf("  %s put session \"token\" 30000\n", program);
 }
 
 void print_success(const char* format, ...) {
@@ -41,8 +63,342 @@ void print_error(const char* format, ...) {
     va_end(args);
 }
 
+// Print every page of a scan. Returns the number of keys, or -1 on error.
+static long print_scan(kv_client_t* client, kv_scan_t* scan) {
+    kv_scan_item_t items[KV_SCAN_MAX_PAGE];
+    long total = 0;
+    while (!scan->done) {
+        size_t count;
+        if (kv_client_scan(client, scan, items, KV_SCAN_MAX_PAGE, &count) != KV_SUCCESS) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            int value_len = items[i].value_len < MAX_VALUE_SIZE ? (int)items[i].value_len
+                                                                : MAX_VALUE_SIZE;
+            printf("%.*s = %.*s\n", (int)items[i].key_len, items[i].key,
+                   value_len, items[i].value);
+        }
+        total += (long)count;
+    }
+    return total;
+}
+
+typedef struct {
+    const char* host;
+    int port;
+    int id;
+    int protocol;
+    int transports;
+    long requests;
+    int depth;                          // Pipelined requests in flight
+    long done;                          // Requests answered
+} bench_worker_t;
+
+// Alternate PUTs and GETs over a few keys of the worker's own
+static void* bench_worker(void* arg) {
+    bench_worker_t* worker = arg;
+    kv_client_t* client = kv_client_create();
+    if (client) {
+        client->protocol = (uint8_t)worker->protocol;
+        client->transports = (uint8_t)worker->transports;
+    }
+    if (!client || !kv_client_connect(client, worker->host, worker->port)) {
+        kv_client_destroy(client);
+        return NULL;
+    }
+
+    char key[MAX_KEY_SIZE], value[MAX_VALUE_SIZE];
+    kv_pipeline_t* pipeline = worker->depth > 1 ? kv_pipeline_create(client) : NULL;
+    if (pipeline) {
+        // Send depth requests at a time, then collect their replies
+        for (long i = 0; i < worker->requests;) {
+            long batch = 0;
+            for (; batch < worker->depth && i < worker->requests; batch++, i++) {
+                snprintf(key, sizeof(key), "bench:%d:%ld", worker->id, i / 2 % 100);
+                if (i % 2 == 0) {
+                    kv_pipeline_put(pipeline, key, "bench value");
+                } else {
+                    kv_pipeline_get(pipeline, key);
+                }
+            }
+            kv_reply_t reply;
+            for (; batch > 0; batch--) {
+                if (kv_pipeline_recv(pipeline, &reply) != KV_SUCCESS) {
+                    i = worker->requests;
+                    break;
+                }
+                worker->done++;
+            }
+        }
+        kv_pipeline_destroy(pipeline);
+    } else {
+        for (long i = 0; i < worker->requests; i++) {
+            snprintf(key, sizeof(key), "bench:%d:%ld", worker->id, i / 2 % 100);
+            kv_error_t result = i % 2 == 0 ? kv_client_put(client, key, "bench value")
+                                           : kv_client_get(client, key, value);
+            if (result != KV_SUCCESS) break;
+            worker->done++;
+        }
+    }
+    kv_client_destroy(client);
+    return NULL;
+}
+
+// KV_TRANSPORT_* for KV_TRANSPORT: tcp, unix or shm, each the only one
+// allowed; unset allows all. -1 if unknown.
+static int parse_transports(const char* name) {
+    if (!name || !*name) return KV_TRANSPORT_TCP | KV_TRANSPORT_UNIX | KV_TRANSPORT_SHM;
+    if (strcmp(name, "tcp") == 0) return KV_TRANSPORT_TCP;
+    if (strcmp(name, "unix") == 0) return KV_TRANSPORT_UNIX;
+    if (strcmp(name, "shm") == 0) return KV_TRANSPORT_SHM;
+    return -1;
+}
+
+// Run requests on each of connections at once and report the throughput
+static int run_bench(const char* host, int port, int protocol, int transports,
+                     int connections, long requests, int depth) {
+    bench_worker_t* workers = calloc((size_t)connections, sizeof(bench_worker_t));
+    pthread_t* threads = calloc((size_t)connections, sizeof(pthread_t));
+    if (!workers || !threads) {
+        free(workers);
+        free(threads);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < connections; started++) {
+        workers[started] = (bench_worker_t){ .host = host, .port = port, .id = started,
+                                             .protocol = protocol, .transports = transports,
+                                             .requests = requests, .depth = depth };
+        if (pthread_create(&threads[started], NULL, bench_worker, &workers[started]) != 0) break;
+    }
+    long done = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        done += workers[i].done;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("bench: %ld requests over %d connections, depth %d, in %.2f s (%.0f requests/s)\n",
+           done, started, depth, seconds, seconds > 0 ? (double)done / seconds : 0.0);
+    free(workers);
+    free(threads);
+    return done == (long)started * requests && started == connections ? 0 : 1;
+}
+
+#define ASYNC_THREADS 4
+#define ASYNC_KEYS 100                  // Per thread
+
+typedef struct {
+    kv_async_t* pool;
+    int id;
+    bool ok;
+} async_worker_t;
+
+// Start a thread's PUTs, GETs and DELETEs a batch at a time, then wait
+// for each batch
+static void* async_worker(void* arg) {
+    async_worker_t* worker = arg;
+    kv_future_t futures[ASYNC_KEYS];
+    char key[MAX_KEY_SIZE], value[32];
+    worker->ok = true;
+    for (int op = 0; op < 3 && worker->ok; op++) {
+        int started = 0;
+        for (; started < ASYNC_KEYS; started++) {
+            snprintf(key, sizeof(key), "async:%d:%d", worker->id, started);
+            snprintf(value, sizeof(value), "value %d", started);
+            kv_future_init(&futures[started]);
+            bool sent = op == 0 ? kv_async_put(worker->pool, key, value, 0, kv_future_complete,
+                                               &futures[started])
+                      : op == 1 ? kv_async_get(worker->pool, key, 0, kv_future_complete,
+                                               &futures[started])
+                                : kv_async_delete(worker->pool, key, 0, kv_future_complete,
+                                                  &futures[started]);
+            if (!sent) {
+                kv_future_destroy(&futures[started]);
+                worker->ok = false;
+                break;
+            }
+        }
+        for (int i = 0; i < started; i++) {
+            snprintf(value, sizeof(value), "value %d", i);
+            if (kv_future_wait(&futures[i]) != KV_SUCCESS ||
+                (op == 1 && (!futures[i].value || strcmp(futures[i].value, value) != 0))) {
+                worker->ok = false;
+            }
+            kv_future_destroy(&futures[i]);
+        }
+    }
+    return NULL;
+}
+
+// GET key through reader's near cache until the write of expected shows,
+// for up to a second
+static bool near_cache_sees(kv_client_t* reader, const char* key, const char* expected) {
+    char value[MAX_VALUE_SIZE];
+    for (int i = 0; i < 1000; i++) {
+        if (kv_client_get(reader, key, value) == KV_SUCCESS && strcmp(value, expected) == 0) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+// GET key through reader's near cache until one is answered from it, for
+// up to a second: an invalidation racing a read keeps its value out
+static bool near_cache_hits(kv_client_t* reader, const char* key) {
+    char value[MAX_VALUE_SIZE];
+    kv_cache_stats_t before, after;
+    kv_client_cache_stats(reader, &before);
+    for (int i = 0; i < 1000; i++) {
+        if (kv_client_get(reader, key, value) != KV_SUCCESS) return false;
+        kv_client_cache_stats(reader, &after);
+        if (after.hits > before.hits) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+// GET key from a backup until it holds expected, or with NULL is gone,
+// for up to a second: updates reach it a little after the primary acks them
+static bool backup_sees(kv_client_t* backup, const char* key, const char* expected) {
+    char value[MAX_VALUE_SIZE];
+    for (int i = 0; i < 1000; i++) {
+        kv_error_t result = kv_client_get(backup, key, value);
+        if (expected ? result == KV_SUCCESS && strcmp(value, expected) == 0
+                     : result == KV_ERROR_NOT_FOUND) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
 // Run basic tests
-void run_tests(kv_client_t* client) {
+// Keys that must outlive a server restart: "write" puts them, deleting every
+// tenth, and "check" reads them back from the restarted server. Values are
+// large so that an LSM server with a small memtable flushes several tables
+#define RESTART_KEYS 2000
+#define RESTART_VALUE_SIZE 200
+
+int run_restart_test(kv_client_t* client, bool write) {
+    char key[MAX_KEY_SIZE], expected[RESTART_VALUE_SIZE], value[MAX_VALUE_SIZE];
+    for (int i = 0; i < RESTART_KEYS; i++) {
+        snprintf(key, sizeof(key), "restart_%d", i);
+        memset(expected, 'a' + i % 26, sizeof(expected) - 1);
+        snprintf(expected, sizeof(expected), "%d", i);
+        expected[strlen(expected)] = '-';
+        expected[sizeof(expected) - 1] = '\0';
+        bool deleted = i % 10 == 0;
+        bool ok;
+        if (write) {
+            ok = kv_client_put(client, key, expected) == KV_SUCCESS &&
+                 (!deleted || kv_client_delete(client, key) == KV_SUCCESS);
+        } else {
+            kv_error_t err = kv_client_get(client, key, value);
+            ok = deleted ? err == KV_ERROR_NOT_FOUND
+                         : err == KV_SUCCESS && strcmp(value, expected) == 0;
+        }
+        if (!ok) {
+            print_error("Failed at %s", key);
+            return 1;
+        }
+    }
+    print_success("%s %d keys", write ? "Wrote" : "Checked", RESTART_KEYS);
+    return 0;
+}
+
+// A MSG_REPLICATE frame with id as its value unless it is a query
+static kv_error_t replicate(kv_client_t* client, uint8_t flags, uint64_t start, uint64_t id,
+                            char* reply, size_t* reply_len) {
+    char value[sizeof(uint64_t)];
+    kv_put_u64(value, id);
+    return kv_client_replicate(client, flags, start, value,
+                               flags & KV_FRAME_REPL_QUERY ? 0 : sizeof(value), reply, reply_len);
+}
+
+static kv_client_t* connect_tcp(const char* host, int port) {
+    kv_client_t* client = kv_client_create();
+    if (!client) return NULL;
+    client->transports = KV_TRANSPORT_TCP;
+    if (!kv_client_connect(client, host, port) || client->protocol != KV_PROTO_V2) {
+        kv_client_destroy(client);
+        return NULL;
+    }
+    return client;
+}
+
+// Play the primary of a backup server that has none: start a full sync,
+// drop the link before it ends, and check that the server, having missed
+// pages, says it has no stream to resume; then finish one, whose clear
+// takes two FULL frames, and check it does. Its keys are cleared. 0 when
+// it behaves.
+#define RESYNC_ID 0x7465737473796e63ull
+#define RESYNC_OFFSET 4096
+#define RESYNC_KEYS 1500                // More than a FULL frame clears
+
+int run_resync_test(const char* host, int port) {
+    char reply[2 * sizeof(uint64_t)];
+    size_t reply_len;
+    kv_client_t* link = connect_tcp(host, port);
+    bool ok = link && kv_client_put(link, "resync_stale", "value") == KV_SUCCESS &&
+              replicate(link, KV_FRAME_REPL_FULL, RESYNC_OFFSET, RESYNC_ID, reply,
+                        &reply_len) == KV_SUCCESS &&
+              reply_len == sizeof(uint64_t) && kv_get_u64(reply) == RESYNC_OFFSET;
+    kv_client_destroy(link);
+    if (!ok) {
+        print_error("Failed to start a full sync");
+        return 1;
+    }
+
+    // The link is gone with the sync unfinished
+    link = connect_tcp(host, port);
+    ok = link && replicate(link, KV_FRAME_REPL_QUERY, 0, 0, reply, &reply_len) == KV_SUCCESS &&
+         reply_len == 2 * sizeof(uint64_t);
+    if (!ok || kv_get_u64(reply) != 0) {
+        print_error("Failed: an unfinished full sync would be resumed");
+        kv_client_destroy(link);
+        return 1;
+    }
+    ok = replicate(link, 0, RESYNC_OFFSET, 0, reply, &reply_len) == KV_ERROR_INVALID_KEY;
+
+    // Too many keys to clear at once: the sync has not begun after one FULL
+    char key[32];
+    for (int i = 0; i < RESYNC_KEYS && ok; i++) {
+        snprintf(key, sizeof(key), "resync_%d", i);
+        ok = kv_client_put(link, key, "value") == KV_SUCCESS;
+    }
+    ok = ok && replicate(link, KV_FRAME_REPL_FULL, RESYNC_OFFSET, RESYNC_ID, reply,
+                         &reply_len) == KV_SUCCESS &&
+         replicate(link, KV_FRAME_REPL_DONE, RESYNC_OFFSET, RESYNC_ID, reply,
+                   &reply_len) == KV_ERROR_INVALID_KEY;
+
+    // A full sync that ends can be resumed, from where its stream begins
+    char value[MAX_VALUE_SIZE];
+    ok = ok && replicate(link, KV_FRAME_REPL_FULL, RESYNC_OFFSET, RESYNC_ID, reply,
+                         &reply_len) == KV_SUCCESS &&
+         replicate(link, KV_FRAME_REPL_DONE, RESYNC_OFFSET, RESYNC_ID, reply,
+                   &reply_len) == KV_SUCCESS &&
+         replicate(link, KV_FRAME_REPL_QUERY, 0, 0, reply, &reply_len) == KV_SUCCESS &&
+         reply_len == 2 * sizeof(uint64_t) && kv_get_u64(reply) == RESYNC_ID &&
+         kv_get_u64(reply + sizeof(uint64_t)) == RESYNC_OFFSET &&
+         kv_client_get(link, "resync_stale", value) == KV_ERROR_NOT_FOUND &&
+         kv_client_get(link, key, value) == KV_ERROR_NOT_FOUND;
+    kv_client_destroy(link);
+    if (!ok) {
+        print_error("Failed to finish a full sync");
+        return 1;
+    }
+    print_success("A full sync cut short is not resumed");
+    return 0;
+}
+
+void run_tests(kv_client_t* client, const char* host, int port) {
     printf("Running tests...\n");
 
     // Test PUT
@@ -73,6 +429,484 @@ void run_tests(kv_client_t* client) {
         return;
     }
 
+    // Test SCAN
+    printf("4. Scan prefix: ");
+    kv_client_put(client, "scan_a", "1");
+    kv_client_put(client, "scan_b", "2");
+    kv_client_put(client, "scan_c", "3");
+    kv_client_put(client, "scanz", "4");
+    kv_scan_t scan;
+    kv_scan_prefix(&scan, "scan_");
+    long found = print_scan(client, &scan);
+    kv_client_delete(client, "scan_a");
+    kv_client_delete(client, "scan_b");
+    kv_client_delete(client, "scan_c");
+    kv_client_delete(client, "scanz");
+    if (found == 3) {
+        print_success("OK");
+    } else {
+        print_error("Failed (%ld keys)", found);
+        return;
+    }
+
+    // Test TTL
+    printf("5. Expire keys: ");
+    int64_t ttl_before = 0, ttl_after = 0;
+    bool ok = kv_client_put_ttl(client, "ttl_key", "soon gone", 200) == KV_SUCCESS &&
+              kv_client_ttl(client, "ttl_key", &ttl_before) == KV_SUCCESS &&
+              ttl_before > 0 && ttl_before <= 200 &&
+              kv_client_put(client, "ttl_kept", "kept") == KV_SUCCESS &&
+              kv_client_expire(client, "ttl_kept", 60000) == KV_SUCCESS &&
+              kv_client_expire(client, "ttl_kept", 0) == KV_SUCCESS &&
+              kv_client_ttl(client, "ttl_kept", &ttl_after) == KV_SUCCESS && ttl_after == -1;
+    usleep(300 * 1000);
+    ok = ok && kv_client_get(client, "ttl_key", value) == KV_ERROR_NOT_FOUND &&
+         kv_client_get(client, "ttl_kept", value) == KV_SUCCESS;
+    kv_client_delete(client, "ttl_kept");
+    if (ok) {
+        print_success("OK");
+    } else {
+        print_error("Failed");
+        return;
+    }
+
+    // Test pipelining
+    printf("6. Pipeline: ");
+    kv_pipeline_t* pipeline = kv_pipeline_create(client);
+    if (!pipeline) {
+        print_success("skipped (protocol v1)");
+    } else {
+        char key[MAX_KEY_SIZE], expected[MAX_VALUE_SIZE];
+        uint32_t ids[30];
+        for (int i = 0; i < 10; i++) {
+            snprintf(key, sizeof(key), "pipe_%d", i);
+            snprintf(expected, sizeof(expected), "value %d", i);
+            ids[i] = kv_pipeline_put(pipeline, key, expected);
+            ids[10 + i] = kv_pipeline_get(pipeline, key);
+            ids[20 + i] = kv_pipeline_delete(pipeline, key);
+        }
+        // Replies arrive in the order the requests were queued
+        static const int order[3] = { 0, 10, 20 };
+        ok = true;
+        for (int i = 0; i < 10 && ok; i++) {
+            for (int op = 0; op < 3 && ok; op++) {
+                kv_reply_t reply;
+                ok = kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS &&
+                     reply.id == ids[order[op] + i];
+                snprintf(expected, sizeof(expected), "value %d", i);
+                if (ok && op == 1) ok = strcmp(reply.value, expected) == 0;
+            }
+        }
+        ok = ok && kv_pipeline_pending(pipeline) == 0;
+        kv_pipeline_destroy(pipeline);
+        if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test multi-key commands
+    printf("7. Multi-key: ");
+    {
+        static const char* const keys[] = { "multi_a", "multi_b", "multi_c", "multi_a" };
+        static const char* const values[] = { "1", "2", "3", "4" };
+        char buffers[4][MAX_VALUE_SIZE];
+        char* got[4] = { buffers[0], buffers[1], buffers[2], buffers[3] };
+        kv_error_t statuses[4];
+        // Duplicates apply in order, so multi_a ends up "4". Atomic needs v2.
+        ok = kv_client_mset(client, keys, values, 4, false, statuses) == KV_SUCCESS &&
+             kv_client_mset(client, keys + 1, values + 1, 2, client->protocol >= KV_PROTO_V2,
+                            statuses) == KV_SUCCESS &&
+             kv_client_mdelete(client, keys + 2, 1, statuses) == KV_SUCCESS &&
+             kv_client_mget(client, keys, 3, got, statuses) == KV_ERROR_NOT_FOUND &&
+             statuses[0] == KV_SUCCESS && strcmp(got[0], "4") == 0 &&
+             statuses[1] == KV_SUCCESS && strcmp(got[1], "2") == 0 &&
+             statuses[2] == KV_ERROR_NOT_FOUND &&
+             kv_client_mdelete(client, keys, 3, statuses) == KV_ERROR_NOT_FOUND &&
+             statuses[0] == KV_SUCCESS && statuses[1] == KV_SUCCESS;
+        if (ok && client->protocol < KV_PROTO_V2) {
+            print_success("OK (protocol v1, key by key)");
+        } else if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test values that overflow the transport's buffers: two PUTs, then two
+    // GETs, each more than the shared-memory rings hold, so the client waits
+    // for room to send and the server for room to reply
+    printf("8. Large values: ");
+    pipeline = kv_pipeline_create(client);
+    if (!pipeline) {
+        print_success("skipped (protocol v1)");
+    } else {
+        size_t size = 600 * 1024;
+        char* big = malloc(size + 1);
+        kv_reply_t reply;
+        ok = big != NULL;
+        for (int i = 0; ok && i < 2; i++) {
+            memset(big, 'a' + i, size);
+            big[size] = '\0';
+            ok = kv_pipeline_put(pipeline, i ? "big_b" : "big_a", big) != 0;
+        }
+        ok = ok && kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS &&
+             kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS &&
+             kv_pipeline_get(pipeline, "big_a") && kv_pipeline_get(pipeline, "big_b");
+        for (int i = 0; ok && i < 2; i++) {
+            ok = kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS && reply.value_len == size &&
+                 reply.value[0] == 'a' + i && reply.value[size - 1] == 'a' + i;
+        }
+        ok = ok && kv_pipeline_delete(pipeline, "big_a") && kv_pipeline_delete(pipeline, "big_b") &&
+             kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS &&
+             kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS;
+        free(big);
+        kv_pipeline_destroy(pipeline);
+        if (ok) {
+            print_success("OK (%s)", client->transport == KV_TRANSPORT_SHM ? "shared memory"
+                                   : client->transport == KV_TRANSPORT_UNIX ? "Unix socket"
+                                   : "TCP");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test a pipeline deeper than one turn: the server runs the requests
+    // past max_inflight on later turns, still in order
+    printf("9. Deep pipeline: ");
+    pipeline = kv_pipeline_create(client);
+    if (!pipeline) {
+        print_success("skipped (protocol v1)");
+    } else {
+        uint32_t ids[1000];
+        kv_reply_t reply;
+        ok = kv_client_put(client, "deep_key", "deep value") == KV_SUCCESS;
+        for (int i = 0; ok && i < 1000; i++) {
+            ok = (ids[i] = kv_pipeline_get(pipeline, "deep_key")) != 0;
+        }
+        int busy = 0;
+        for (int i = 0; ok && i < 1000; i++) {
+            kv_error_t result = kv_pipeline_recv(pipeline, &reply);
+            busy += result == KV_ERROR_BUSY;
+            ok = reply.id == ids[i] &&
+                 (result == KV_ERROR_BUSY ||
+                  (result == KV_SUCCESS && strcmp(reply.value, "deep value") == 0));
+        }
+        kv_pipeline_destroy(pipeline);
+        kv_client_delete(client, "deep_key");
+        if (ok && busy > 0) {
+            print_success("OK (%d shed as busy)", busy);
+        } else if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test a pipeline mixing short values, copied into the replies, with
+    // long ones the server sends from where they are stored
+    printf("10. Mixed value sizes: ");
+    pipeline = kv_pipeline_create(client);
+    if (!pipeline) {
+        print_success("skipped (protocol v1)");
+    } else {
+        static const size_t sizes[] = { 100, 5000, 70000 };
+        static const char* keys[] = { "mixed_small", "mixed_medium", "mixed_large" };
+        char* value = malloc(sizes[2] + 1);
+        kv_reply_t reply;
+        ok = value != NULL;
+        for (int i = 0; ok && i < 3; i++) {
+            memset(value, 'x' + i, sizes[i]);
+            value[sizes[i]] = '\0';
+            ok = kv_client_put(client, keys[i], value) == KV_SUCCESS;
+        }
+        for (int i = 0; ok && i < 300; i++) ok = kv_pipeline_get(pipeline, keys[i % 3]) != 0;
+        for (int i = 0; ok && i < 300; i++) {
+            size_t size = sizes[i % 3];
+            ok = kv_pipeline_recv(pipeline, &reply) == KV_SUCCESS && reply.value_len == size &&
+                 reply.value[0] == 'x' + i % 3 && reply.value[size - 1] == 'x' + i % 3;
+        }
+        for (int i = 0; i < 3; i++) kv_client_delete(client, keys[i]);
+        free(value);
+        kv_pipeline_destroy(pipeline);
+        if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test threads sharing a pool of pipelined connections, then a
+    // deadline against a port nobody serves
+    printf("11. Async pool: ");
+    if (client->protocol < KV_PROTO_V2) {
+        print_success("skipped (protocol v1)");
+    } else {
+        kv_async_options_t options;
+        kv_async_options_init(&options);
+        options.connections = 2;
+        options.transports = client->transport == KV_TRANSPORT_TCP ? KV_TRANSPORT_TCP
+                                                                   : KV_TRANSPORT_UNIX;
+        kv_async_t* pool = kv_async_create(host, port, &options);
+        async_worker_t workers[ASYNC_THREADS];
+        pthread_t threads[ASYNC_THREADS];
+        int started = 0;
+        ok = pool != NULL;
+        for (; ok && started < ASYNC_THREADS; started++) {
+            workers[started] = (async_worker_t){ .pool = pool, .id = started };
+            ok = pthread_create(&threads[started], NULL, async_worker, &workers[started]) == 0;
+            if (!ok) break;
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+            ok = ok && workers[i].ok;
+        }
+        kv_async_destroy(pool);
+
+        options.transports = KV_TRANSPORT_TCP;
+        pool = ok ? kv_async_create("127.0.0.1", 1, &options) : NULL;
+        kv_future_t future;
+        kv_future_init(&future);
+        ok = pool && kv_async_get(pool, "async_key", 50, kv_future_complete, &future) &&
+             kv_future_wait(&future) == KV_ERROR_TIMEOUT;
+        kv_async_destroy(pool);
+        kv_future_destroy(&future);
+        if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test a second connection's near cache: a repeated GET is a hit, and
+    // writes by the first reach it, for keys it read and then by prefix
+    printf("12. Near cache: ");
+    kv_client_t* reader = client->protocol >= KV_PROTO_V2 ? kv_client_create() : NULL;
+    kv_cache_options_t cache_options;
+    kv_cache_options_init(&cache_options);
+    if (reader) {
+        reader->transports = client->transport == KV_TRANSPORT_SHM
+                                 ? KV_TRANSPORT_UNIX | KV_TRANSPORT_SHM : client->transport;
+    }
+    if (!reader || !kv_client_connect(reader, host, port) ||
+        !kv_client_cache_enable(reader, &cache_options)) {
+        print_success("skipped (%s)", reader ? "not offered" : "protocol v1");
+    } else {
+        static const char* const prefixes[] = { "near:" };
+        kv_cache_stats_t stats;
+        char value[MAX_VALUE_SIZE];
+        ok = kv_client_put(client, "near_key", "first") == KV_SUCCESS &&
+             kv_client_get(reader, "near_key", value) == KV_SUCCESS &&
+             kv_client_get(reader, "near_key", value) == KV_SUCCESS &&
+             strcmp(value, "first") == 0;
+        kv_client_cache_stats(reader, &stats);
+        ok = ok && stats.hits == 1 && stats.entries == 1 &&
+             kv_client_put(client, "near_key", "second") == KV_SUCCESS &&
+             near_cache_sees(reader, "near_key", "second");
+
+        cache_options.prefixes = prefixes;
+        cache_options.prefix_count = 1;
+        ok = ok && kv_client_cache_enable(reader, &cache_options) &&
+             kv_client_put(client, "near:key", "first") == KV_SUCCESS &&
+             near_cache_sees(reader, "near:key", "first") &&
+             near_cache_hits(reader, "near:key") &&
+             kv_client_put(client, "near:key", "second") == KV_SUCCESS &&
+             near_cache_sees(reader, "near:key", "second");
+        // Keys longer than a message key field are pushed too
+        char long_key[300];
+        memset(long_key, 'k', sizeof(long_key) - 1);
+        memcpy(long_key, "near:", 5);
+        long_key[sizeof(long_key) - 1] = '\0';
+        ok = ok && kv_client_put(client, long_key, "first") == KV_SUCCESS &&
+             near_cache_sees(reader, long_key, "first") &&
+             kv_client_put(client, long_key, "second") == KV_SUCCESS &&
+             near_cache_sees(reader, long_key, "second");
+        kv_client_cache_stats(reader, &stats);
+        ok = ok && stats.invalidations >= 1 && kv_client_cache_hit_ratio(reader) > 0;
+        kv_client_delete(client, "near_key");
+        kv_client_delete(client, "near:key");
+        kv_client_delete(client, long_key);
+        if (ok) {
+            print_success("OK (hit ratio %.2f)", kv_client_cache_hit_ratio(reader));
+        } else {
+            kv_client_destroy(reader);
+            print_error("Failed");
+            return;
+        }
+    }
+    kv_client_destroy(reader);
+
+    // Test a cluster client over two names for this server: keys split
+    // between them, batches fan out and merge back, and tagged keys stay
+    // together
+    printf("13. Cluster: ");
+    if (client->protocol < KV_PROTO_V2 || strncmp(host, "127.", 4) != 0) {
+        print_success("skipped (%s)", client->protocol < KV_PROTO_V2 ? "protocol v1"
+                                                                    : "needs a loopback host");
+    } else {
+        char names[2][32];
+        snprintf(names[0], sizeof(names[0]), "%s:%d", host, port);
+        snprintf(names[1], sizeof(names[1]), "127.0.0.%d:%d", strcmp(host, "127.0.0.2") ? 2 : 3,
+                 port);
+        const char* const nodes[] = { names[0], names[1] };
+        kv_cluster_options_t cluster_options;
+        kv_cluster_options_init(&cluster_options);
+        cluster_options.transports = KV_TRANSPORT_TCP;
+        kv_cluster_t* cluster = kv_cluster_create(nodes, 2, &cluster_options);
+
+        enum { CLUSTER_KEYS = 16 };
+        char keys[CLUSTER_KEYS][16], values[CLUSTER_KEYS][16];
+        char read[CLUSTER_KEYS][MAX_VALUE_SIZE];
+        const char* key_list[CLUSTER_KEYS];
+        const char* value_list[CLUSTER_KEYS];
+        char* read_list[CLUSTER_KEYS];
+        kv_error_t statuses[CLUSTER_KEYS];
+        bool spread = false;
+        for (int i = 0; i < CLUSTER_KEYS; i++) {
+            snprintf(keys[i], sizeof(keys[i]), "cluster_%d", i);
+            snprintf(values[i], sizeof(values[i]), "value_%d", i);
+            key_list[i] = keys[i];
+            value_list[i] = values[i];
+            read_list[i] = read[i];
+            spread = spread || (cluster && strcmp(kv_cluster_node_of(cluster, keys[i]),
+                                                  kv_cluster_node_of(cluster, keys[0])) != 0);
+        }
+        ok = cluster && spread &&
+             kv_cluster_mset(cluster, key_list, value_list, CLUSTER_KEYS, false, statuses) ==
+                 KV_SUCCESS &&
+             kv_cluster_mget(cluster, key_list, CLUSTER_KEYS, read_list, statuses) == KV_SUCCESS;
+        for (int i = 0; ok && i < CLUSTER_KEYS; i++) ok = strcmp(read[i], values[i]) == 0;
+
+        static const char* const tagged[] = { "cluster:{7}:a", "cluster:{7}:b" };
+        kv_cluster_stats_t stats;
+        if (cluster) kv_cluster_stats(cluster, &stats);
+        ok = ok && stats.fanouts == 2 &&
+             kv_cluster_mset(cluster, key_list, value_list, CLUSTER_KEYS, true, statuses) ==
+                 KV_ERROR_INVALID_KEY &&
+             kv_cluster_mset(cluster, tagged, value_list, 2, true, statuses) == KV_SUCCESS &&
+             kv_cluster_get(cluster, "cluster:{7}:b", read[0]) == KV_SUCCESS &&
+             strcmp(read[0], values[1]) == 0 &&
+             kv_cluster_mdelete(cluster, key_list, CLUSTER_KEYS, statuses) == KV_SUCCESS &&
+             kv_cluster_mdelete(cluster, tagged, 2, statuses) == KV_SUCCESS &&
+             kv_cluster_get(cluster, keys[0], read[0]) == KV_ERROR_NOT_FOUND;
+        kv_cluster_destroy(cluster);
+        if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test replication to the backup at KV_BACKUP_PORT, if the server has
+    // one: puts, a TTL, a delete and a batch all show up there
+    printf("14. Replication: ");
+    const char* backup_port = getenv("KV_BACKUP_PORT");
+    kv_client_t* backup = backup_port ? kv_client_create() : NULL;
+    if (!backup_port) {
+        print_success("skipped (KV_BACKUP_PORT not set)");
+    } else {
+        static const char* const batch_keys[] = { "repl_batch_1", "repl_batch_2" };
+        static const char* const batch_values[] = { "one", "two" };
+        kv_error_t statuses[2];
+        int64_t ttl_ms = 0;
+        if (backup) {
+            backup->protocol = client->protocol;
+            backup->transports = KV_TRANSPORT_TCP;
+        }
+        // repl_seed, if the primary had it before the backup came up, only
+        // reaches it by a full sync
+        char seed[MAX_VALUE_SIZE];
+        bool seeded = kv_client_get(client, "repl_seed", seed) == KV_SUCCESS;
+        ok = backup && kv_client_connect(backup, host, atoi(backup_port)) &&
+             (!seeded || backup_sees(backup, "repl_seed", seed)) &&
+             kv_client_put(client, "repl_key", "first") == KV_SUCCESS &&
+             kv_client_put(client, "repl_key", "second") == KV_SUCCESS &&
+             kv_client_put_ttl(client, "repl_ttl", "brief", 60000) == KV_SUCCESS &&
+             kv_client_put(client, "repl_gone", "x") == KV_SUCCESS &&
+             kv_client_delete(client, "repl_gone") == KV_SUCCESS &&
+             kv_client_mset(client, batch_keys, batch_values, 2, false, statuses) ==
+                 KV_SUCCESS &&
+             backup_sees(backup, "repl_key", "second") &&
+             backup_sees(backup, "repl_ttl", "brief") &&
+             kv_client_ttl(backup, "repl_ttl", &ttl_ms) == KV_SUCCESS && ttl_ms > 0 &&
+             ttl_ms <= 60000 && backup_sees(backup, "repl_gone", NULL) &&
+             backup_sees(backup, "repl_batch_2", "two");
+        // Only a backup takes a primary's frames, which could clear its keys
+        char reply[2 * sizeof(uint64_t)];
+        size_t reply_len;
+        ok = ok && (client->protocol < KV_PROTO_V2 ||
+                    kv_client_replicate(client, KV_FRAME_REPL_QUERY, 0, NULL, 0, reply,
+                                        &reply_len) == KV_ERROR_INVALID_KEY);
+        kv_client_delete(client, "repl_key");
+        kv_client_delete(client, "repl_ttl");
+        kv_client_delete(client, "repl_seed");
+        kv_client_mdelete(client, batch_keys, 2, statuses);
+        ok = ok && backup_sees(backup, "repl_key", NULL);
+        kv_client_destroy(backup);
+        if (ok) {
+            print_success("OK");
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
+    // Test enough keys that many share a probe group and every segment's
+    // table resizes several times, reading back each one while later
+    // resizes are still migrating
+    printf("15. Many keys: ");
+    {
+        enum { MANY_KEYS = 20000, MANY_BATCH = 500 };
+        static char keys[MANY_BATCH][MAX_KEY_SIZE], values[MANY_BATCH][MAX_VALUE_SIZE];
+        static char buffers[MANY_BATCH][MAX_VALUE_SIZE];
+        const char* key_list[MANY_BATCH];
+        const char* value_list[MANY_BATCH];
+        char* got[MANY_BATCH];
+        kv_error_t statuses[MANY_BATCH];
+        for (int i = 0; i < MANY_BATCH; i++) {
+            key_list[i] = keys[i];
+            value_list[i] = values[i];
+            got[i] = buffers[i];
+        }
+        ok = true;
+        for (int pass = 0; pass < 3 && ok; pass++) {
+            // Put every key, then read every key, then delete every key
+            for (int base = 0; base < MANY_KEYS && ok; base += MANY_BATCH) {
+                for (int i = 0; i < MANY_BATCH; i++) {
+                    snprintf(keys[i], sizeof(keys[i]), "many_%d", base + i);
+                    snprintf(values[i], sizeof(values[i]), "value %d", base + i);
+                }
+                if (pass == 0) {
+                    ok = kv_client_mset(client, key_list, value_list, MANY_BATCH, false,
+                                        statuses) == KV_SUCCESS;
+                } else if (pass == 1) {
+                    ok = kv_client_mget(client, key_list, MANY_BATCH, got, statuses) ==
+                         KV_SUCCESS;
+                    for (int i = 0; i < MANY_BATCH && ok; i++) {
+                        ok = strcmp(got[i], values[i]) == 0;
+                    }
+                } else {
+                    ok = kv_client_mdelete(client, key_list, MANY_BATCH, statuses) ==
+                         KV_SUCCESS;
+                }
+            }
+        }
+        if (ok) {
+            print_success("OK (%d keys)", MANY_KEYS);
+        } else {
+            print_error("Failed");
+            return;
+        }
+    }
+
     print_success("All tests passed!");
 }
 
@@ -85,6 +919,26 @@ int main(int argc, char* argv[]) {
     // Get server details from environment or use defaults
     const char* host = getenv("KV_HOST") ? getenv("KV_HOST") : DEFAULT_HOST;
     int port = getenv("KV_PORT") ? atoi(getenv("KV_PORT")) : DEFAULT_PORT;
+    int protocol = getenv("KV_PROTOCOL") ? atoi(getenv("KV_PROTOCOL")) : KV_PROTO_V2;
+    int transports = parse_transports(getenv("KV_TRANSPORT"));
+    if (transports < 0) {
+        print_error("KV_TRANSPORT must be tcp, unix or shm");
+        return 1;
+    }
+    int level = log_level_parse(getenv("KV_LOG_LEVEL"));
+    if (level >= 0) log_set_level(level);
+
+    // The benchmark opens connections of its own
+    if (strcmp(argv[1], "bench") == 0) {
+        int connections = argc > 2 ? atoi(argv[2]) : BENCH_CONNECTIONS;
+        long requests = argc > 3 ? atol(argv[3]) : BENCH_REQUESTS;
+        int depth = argc > 4 ? atoi(argv[4]) : 1;
+        if (connections <= 0 || requests <= 0 || depth <= 0 || depth > KV_PIPELINE_MAX_DEPTH) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_bench(host, port, protocol, transports, connections, requests, depth);
+    }
 
     // Create and connect client
     kv_client_t* client = kv_client_create();
@@ -92,6 +946,8 @@ int main(int argc, char* argv[]) {
         print_error("Failed to create client");
         return 1;
     }
+    client->protocol = (uint8_t)protocol;
+    client->transports = (uint8_t)transports;
 
     if (!kv_client_connect(client, host, port)) {
         print_error("Failed to connect to server at %s:%d", host, port);
@@ -103,10 +959,12 @@ int main(int argc, char* argv[]) {
 
     // Handle commands
     if (strcmp(argv[1], "put") == 0) {
-        if (argc != 4) {
+        if (argc != 4 && argc != 5) {
             print_usage(argv[0]);
             result = 1;
-        } else if (kv_client_put(client, argv[2], argv[3]) == KV_SUCCESS) {
+        } else if ((argc == 5 ? kv_client_put_ttl(client, argv[2], argv[3],
+                                                  strtoull(argv[4], NULL, 10))
+                              : kv_client_put(client, argv[2], argv[3])) == KV_SUCCESS) {
             print_success("%s = %s", argv[2], argv[3]);
         } else {
             print_error("Failed to store value");
@@ -138,8 +996,93 @@ int main(int argc, char* argv[]) {
             result = 1;
         }
     }
+    else if (strcmp(argv[1], "expire") == 0) {
+        if (argc != 4) {
+            print_usage(argv[0]);
+            result = 1;
+        } else if (kv_client_expire(client, argv[2], strtoull(argv[3], NULL, 10)) == KV_SUCCESS) {
+            print_success("Expiry set: %s", argv[2]);
+        } else {
+            print_error("Key not found: %s", argv[2]);
+            result = 1;
+        }
+    }
+    else if (strcmp(argv[1], "ttl") == 0) {
+        if (argc != 3) {
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            int64_t ttl_ms;
+            if (kv_client_ttl(client, argv[2], &ttl_ms) != KV_SUCCESS) {
+                print_error("Key not found: %s", argv[2]);
+                result = 1;
+            } else if (ttl_ms < 0) {
+                printf("%s does not expire\n", argv[2]);
+            } else {
+                printf("%lld ms\n", (long long)ttl_ms);
+            }
+        }
+    }
+    else if (strcmp(argv[1], "mget") == 0) {
+        size_t count = (size_t)argc - 2;
+        char (*buffers)[MAX_VALUE_SIZE] = malloc((count ? count : 1) * MAX_VALUE_SIZE);
+        char** values = malloc((count ? count : 1) * sizeof(*values));
+        kv_error_t* statuses = malloc((count ? count : 1) * sizeof(*statuses));
+        if (argc < 3 || !buffers || !values || !statuses) {
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            for (size_t i = 0; i < count; i++) values[i] = buffers[i];
+            if (kv_client_mget(client, (const char* const*)argv + 2, count, values,
+                               statuses) == KV_ERROR_NETWORK) {
+                print_error("MGET failed");
+                result = 1;
+            }
+            for (size_t i = 0; result == 0 && i < count; i++) {
+                if (statuses[i] == KV_SUCCESS) {
+                    printf("%s = %s\n", argv[2 + i], values[i]);
+                } else {
+                    printf("%s: error %d\n", argv[2 + i], statuses[i]);
+                }
+            }
+        }
+        free(buffers);
+        free(values);
+        free(statuses);
+    }
+    else if (strcmp(argv[1], "scan") == 0 || strcmp(argv[1], "prefix") == 0) {
+        kv_scan_t scan;
+        kv_error_t valid = KV_SUCCESS;
+        if (strcmp(argv[1], "prefix") == 0 && argc == 3) {
+            valid = kv_scan_prefix(&scan, argv[2]);
+        } else if (strcmp(argv[1], "scan") == 0 && argc <= 4) {
+            valid = kv_scan_range(&scan, argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+        } else {
+            print_usage(argv[0]);
+            kv_client_destroy(client);
+            return 1;
+        }
+        if (valid != KV_SUCCESS) {
+            print_error("Keys are at most %d bytes", MAX_KEY_SIZE);
+            result = 1;
+        } else if (print_scan(client, &scan) < 0) {
+            print_error("Scan failed");
+            result = 1;
+        }
+    }
     else if (strcmp(argv[1], "test") == 0) {
-        run_tests(client);
+        run_tests(client, host, port);
+    }
+    else if (strcmp(argv[1], "test-resync") == 0) {
+        result = run_resync_test(host, port);
+    }
+    else if (strcmp(argv[1], "test-restart") == 0) {
+        if (argc != 3 || (strcmp(argv[2], "write") != 0 && strcmp(argv[2], "check") != 0)) {
+            print_usage(argv[0]);
+            result = 1;
+        } else {
+            result = run_restart_test(client, strcmp(argv[2], "write") == 0);
+        }
     }
     else {
         print_usage(argv[0]);
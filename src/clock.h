@@ -0,0 +1,27 @@
+// Wall-clock time for key expiry
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Milliseconds since the Unix epoch. Expiry times are absolute so they
+// survive restarts; the coarse clock is a few ms behind at worst and costs
+// no more than a memory read, which keeps it off the GET profile.
+static inline uint64_t clock_now_ms(void) {
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Expiry time ttl_ms from now; 0 (no expiry) stays 0
+static inline uint64_t clock_deadline_ms(uint64_t ttl_ms) {
+    return ttl_ms ? clock_now_ms() + ttl_ms : 0;
+}
+
+#endif // CLOCK_H
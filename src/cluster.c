@@ -0,0 +1,173 @@
+#include "cluster.h"
+#include "hash.h"
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CLUSTER_HASH_SEED 0x636c75737465726bull
+#define CLUSTER_MAX_VNODES 4096
+#define CLUSTER_MAX_NAME 255            // "host:port"
+
+typedef struct {
+    uint64_t hash;
+    unsigned node;
+} ring_point_t;
+
+struct cluster_map {
+    uint8_t placement;
+    unsigned vnodes;
+    size_t count;
+    char** nodes;
+    ring_point_t* points;               // KV_PLACEMENT_RING: sorted by hash
+    size_t point_count;
+};
+
+bool cluster_parse_node(const char* name, char* host, size_t host_size, int* port) {
+    const char* colon = strrchr(name, ':');
+    if (!colon || colon == name || (size_t)(colon - name) >= host_size) return false;
+    char* end;
+    long value = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || value <= 0 || value > 65535) return false;
+    memcpy(host, name, (size_t)(colon - name));
+    host[colon - name] = '\0';
+    *port = (int)value;
+    return true;
+}
+
+static int compare_points(const void* a, const void* b) {
+    const ring_point_t* x = a;
+    const ring_point_t* y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+cluster_map_t* cluster_map_create(const char* const* nodes, size_t count, uint8_t placement,
+                                  unsigned vnodes) {
+    if (count == 0 || count > KV_CLUSTER_MAX_NODES ||
+        (placement != KV_PLACEMENT_RING && placement != KV_PLACEMENT_SLOTS)) {
+        return NULL;
+    }
+    if (vnodes == 0) vnodes = 1;
+    if (vnodes > CLUSTER_MAX_VNODES) vnodes = CLUSTER_MAX_VNODES;
+
+    cluster_map_t* map = calloc(1, sizeof(cluster_map_t));
+    if (!map) return NULL;
+    map->placement = placement;
+    map->vnodes = vnodes;
+    map->nodes = calloc(count, sizeof(*map->nodes));
+    if (!map->nodes) goto fail;
+    for (size_t i = 0; i < count; i++) {
+        char host[CLUSTER_MAX_NAME + 1];
+        int port;
+        if (strlen(nodes[i]) > CLUSTER_MAX_NAME ||
+            !cluster_parse_node(nodes[i], host, sizeof(host), &port) ||
+            cluster_map_find(map, nodes[i]) >= 0) {
+            goto fail;
+        }
+        map->nodes[i] = strdup(nodes[i]);
+        if (!map->nodes[i]) goto fail;
+        map->count++;
+    }
+
+    if (placement == KV_PLACEMENT_RING) {
+        map->points = malloc(count * vnodes * sizeof(*map->points));
+        if (!map->points) goto fail;
+        for (size_t i = 0; i < count; i++) {
+            size_t len = strlen(map->nodes[i]);
+            for (unsigned v = 0; v < vnodes; v++) {
+                ring_point_t* point = &map->points[map->point_count++];
+                point->hash = kv_hash(map->nodes[i], len, CLUSTER_HASH_SEED + v);
+                point->node = (unsigned)i;
+            }
+        }
+        qsort(map->points, map->point_count, sizeof(*map->points), compare_points);
+    }
+    return map;
+
+fail:
+    cluster_map_destroy(map);
+    return NULL;
+}
+
+void cluster_map_destroy(cluster_map_t* map) {
+    if (!map) return;
+    for (size_t i = 0; i < map->count; i++) free(map->nodes[i]);
+    free(map->nodes);
+    free(map->points);
+    free(map);
+}
+
+unsigned cluster_map_owner(const cluster_map_t* map, const char* key, size_t key_len) {
+    kv_hash_tag(&key, &key_len);
+    uint64_t hash = kv_hash(key, key_len, CLUSTER_HASH_SEED);
+    if (map->placement == KV_PLACEMENT_SLOTS) {
+        size_t slot = hash & (KV_CLUSTER_SLOTS - 1);
+        return (unsigned)(slot * map->count / KV_CLUSTER_SLOTS);
+    }
+
+    // First point at or after hash, wrapping around to the lowest
+    size_t low = 0, high = map->point_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (map->points[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return map->points[low == map->point_count ? 0 : low].node;
+}
+
+size_t cluster_map_count(const cluster_map_t* map) {
+    return map->count;
+}
+
+const char* cluster_map_node(const cluster_map_t* map, unsigned node) {
+    return node < map->count ? map->nodes[node] : NULL;
+}
+
+int cluster_map_find(const cluster_map_t* map, const char* name) {
+    for (size_t i = 0; i < map->count; i++) {
+        if (strcmp(map->nodes[i], name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+bool cluster_map_encode(const cluster_map_t* map, char** data, size_t* len) {
+    size_t size = 1 + sizeof(uint16_t);
+    for (size_t i = 0; i < map->count; i++) size += sizeof(uint16_t) + strlen(map->nodes[i]);
+    char* at = malloc(size);
+    if (!at) return false;
+    *data = at;
+    *len = size;
+    *at++ = (char)map->placement;
+    kv_put_u16(at, (uint16_t)map->vnodes);
+    at += sizeof(uint16_t);
+    for (size_t i = 0; i < map->count; i++) {
+        size_t name_len = strlen(map->nodes[i]);
+        kv_put_u16(at, (uint16_t)name_len);
+        memcpy(at + sizeof(uint16_t), map->nodes[i], name_len);
+        at += sizeof(uint16_t) + name_len;
+    }
+    return true;
+}
+
+cluster_map_t* cluster_map_decode(const char* data, size_t len) {
+    if (len < 1 + sizeof(uint16_t)) return NULL;
+    uint8_t placement = (uint8_t)data[0];
+    unsigned vnodes = kv_get_u16(data + 1);
+    char names[KV_CLUSTER_MAX_NODES][CLUSTER_MAX_NAME + 1];
+    const char* nodes[KV_CLUSTER_MAX_NODES];
+    size_t count = 0;
+    for (size_t at = 1 + sizeof(uint16_t); at < len; count++) {
+        if (count == KV_CLUSTER_MAX_NODES || len - at < sizeof(uint16_t)) return NULL;
+        size_t name_len = kv_get_u16(data + at);
+        at += sizeof(uint16_t);
+        if (name_len > CLUSTER_MAX_NAME || len - at < name_len) return NULL;
+        memcpy(names[count], data + at, name_len);
+        names[count][name_len] = '\0';
+        nodes[count] = names[count];
+        at += name_len;
+    }
+    return cluster_map_create(nodes, count, placement, vnodes);
+}
@@ -0,0 +1,34 @@
+// Which node of a cluster owns a key, shared by servers and clients
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "kv_store.h"
+
+// Nodes are "host:port" names. With KV_PLACEMENT_RING each node has vnodes
+// points on a 64-bit ring, hashed from its name, and a key goes to the
+// first point at or after its hash; with KV_PLACEMENT_SLOTS its hash picks
+// one of KV_CLUSTER_SLOTS slots, node i owning the i-th equal run of them.
+// Keys hash by their {tag} when they have one (kv_hash_tag). Every node
+// and client given the same list and settings agrees on each key's owner.
+typedef struct cluster_map cluster_map_t;
+
+// NULL if count is 0 or past KV_CLUSTER_MAX_NODES, a name is malformed
+// or repeated, or out of memory
+cluster_map_t* cluster_map_create(const char* const* nodes, size_t count, uint8_t placement,
+                                  unsigned vnodes);
+void cluster_map_destroy(cluster_map_t* map);
+unsigned cluster_map_owner(const cluster_map_t* map, const char* key, size_t key_len);
+size_t cluster_map_count(const cluster_map_t* map);
+const char* cluster_map_node(const cluster_map_t* map, unsigned node);
+// The index of the node named name, or -1
+int cluster_map_find(const cluster_map_t* map, const char* name);
+// Split "host:port" into host, a buffer of host_size, and port
+bool cluster_parse_node(const char* name, char* host, size_t host_size, int* port);
+
+// The MSG_CLUSTER reply (protocol.h) into *data, which the caller frees
+bool cluster_map_encode(const cluster_map_t* map, char** data, size_t* len);
+// NULL if the reply is malformed
+cluster_map_t* cluster_map_decode(const char* data, size_t len);
+
+#endif // CLUSTER_H
@@ -0,0 +1,322 @@
+#include "kv_store.h"
+#include "clock.h"
+#include "replication.h"
+
+void kv_store_options_init(kv_store_options_t* options) {
+    options->engine = &kv_hash_engine;
+    options->max_value_length = DEFAULT_MAX_VALUE_LENGTH;
+    options->max_memory = 0;
+    options->wal_enabled = true;
+    options->fsync_policy = KV_FSYNC_INTERVAL;
+    options->fsync_interval_ms = 1000;
+    options->snapshot_interval_ms = 60000;
+    options->snapshot_min_changes = 1;
+    options->memtable_size = 4 * 1024 * 1024;
+    options->block_cache_size = 64 * 1024 * 1024;
+    options->compaction_threads = 2;
+}
+
+// Create a new key-value store
+kv_store_t* kv_store_create(const char* backup_file) {
+    kv_store_options_t options;
+    kv_store_options_init(&options);
+    return kv_store_create_with_options(backup_file, &options);
+}
+
+kv_store_t* kv_store_create_with_options(const char* backup_file,
+                                         const kv_store_options_t* options) {
+    kv_store_t* store = malloc(sizeof(kv_store_t));
+    if (!store) return NULL;
+
+    store->options = *options;
+    store->on_write = NULL;
+    store->on_write_ctx = NULL;
+    store->repl = NULL;
+    store->ops = options->engine ? options->engine : &kv_hash_engine;
+    store->engine = store->ops->open(backup_file, &store->options);
+    if (!store->engine) {
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Destroy the store and free resources
+void kv_store_destroy(kv_store_t* store) {
+    if (!store) return;
+    store->ops->close(store->engine);
+    free(store);
+}
+
+// With a backup, writes run under stripe locks. Their WAL wait is put off
+// until the locks are let go, or writers to one stripe would each queue
+// for an fsync of their own instead of sharing one (group commit).
+static void durable_defer(const kv_store_t* store) {
+    if (store->repl) wal_defer();
+}
+
+// The write's result once its WAL wait is done; a write that reached the
+// backup before its log failed is still KV_ERROR_IO
+static kv_error_t durable(const kv_store_t* store, kv_error_t result) {
+    return store->repl && !wal_wait_deferred() ? KV_ERROR_IO : result;
+}
+
+// Append a write that succeeded to the replication stream, still under
+// the stripe lock that keeps its key's records in order
+static void replicated(kv_store_t* store, unsigned stripe, kv_error_t result,
+                       wal_record_type_t type, const char* key, size_t key_len,
+                       const char* value, size_t value_len, uint64_t expires_at) {
+    if (!store->repl) return;
+    if (result == KV_SUCCESS) {
+        repl_append(store->repl, type, key, key_len, value, value_len, expires_at);
+    }
+    repl_unlock(store->repl, stripe);
+}
+
+// Store a key-value pair
+kv_error_t kv_store_put(kv_store_t* store, const char* key, size_t key_len,
+                        const char* value, size_t value_len) {
+    return kv_store_put_ttl(store, key, key_len, value, value_len, 0);
+}
+
+kv_error_t kv_store_put_ttl(kv_store_t* store, const char* key, size_t key_len,
+                            const char* value, size_t value_len, uint64_t ttl_ms) {
+    if (!key || key_len > MAX_KEY_LENGTH) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    if (!value || value_len > store->options.max_value_length) {
+        return KV_ERROR_VALUE_TOO_LARGE;
+    }
+    uint64_t expires_at = clock_deadline_ms(ttl_ms);
+    unsigned stripe = store->repl ? repl_lock(store->repl, key, key_len) : 0;
+    durable_defer(store);
+    kv_error_t result = store->ops->put(store->engine, key, key_len, value, value_len,
+                                        expires_at);
+    replicated(store, stripe, result, WAL_PUT, key, key_len, value, value_len, expires_at);
+    result = durable(store, result);
+    if (result == KV_SUCCESS && store->on_write) store->on_write(store->on_write_ctx, key, key_len);
+    return result;
+}
+
+// Retrieve a value by key
+kv_error_t kv_store_get(kv_store_t* store, const char* key, size_t key_len,
+                        char* value, size_t value_size, size_t* value_len) {
+    if (!key || !value || key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+    return store->ops->get(store->engine, key, key_len, value, value_size, value_len);
+}
+
+bool kv_store_can_pin(const kv_store_t* store) {
+    return store->ops->get_ref != NULL;
+}
+
+kv_error_t kv_store_get_ref(kv_store_t* store, const char* key, size_t key_len,
+                            kv_value_ref_t* ref) {
+    if (!key || !ref || key_len > MAX_KEY_LENGTH || !store->ops->get_ref) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    return store->ops->get_ref(store->engine, key, key_len, ref);
+}
+
+// Delete a key-value pair
+kv_error_t kv_store_delete(kv_store_t* store, const char* key, size_t key_len) {
+    if (!key || key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+    unsigned stripe = store->repl ? repl_lock(store->repl, key, key_len) : 0;
+    durable_defer(store);
+    kv_error_t result = store->ops->delete(store->engine, key, key_len);
+    replicated(store, stripe, result, WAL_DELETE, key, key_len, NULL, 0, 0);
+    result = durable(store, result);
+    if (result == KV_SUCCESS && store->on_write) store->on_write(store->on_write_ctx, key, key_len);
+    return result;
+}
+
+kv_error_t kv_store_expire(kv_store_t* store, const char* key, size_t key_len,
+                           uint64_t ttl_ms) {
+    if (!key || key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+    uint64_t expires_at = clock_deadline_ms(ttl_ms);
+    unsigned stripe = store->repl ? repl_lock(store->repl, key, key_len) : 0;
+    durable_defer(store);
+    kv_error_t result = store->ops->expire(store->engine, key, key_len, expires_at);
+    replicated(store, stripe, result, WAL_EXPIRE, key, key_len, NULL, 0, expires_at);
+    result = durable(store, result);
+    if (result == KV_SUCCESS && store->on_write) store->on_write(store->on_write_ctx, key, key_len);
+    return result;
+}
+
+void kv_store_watch(kv_store_t* store, kv_write_fn fn, void* ctx) {
+    store->on_write = fn;
+    store->on_write_ctx = ctx;
+}
+
+void kv_store_replicate(kv_store_t* store, struct replication* repl) {
+    store->repl = repl;
+}
+
+// Append the items of a batch that were written, then unlock their stripes
+// and wait for the WAL as durable does
+static void batch_replicated(kv_store_t* store, uint64_t stripes, const kv_batch_item_t* items,
+                             size_t count, kv_error_t* results, wal_record_type_t type) {
+    if (!store->repl) return;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] != KV_SUCCESS) continue;
+        repl_append(store->repl, type, items[i].key, items[i].key_len,
+                    type == WAL_PUT ? items[i].value : NULL,
+                    type == WAL_PUT ? items[i].value_len : 0, 0);
+    }
+    repl_unlock_batch(store->repl, stripes);
+    if (wal_wait_deferred()) return;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] == KV_SUCCESS) results[i] = KV_ERROR_IO;
+    }
+}
+
+// Report the items of a batch that were written
+static void batch_written(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                          const kv_error_t* results) {
+    for (size_t i = 0; store->on_write && i < count; i++) {
+        if (results[i] == KV_SUCCESS) {
+            store->on_write(store->on_write_ctx, items[i].key, items[i].key_len);
+        }
+    }
+}
+
+kv_error_t kv_store_ttl(kv_store_t* store, const char* key, size_t key_len,
+                        int64_t* ttl_ms) {
+    if (!key || !ttl_ms || key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+    uint64_t expires_at;
+    kv_error_t result = store->ops->ttl(store->engine, key, key_len, &expires_at);
+    if (result != KV_SUCCESS) return result;
+    if (!expires_at) {
+        *ttl_ms = -1;
+    } else {
+        uint64_t now = clock_now_ms();
+        *ttl_ms = expires_at > now ? (int64_t)(expires_at - now) : 0;
+    }
+    return KV_SUCCESS;
+}
+
+kv_error_t kv_store_scan(kv_store_t* store, const char* start, size_t start_len,
+                         const char* end, size_t end_len, kv_scan_fn visit, void* ctx) {
+    if (!visit || start_len > MAX_KEY_LENGTH || end_len > MAX_KEY_LENGTH + 1) {
+        return KV_ERROR_INVALID_KEY;
+    }
+    if (!start) start_len = 0;
+    return store->ops->scan(store->engine, start ? start : "", start_len, end, end_len, visit, ctx);
+}
+
+// Check a batch up front so it fails whole rather than part way
+kv_error_t kv_store_check_batch(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                              bool values) {
+    if (count > 0 && !items) return KV_ERROR_INVALID_KEY;
+    for (size_t i = 0; i < count; i++) {
+        if (!items[i].key || items[i].key_len > MAX_KEY_LENGTH) return KV_ERROR_INVALID_KEY;
+        if (values && (!items[i].value ||
+                       items[i].value_len > store->options.max_value_length)) {
+            return KV_ERROR_VALUE_TOO_LARGE;
+        }
+    }
+    return KV_SUCCESS;
+}
+
+static kv_error_t fail_batch(kv_error_t* results, size_t count, kv_error_t result) {
+    for (size_t i = 0; i < count; i++) results[i] = result;
+    return result;
+}
+
+static kv_error_t first_failure(const kv_error_t* results, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] != KV_SUCCESS) return results[i];
+    }
+    return KV_SUCCESS;
+}
+
+kv_error_t kv_store_mget(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                         kv_mget_fn visit, void* ctx) {
+    if (!visit) return KV_ERROR_INVALID_KEY;
+    kv_error_t result = kv_store_check_batch(store, items, count, false);
+    if (result != KV_SUCCESS) return result;
+    if (store->ops->mget) return store->ops->mget(store->engine, items, count, visit, ctx);
+
+    // Engines without a batch path: one get per key into a shared buffer
+    char first;
+    char* value = &first;
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t value_len = 0;
+        kv_error_t found;
+        while ((found = store->ops->get(store->engine, items[i].key, items[i].key_len,
+                                        value, size, &value_len)) == KV_ERROR_NO_SPACE) {
+            char* grown = realloc(value == &first ? NULL : value, value_len);
+            if (!grown) {
+                found = KV_ERROR_NO_SPACE;
+                break;
+            }
+            value = grown;
+            size = value_len;
+        }
+        visit(ctx, i, found, value, found == KV_SUCCESS ? value_len : 0);
+    }
+    if (value != &first) free(value);
+    return KV_SUCCESS;
+}
+
+kv_error_t kv_store_mset(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                         bool atomic, kv_error_t* results) {
+    if (!results) return KV_ERROR_INVALID_KEY;
+    kv_error_t result = kv_store_check_batch(store, items, count, true);
+    if (result != KV_SUCCESS) return fail_batch(results, count, result);
+    uint64_t stripes = store->repl ? repl_lock_batch(store->repl, items, count) : 0;
+    durable_defer(store);
+    if (store->ops->mput) {
+        store->ops->mput(store->engine, items, count, atomic, results);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = store->ops->put(store->engine, items[i].key, items[i].key_len,
+                                         items[i].value, items[i].value_len, 0);
+        }
+    }
+    batch_replicated(store, stripes, items, count, results, WAL_PUT);
+    batch_written(store, items, count, results);
+    return first_failure(results, count);
+}
+
+kv_error_t kv_store_mdelete(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                            kv_error_t* results) {
+    if (!results) return KV_ERROR_INVALID_KEY;
+    kv_error_t result = kv_store_check_batch(store, items, count, false);
+    if (result != KV_SUCCESS) return fail_batch(results, count, result);
+    uint64_t stripes = store->repl ? repl_lock_batch(store->repl, items, count) : 0;
+    durable_defer(store);
+    if (store->ops->mdelete) {
+        store->ops->mdelete(store->engine, items, count, results);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = store->ops->delete(store->engine, items[i].key, items[i].key_len);
+        }
+    }
+    batch_replicated(store, stripes, items, count, results, WAL_DELETE);
+    batch_written(store, items, count, results);
+    return first_failure(results, count);
+}
+
+size_t kv_store_count(kv_store_t* store) {
+    return store ? store->ops->count(store->engine) : 0;
+}
+
+void kv_store_save(kv_store_t* store) {
+    if (store) store->ops->save(store->engine, true);
+}
+
+void kv_store_snapshot(kv_store_t* store) {
+    if (store) store->ops->save(store->engine, false);
+}
+
+void kv_store_get_stats(kv_store_t* store, kv_store_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    store->ops->get_stats(store->engine, stats);
+    stats->engine = store->ops->name;
+}
+
+void kv_store_dump_stats(kv_store_t* store, FILE* out) {
+    fprintf(out, "engine: %s\n", store->ops->name);
+    store->ops->dump_stats(store->engine, out);
+}
@@ -0,0 +1,208 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A thread's state word is (epoch << 1) | EPOCH_ACTIVE while it is inside
+// a read section and 0 otherwise.
+#define EPOCH_ACTIVE 1ull
+
+// Retires between attempts to advance the global epoch
+#define RETIRE_SCAN_INTERVAL 64
+
+typedef struct {
+    void* ptr;
+    void (*free_fn)(void*);
+    uint64_t epoch;                     // Global epoch when retired
+} retired_t;
+
+typedef struct {
+    retired_t* items;                   // Oldest first
+    size_t count;
+    size_t capacity;
+} retire_list_t;
+
+typedef struct epoch_record {
+    uint64_t state;                     // Read by other threads
+    char pad[56];                       // Keep state on its own cache line
+    unsigned depth;
+    unsigned since_scan;
+    bool in_use;
+    retire_list_t retired;
+    struct epoch_record* next;
+} epoch_record_t;
+
+static uint64_t global_epoch = 1;
+static epoch_record_t* records;         // Push-only list, records are reused
+
+// Retired objects of exited threads
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static retire_list_t orphans;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record_t* self;
+
+static bool list_push(retire_list_t* list, retired_t item) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        retired_t* items = realloc(list->items, capacity * sizeof(retired_t));
+        if (!items) return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+    return true;
+}
+
+// Free every item retired at least two epochs before now
+static void list_reclaim(retire_list_t* list, uint64_t now) {
+    size_t n = 0;
+    while (n < list->count && list->items[n].epoch + 2 <= now) {
+        list->items[n].free_fn(list->items[n].ptr);
+        n++;
+    }
+    if (n > 0) {
+        memmove(list->items, list->items + n, (list->count - n) * sizeof(retired_t));
+        list->count -= n;
+    }
+}
+
+static void record_release(void* arg) {
+    epoch_record_t* rec = arg;
+
+    pthread_mutex_lock(&orphan_lock);
+    for (size_t i = 0; i < rec->retired.count; i++) {
+        if (!list_push(&orphans, rec->retired.items[i])) {
+            // Out of memory: leaking is the only safe option
+            break;
+        }
+    }
+    pthread_mutex_unlock(&orphan_lock);
+
+    rec->retired.count = 0;
+    rec->depth = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void make_record_key(void) {
+    pthread_key_create(&record_key, record_release);
+}
+
+static epoch_record_t* get_record(void) {
+    if (self) return self;
+
+    pthread_once(&record_key_once, make_record_key);
+
+    // Reuse a record left behind by an exited thread
+    epoch_record_t* rec;
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        bool expected = false;
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&rec->in_use, &expected, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (!rec) {
+        if (posix_memalign((void**)&rec, 64, sizeof(epoch_record_t)) != 0) abort();
+        memset(rec, 0, sizeof(*rec));
+        rec->in_use = true;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(record_key, rec);
+    self = rec;
+    return rec;
+}
+
+// Advance the global epoch if every active reader has seen the current one
+static uint64_t try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    for (epoch_record_t* rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+         rec; rec = rec->next) {
+        uint64_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+static void reclaim_orphans(uint64_t now, bool wait) {
+    if (wait) {
+        pthread_mutex_lock(&orphan_lock);
+    } else if (pthread_mutex_trylock(&orphan_lock) != 0) {
+        return;
+    }
+    list_reclaim(&orphans, now);
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+void epoch_enter(void) {
+    epoch_record_t* rec = get_record();
+    if (rec->depth++ > 0) return;
+
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, (epoch << 1) | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+    // Publish the pin before reading any shared pointer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    epoch_record_t* rec = self;
+    if (--rec->depth > 0) return;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void* ptr, void (*free_fn)(void*)) {
+    if (!ptr) return;
+
+    epoch_record_t* rec = get_record();
+
+    // Order the caller's unlink before sampling the epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    retired_t item = {
+        .ptr = ptr,
+        .free_fn = free_fn,
+        .epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+    };
+
+    if (!list_push(&rec->retired, item)) {
+        // Cannot defer: wait out all readers and free directly
+        epoch_synchronize();
+        free_fn(ptr);
+        return;
+    }
+
+    if (++rec->since_scan >= RETIRE_SCAN_INTERVAL) {
+        rec->since_scan = 0;
+        uint64_t now = try_advance();
+        list_reclaim(&rec->retired, now);
+        reclaim_orphans(now, false);
+    }
+}
+
+void epoch_synchronize(void) {
+    epoch_record_t* rec = get_record();
+    uint64_t target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+
+    uint64_t now;
+    while ((now = try_advance()) < target) {
+        sched_yield();
+    }
+    list_reclaim(&rec->retired, now);
+    reclaim_orphans(now, true);
+}
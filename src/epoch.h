@@ -0,0 +1,18 @@
+// Epoch-based memory reclamation for lock-free readers
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// Readers bracket every access to shared pointers with epoch_enter() and
+// epoch_exit(). Sections may nest and must not block for long.
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Defer free_fn(ptr) until no reader that could still see ptr is active
+void epoch_retire(void* ptr, void (*free_fn)(void*));
+
+// Reclaim everything this thread and exited threads have retired, waiting
+// for active readers to move on. Must not be called inside a section.
+void epoch_synchronize(void);
+
+#endif // EPOCH_H
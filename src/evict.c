@@ -0,0 +1,160 @@
+#include "evict.h"
+#include "slab.h"
+
+#define GHOST_MIN_CAPACITY 16
+
+size_t evict_charge(const kv_entry_t* entry) {
+    return slab_chunk_size(sizeof(kv_entry_t) + entry->key_len + entry->value_len);
+}
+
+void evict_queues_init(evict_queues_t* queues) {
+    memset(queues, 0, sizeof(*queues));
+}
+
+void evict_queues_destroy(evict_queues_t* queues) {
+    free(queues->ghost);
+    queues->ghost = NULL;
+    queues->ghost_mask = 0;
+}
+
+static void fifo_push(evict_fifo_t* fifo, kv_entry_t* entry) {
+    entry->prev = fifo->tail;
+    entry->next = NULL;
+    if (fifo->tail) {
+        fifo->tail->next = entry;
+    } else {
+        fifo->head = entry;
+    }
+    fifo->tail = entry;
+    fifo->bytes += evict_charge(entry);
+    fifo->count++;
+}
+
+static void fifo_unlink(evict_fifo_t* fifo, kv_entry_t* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        fifo->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        fifo->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    fifo->bytes -= evict_charge(entry);
+    fifo->count--;
+}
+
+static evict_fifo_t* fifo_of(evict_queues_t* queues, const kv_entry_t* entry) {
+    return entry->queue == EVICT_MAIN ? &queues->main : &queues->small;
+}
+
+// The ghost is direct-mapped: a newer hash simply takes the slot of an
+// older one. It is kept about as large as the segment has entries, which
+// is how long S3-FIFO remembers an eviction. Hashes are stored with the
+// low bit set so that 0 always means empty.
+static bool ghost_take(evict_queues_t* queues, uint64_t h) {
+    if (!queues->ghost) return false;
+    uint64_t* slot = &queues->ghost[h & queues->ghost_mask];
+    if (*slot != (h | 1)) return false;
+    *slot = 0;
+    return true;
+}
+
+static void ghost_add(evict_queues_t* queues, uint64_t h) {
+    size_t wanted = queues->small.count + queues->main.count;
+    if (wanted < GHOST_MIN_CAPACITY) wanted = GHOST_MIN_CAPACITY;
+    if (wanted > queues->ghost_mask + 1 || !queues->ghost) {
+        size_t capacity = queues->ghost ? (queues->ghost_mask + 1) * 2 : GHOST_MIN_CAPACITY;
+        while (capacity < wanted) capacity *= 2;
+        uint64_t* ghost = calloc(capacity, sizeof(uint64_t));
+        if (ghost) {
+            // Growing keeps what fits; colliding hashes drop out
+            for (size_t i = 0; queues->ghost && i <= queues->ghost_mask; i++) {
+                if (queues->ghost[i]) ghost[queues->ghost[i] & (capacity - 1)] = queues->ghost[i];
+            }
+            free(queues->ghost);
+            queues->ghost = ghost;
+            queues->ghost_mask = capacity - 1;
+        }
+        if (!queues->ghost) return;
+    }
+    queues->ghost[h & queues->ghost_mask] = h | 1;
+}
+
+void evict_insert(evict_queues_t* queues, kv_entry_t* entry) {
+    entry->freq = 0;
+    entry->queue = ghost_take(queues, entry->hash) ? EVICT_MAIN : EVICT_SMALL;
+    fifo_push(fifo_of(queues, entry), entry);
+}
+
+void evict_replace(evict_queues_t* queues, kv_entry_t* old, kv_entry_t* entry) {
+    evict_fifo_t* fifo = fifo_of(queues, old);
+    entry->freq = __atomic_load_n(&old->freq, __ATOMIC_RELAXED);
+    entry->queue = old->queue;
+    entry->prev = old->prev;
+    entry->next = old->next;
+    if (entry->prev) {
+        entry->prev->next = entry;
+    } else {
+        fifo->head = entry;
+    }
+    if (entry->next) {
+        entry->next->prev = entry;
+    } else {
+        fifo->tail = entry;
+    }
+    fifo->bytes += evict_charge(entry) - evict_charge(old);
+    old->prev = old->next = NULL;
+    old->queue = EVICT_NONE;
+}
+
+void evict_remove(evict_queues_t* queues, kv_entry_t* entry) {
+    if (entry->queue == EVICT_NONE) return;
+    fifo_unlink(fifo_of(queues, entry), entry);
+    entry->queue = EVICT_NONE;
+}
+
+static inline bool expired_at(const kv_entry_t* entry, uint64_t now) {
+    return entry->expires_at && entry->expires_at <= now;
+}
+
+// Every pass over a read entry lowers its count, so the loop ends within
+// EVICT_FREQ_MAX + 1 rounds of the queues unless readers keep up with it.
+kv_entry_t* evict_next(evict_queues_t* queues, uint64_t now) {
+    for (;;) {
+        evict_fifo_t* small = &queues->small;
+        evict_fifo_t* main = &queues->main;
+        size_t total = small->bytes + main->bytes;
+
+        if (small->count &&
+            (!main->count || small->bytes * 100 >= total * EVICT_SMALL_PERCENT)) {
+            kv_entry_t* entry = small->head;
+            fifo_unlink(small, entry);
+            uint8_t freq = __atomic_load_n(&entry->freq, __ATOMIC_RELAXED);
+            if (freq > 0 && !expired_at(entry, now)) {
+                // Read while on probation: admitted
+                entry->queue = EVICT_MAIN;
+                __atomic_store_n(&entry->freq, 0, __ATOMIC_RELAXED);
+                fifo_push(main, entry);
+                continue;
+            }
+            if (!expired_at(entry, now)) ghost_add(queues, entry->hash);
+            entry->queue = EVICT_NONE;
+            return entry;
+        }
+
+        if (!main->count) return NULL;
+        kv_entry_t* entry = main->head;
+        fifo_unlink(main, entry);
+        uint8_t freq = __atomic_load_n(&entry->freq, __ATOMIC_RELAXED);
+        if (freq > 0 && !expired_at(entry, now)) {
+            __atomic_store_n(&entry->freq, freq - 1, __ATOMIC_RELAXED);
+            fifo_push(main, entry);
+            continue;
+        }
+        entry->queue = EVICT_NONE;
+        return entry;
+    }
+}
@@ -0,0 +1,71 @@
+// S3-FIFO eviction queues for cache mode
+
+#ifndef EVICT_H
+#define EVICT_H
+
+#include "kv_store.h"
+
+// Each segment keeps its entries in two FIFO queues linked through the
+// entries themselves. New keys enter the small queue, which holds about a
+// tenth of the segment's bytes; only keys read again before they reach its
+// head are admitted to the main queue, so a scan of one-hit keys washes
+// through the small queue without disturbing the working set. Main is a
+// CLOCK: a read key goes round again with its count reduced. Keys evicted
+// from the small queue leave their hash in a ghost table, and a key that
+// comes back while still remembered goes straight to main.
+//
+// Everything here runs under the segment lock except evict_touch, which
+// readers call without any lock.
+#define EVICT_FREQ_MAX 3
+#define EVICT_SMALL_PERCENT 10
+
+enum {
+    EVICT_NONE = 0,                     // Not queued (cache mode off)
+    EVICT_SMALL,
+    EVICT_MAIN,
+};
+
+typedef struct {
+    kv_entry_t* head;                   // Next to leave
+    kv_entry_t* tail;
+    size_t bytes;                       // Charged bytes of the queued entries
+    size_t count;
+} evict_fifo_t;
+
+typedef struct evict_queues {
+    evict_fifo_t small;
+    evict_fifo_t main;
+    uint64_t* ghost;                    // Hashes of recent small-queue evictions
+    size_t ghost_mask;                  // Capacity - 1, 0 until the first
+    // Bumped by readers, so kept off the cache line writers update
+    uint64_t hits __attribute__((aligned(64)));
+    uint64_t misses;
+    uint64_t evictions;                 // Under the segment lock
+} __attribute__((aligned(64))) evict_queues_t;
+
+// Memory an entry is charged for: its slab chunk
+size_t evict_charge(const kv_entry_t* entry);
+
+void evict_queues_init(evict_queues_t* queues);
+void evict_queues_destroy(evict_queues_t* queues);
+
+// Queue a new key: in main if the ghost remembers it, else in small
+void evict_insert(evict_queues_t* queues, kv_entry_t* entry);
+
+// Put entry in old's place, with old's read count. Old leaves the queues.
+void evict_replace(evict_queues_t* queues, kv_entry_t* old, kv_entry_t* entry);
+
+void evict_remove(evict_queues_t* queues, kv_entry_t* entry);
+
+// Pick and dequeue the next entry to evict, or NULL if none are queued.
+// Entries past their expiry at now go first, whatever their read count.
+kv_entry_t* evict_next(evict_queues_t* queues, uint64_t now);
+
+// Note a read. Racing readers may lose an increment, which only makes the
+// count more approximate.
+static inline void evict_touch(kv_entry_t* entry) {
+    uint8_t freq = __atomic_load_n(&entry->freq, __ATOMIC_RELAXED);
+    if (freq < EVICT_FREQ_MAX) __atomic_store_n(&entry->freq, freq + 1, __ATOMIC_RELAXED);
+}
+
+#endif // EVICT_H
@@ -0,0 +1,93 @@
+// Seeded 64-bit hash shared by the hash table, on-disk filters and key placement
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint64_t hash_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Seeded 64-bit hash (wyhash-style multiply-fold over 16-byte blocks)
+static inline uint64_t kv_hash(const char* key, size_t len, uint64_t seed) {
+    const uint64_t p0 = 0xa0761d6478bd642full;
+    const uint64_t p1 = 0xe7037ed1a0b428dbull;
+    const uint64_t p2 = 0x8ebc6af09c88c6e3ull;
+    const uint8_t* p = (const uint8_t*)key;
+    uint64_t a, b;
+
+    seed ^= hash_mix(seed ^ p0, p1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ p1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+    return hash_mix(p1 ^ len, hash_mix(a ^ p1, b ^ seed ^ p2));
+}
+
+// The part of a key placement goes by: only the tag of a key like
+// "user:{42}:name" counts, so related keys can be kept together
+static inline void kv_hash_tag(const char** key, size_t* key_len) {
+    const char* open = memchr(*key, '{', *key_len);
+    if (!open) return;
+    size_t rest = *key_len - (size_t)(open - *key) - 1;
+    const char* close = memchr(open + 1, '}', rest);
+    if (close && close > open + 1) {
+        *key = open + 1;
+        *key_len = (size_t)(close - *key);
+    }
+}
+
+// Double a chained table of power-of-two bucket_count buckets, placing each
+// entry (of type, linked by its member next) by its uint64_t hash. Staying
+// as it is is fine if that fails.
+#define KV_BUCKETS_GROW(buckets, bucket_count, type, next) do {              \
+        size_t grown_count_ = (bucket_count) * 2;                           \
+        type** grown_ = calloc(grown_count_, sizeof(*grown_));              \
+        if (!grown_) break;                                                 \
+        for (size_t i_ = 0; i_ < (bucket_count); i_++) {                    \
+            while ((buckets)[i_]) {                                         \
+                type* entry_ = (buckets)[i_];                               \
+                (buckets)[i_] = entry_->next;                               \
+                entry_->next = grown_[entry_->hash & (grown_count_ - 1)];   \
+                grown_[entry_->hash & (grown_count_ - 1)] = entry_;         \
+            }                                                               \
+        }                                                                   \
+        free(buckets);                                                      \
+        (buckets) = grown_;                                                 \
+        (bucket_count) = grown_count_;                                      \
+    } while (0)
+
+#endif // HASH_H
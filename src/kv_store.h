@@ -5,6 +5,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +15,18 @@
 #include <arpa/inet.h>
 
 // Configuration
-#define MAX_KEY_SIZE 32
-#define MAX_VALUE_SIZE 256
-#define TABLE_SIZE 1024
-#define MAX_CLIENTS 10
+#define MAX_KEY_SIZE 32                 // Key field of a network message
+#define MAX_VALUE_SIZE 256              // Value field of a network message
+#define MAX_KEY_LENGTH 65535            // Longest key the store accepts
+#define DEFAULT_MAX_VALUE_LENGTH (1024 * 1024)  // Default store value limit
+#define NUM_SEGMENTS 256             // Lock stripes, each an independent hash table
+#define SEGMENT_INITIAL_CAPACITY 16 // Slots per segment table (power of two, >= 16)
+#define DEFAULT_MAX_CONNECTIONS 10000   // Open at once; more are refused
+#define DEFAULT_MAX_INFLIGHT 256        // Requests one connection runs per turn
+#define DEFAULT_LATENCY_BUDGET_MS 100   // Before held-back requests are shed
+#define DEFAULT_TRACKING_KEYS (1024 * 1024)  // Keys tracked for near caches
+#define DEFAULT_REPL_BACKLOG (64 * 1024 * 1024)  // Stream kept to resume a backup from
+#define DEFAULT_REPL_SYNC_RATE (32 * 1024 * 1024) // Full sync bytes/s to a backup
 
 // Error codes
 typedef enum {
@@ -26,75 +35,771 @@ typedef enum {
     KV_ERROR_NO_SPACE,
     KV_ERROR_INVALID_KEY,
     KV_ERROR_NETWORK,
+    KV_ERROR_VALUE_TOO_LARGE,
+    KV_ERROR_IO,
+    KV_ERROR_BUSY,                      // Overloaded: shed without running, retry later
+    KV_ERROR_TIMEOUT,                   // Client side: no reply before the deadline
+    KV_ERROR_MOVED,                     // Cluster: the key belongs to another node
 } kv_error_t;
 
-// Storage entry structure
-typedef struct {
-    char key[MAX_KEY_SIZE];
-    char value[MAX_VALUE_SIZE];
-    bool is_occupied;
+// When the write-ahead log forces records to disk
+typedef enum {
+    KV_FSYNC_ALWAYS,                    // Before acknowledging each write (group commit)
+    KV_FSYNC_INTERVAL,                  // Every fsync_interval_ms
+    KV_FSYNC_NEVER,                     // Leave flushing to the OS
+} kv_fsync_policy_t;
+
+// Storage entry structure (slab allocated, referenced from table slots).
+// Sized to its payload, which is never modified once published. In cache
+// mode the eviction fields belong to the segment's queues (evict.h).
+// refs counts the table's reference, dropped when the entry is retired,
+// and the values pinned for sending (kv_store_get_ref); the last one
+// frees it.
+typedef struct kv_entry {
+    uint64_t hash;                      // Cached full hash, reused when resizing
+    uint64_t expires_at;                // Ms since the epoch, 0 if it never expires
+    struct kv_entry* prev;              // Eviction queue links, under the segment lock
+    struct kv_entry* next;
+    uint32_t value_len;
+    uint32_t refs;
+    uint16_t key_len;                   // Up to MAX_KEY_LENGTH
+    uint8_t freq;                       // Reads since queued, saturating; lock-free
+    uint8_t queue;                      // Eviction queue holding the entry
+    char data[];                        // Key bytes followed by value bytes
 } kv_entry_t;
 
-// Storage structure
+// Open-addressing hash table with one control byte per slot.
+// A control byte is EMPTY, DELETED, or the low 7 bits of a full slot's hash.
+typedef struct {
+    uint8_t* ctrl;
+    kv_entry_t** slots;
+    size_t capacity;                    // Power of two, multiple of 16
+    size_t size;                        // Full slots
+    size_t tombstones;                  // DELETED slots
+} kv_table_t;
+
+// A segment owns a slice of the hash space. While it grows, entries are
+// moved from old_table to table a few groups at a time by each write.
+// Writers serialize on lock; readers take no lock and rely on epoch-based
+// reclamation (epoch.h) to keep tables and entries alive while they look.
+typedef struct {
+    pthread_mutex_t lock;               // Writers only
+    kv_table_t* table;
+    kv_table_t* old_table;              // Non-NULL while a resize is in progress
+    size_t migrate_pos;                 // Next slot of old_table to move
+    uint64_t changes;                   // Writes applied, for snapshot scheduling
+    struct timer_wheel* expiry;         // Keys with a TTL; NULL until the first
+    struct evict_queues* evict;         // Eviction order; NULL unless in cache mode
+} __attribute__((aligned(64))) kv_segment_t;
+
+struct kv_engine_ops;
+
+// Storage options
 typedef struct {
-    kv_entry_t entries[TABLE_SIZE];
-    pthread_mutex_t locks[TABLE_SIZE];  // Per-bucket locks
+    const struct kv_engine_ops* engine; // Backend, kv_hash_engine by default
+    size_t max_value_length;            // Largest value PUT accepts
+    size_t max_memory;                  // Hash: evict beyond this many bytes of entries, 0 = off
+    bool wal_enabled;                   // Log writes to <backup_file>.wal.<n>
+    kv_fsync_policy_t fsync_policy;
+    unsigned fsync_interval_ms;         // For KV_FSYNC_INTERVAL
+    unsigned snapshot_interval_ms;      // Background snapshot period, 0 = off
+    uint64_t snapshot_min_changes;      // Skip periodic snapshots below this
+    size_t memtable_size;               // LSM: flush the memtable beyond this
+    size_t block_cache_size;            // LSM: bytes of SSTable blocks cached
+    unsigned compaction_threads;        // LSM: background compaction workers
+} kv_store_options_t;
+
+// State of the in-memory hash engine
+typedef struct {
+    kv_segment_t segments[NUM_SEGMENTS]; // Per-segment locks
+    uint64_t hash_seed;
+    kv_store_options_t options;
     char* backup_file;                  // For persistence
+    char* wal_prefix;                   // <backup_file>.wal
+    struct wal* wal;                    // NULL when the WAL is disabled
+    struct snapshotter* snapshotter;    // NULL without a backup file
+    uint64_t snapshot_generation;       // Last WAL generation the snapshot covers
+    struct skiplist* index;             // Every key in order, for scans
+    pthread_mutex_t index_lock;         // Index writers, taken inside a segment lock
+    pthread_t sweeper;                  // Reclaims expired keys
+    pthread_mutex_t sweep_lock;
+    pthread_cond_t sweep_cond;          // Signalled to stop the sweeper
+    bool sweeper_started;
+    bool sweeper_stopping;
+    uint64_t expired;                   // Keys reclaimed by the sweeper
+    size_t memory_used;                 // Cache mode: bytes charged to queued entries
+    struct evict_queues* evict_queues;  // Cache mode: one per segment
+} kv_hash_store_t;
+
+// Storage statistics. Engines fill in the fields that apply to them.
+typedef struct {
+    const char* engine;
+    size_t keys;                        // Estimated by the LSM engine
+    size_t slab_pages;                  // SLAB_PAGE_SIZE pages carved into chunks
+    size_t slab_chunk_bytes;            // Bytes in chunks holding entries
+    size_t slab_requested_bytes;        // Bytes the entries actually need
+    size_t large_entries;               // Entries too big for any slab class
+    size_t large_bytes;
+    double fragmentation;               // 1 - requested / chunk bytes
+    double slab_utilization;            // Chunk bytes / page bytes
+    uint64_t wal_records;
+    uint64_t wal_bytes;
+    uint64_t wal_batches;               // Sequential writes by the log writer
+    uint64_t wal_fsyncs;
+    uint64_t snapshots;
+    uint64_t snapshot_failures;
+    uint64_t snapshot_last_ms;          // Duration of the last snapshot
+    uint64_t snapshot_last_pause_us;    // Writers blocked by the last snapshot
+    uint64_t snapshot_max_pause_us;
+    size_t snapshot_bytes;              // Size of the last snapshot
+    size_t memtable_bytes;
+    size_t sstables;
+    uint64_t sstable_bytes;
+    uint64_t flushes;
+    uint64_t compactions;
+    uint64_t compaction_bytes_read;
+    uint64_t compaction_bytes_written;
+    uint64_t write_stalls;              // Writes that waited for a flush
+    uint64_t block_reads;               // Data blocks read from disk
+    uint64_t block_cache_hits;
+    uint64_t bloom_negatives;           // SSTable probes skipped by a filter
+    uint64_t expired_keys;              // Reclaimed after their TTL ran out
+    size_t max_memory;                  // Cache mode limit, 0 when off
+    size_t memory_used;
+    uint64_t cache_hits;                // GETs that found their key (cache mode)
+    uint64_t cache_misses;
+    uint64_t evictions;
+    double hit_ratio;                   // hits / (hits + misses)
+} kv_store_stats_t;
+
+// Scan callback, called for each key in order; return false to stop. It
+// runs while the engine pins what the scan is reading, so it must be quick
+// and must not call back into the store.
+typedef bool (*kv_scan_fn)(void* ctx, const char* key, size_t key_len,
+                           const char* value, size_t value_len);
+
+// One key of a multi-key operation; value is only read by kv_store_mset
+typedef struct {
+    const char* key;
+    size_t key_len;
+    const char* value;
+    size_t value_len;
+} kv_batch_item_t;
+
+// A stored value pinned where it lies (kv_store_get_ref). The bytes never
+// change, and stay valid on any thread until release(pin) is called.
+typedef struct {
+    const char* data;
+    size_t len;
+    void* pin;
+    void (*release)(void* pin);
+} kv_value_ref_t;
+
+// MGET callback, called for each item in order with its status and, on
+// success, its value. Same rules as kv_scan_fn.
+typedef void (*kv_mget_fn)(void* ctx, size_t index, kv_error_t status,
+                           const char* value, size_t value_len);
+
+// Storage engine interface. Every kv_store_* call is forwarded to the
+// engine's handle; keys and values are already validated. Expiry times are
+// absolute, in ms since the epoch (0: never); keys past theirs read as
+// missing until the engine reclaims them.
+typedef struct kv_engine_ops {
+    const char* name;
+    void* (*open)(const char* path, const kv_store_options_t* options);
+    void (*close)(void* engine);        // Persist everything and free
+    kv_error_t (*put)(void* engine, const char* key, size_t key_len,
+                      const char* value, size_t value_len, uint64_t expires_at);
+    kv_error_t (*get)(void* engine, const char* key, size_t key_len,
+                      char* value, size_t value_size, size_t* value_len);
+    // Optional: pin the value instead of copying it out
+    kv_error_t (*get_ref)(void* engine, const char* key, size_t key_len,
+                          kv_value_ref_t* ref);
+    kv_error_t (*delete)(void* engine, const char* key, size_t key_len);
+    kv_error_t (*expire)(void* engine, const char* key, size_t key_len, uint64_t expires_at);
+    kv_error_t (*ttl)(void* engine, const char* key, size_t key_len, uint64_t* expires_at);
+    // Keys in [start, end) in byte order; end NULL means no upper bound
+    kv_error_t (*scan)(void* engine, const char* start, size_t start_len,
+                       const char* end, size_t end_len, kv_scan_fn visit, void* ctx);
+    // Optional batch forms of get, put and delete; NULL runs the single-key
+    // call once per item. mput and mdelete set results[i] for every item.
+    // With atomic, mput keeps other writers out until every item is applied.
+    kv_error_t (*mget)(void* engine, const kv_batch_item_t* items, size_t count,
+                       kv_mget_fn visit, void* ctx);
+    void (*mput)(void* engine, const kv_batch_item_t* items, size_t count,
+                 bool atomic, kv_error_t* results);
+    void (*mdelete)(void* engine, const kv_batch_item_t* items, size_t count,
+                    kv_error_t* results);
+    size_t (*count)(void* engine);
+    // Make all data durable outside the WAL; with wait false, only start it
+    bool (*save)(void* engine, bool wait);
+    void (*get_stats)(void* engine, kv_store_stats_t* stats);
+    void (*dump_stats)(void* engine, FILE* out);
+} kv_engine_ops_t;
+
+extern const kv_engine_ops_t kv_hash_engine;   // In-memory hash table (storage.c)
+extern const kv_engine_ops_t kv_lsm_engine;    // On-disk LSM tree (lsm.c)
+
+// Called after a write that may have changed key
+typedef void (*kv_write_fn)(void* ctx, const char* key, size_t key_len);
+
+struct replication;
+
+// Storage structure
+typedef struct {
+    const kv_engine_ops_t* ops;
+    void* engine;
+    kv_store_options_t options;
+    kv_write_fn on_write;               // kv_store_watch
+    void* on_write_ctx;
+    struct replication* repl;           // kv_store_replicate, or NULL
 } kv_store_t;
 
-// Message types
+// Message types, also the opcodes of v2 frames (protocol.h)
 typedef enum {
     MSG_PUT,
     MSG_GET,
     MSG_DELETE,
-    MSG_REPLICATE
+    MSG_REPLICATE,
+    MSG_SCAN,
+    MSG_PUT_TTL,
+    MSG_EXPIRE,
+    MSG_TTL,
+    MSG_MGET,                           // Multi-key commands are v2 only
+    MSG_MSET,
+    MSG_MDELETE,
+    MSG_SHM_ATTACH,                     // v2 over the Unix socket only (shm.h)
+    MSG_TRACK,                          // v2, epoll only: invalidations for a near cache
+    MSG_INVALIDATE,                     // Pushed by the server, never requested
+    MSG_CLUSTER                         // v2: the nodes of the server's cluster
 } message_type_t;
 
-// Network message structure
+// Protocol v1 network message, sent whole whatever the key and value
+// lengths. Clients that open with a v2 hello use compact frames instead.
 typedef struct {
     message_type_t type;
     char key[MAX_KEY_SIZE];
     char value[MAX_VALUE_SIZE];
 } kv_message_t;
 
+// MSG_SCAN: the message key holds the start key, or with KV_SCAN_AFTER the
+// last key of the previous page; the value holds a kv_scan_request_t. The
+// reply is a kv_error_t, then on success a kv_scan_reply_t and count items.
+#define KV_SCAN_PREFIX 0x01             // bound is a prefix, not an end key
+#define KV_SCAN_AFTER  0x02             // Start just past the message key
+#define KV_SCAN_MAX_PAGE 64             // Most items the server returns at once
+
+typedef struct {
+    uint8_t flags;
+    uint8_t reserved;
+    uint16_t limit;                     // Items wanted, capped at KV_SCAN_MAX_PAGE
+    char bound[MAX_KEY_SIZE];           // End key (exclusive) or prefix, "" for none
+} kv_scan_request_t;
+
+typedef struct {
+    uint32_t count;                     // Items that follow
+    uint32_t more;                      // Non-zero if the scan may continue
+} kv_scan_reply_t;
+
+// Values longer than the field are cut short; value_len is the full length
+typedef struct {
+    uint32_t key_len;
+    uint32_t value_len;
+    char key[MAX_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+} kv_scan_item_t;
+
+// Expiry. TTLs travel as uint64_t milliseconds:
+//   MSG_PUT_TTL  a MSG_PUT message followed by the TTL
+//   MSG_EXPIRE   the TTL in the first 8 bytes of the value field; 0 clears it
+//   MSG_TTL      reply is a kv_error_t, then on success an int64_t of the
+//                ms left, or -1 if the key does not expire
+
 // Function declarations
 // Storage operations
+void kv_store_options_init(kv_store_options_t* options);
 kv_store_t* kv_store_create(const char* backup_file);
+kv_store_t* kv_store_create_with_options(const char* backup_file,
+                                         const kv_store_options_t* options);
 void kv_store_destroy(kv_store_t* store);
-kv_error_t kv_store_put(kv_store_t* store, const char* key, const char* value);
-kv_error_t kv_store_get(kv_store_t* store, const char* key, char* value);
-kv_error_t kv_store_delete(kv_store_t* store, const char* key);
+kv_error_t kv_store_put(kv_store_t* store, const char* key, size_t key_len,
+                        const char* value, size_t value_len);
+// Copies at most value_size bytes; returns KV_ERROR_NO_SPACE (with
+// *value_len set to the stored length) if the value does not fit.
+kv_error_t kv_store_get(kv_store_t* store, const char* key, size_t key_len,
+                        char* value, size_t value_size, size_t* value_len);
+// Whether the engine can pin values, for kv_store_get_ref
+bool kv_store_can_pin(const kv_store_t* store);
+// Like kv_store_get, without a copy: ref points at the stored bytes until
+// ref->release(ref->pin)
+kv_error_t kv_store_get_ref(kv_store_t* store, const char* key, size_t key_len,
+                            kv_value_ref_t* ref);
+kv_error_t kv_store_delete(kv_store_t* store, const char* key, size_t key_len);
+// Store a pair that expires ttl_ms from now (0: never)
+kv_error_t kv_store_put_ttl(kv_store_t* store, const char* key, size_t key_len,
+                            const char* value, size_t value_len, uint64_t ttl_ms);
+// Make an existing key expire ttl_ms from now, or with 0 never
+kv_error_t kv_store_expire(kv_store_t* store, const char* key, size_t key_len,
+                           uint64_t ttl_ms);
+// Call fn after every put, delete or expire that succeeds, batches one
+// key at a time, on the writing thread; NULL stops. Expiry reclaiming a
+// key is not reported. Set before the store is shared.
+void kv_store_watch(kv_store_t* store, kv_write_fn fn, void* ctx);
+// Append every put, delete or expire that succeeds to repl's stream
+// (replication.h); NULL stops. Set before the store is shared.
+void kv_store_replicate(kv_store_t* store, struct replication* repl);
+// Milliseconds until key expires, or -1 if it does not
+kv_error_t kv_store_ttl(kv_store_t* store, const char* key, size_t key_len,
+                        int64_t* ttl_ms);
+// Visit keys in [start, end) in byte order without blocking writers; start
+// NULL scans from the first key, end NULL to the last. Keys written while
+// the scan runs may or may not be seen.
+kv_error_t kv_store_scan(kv_store_t* store, const char* start, size_t start_len,
+                         const char* end, size_t end_len, kv_scan_fn visit, void* ctx);
+// Multi-key operations. Every key is hashed and prefetched before any is
+// looked up, and writes take each segment lock once per batch. A batch
+// with an invalid item fails whole. mset and mdelete fill results (count
+// entries) and return the first failure; duplicate keys apply in order.
+kv_error_t kv_store_mget(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                         kv_mget_fn visit, void* ctx);
+// With atomic, no other write lands between the batch's first and last
+// key, and the hash engine takes all the memory the batch needs (entries,
+// table room, index nodes, and in cache mode room under max_memory)
+// before applying any, so running out of memory changes nothing and the
+// batch never evicts its own keys. A log write failing part way is not undone: keys
+// already applied stay so, and those whose writes failed are KV_ERROR_IO.
+// Lock-free readers may still see the batch part way through.
+kv_error_t kv_store_mset(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                         bool atomic, kv_error_t* results);
+kv_error_t kv_store_mdelete(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                            kv_error_t* results);
+// The error a batch would fail whole with, or KV_SUCCESS; values for mset
+kv_error_t kv_store_check_batch(kv_store_t* store, const kv_batch_item_t* items, size_t count,
+                                bool values);
+// Persist the store so the WAL it covers can be dropped (a snapshot for
+// the hash engine, a memtable flush for LSM). kv_store_save waits for it;
+// kv_store_snapshot starts it in the background.
 void kv_store_save(kv_store_t* store);
-void kv_store_load(kv_store_t* store);
+void kv_store_snapshot(kv_store_t* store);
+size_t kv_store_count(kv_store_t* store);
+void kv_store_get_stats(kv_store_t* store, kv_store_stats_t* stats);
+void kv_store_dump_stats(kv_store_t* store, FILE* out);
+
+// Sharded storage: the keyspace split by key hash over independent stores,
+// each with its own segments, WAL and snapshots. A key containing {tag}
+// is placed by the tag alone, so related keys can share a shard.
+#define KV_MAX_SHARDS 256
+
+struct cluster_map;
+struct repl_replica;
+
+typedef struct {
+    kv_store_t** stores;
+    unsigned count;
+    // Set by kv_server_set_cluster: keys the map places on other nodes
+    // are answered KV_ERROR_MOVED (cluster.h)
+    const struct cluster_map* cluster;
+    unsigned cluster_self;              // This node's index in the map
+    // Set by a server started as a backup: how far it follows a
+    // primary's stream (replication.h); NULL refuses MSG_REPLICATE
+    struct repl_replica* replica;
+} kv_shards_t;
+
+// Shard i keeps its data in <backup_file>.shard<i>. Opening with a
+// different count than last time, or over an unsharded <backup_file>,
+// first moves every key to the shard it now belongs to. Memory limits in
+// options are split evenly between the shards.
+kv_shards_t* kv_shards_open(const char* backup_file, const kv_store_options_t* options,
+                            unsigned count);
+void kv_shards_close(kv_shards_t* shards);
+unsigned kv_shard_of(const kv_shards_t* shards, const char* key, size_t key_len);
+static inline kv_store_t* kv_shard_store(const kv_shards_t* shards, const char* key,
+                                         size_t key_len) {
+    return shards->count == 1 ? shards->stores[0]
+                              : shards->stores[kv_shard_of(shards, key, key_len)];
+}
+// As kv_store_scan, merging the shards in key order
+kv_error_t kv_shards_scan(const kv_shards_t* shards, const char* start, size_t start_len,
+                          const char* end, size_t end_len, kv_scan_fn visit, void* ctx);
+// As the kv_store_m* calls, each shard taking its keys as one batch. An
+// atomic mset must keep to one shard; otherwise every key fails with
+// KV_ERROR_INVALID_KEY.
+kv_error_t kv_shards_mget(const kv_shards_t* shards, const kv_batch_item_t* items,
+                          size_t count, kv_mget_fn visit, void* ctx);
+kv_error_t kv_shards_mset(const kv_shards_t* shards, const kv_batch_item_t* items,
+                          size_t count, bool atomic, kv_error_t* results);
+kv_error_t kv_shards_mdelete(const kv_shards_t* shards, const kv_batch_item_t* items,
+                             size_t count, kv_error_t* results);
+size_t kv_shards_count(const kv_shards_t* shards);
+void kv_shards_dump_stats(const kv_shards_t* shards, FILE* out);
+
+// Where a server on port listens for local clients by default, and where
+// kv_client_connect looks for it
+#define KV_UNIX_PATH_FORMAT "/tmp/kvstore-%d.sock"
+
+// Server options
+typedef struct {
+    unsigned reactors;                  // Event loop threads, 0 = one per CPU
+    bool threaded;                      // A blocking thread per connection instead
+    bool io_uring;                      // io_uring loops, epoll if unsupported
+    const char* unix_path;              // Also listen on this Unix socket; NULL for none
+    bool shm;                           // Offer its clients shared-memory rings (epoll only)
+    unsigned max_connections;           // Open at once, 0 for no limit
+    // epoll only: requests one connection runs per turn before the others
+    // get theirs, and may have at other shards (0 for no limit), and how
+    // long in ms the rest may wait before being answered KV_ERROR_BUSY
+    // (0: never shed)
+    unsigned max_inflight;
+    unsigned latency_budget_ms;
+    // epoll only: GET values at least this long go out over TCP with
+    // MSG_ZEROCOPY, 0 never (reactor.h)
+    size_t zerocopy_min;
+    // epoll only: keys whose readers are tracked for near caches, 0 to
+    // refuse MSG_TRACK (tracking.h)
+    size_t tracking_keys;
+    // With a backup: bytes of the latest writes kept so a backup that was
+    // away can catch up on them alone, and the most a full sync sends it
+    // per second, 0 for no limit (replication.h)
+    size_t repl_backlog;
+    size_t repl_sync_rate;
+    // Take a primary's stream as its backup. Other servers refuse
+    // MSG_REPLICATE, which clears every key; a backup may not have a
+    // backup of its own (kv_server_set_backup fails)
+    bool backup;
+} kv_server_options_t;
 
 // Server operations
 typedef struct {
-    int socket;
-    kv_store_t* store;
-    bool is_running;
-    pthread_t worker_threads[MAX_CLIENTS];
-    int client_sockets[MAX_CLIENTS];
-    int backup_socket;  // Connection to backup server
+    int socket;                         // Listener (reactor 0's with SO_REUSEPORT)
+    int port;
+    int unix_socket;                    // Unix socket listener, or -1
+    char unix_path[108];                // Unlinked when the server stops
+    kv_store_t* store;                  // The first shard when sharded
+    kv_shards_t shards;                 // Just store unless sharded
+    kv_server_options_t options;
+    volatile bool is_running;
+    bool reuseport;                     // Reactors may open listeners of their own
+    int wake_fd;                        // eventfd, readable once stopping
+    unsigned connections;               // Open, over every loop
+    uint64_t refused;                   // Connections turned away at the limit
+    struct replication* repl;           // kv_server_set_backup, or NULL
+    struct repl_replica* replica;       // options.backup: the stream it follows
+    struct cluster_map* cluster;        // kv_server_set_cluster, or NULL
 } kv_server_t;
 
+void kv_server_options_init(kv_server_options_t* options);
 kv_server_t* kv_server_create(kv_store_t* store, int port);
+kv_server_t* kv_server_create_with_options(kv_store_t* store, int port,
+                                           const kv_server_options_t* options);
+// One event loop per shard, pinned to its own CPU; a request for a key of
+// another shard is handed to that shard's loop. shards must outlive the
+// server.
+kv_server_t* kv_server_create_sharded(kv_shards_t* shards, int port,
+                                      const kv_server_options_t* options);
 void kv_server_destroy(kv_server_t* server);
+// Serve connections until kv_server_request_stop is called
 void kv_server_start(kv_server_t* server);
+// Make kv_server_start return. Async-signal-safe.
+void kv_server_request_stop(kv_server_t* server);
 void kv_server_stop(kv_server_t* server);
+// Ship every write to the server at host:port, an IPv4 address, which
+// applies them as they come (replication.h); before kv_server_start. The
+// backup need not be up: it is synced whenever it connects. False if host
+// is not an address.
 bool kv_server_set_backup(kv_server_t* server, const char* host, int port);
 
+typedef struct {
+    bool connected;
+    bool syncing;                       // A full sync is under way
+    uint64_t offset;                    // Bytes of updates written so far
+    uint64_t acked;                     // Of them, applied by the backup
+    uint64_t lag_bytes;                 // offset - acked
+    uint64_t lag_ms;                    // Age of the oldest update not yet acked
+    uint64_t records;                   // Updates written
+    uint64_t batches;                   // MSG_REPLICATE frames sent
+    uint64_t full_syncs;                // Connections that cleared the backup
+    uint64_t partial_syncs;             // Connections resumed from the backlog
+    uint64_t sync_bytes;                // Sent by full syncs
+} kv_repl_stats_t;
+
+// False without a backup
+bool kv_server_backup_stats(kv_server_t* server, kv_repl_stats_t* stats);
+// Serve only this node's keys of a cluster of nodes, each "host:port", of
+// which self is this server; before kv_server_start. placement and vnodes
+// as in kv_cluster_options_t. False if the list is invalid or lacks self.
+bool kv_server_set_cluster(kv_server_t* server, const char* const* nodes, size_t count,
+                           const char* self, uint8_t placement, unsigned vnodes);
+
 // Client operations
+#define KV_PROTO_V1 1                   // Fixed kv_message_t requests
+#define KV_PROTO_V2 2                   // Length-prefixed frames (protocol.h)
+
+// Transports, fastest last
+#define KV_TRANSPORT_TCP  0x01
+#define KV_TRANSPORT_UNIX 0x02          // The server's Unix socket
+#define KV_TRANSPORT_SHM  0x04          // Shared-memory rings set up over it (v2)
+
+struct kv_client_shm;
+struct near_cache;
+
 typedef struct {
     int socket;
     bool is_connected;
+    uint8_t protocol;                   // Version to offer; once connected, the one in use
+    uint32_t next_id;                   // Of the next v2 request
+    uint8_t transports;                 // KV_TRANSPORT_* allowed, all by default
+    uint8_t transport;                  // The one in use once connected
+    struct kv_client_shm* shm;          // With KV_TRANSPORT_SHM
+    struct near_cache* cache;           // kv_client_cache_enable, or NULL
+    const char* reading;                // Key of the GET awaiting its reply
+    bool reading_stale;                 // Invalidated meanwhile: not to be cached
 } kv_client_t;
 
 kv_client_t* kv_client_create(void);
 void kv_client_destroy(kv_client_t* client);
+// Picks the fastest transport allowed: for a host that is this machine,
+// shared memory or the Unix socket at KV_UNIX_PATH_FORMAT if the server
+// offers them, else TCP
 bool kv_client_connect(kv_client_t* client, const char* host, int port);
+bool kv_client_connect_unix(kv_client_t* client, const char* path);
+// Whether host, an IPv4 address, is this machine
+bool kv_client_local_host(const char* host);
 void kv_client_disconnect(kv_client_t* client);
 kv_error_t kv_client_put(kv_client_t* client, const char* key, const char* value);
 kv_error_t kv_client_get(kv_client_t* client, const char* key, char* value);
 kv_error_t kv_client_delete(kv_client_t* client, const char* key);
+kv_error_t kv_client_put_ttl(kv_client_t* client, const char* key, const char* value,
+                             uint64_t ttl_ms);
+kv_error_t kv_client_expire(kv_client_t* client, const char* key, uint64_t ttl_ms);
+kv_error_t kv_client_ttl(kv_client_t* client, const char* key, int64_t* ttl_ms);
+
+// Multi-key commands, one round trip for up to KV_BATCH_MAX_KEYS keys
+// (protocol v2; over v1 they run key by key). statuses gets each key's
+// result; the return value is the first failure, or KV_ERROR_NETWORK.
+// MGET fills values[i], a MAX_VALUE_SIZE buffer, for each key found.
+#define KV_BATCH_MAX_KEYS 1024
+kv_error_t kv_client_mget(kv_client_t* client, const char* const* keys, size_t count,
+                          char** values, kv_error_t* statuses);
+// atomic needs protocol v2
+kv_error_t kv_client_mset(kv_client_t* client, const char* const* keys,
+                          const char* const* values, size_t count, bool atomic,
+                          kv_error_t* statuses);
+kv_error_t kv_client_mdelete(kv_client_t* client, const char* const* keys, size_t count,
+                             kv_error_t* statuses);
+
+// Client-side scan state; fill with kv_scan_range or kv_scan_prefix, then
+// call kv_client_scan until done is set. Keys and prefixes longer than
+// MAX_KEY_SIZE are KV_ERROR_INVALID_KEY, leaving the scan done.
+typedef struct {
+    uint8_t flags;
+    char start[MAX_KEY_SIZE];           // Next start key, or last key with KV_SCAN_AFTER
+    char bound[MAX_KEY_SIZE];           // NUL-padded like message fields
+    bool done;
+} kv_scan_t;
+
+// Keys in [start, end); NULL for either leaves that side open
+kv_error_t kv_scan_range(kv_scan_t* scan, const char* start, const char* end);
+kv_error_t kv_scan_prefix(kv_scan_t* scan, const char* prefix);
+// Fetch the next page of at most max_items into items
+kv_error_t kv_client_scan(kv_client_t* client, kv_scan_t* scan,
+                          kv_scan_item_t* items, size_t max_items, size_t* count);
+
+// Pipelining (protocol v2): queue requests, then collect their replies,
+// which come back in order and are matched to them by request id. Queued
+// requests go out in one send, at kv_pipeline_send or the first
+// kv_pipeline_recv after them. The server stops reading a connection with
+// 1 MB of unread replies, so send no more than that much ahead.
+#define KV_PIPELINE_MAX_DEPTH 1024      // Requests awaiting replies at once
+
+typedef struct {
+    uint32_t id;                        // Of the request answered
+    kv_error_t status;
+    const char* value;                  // GET: NUL-terminated, valid until the next recv
+    size_t value_len;
+} kv_reply_t;
+
+typedef struct kv_pipeline kv_pipeline_t;
+
+// NULL unless the client is connected with protocol v2
+kv_pipeline_t* kv_pipeline_create(kv_client_t* client);
+void kv_pipeline_destroy(kv_pipeline_t* pipeline);
+// Queue a request; returns its id, or 0 if KV_PIPELINE_MAX_DEPTH are pending
+uint32_t kv_pipeline_put(kv_pipeline_t* pipeline, const char* key, const char* value);
+uint32_t kv_pipeline_get(kv_pipeline_t* pipeline, const char* key);
+uint32_t kv_pipeline_delete(kv_pipeline_t* pipeline, const char* key);
+// Multi-key requests as kv_client_mget and the rest; their reply's value is
+// the reply body as is (protocol.h)
+uint32_t kv_pipeline_mget(kv_pipeline_t* pipeline, const char* const* keys, size_t count);
+uint32_t kv_pipeline_mset(kv_pipeline_t* pipeline, const char* const* keys,
+                          const char* const* values, size_t count, bool atomic);
+uint32_t kv_pipeline_mdelete(kv_pipeline_t* pipeline, const char* const* keys, size_t count);
+bool kv_pipeline_send(kv_pipeline_t* pipeline);
+// Wait for the reply to the oldest pending request. Returns its status,
+// or KV_ERROR_NETWORK if the connection failed.
+kv_error_t kv_pipeline_recv(kv_pipeline_t* pipeline, kv_reply_t* reply);
+// Requests queued or sent and not yet answered
+size_t kv_pipeline_pending(const kv_pipeline_t* pipeline);
+
+// Near cache: kv_client_get answers from values the client read before,
+// kept until the server reports them changed. The server pushes an
+// invalidation for every key the connection has read when it is written
+// (tracking), or with prefixes, for every write under them (broadcast).
+// Entries also lapse ttl_ms after they were read, in case an invalidation
+// is lost, and the least recently used go once max_bytes is reached. Only
+// GET is cached; writes through the client drop its own entry at once.
+// The cache ends with the connection. v2 over the epoll loops only.
+#define KV_CACHE_MAX_PREFIXES 64
+
+typedef struct {
+    size_t max_bytes;                   // Keys and values held (default 16 MB)
+    unsigned ttl_ms;                    // Longest an entry is trusted (default 60000), 0: no limit
+    const char* const* prefixes;        // Broadcast mode; "" covers every key
+    size_t prefix_count;                // 0: track the keys read
+} kv_cache_options_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;             // Pushed by the server
+    uint64_t evictions;                 // For room
+    uint64_t expirations;               // Past ttl_ms
+    size_t entries;
+    size_t bytes;
+} kv_cache_stats_t;
+
+void kv_cache_options_init(kv_cache_options_t* options);
+// Ask the server to track the connection and start caching. False if it
+// cannot (v1, io_uring or threaded mode, tracking off).
+bool kv_client_cache_enable(kv_client_t* client, const kv_cache_options_t* options);
+void kv_client_cache_disable(kv_client_t* client);
+void kv_client_cache_stats(const kv_client_t* client, kv_cache_stats_t* stats);
+// Hits over lookups, 0 before the first
+double kv_client_cache_hit_ratio(const kv_client_t* client);
+
+// Asynchronous client (client_async.c): a pool of pipelined v2
+// connections to one server, run by an event loop thread of its own. Any
+// thread may start requests, which go out over the least busy connection
+// in one send per pass of the loop. Each completes exactly once, on the
+// loop thread: with its reply, with KV_ERROR_TIMEOUT once its deadline
+// passes, or with KV_ERROR_NETWORK if its connection fails after sending
+// it (it may or may not have run). Requests not sent yet wait for another
+// connection. Failed connections are reopened in the background, backing
+// off from reconnect_ms to KV_ASYNC_MAX_BACKOFF_MS.
+#define KV_ASYNC_MAX_BACKOFF_MS 5000
+
+typedef struct {
+    unsigned connections;               // Kept open (default 4)
+    unsigned timeout_ms;                // Deadline of requests that set none (default 5000)
+    unsigned reconnect_ms;              // First wait before reopening (default 100)
+    uint8_t transports;                 // KV_TRANSPORT_TCP and/or KV_TRANSPORT_UNIX
+} kv_async_options_t;
+
+typedef struct kv_async kv_async_t;
+
+// Called once per request, on the loop thread, so it must not block. The
+// reply's value is valid for the call only.
+typedef void (*kv_async_fn)(void* ctx, const kv_reply_t* reply);
+
+void kv_async_options_init(kv_async_options_t* options);
+// Starts connecting straight away; NULL if the address is invalid or the
+// loop cannot start
+kv_async_t* kv_async_create(const char* host, int port, const kv_async_options_t* options);
+// Stop the loop, completing pending requests with KV_ERROR_NETWORK. Not
+// from a callback.
+void kv_async_destroy(kv_async_t* pool);
+// Start a request due within timeout_ms (0: the pool's). Returns false,
+// and fn is never called, if it cannot be queued.
+bool kv_async_put(kv_async_t* pool, const char* key, const char* value,
+                  unsigned timeout_ms, kv_async_fn fn, void* ctx);
+bool kv_async_get(kv_async_t* pool, const char* key, unsigned timeout_ms,
+                  kv_async_fn fn, void* ctx);
+bool kv_async_delete(kv_async_t* pool, const char* key, unsigned timeout_ms,
+                     kv_async_fn fn, void* ctx);
+// Connections open and speaking v2
+unsigned kv_async_connected(kv_async_t* pool);
+
+// A reply to wait for: pass kv_future_complete as the callback and the
+// future as its ctx
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    kv_error_t status;
+    char* value;                        // GET: a NUL-terminated copy, or NULL
+    size_t value_len;
+} kv_future_t;
+
+void kv_future_init(kv_future_t* future);
+void kv_future_complete(void* future, const kv_reply_t* reply);
+// Block until complete; returns the status
+kv_error_t kv_future_wait(kv_future_t* future);
+void kv_future_destroy(kv_future_t* future);
+
+// Cluster client (client_cluster.c): keys spread over several servers,
+// each "host:port". A key's node is picked from its hash, or its {tag}'s,
+// on a ring of vnodes points per node (consistent hashing: adding a node
+// moves about 1/n of the keys), or by the fixed hash slot it falls in,
+// each node owning an equal run of KV_CLUSTER_SLOTS. Servers given the
+// same list (kv_server_set_cluster) answer keys they do not own
+// KV_ERROR_MOVED; the client then fetches the node list from that server
+// (MSG_CLUSTER) and retries, up to KV_CLUSTER_MAX_REDIRECTS times.
+// Multi-key commands are split by node and sent to all of them before any
+// reply is read, then merged back into request order. Connections are
+// opened on first use and after failures. Not thread-safe.
+#define KV_CLUSTER_MAX_NODES 256
+#define KV_CLUSTER_SLOTS 16384
+#define KV_CLUSTER_MAX_REDIRECTS 3
+#define KV_CLUSTER_VNODES 160           // Ring points per node by default
+
+typedef enum {
+    KV_PLACEMENT_RING,                  // Consistent hashing with virtual nodes
+    KV_PLACEMENT_SLOTS,                 // Fixed hash slots
+} kv_placement_t;
+
+typedef struct {
+    uint8_t placement;                  // kv_placement_t (default KV_PLACEMENT_RING)
+    unsigned vnodes;                    // Ring points per node (default KV_CLUSTER_VNODES)
+    uint8_t transports;                 // As kv_client_t (default all)
+} kv_cluster_options_t;
+
+typedef struct {
+    uint64_t moved;                     // KV_ERROR_MOVED replies
+    uint64_t refreshes;                 // Node lists fetched after them
+    uint64_t fanouts;                   // Multi-key commands that spanned nodes
+} kv_cluster_stats_t;
+
+typedef struct kv_cluster kv_cluster_t;
+
+void kv_cluster_options_init(kv_cluster_options_t* options);
+// NULL if the list is empty, too long or malformed. Connects lazily.
+kv_cluster_t* kv_cluster_create(const char* const* nodes, size_t count,
+                                const kv_cluster_options_t* options);
+void kv_cluster_destroy(kv_cluster_t* cluster);
+// The node list of the cluster the server is in, as the MSG_CLUSTER reply
+// (protocol.h), into *nodes, which the caller frees. Protocol v2.
+kv_error_t kv_client_cluster_nodes(kv_client_t* client, char** nodes, size_t* len);
+// Send a server started as a backup a MSG_REPLICATE frame with these flags,
+// offset and value, as its primary would (protocol.h), to test it. The
+// reply value, at most 16 bytes, goes to reply. Protocol v2.
+kv_error_t kv_client_replicate(kv_client_t* client, uint8_t flags, uint64_t offset,
+                               const void* value, size_t value_len, char* reply,
+                               size_t* reply_len);
+// The node key is placed on, as "host:port"
+const char* kv_cluster_node_of(const kv_cluster_t* cluster, const char* key);
+void kv_cluster_stats(const kv_cluster_t* cluster, kv_cluster_stats_t* stats);
+// As the kv_client_* calls
+kv_error_t kv_cluster_put(kv_cluster_t* cluster, const char* key, const char* value);
+kv_error_t kv_cluster_get(kv_cluster_t* cluster, const char* key, char* value);
+kv_error_t kv_cluster_delete(kv_cluster_t* cluster, const char* key);
+kv_error_t kv_cluster_put_ttl(kv_cluster_t* cluster, const char* key, const char* value,
+                              uint64_t ttl_ms);
+kv_error_t kv_cluster_mget(kv_cluster_t* cluster, const char* const* keys, size_t count,
+                           char** values, kv_error_t* statuses);
+// atomic needs every key on one node, else each fails KV_ERROR_INVALID_KEY
+kv_error_t kv_cluster_mset(kv_cluster_t* cluster, const char* const* keys,
+                           const char* const* values, size_t count, bool atomic,
+                           kv_error_t* statuses);
+kv_error_t kv_cluster_mdelete(kv_cluster_t* cluster, const char* const* keys, size_t count,
+                              kv_error_t* statuses);
 
 #endif // KV_STORE_H
\ No newline at end of file
@@ -0,0 +1,211 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 512              // Messages buffered per thread (power of two)
+#define LOG_LINE_MAX 256                // Longer messages are cut short
+#define LOG_DRAIN_INTERVAL_MS 10
+
+typedef struct {
+    uint64_t time_ms;
+    int level;
+    int len;
+    char text[LOG_LINE_MAX];
+} log_record_t;
+
+// Single producer (the owning thread), single consumer (the drainer)
+typedef struct log_ring {
+    uint64_t head;                      // Next slot to fill; owner only
+    uint64_t tail __attribute__((aligned(64)));  // Next slot to write out; drainer only
+    uint64_t dropped;                   // Messages that found the ring full
+    bool closed;                        // The owner exited
+    struct log_ring* next;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+int log_level = LOG_INFO;
+
+static const char* const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Rings are pushed at the head by their threads and only ever unlinked by
+// the drainer, under drain_lock
+static log_ring_t* rings;
+static __thread log_ring_t* thread_ring;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool drainer_started;
+
+// Drained lines are gathered here and written to stderr together
+static char drain_buf[64 * 1024];
+static size_t drain_len;
+
+static int format_record(const log_record_t* record, char* out, size_t size) {
+    time_t seconds = (time_t)(record->time_ms / 1000);
+    struct tm tm;
+    char stamp[16];
+    localtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    int level = record->level >= LOG_DEBUG && record->level <= LOG_ERROR ? record->level
+                                                                         : LOG_ERROR;
+    return snprintf(out, size, "%s.%03u %-5s %.*s\n", stamp,
+                    (unsigned)(record->time_ms % 1000), level_names[level],
+                    record->len, record->text);
+}
+
+static void drain_flush(void) {
+    if (drain_len > 0) fwrite(drain_buf, 1, drain_len, stderr);
+    drain_len = 0;
+}
+
+// Caller holds drain_lock
+static void write_record(const log_record_t* record) {
+    if (sizeof(drain_buf) - drain_len < LOG_LINE_MAX + 32) drain_flush();
+    int len = format_record(record, drain_buf + drain_len, sizeof(drain_buf) - drain_len);
+    if (len > 0) {
+        drain_len += (size_t)len < sizeof(drain_buf) - drain_len
+                         ? (size_t)len : sizeof(drain_buf) - drain_len - 1;
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Write out every ring and free those whose threads have exited. Caller
+// holds drain_lock.
+static void drain(void) {
+    log_ring_t* prev = NULL;
+    log_ring_t* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (ring) {
+        bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t tail = ring->tail; tail != head; tail++) {
+            write_record(&ring->records[tail & (LOG_RING_SLOTS - 1)]);
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            log_record_t note = { .level = LOG_WARN, .time_ms = now_ms() };
+            note.len = snprintf(note.text, sizeof(note.text), "log: %llu messages dropped",
+                                (unsigned long long)dropped);
+            write_record(&note);
+        }
+
+        // Threads only push at the head, so any other ring can be unlinked
+        log_ring_t* next = ring->next;
+        if (closed && prev) {
+            prev->next = next;
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+    drain_flush();
+}
+
+static void* drainer_thread(void* arg) {
+    (void)arg;
+    for (;;) {
+        struct timespec delay = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    return NULL;
+}
+
+// The ring outlives its thread until the drainer has written it out
+static void ring_release(void* ptr) {
+    log_ring_t* ring = ptr;
+    thread_ring = NULL;
+    __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+static void log_init(void) {
+    pthread_key_create(&ring_key, ring_release);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    drainer_started = pthread_create(&thread, &attr, drainer_thread, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    atexit(log_flush);
+}
+
+static log_ring_t* ring_attach(void) {
+    pthread_once(&log_once, log_init);
+    if (!drainer_started) return NULL;
+
+    log_ring_t* ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(int level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    log_ring_t* ring = thread_ring ? thread_ring : ring_attach();
+    if (!ring) {
+        // No drainer: write directly rather than lose the message
+        log_record_t record = { .level = level, .time_ms = now_ms() };
+        int len = vsnprintf(record.text, sizeof(record.text), format, args);
+        record.len = len < 0 ? 0 : len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+        char line[LOG_LINE_MAX + 32];
+        if (format_record(&record, line, sizeof(line)) > 0) fputs(line, stderr);
+        va_end(args);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    log_record_t* record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+    record->time_ms = now_ms();
+    record->level = level;
+    int len = vsnprintf(record->text, sizeof(record->text), format, args);
+    record->len = len < 0 ? 0 : len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_level_parse(const char* name) {
+    static const char* const names[] = { "debug", "info", "warn", "error", "off" };
+    for (int level = LOG_DEBUG; name && level <= LOG_OFF; level++) {
+        if (strcmp(name, names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
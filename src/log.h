@@ -0,0 +1,51 @@
+// Leveled logging through per-thread ring buffers
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+#define LOG_DEBUG 0
+#define LOG_INFO  1
+#define LOG_WARN  2
+#define LOG_ERROR 3
+#define LOG_OFF   4
+
+// Levels below this are compiled out (e.g. -DLOG_COMPILE_LEVEL=1 drops
+// debug logs); the rest are filtered at run time by log_level
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+extern int log_level;                   // Least severe level written, LOG_INFO by default
+
+// Whether messages at level are written; guards work done only to log
+#define log_enabled(level)                                                  \
+    ((level) >= LOG_COMPILE_LEVEL &&                                        \
+     (level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+// A filtered log costs one branch: its arguments are not even evaluated.
+// Messages take no trailing newline.
+#define log_at(level, ...)                                                  \
+    do {                                                                    \
+        if (log_enabled(level)) log_write((level), __VA_ARGS__);            \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+// Format the message into the calling thread's ring, never blocking; a
+// background thread writes the rings to stderr. A message that finds its
+// ring full is dropped and counted. Order is kept within a thread.
+void log_write(int level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void log_set_level(int level);
+// "debug", "info", "warn", "error" or "off"; -1 for anything else
+int log_level_parse(const char* name);
+// Write out everything logged so far. Also runs at exit.
+void log_flush(void);
+
+#endif // LOG_H
@@ -0,0 +1,1381 @@
+#include "kv_store.h"
+#include "block_cache.h"
+#include "bloom.h"
+#include "clock.h"
+#include "epoch.h"
+#include "log.h"
+#include "skiplist.h"
+#include "snapshot.h"
+#include "sstable.h"
+#include "wal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Log-structured merge engine. Writes go to the WAL and an in-memory
+// skiplist (the memtable). A full memtable becomes immutable and a flush
+// thread writes it out as a level 0 SSTable. Compaction threads merge
+// level 0 into level 1, and each level L >= 1 into L + 1 once it outgrows
+// its budget, so levels 1 and up hold non-overlapping tables and a lookup
+// reads at most one block per level, usually none thanks to the filters.
+//
+// Files live in <path>.lsm/: NNNNNN.sst tables, wal.NNNNNN logs and a
+// MANIFEST naming the live tables. The manifest is rewritten (tmp + rename)
+// on every flush and compaction; files it does not name are leftovers.
+//
+// A key with a TTL carries its expiry time in every copy. Reads skip
+// expired values, flushes and compactions write them as tombstones, and
+// compaction into the bottom level drops them, so expired keys are
+// reclaimed by the merges the tree does anyway rather than by a sweeper.
+
+#define LSM_LEVELS 7
+#define L0_COMPACTION_TRIGGER 4         // Level 0 tables that start a compaction
+#define L0_STOP_WRITES 12               // Writers wait for compaction beyond this
+#define LEVEL1_MAX_BYTES (10ull * 1024 * 1024)
+#define LEVEL_SIZE_MULTIPLIER 10
+#define TABLE_TARGET_SIZE (2 * 1024 * 1024)  // Compaction output files
+// Compaction checks for shutdown every this many records
+#define COMPACTION_CANCEL_INTERVAL 1024
+
+#define MANIFEST_MAGIC "KVLSM 1"
+
+// Memtable value: a put or a tombstone
+typedef struct {
+    uint32_t len;
+    uint8_t type;                       // sstable_record_type_t
+    uint64_t expires_at;                // 0 if the value does not expire
+    char data[];
+} lsm_value_t;
+
+typedef struct {
+    skiplist_t* list;
+    uint32_t refs;
+    size_t value_bytes;                 // lsm_value_t allocations
+    uint64_t wal_generation;            // Log file holding its writes, 0 if none
+} memtable_t;
+
+// Set of live tables. Immutable once published; readers hold a reference.
+typedef struct {
+    uint32_t refs;
+    sstable_t** tables[LSM_LEVELS];     // Level 0 newest first, others by key
+    size_t count[LSM_LEVELS];
+    uint64_t bytes[LSM_LEVELS];
+} version_t;
+
+typedef struct {
+    int level;                          // Merges level into level + 1
+    sstable_t** inputs;                 // Newest first, referenced
+    size_t num_inputs;
+    bool drop_tombstones;               // Nothing older lies below the output
+} compaction_t;
+
+typedef struct {
+    char* dir;
+    char* manifest_path;
+    char* wal_prefix;
+    kv_store_options_t options;
+    block_cache_t* cache;
+    wal_t* wal;                         // NULL when the WAL is disabled
+
+    pthread_mutex_t write_lock;         // Serializes writers
+    pthread_mutex_t manifest_lock;      // Serializes version changes
+    pthread_mutex_t lock;               // Everything below
+    pthread_cond_t work_cond;           // Flush or compaction work may be available
+    pthread_cond_t done_cond;           // A flush or compaction finished
+    memtable_t* mem;
+    memtable_t* imm;                    // Waiting to be flushed, or NULL
+    version_t* current;
+    uint64_t next_file;
+    uint64_t flushed_generation;        // WAL generations <= this are in tables
+    bool busy[LSM_LEVELS];              // Input or output of a running compaction
+    size_t cursor[LSM_LEVELS];          // Next table of the level to compact
+    bool stopping;
+    bool failed;                        // A flush failed; writes are refused
+
+    pthread_t flush_thread;
+    pthread_t* compaction_threads;
+    unsigned num_compaction_threads;
+
+    uint64_t flushes;
+    uint64_t compactions;
+    uint64_t compaction_bytes_read;
+    uint64_t compaction_bytes_written;
+    uint64_t write_stalls;
+    uint64_t block_reads;
+    uint64_t bloom_negatives;
+} lsm_t;
+
+static inline void stat_add(uint64_t* counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline bool expired(uint64_t expires_at, uint64_t now) {
+    return expires_at && expires_at <= now;
+}
+
+static char* path_join(const char* dir, const char* name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char* path = malloc(len);
+    if (path) snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static char* table_path(lsm_t* lsm, uint64_t number) {
+    char name[32];
+    snprintf(name, sizeof(name), "%06llu.sst", (unsigned long long)number);
+    return path_join(lsm->dir, name);
+}
+
+static uint64_t new_file_number(lsm_t* lsm) {
+    pthread_mutex_lock(&lsm->lock);
+    uint64_t number = lsm->next_file++;
+    pthread_mutex_unlock(&lsm->lock);
+    return number;
+}
+
+static memtable_t* memtable_create(void) {
+    memtable_t* mem = calloc(1, sizeof(memtable_t));
+    if (!mem) return NULL;
+    mem->list = skiplist_create();
+    if (!mem->list) {
+        free(mem);
+        return NULL;
+    }
+    mem->refs = 1;
+    return mem;
+}
+
+static void memtable_unref(memtable_t* mem) {
+    if (mem && __atomic_sub_fetch(&mem->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        skiplist_destroy(mem->list, free);
+        free(mem);
+    }
+}
+
+static size_t memtable_bytes(memtable_t* mem) {
+    return skiplist_bytes(mem->list) + __atomic_load_n(&mem->value_bytes, __ATOMIC_RELAXED);
+}
+
+// Insert a put or tombstone. Writers must be serialized.
+static bool memtable_add(memtable_t* mem, sstable_record_type_t type,
+                         const char* key, size_t key_len,
+                         const char* value, size_t value_len, uint64_t expires_at) {
+    lsm_value_t* v = malloc(sizeof(lsm_value_t) + value_len);
+    if (!v) return false;
+    v->len = (uint32_t)value_len;
+    v->type = (uint8_t)type;
+    v->expires_at = expires_at;
+    if (value_len > 0) memcpy(v->data, value, value_len);
+
+    void* old;
+    if (!skiplist_put(mem->list, key, key_len, v, &old)) {
+        free(v);
+        return false;
+    }
+
+    size_t bytes = mem->value_bytes + sizeof(lsm_value_t) + value_len;
+    if (old) {
+        bytes -= sizeof(lsm_value_t) + ((lsm_value_t*)old)->len;
+        epoch_retire(old, free);
+    }
+    __atomic_store_n(&mem->value_bytes, bytes, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Look key up in a memtable. Readers may race with writers replacing the
+// value, so the copy is made inside an epoch section.
+static sstable_lookup_t memtable_get(memtable_t* mem, const char* key, size_t key_len,
+                                     char* value, size_t value_size, size_t* value_len,
+                                     uint64_t* expires_at) {
+    sstable_lookup_t result = SSTABLE_NOT_FOUND;
+
+    epoch_enter();
+    skiplist_node_t* node = skiplist_find(mem->list, key, key_len);
+    if (node) {
+        const lsm_value_t* v = skiplist_value(node);
+        if (v->type == SSTABLE_TOMBSTONE) {
+            result = SSTABLE_DELETED;
+        } else {
+            *value_len = v->len;
+            *expires_at = v->expires_at;
+            if (v->len <= value_size) memcpy(value, v->data, v->len);
+            result = SSTABLE_FOUND;
+        }
+    }
+    epoch_exit();
+
+    return result;
+}
+
+static void table_unref(sstable_t* table) {
+    if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        sstable_close(table);
+    }
+}
+
+static void version_unref(version_t* v) {
+    if (!v || __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        for (size_t i = 0; i < v->count[l]; i++) table_unref(v->tables[l][i]);
+        free(v->tables[l]);
+    }
+    free(v);
+}
+
+static version_t* version_create(void) {
+    version_t* v = calloc(1, sizeof(version_t));
+    if (v) v->refs = 1;
+    return v;
+}
+
+static bool version_push(version_t* v, int level, sstable_t* table) {
+    sstable_t** tables = realloc(v->tables[level], (v->count[level] + 1) * sizeof(sstable_t*));
+    if (!tables) return false;
+    v->tables[level] = tables;
+    tables[v->count[level]++] = table;
+    v->bytes[level] += table->file_size;
+    __atomic_add_fetch(&table->refs, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static int compare_smallest(const void* a, const void* b) {
+    const sstable_t* x = *(sstable_t* const*)a;
+    const sstable_t* y = *(sstable_t* const*)b;
+    return kv_key_compare(x->smallest, x->smallest_len, y->smallest, y->smallest_len);
+}
+
+static bool contains(sstable_t* const* tables, size_t count, const sstable_t* table) {
+    for (size_t i = 0; i < count; i++) {
+        if (tables[i] == table) return true;
+    }
+    return false;
+}
+
+// Copy of base without the removed tables, with added placed at level
+static version_t* version_edit(const version_t* base,
+                               sstable_t* const* removed, size_t num_removed,
+                               int level, sstable_t* const* added, size_t num_added) {
+    version_t* v = version_create();
+    if (!v) return NULL;
+
+    bool ok = true;
+    for (int l = 0; l < LSM_LEVELS && ok; l++) {
+        // Level 0 is searched front to back, so new tables go first
+        if (l == level && l == 0) {
+            for (size_t i = 0; i < num_added && ok; i++) ok = version_push(v, l, added[i]);
+        }
+        for (size_t i = 0; i < base->count[l] && ok; i++) {
+            sstable_t* table = base->tables[l][i];
+            if (!contains(removed, num_removed, table)) ok = version_push(v, l, table);
+        }
+        if (l == level && l > 0) {
+            for (size_t i = 0; i < num_added && ok; i++) ok = version_push(v, l, added[i]);
+            qsort(v->tables[l], v->count[l], sizeof(sstable_t*), compare_smallest);
+        }
+    }
+    if (!ok) {
+        version_unref(v);
+        return NULL;
+    }
+    return v;
+}
+
+typedef struct {
+    const version_t* version;
+    uint64_t next_file;
+    uint64_t flushed_generation;
+} manifest_t;
+
+static bool write_manifest(void* ctx, FILE* fp) {
+    const manifest_t* m = ctx;
+    fprintf(fp, "%s\n", MANIFEST_MAGIC);
+    fprintf(fp, "next_file %llu\n", (unsigned long long)m->next_file);
+    fprintf(fp, "wal_generation %llu\n", (unsigned long long)m->flushed_generation);
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        for (size_t i = 0; i < m->version->count[l]; i++) {
+            fprintf(fp, "table %d %llu\n", l, (unsigned long long)m->version->tables[l][i]->number);
+        }
+    }
+    return !ferror(fp);
+}
+
+// Make an edit of the current version durable in the manifest, then
+// publish it. Removed tables are deleted once no reader holds them.
+// flushed_generation 0 leaves the flushed WAL generation unchanged.
+static bool install_version(lsm_t* lsm, sstable_t* const* removed, size_t num_removed,
+                            int level, sstable_t* const* added, size_t num_added,
+                            uint64_t flushed_generation) {
+    pthread_mutex_lock(&lsm->manifest_lock);
+
+    pthread_mutex_lock(&lsm->lock);
+    version_t* v = version_edit(lsm->current, removed, num_removed, level, added, num_added);
+    manifest_t m = {
+        .version = v,
+        .next_file = lsm->next_file,
+        .flushed_generation = flushed_generation > lsm->flushed_generation
+                                  ? flushed_generation : lsm->flushed_generation,
+    };
+    pthread_mutex_unlock(&lsm->lock);
+
+    bool ok = v && snapshot_write_file(lsm->manifest_path, write_manifest, &m);
+    if (ok) {
+        pthread_mutex_lock(&lsm->lock);
+        version_t* old = lsm->current;
+        lsm->current = v;
+        lsm->flushed_generation = m.flushed_generation;
+        for (size_t i = 0; i < num_removed; i++) {
+            // A trivial move keeps the file
+            if (!contains(added, num_added, removed[i])) removed[i]->obsolete = true;
+        }
+        pthread_mutex_unlock(&lsm->lock);
+        version_unref(old);
+    } else {
+        version_unref(v);
+    }
+
+    pthread_mutex_unlock(&lsm->manifest_lock);
+    return ok;
+}
+
+// Write a memtable out as a level 0 table and drop the log it came from
+static bool flush_memtable(lsm_t* lsm, memtable_t* mem) {
+    uint64_t number = new_file_number(lsm);
+    char* path = table_path(lsm, number);
+    sstable_builder_t* builder = path ? sstable_builder_create(path) : NULL;
+    bool ok = builder != NULL;
+
+    uint64_t now = clock_now_ms();
+    skiplist_node_t* node = skiplist_seek(mem->list, NULL, 0);
+    for (; ok && node; node = skiplist_next(node)) {
+        const lsm_value_t* v = skiplist_value(node);
+        if (expired(v->expires_at, now)) {
+            ok = sstable_builder_add(builder, skiplist_key(node), node->key_len,
+                                     NULL, 0, SSTABLE_TOMBSTONE, 0);
+        } else {
+            ok = sstable_builder_add(builder, skiplist_key(node), node->key_len,
+                                     v->data, v->len, (sstable_record_type_t)v->type,
+                                     v->expires_at);
+        }
+    }
+    if (builder) {
+        if (ok) ok = sstable_builder_finish(builder);
+        else sstable_builder_abort(builder);
+    }
+
+    sstable_t* table = ok ? sstable_open(path, number) : NULL;
+    free(path);
+    if (!table) return false;
+
+    table->refs = 1;
+    ok = install_version(lsm, NULL, 0, 0, &table, 1, mem->wal_generation);
+    if (!ok) table->obsolete = true;
+    table_unref(table);
+
+    if (ok) {
+        stat_add(&lsm->flushes, 1);
+        if (lsm->wal_prefix && mem->wal_generation) {
+            wal_remove(lsm->wal_prefix, mem->wal_generation);
+        }
+    }
+    return ok;
+}
+
+static void* flush_thread(void* arg) {
+    lsm_t* lsm = arg;
+
+    pthread_mutex_lock(&lsm->lock);
+    for (;;) {
+        while (!lsm->imm && !lsm->stopping) {
+            pthread_cond_wait(&lsm->work_cond, &lsm->lock);
+        }
+        // Finish a pending flush even when stopping
+        memtable_t* imm = lsm->imm;
+        if (!imm) break;
+        pthread_mutex_unlock(&lsm->lock);
+
+        bool ok = flush_memtable(lsm, imm);
+
+        pthread_mutex_lock(&lsm->lock);
+        if (ok) {
+            lsm->imm = NULL;
+        } else {
+            log_error("LSM flush failed; refusing further writes");
+            lsm->failed = true;
+        }
+        pthread_cond_broadcast(&lsm->done_cond);
+        pthread_cond_broadcast(&lsm->work_cond);
+        if (!ok) break;
+
+        pthread_mutex_unlock(&lsm->lock);
+        memtable_unref(imm);
+        pthread_mutex_lock(&lsm->lock);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+}
+
+static uint64_t level_max_bytes(int level) {
+    uint64_t bytes = LEVEL1_MAX_BYTES;
+    for (int l = 1; l < level; l++) bytes *= LEVEL_SIZE_MULTIPLIER;
+    return bytes;
+}
+
+static bool overlaps(const sstable_t* table, const char* lo, size_t lo_len,
+                     const char* hi, size_t hi_len) {
+    return kv_key_compare(table->largest, table->largest_len, lo, lo_len) >= 0 &&
+           kv_key_compare(table->smallest, table->smallest_len, hi, hi_len) <= 0;
+}
+
+// Choose the most urgent compaction whose levels are free. Called with
+// lock held; marks the levels busy and references the inputs.
+static bool pick_compaction(lsm_t* lsm, compaction_t* c) {
+    const version_t* v = lsm->current;
+    double best = 1.0;
+    int level = -1;
+
+    for (int l = 0; l < LSM_LEVELS - 1; l++) {
+        if (lsm->busy[l] || lsm->busy[l + 1]) continue;
+        double score = l == 0 ? (double)v->count[0] / L0_COMPACTION_TRIGGER
+                              : (double)v->bytes[l] / (double)level_max_bytes(l);
+        if (score >= best) {
+            best = score;
+            level = l;
+        }
+    }
+    if (level < 0) return false;
+
+    // All of level 0, since its tables overlap; one table of any other level
+    size_t first = 0, num_first = v->count[level];
+    if (level > 0) {
+        first = lsm->cursor[level]++ % v->count[level];
+        num_first = 1;
+    }
+
+    c->inputs = malloc((num_first + v->count[level + 1]) * sizeof(sstable_t*));
+    if (!c->inputs) return false;
+    c->level = level;
+    c->num_inputs = 0;
+
+    const char *lo = NULL, *hi = NULL;
+    size_t lo_len = 0, hi_len = 0;
+    for (size_t i = first; i < first + num_first; i++) {
+        sstable_t* table = v->tables[level][i];
+        c->inputs[c->num_inputs++] = table;
+        if (!lo || kv_key_compare(table->smallest, table->smallest_len, lo, lo_len) < 0) {
+            lo = table->smallest;
+            lo_len = table->smallest_len;
+        }
+        if (!hi || kv_key_compare(table->largest, table->largest_len, hi, hi_len) > 0) {
+            hi = table->largest;
+            hi_len = table->largest_len;
+        }
+    }
+    for (size_t i = 0; i < v->count[level + 1]; i++) {
+        sstable_t* table = v->tables[level + 1][i];
+        if (overlaps(table, lo, lo_len, hi, hi_len)) c->inputs[c->num_inputs++] = table;
+    }
+
+    // Deeper levels only change through level + 1, which is now busy
+    c->drop_tombstones = true;
+    for (int l = level + 2; l < LSM_LEVELS; l++) {
+        if (v->count[l] > 0) c->drop_tombstones = false;
+    }
+
+    for (size_t i = 0; i < c->num_inputs; i++) {
+        __atomic_add_fetch(&c->inputs[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    lsm->busy[level] = lsm->busy[level + 1] = true;
+    return true;
+}
+
+typedef struct {
+    sstable_t** tables;
+    size_t count;
+} table_list_t;
+
+// Finish the output file being built and open it
+static bool finish_output(lsm_t* lsm, sstable_builder_t* builder, uint64_t number,
+                          table_list_t* outputs) {
+    bool ok = sstable_builder_finish(builder);
+    char* path = table_path(lsm, number);
+    sstable_t* table = ok && path ? sstable_open(path, number) : NULL;
+    free(path);
+
+    sstable_t** tables = table ? realloc(outputs->tables, (outputs->count + 1) * sizeof(sstable_t*))
+                               : NULL;
+    if (!tables) {
+        if (table) {
+            table->obsolete = true;
+            sstable_close(table);
+        }
+        return false;
+    }
+    table->refs = 1;
+    outputs->tables = tables;
+    outputs->tables[outputs->count++] = table;
+    stat_add(&lsm->compaction_bytes_written, table->file_size);
+    return true;
+}
+
+// Merge the inputs into new tables of level + 1. Where several inputs hold
+// a key, the first (newest) one wins.
+static bool run_compaction(lsm_t* lsm, compaction_t* c) {
+    // A table with nothing to merge with just moves down
+    if (c->level > 0 && c->num_inputs == 1) {
+        return install_version(lsm, c->inputs, 1, c->level + 1, c->inputs, 1, 0);
+    }
+
+    sstable_iter_t* its = calloc(c->num_inputs, sizeof(sstable_iter_t));
+    char* key = malloc(MAX_KEY_LENGTH);
+    table_list_t outputs = { 0 };
+    sstable_builder_t* builder = NULL;
+    uint64_t number = 0, records = 0;
+    uint64_t now = clock_now_ms();
+    bool ok = its && key;
+
+    for (size_t i = 0; ok && i < c->num_inputs; i++) {
+        sstable_iter_init(&its[i], c->inputs[i], NULL, &lsm->block_reads);
+        sstable_iter_seek(&its[i], NULL, 0);
+        stat_add(&lsm->compaction_bytes_read, c->inputs[i]->file_size);
+    }
+
+    while (ok) {
+        size_t best = c->num_inputs;
+        for (size_t i = 0; i < c->num_inputs; i++) {
+            sstable_iter_t* it = &its[i];
+            if (it->error) ok = false;
+            if (!it->valid) continue;
+            if (best == c->num_inputs ||
+                kv_key_compare(it->key, it->key_len, its[best].key, its[best].key_len) < 0) {
+                best = i;
+            }
+        }
+        if (!ok || best == c->num_inputs) break;
+
+        if (++records % COMPACTION_CANCEL_INTERVAL == 0 &&
+            __atomic_load_n(&lsm->stopping, __ATOMIC_RELAXED)) {
+            ok = false;
+            break;
+        }
+
+        // An expired value still has to hide older versions below it
+        sstable_iter_t* it = &its[best];
+        bool dead = it->type == SSTABLE_TOMBSTONE || expired(it->expires_at, now);
+        if (!(c->drop_tombstones && dead)) {
+            if (!builder) {
+                number = new_file_number(lsm);
+                char* path = table_path(lsm, number);
+                builder = path ? sstable_builder_create(path) : NULL;
+                free(path);
+                if (!builder) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (dead) {
+                ok = sstable_builder_add(builder, it->key, it->key_len,
+                                         NULL, 0, SSTABLE_TOMBSTONE, 0);
+            } else {
+                ok = sstable_builder_add(builder, it->key, it->key_len,
+                                         it->value, it->value_len, it->type, it->expires_at);
+            }
+            if (ok && sstable_builder_size(builder) >= TABLE_TARGET_SIZE) {
+                ok = finish_output(lsm, builder, number, &outputs);
+                builder = NULL;
+            }
+        }
+
+        // Step past this key in every input that has it
+        uint32_t key_len = it->key_len;
+        memcpy(key, it->key, key_len);
+        for (size_t i = best; i < c->num_inputs; i++) {
+            if (its[i].valid && kv_key_compare(its[i].key, its[i].key_len, key, key_len) == 0) {
+                sstable_iter_next(&its[i]);
+            }
+        }
+    }
+
+    if (builder) {
+        if (ok) ok = finish_output(lsm, builder, number, &outputs);
+        else sstable_builder_abort(builder);
+    }
+    for (size_t i = 0; its && i < c->num_inputs; i++) sstable_iter_close(&its[i]);
+    free(its);
+    free(key);
+
+    if (ok) {
+        ok = install_version(lsm, c->inputs, c->num_inputs, c->level + 1,
+                             outputs.tables, outputs.count, 0);
+    }
+    for (size_t i = 0; i < outputs.count; i++) {
+        if (!ok) outputs.tables[i]->obsolete = true;
+        table_unref(outputs.tables[i]);
+    }
+    free(outputs.tables);
+    return ok;
+}
+
+static void* compaction_thread(void* arg) {
+    lsm_t* lsm = arg;
+
+    pthread_mutex_lock(&lsm->lock);
+    while (!lsm->stopping) {
+        compaction_t c;
+        if (!pick_compaction(lsm, &c)) {
+            pthread_cond_wait(&lsm->work_cond, &lsm->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lsm->lock);
+
+        bool ok = run_compaction(lsm, &c);
+        for (size_t i = 0; i < c.num_inputs; i++) table_unref(c.inputs[i]);
+        free(c.inputs);
+
+        pthread_mutex_lock(&lsm->lock);
+        lsm->busy[c.level] = lsm->busy[c.level + 1] = false;
+        if (ok) {
+            lsm->compactions++;
+        } else if (!lsm->stopping) {
+            // Inputs are intact; back off until the next flush
+            log_error("LSM compaction of level %d failed", c.level);
+            pthread_cond_wait(&lsm->work_cond, &lsm->lock);
+        }
+        pthread_cond_broadcast(&lsm->done_cond);
+        pthread_cond_broadcast(&lsm->work_cond);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+}
+
+// Retire a full memtable (any non-empty one with force) to the flush
+// thread and start a new WAL generation for its successor. Writers wait
+// while the previous memtable is still being flushed or level 0 is backed
+// up. Called with write_lock held.
+static bool make_room(lsm_t* lsm, bool force) {
+    if (!force && memtable_bytes(lsm->mem) < lsm->options.memtable_size) return true;
+
+    bool stalled = false;
+    pthread_mutex_lock(&lsm->lock);
+    while (!lsm->failed && (lsm->imm || lsm->current->count[0] >= L0_STOP_WRITES)) {
+        stalled = true;
+        pthread_cond_wait(&lsm->done_cond, &lsm->lock);
+    }
+    bool ok = !lsm->failed;
+    pthread_mutex_unlock(&lsm->lock);
+    if (stalled) stat_add(&lsm->write_stalls, 1);
+    if (!ok) return false;
+    if (skiplist_count(lsm->mem->list) == 0) return true;
+
+    // Only writers replace mem, so it cannot change under write_lock
+    uint64_t generation = 0;
+    if (lsm->wal && !(generation = wal_rotate(lsm->wal))) return false;
+    memtable_t* mem = memtable_create();
+    if (!mem) return false;
+
+    pthread_mutex_lock(&lsm->lock);
+    lsm->mem->wal_generation = generation;
+    lsm->imm = lsm->mem;
+    lsm->mem = mem;
+    pthread_cond_broadcast(&lsm->work_cond);
+    pthread_mutex_unlock(&lsm->lock);
+    return true;
+}
+
+// Log a write and add it to the memtable. Called with write_lock held, so
+// the log order matches the memtable; *lsn is the record to wait for.
+static kv_error_t write_locked(lsm_t* lsm, sstable_record_type_t type,
+                               const char* key, size_t key_len,
+                               const char* value, size_t value_len,
+                               uint64_t expires_at, uint64_t* lsn) {
+    *lsn = 0;
+    if (!make_room(lsm, false)) return KV_ERROR_IO;
+
+    if (lsm->wal &&
+        !(*lsn = wal_append(lsm->wal, type == SSTABLE_VALUE ? WAL_PUT : WAL_DELETE,
+                            key, key_len, value, value_len, expires_at))) {
+        return KV_ERROR_IO;
+    }
+    if (!memtable_add(lsm->mem, type, key, key_len, value, value_len, expires_at)) {
+        return KV_ERROR_NO_SPACE;
+    }
+    return KV_SUCCESS;
+}
+
+static kv_error_t lsm_write(lsm_t* lsm, sstable_record_type_t type,
+                            const char* key, size_t key_len,
+                            const char* value, size_t value_len, uint64_t expires_at) {
+    uint64_t lsn;
+    pthread_mutex_lock(&lsm->write_lock);
+    kv_error_t result = write_locked(lsm, type, key, key_len, value, value_len,
+                                     expires_at, &lsn);
+    pthread_mutex_unlock(&lsm->write_lock);
+
+    if (result != KV_SUCCESS) return result;
+    if (lsn && !wal_wait(lsm->wal, lsn)) return KV_ERROR_IO;
+    return KV_SUCCESS;
+}
+
+// Replay callback: re-apply a logged write (the WAL is not open yet). This
+// engine logs expiry changes as whole puts, so there are no WAL_EXPIRE records.
+static void apply_wal_record(void* ctx, wal_record_type_t type,
+                             const char* key, size_t key_len,
+                             const char* value, size_t value_len, uint64_t expires_at) {
+    lsm_t* lsm = ctx;
+    if (type == WAL_EXPIRE) return;
+    memtable_add(lsm->mem, type == WAL_PUT ? SSTABLE_VALUE : SSTABLE_TOMBSTONE,
+                 key, key_len, value, value_len, expires_at);
+}
+
+// Rebuild the current version from the manifest. No manifest is an empty store.
+static bool load_manifest(lsm_t* lsm) {
+    lsm->current = version_create();
+    if (!lsm->current) return false;
+
+    FILE* fp = fopen(lsm->manifest_path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return true;
+        log_error("Failed to open LSM manifest %s: %s", lsm->manifest_path, strerror(errno));
+        return false;
+    }
+
+    char line[128];
+    bool ok = fgets(line, sizeof(line), fp) &&
+              strncmp(line, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) == 0;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        unsigned long long n;
+        int level;
+        if (sscanf(line, "next_file %llu", &n) == 1) {
+            lsm->next_file = n;
+        } else if (sscanf(line, "wal_generation %llu", &n) == 1) {
+            lsm->flushed_generation = n;
+        } else if (sscanf(line, "table %d %llu", &level, &n) == 2 &&
+                   level >= 0 && level < LSM_LEVELS) {
+            char* path = table_path(lsm, n);
+            sstable_t* table = path ? sstable_open(path, n) : NULL;
+            free(path);
+            ok = table && version_push(lsm->current, level, table);
+            if (table && !ok) sstable_close(table);
+        } else {
+            ok = false;
+        }
+    }
+    fclose(fp);
+
+    if (!ok) log_error("Invalid LSM manifest %s", lsm->manifest_path);
+    return ok;
+}
+
+// Delete tables the manifest does not name: outputs of a flush or
+// compaction that was cut short
+static void remove_orphans(lsm_t* lsm) {
+    DIR* dir = opendir(lsm->dir);
+    struct dirent* de;
+    while (dir && (de = readdir(dir))) {
+        char* end;
+        unsigned long long number = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".sst") != 0) continue;
+
+        bool live = false;
+        for (int l = 0; l < LSM_LEVELS && !live; l++) {
+            for (size_t i = 0; i < lsm->current->count[l] && !live; i++) {
+                live = lsm->current->tables[l][i]->number == number;
+            }
+        }
+        if (live) continue;
+
+        char* path = path_join(lsm->dir, de->d_name);
+        if (path && unlink(path) != 0) log_warn("Failed to remove %s: %s", path, strerror(errno));
+        free(path);
+    }
+    if (dir) closedir(dir);
+}
+
+static void lsm_free(lsm_t* lsm) {
+    memtable_unref(lsm->mem);
+    memtable_unref(lsm->imm);
+    version_unref(lsm->current);
+    block_cache_destroy(lsm->cache);
+    pthread_mutex_destroy(&lsm->write_lock);
+    pthread_mutex_destroy(&lsm->manifest_lock);
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->work_cond);
+    pthread_cond_destroy(&lsm->done_cond);
+    free(lsm->compaction_threads);
+    free(lsm->dir);
+    free(lsm->manifest_path);
+    free(lsm->wal_prefix);
+    free(lsm);
+}
+
+static void* lsm_open(const char* path, const kv_store_options_t* options) {
+    if (!path) {
+        log_error("The LSM engine needs a data path");
+        return NULL;
+    }
+    if (options->max_memory) {
+        // Its data lives on disk; the block cache is what memory bounds
+        log_warn("max memory applies to the hash engine only");
+    }
+
+    lsm_t* lsm = calloc(1, sizeof(lsm_t));
+    if (!lsm) return NULL;
+
+    lsm->options = *options;
+    lsm->next_file = 1;
+    pthread_mutex_init(&lsm->write_lock, NULL);
+    pthread_mutex_init(&lsm->manifest_lock, NULL);
+    pthread_mutex_init(&lsm->lock, NULL);
+    pthread_cond_init(&lsm->work_cond, NULL);
+    pthread_cond_init(&lsm->done_cond, NULL);
+
+    size_t len = strlen(path) + sizeof(".lsm");
+    lsm->dir = malloc(len);
+    if (lsm->dir) snprintf(lsm->dir, len, "%s.lsm", path);
+    if (!lsm->dir || (mkdir(lsm->dir, 0755) != 0 && errno != EEXIST)) {
+        log_error("Failed to create LSM directory %s: %s", lsm->dir ? lsm->dir : path,
+                  strerror(errno));
+        lsm_free(lsm);
+        return NULL;
+    }
+
+    lsm->manifest_path = path_join(lsm->dir, "MANIFEST");
+    lsm->wal_prefix = path_join(lsm->dir, "wal");
+    lsm->cache = block_cache_create(options->block_cache_size);
+    lsm->mem = memtable_create();
+    if (!lsm->manifest_path || !lsm->wal_prefix || !lsm->cache || !lsm->mem ||
+        !load_manifest(lsm)) {
+        lsm_free(lsm);
+        return NULL;
+    }
+    remove_orphans(lsm);
+
+    // Writes logged since the last flush go back into the memtable
+    if (options->wal_enabled) {
+        uint64_t flushed = lsm->flushed_generation;
+        if (flushed > 0) wal_remove(lsm->wal_prefix, flushed);
+
+        uint64_t generation;
+        long replayed = wal_replay(lsm->wal_prefix, flushed + 1,
+                                   apply_wal_record, lsm, &generation);
+        if (replayed > 0) {
+            log_info("Replayed %ld WAL records from %s.*", replayed, lsm->wal_prefix);
+        }
+        if (generation < flushed) generation = flushed;
+        lsm->wal = wal_open(lsm->wal_prefix, generation + 1,
+                            options->fsync_policy, options->fsync_interval_ms);
+        if (!lsm->wal) {
+            log_warn("running without a write-ahead log");
+        }
+    }
+
+    // Compaction is what keeps level 0 from stalling writers, so run at least one
+    lsm->num_compaction_threads = options->compaction_threads ? options->compaction_threads : 1;
+    lsm->compaction_threads = calloc(lsm->num_compaction_threads, sizeof(pthread_t));
+    int err = lsm->compaction_threads ? pthread_create(&lsm->flush_thread, NULL, flush_thread, lsm)
+                                      : ENOMEM;
+    if (err != 0) {
+        log_error("Failed to start LSM flush thread: %s", strerror(err));
+        wal_close(lsm->wal);
+        lsm_free(lsm);
+        return NULL;
+    }
+    for (unsigned i = 0; i < lsm->num_compaction_threads; i++) {
+        err = pthread_create(&lsm->compaction_threads[i], NULL, compaction_thread, lsm);
+        if (err != 0) {
+            log_error("Failed to start LSM compaction thread: %s", strerror(err));
+            lsm->num_compaction_threads = i;
+            break;
+        }
+    }
+
+    return lsm;
+}
+
+static bool lsm_save(void* engine, bool wait) {
+    lsm_t* lsm = engine;
+
+    pthread_mutex_lock(&lsm->write_lock);
+    bool ok = make_room(lsm, true);
+    pthread_mutex_unlock(&lsm->write_lock);
+
+    if (ok && wait) {
+        pthread_mutex_lock(&lsm->lock);
+        while (lsm->imm && !lsm->failed) {
+            pthread_cond_wait(&lsm->done_cond, &lsm->lock);
+        }
+        ok = !lsm->failed;
+        pthread_mutex_unlock(&lsm->lock);
+    }
+    return ok;
+}
+
+static void lsm_close(void* engine) {
+    lsm_t* lsm = engine;
+
+    // Flush the memtable so the log is redundant, then stop the workers;
+    // a compaction in progress is abandoned and its inputs kept
+    bool flushed = lsm_save(lsm, true);
+
+    pthread_mutex_lock(&lsm->lock);
+    lsm->stopping = true;
+    pthread_cond_broadcast(&lsm->work_cond);
+    pthread_mutex_unlock(&lsm->lock);
+
+    pthread_join(lsm->flush_thread, NULL);
+    for (unsigned i = 0; i < lsm->num_compaction_threads; i++) {
+        pthread_join(lsm->compaction_threads[i], NULL);
+    }
+
+    wal_close(lsm->wal);
+    if (flushed && lsm->wal) wal_remove(lsm->wal_prefix, UINT64_MAX);
+
+    // Free memtable values retired by this and exited threads
+    epoch_synchronize();
+    lsm_free(lsm);
+}
+
+static kv_error_t lsm_put(void* engine, const char* key, size_t key_len,
+                          const char* value, size_t value_len, uint64_t expires_at) {
+    return lsm_write(engine, SSTABLE_VALUE, key, key_len, value, value_len, expires_at);
+}
+
+// One write_lock and one log wait for the whole batch. Holding the lock
+// throughout keeps other writers out, atomic or not.
+static void lsm_mput(void* engine, const kv_batch_item_t* items, size_t count,
+                     bool atomic, kv_error_t* results) {
+    (void)atomic;
+    lsm_t* lsm = engine;
+    uint64_t last_lsn = 0;
+
+    pthread_mutex_lock(&lsm->write_lock);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t lsn;
+        results[i] = write_locked(lsm, SSTABLE_VALUE, items[i].key, items[i].key_len,
+                                  items[i].value, items[i].value_len, 0, &lsn);
+        if (lsn) last_lsn = lsn;
+    }
+    pthread_mutex_unlock(&lsm->write_lock);
+
+    if (last_lsn && !wal_wait(lsm->wal, last_lsn)) {
+        for (size_t i = 0; i < count; i++) {
+            if (results[i] == KV_SUCCESS) results[i] = KV_ERROR_IO;
+        }
+    }
+}
+
+// Reference the memtables and tables a read has to look at
+static void acquire_view(lsm_t* lsm, memtable_t** mem, memtable_t** imm, version_t** version) {
+    pthread_mutex_lock(&lsm->lock);
+    *mem = lsm->mem;
+    *imm = lsm->imm;
+    *version = lsm->current;
+    __atomic_add_fetch(&(*mem)->refs, 1, __ATOMIC_RELAXED);
+    if (*imm) __atomic_add_fetch(&(*imm)->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(*version)->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lsm->lock);
+}
+
+static void release_view(memtable_t* mem, memtable_t* imm, version_t* version) {
+    memtable_unref(mem);
+    memtable_unref(imm);
+    version_unref(version);
+}
+
+static sstable_lookup_t table_get(lsm_t* lsm, sstable_t* table,
+                                  const char* key, size_t key_len, uint64_t bloom_h,
+                                  char* value, size_t value_size, size_t* value_len,
+                                  uint64_t* expires_at) {
+    if (kv_key_compare(key, key_len, table->smallest, table->smallest_len) < 0 ||
+        kv_key_compare(key, key_len, table->largest, table->largest_len) > 0) {
+        return SSTABLE_NOT_FOUND;
+    }
+    sstable_lookup_t result = sstable_get(table, lsm->cache, &lsm->block_reads, key, key_len,
+                                          bloom_h, value, value_size, value_len, expires_at);
+    if (result == SSTABLE_FILTERED) {
+        stat_add(&lsm->bloom_negatives, 1);
+        result = SSTABLE_NOT_FOUND;
+    }
+    return result;
+}
+
+// Search the tables newest to oldest: all of level 0, then in each deeper
+// level the one table whose range can hold the key
+static sstable_lookup_t version_get(lsm_t* lsm, const version_t* v,
+                                    const char* key, size_t key_len,
+                                    char* value, size_t value_size, size_t* value_len,
+                                    uint64_t* expires_at) {
+    uint64_t h = bloom_hash(key, key_len);
+
+    for (size_t i = 0; i < v->count[0]; i++) {
+        sstable_lookup_t result = table_get(lsm, v->tables[0][i], key, key_len, h,
+                                            value, value_size, value_len, expires_at);
+        if (result != SSTABLE_NOT_FOUND) return result;
+    }
+
+    for (int l = 1; l < LSM_LEVELS; l++) {
+        size_t lo = 0, hi = v->count[l];
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            const sstable_t* table = v->tables[l][mid];
+            if (kv_key_compare(table->largest, table->largest_len, key, key_len) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == v->count[l]) continue;
+
+        sstable_lookup_t result = table_get(lsm, v->tables[l][lo], key, key_len, h,
+                                            value, value_size, value_len, expires_at);
+        if (result != SSTABLE_NOT_FOUND) return result;
+    }
+    return SSTABLE_NOT_FOUND;
+}
+
+// The newest version of key, unless it is a tombstone or has expired
+static kv_error_t lookup(lsm_t* lsm, const char* key, size_t key_len,
+                         char* value, size_t value_size, size_t* value_len,
+                         uint64_t* expires_at) {
+    memtable_t *mem, *imm;
+    version_t* version;
+    size_t len = 0;
+    uint64_t expiry = 0;
+
+    acquire_view(lsm, &mem, &imm, &version);
+    sstable_lookup_t result = memtable_get(mem, key, key_len, value, value_size, &len, &expiry);
+    if (result == SSTABLE_NOT_FOUND && imm) {
+        result = memtable_get(imm, key, key_len, value, value_size, &len, &expiry);
+    }
+    if (result == SSTABLE_NOT_FOUND) {
+        result = version_get(lsm, version, key, key_len, value, value_size, &len, &expiry);
+    }
+    release_view(mem, imm, version);
+
+    if (result == SSTABLE_FOUND && expiry && expiry <= clock_now_ms()) {
+        result = SSTABLE_DELETED;
+    }
+    if (expires_at) *expires_at = expiry;
+
+    switch (result) {
+        case SSTABLE_FOUND:
+            if (value_len) *value_len = len;
+            return len > value_size ? KV_ERROR_NO_SPACE : KV_SUCCESS;
+        case SSTABLE_ERROR:
+            return KV_ERROR_IO;
+        default:
+            return KV_ERROR_NOT_FOUND;
+    }
+}
+
+static kv_error_t lsm_get(void* engine, const char* key, size_t key_len,
+                          char* value, size_t value_size, size_t* value_len) {
+    return lookup(engine, key, key_len, value, value_size, value_len, NULL);
+}
+
+// Deletes report missing keys like the hash engine, at the cost of a lookup
+static kv_error_t lsm_delete(void* engine, const char* key, size_t key_len) {
+    char probe;
+    kv_error_t found = lsm_get(engine, key, key_len, &probe, 0, NULL);
+    if (found != KV_SUCCESS && found != KV_ERROR_NO_SPACE) return found;
+    return lsm_write(engine, SSTABLE_TOMBSTONE, key, key_len, NULL, 0, 0);
+}
+
+// Write the value back with its new expiry. Holding write_lock from the
+// read to the write keeps another writer from slipping in between.
+static kv_error_t lsm_expire(void* engine, const char* key, size_t key_len,
+                             uint64_t expires_at) {
+    lsm_t* lsm = engine;
+    char probe;
+    char* value = NULL;
+    size_t len = 0;
+    uint64_t lsn = 0;
+
+    pthread_mutex_lock(&lsm->write_lock);
+    kv_error_t result = lookup(lsm, key, key_len, &probe, 0, &len, NULL);
+    if (result == KV_ERROR_NO_SPACE) {
+        value = malloc(len);
+        result = value ? lookup(lsm, key, key_len, value, len, &len, NULL) : KV_ERROR_NO_SPACE;
+    }
+    if (result == KV_SUCCESS) {
+        result = write_locked(lsm, SSTABLE_VALUE, key, key_len, value, len, expires_at, &lsn);
+    }
+    pthread_mutex_unlock(&lsm->write_lock);
+    free(value);
+
+    if (result == KV_SUCCESS && lsn && !wal_wait(lsm->wal, lsn)) result = KV_ERROR_IO;
+    return result;
+}
+
+static kv_error_t lsm_ttl(void* engine, const char* key, size_t key_len, uint64_t* expires_at) {
+    char probe;
+    kv_error_t result = lookup(engine, key, key_len, &probe, 0, NULL, expires_at);
+    return result == KV_ERROR_NO_SPACE ? KV_SUCCESS : result;
+}
+
+// One input of a scan: a memtable, or a run of tables in key order (a
+// single level 0 table, or a deeper level from the table holding start)
+typedef struct {
+    skiplist_node_t* node;              // Memtable source when tables is NULL
+    sstable_t* const* tables;
+    size_t num_tables;
+    size_t table;
+    sstable_iter_t it;
+    bool valid;
+    const char* key;
+    uint32_t key_len;
+} scan_source_t;
+
+static void source_load(lsm_t* lsm, scan_source_t* src, const char* start, size_t start_len) {
+    for (;;) {
+        if (src->table == src->num_tables) {
+            src->valid = false;
+            return;
+        }
+        sstable_iter_init(&src->it, src->tables[src->table], lsm->cache, &lsm->block_reads);
+        sstable_iter_seek(&src->it, start, start_len);
+        if (src->it.valid || src->it.error) break;
+        sstable_iter_close(&src->it);
+        src->table++;
+    }
+    src->valid = src->it.valid;
+    src->key = src->it.key;
+    src->key_len = src->it.key_len;
+}
+
+static void source_next(lsm_t* lsm, scan_source_t* src) {
+    if (!src->tables) {
+        src->node = skiplist_next(src->node);
+        src->valid = src->node != NULL;
+        if (src->valid) {
+            src->key = skiplist_key(src->node);
+            src->key_len = src->node->key_len;
+        }
+        return;
+    }
+    sstable_iter_next(&src->it);
+    if (!src->it.valid && !src->it.error) {
+        sstable_iter_close(&src->it);
+        src->table++;
+        source_load(lsm, src, NULL, 0);
+        return;
+    }
+    src->valid = src->it.valid;
+    src->key = src->it.key;
+    src->key_len = src->it.key_len;
+}
+
+static void source_init_memtable(scan_source_t* src, memtable_t* mem,
+                                 const char* start, size_t start_len) {
+    memset(src, 0, sizeof(*src));
+    src->node = skiplist_seek(mem->list, start, start_len);
+    src->valid = src->node != NULL;
+    if (src->valid) {
+        src->key = skiplist_key(src->node);
+        src->key_len = src->node->key_len;
+    }
+}
+
+// Merge every source in key order, the newest version of each key
+// winning. Memtable nodes are never unlinked, so only the values need an
+// epoch section; tables are pinned by the version reference.
+static kv_error_t lsm_scan(void* engine, const char* start, size_t start_len,
+                           const char* end, size_t end_len, kv_scan_fn visit, void* ctx) {
+    lsm_t* lsm = engine;
+    memtable_t *mem, *imm;
+    version_t* version;
+    uint64_t now = clock_now_ms();
+
+    acquire_view(lsm, &mem, &imm, &version);
+
+    size_t max_sources = 2 + version->count[0] + LSM_LEVELS;
+    scan_source_t* sources = malloc(max_sources * sizeof(scan_source_t));
+    char* key = malloc(MAX_KEY_LENGTH);
+    if (!sources || !key) {
+        free(sources);
+        free(key);
+        release_view(mem, imm, version);
+        return KV_ERROR_NO_SPACE;
+    }
+
+    size_t n = 0;
+    source_init_memtable(&sources[n++], mem, start, start_len);
+    if (imm) source_init_memtable(&sources[n++], imm, start, start_len);
+    for (size_t i = 0; i < version->count[0]; i++) {
+        scan_source_t* src = &sources[n++];
+        memset(src, 0, sizeof(*src));
+        src->tables = &version->tables[0][i];
+        src->num_tables = 1;
+        source_load(lsm, src, start, start_len);
+    }
+    for (int l = 1; l < LSM_LEVELS; l++) {
+        if (version->count[l] == 0) continue;
+        scan_source_t* src = &sources[n++];
+        memset(src, 0, sizeof(*src));
+        src->tables = version->tables[l];
+        src->num_tables = version->count[l];
+        // Skip tables wholly before start
+        while (src->table < src->num_tables &&
+               kv_key_compare(src->tables[src->table]->largest,
+                              src->tables[src->table]->largest_len, start, start_len) < 0) {
+            src->table++;
+        }
+        source_load(lsm, src, start, start_len);
+    }
+
+    kv_error_t result = KV_SUCCESS;
+    bool more = true;
+    while (more) {
+        size_t best = n;
+        for (size_t i = 0; i < n; i++) {
+            if (sources[i].tables && sources[i].it.error) result = KV_ERROR_IO;
+            if (!sources[i].valid) continue;
+            if (best == n || kv_key_compare(sources[i].key, sources[i].key_len,
+                                            sources[best].key, sources[best].key_len) < 0) {
+                best = i;
+            }
+        }
+        if (result != KV_SUCCESS || best == n) break;
+
+        scan_source_t* src = &sources[best];
+        if (end && kv_key_compare(src->key, src->key_len, end, end_len) >= 0) break;
+
+        if (!src->tables) {
+            epoch_enter();
+            const lsm_value_t* v = skiplist_value(src->node);
+            if (v->type != SSTABLE_TOMBSTONE && !expired(v->expires_at, now)) {
+                more = visit(ctx, src->key, src->key_len, v->data, v->len);
+            }
+            epoch_exit();
+        } else if (src->it.type != SSTABLE_TOMBSTONE && !expired(src->it.expires_at, now)) {
+            more = visit(ctx, src->key, src->key_len, src->it.value, src->it.value_len);
+        }
+
+        // Older versions of the key are shadowed
+        uint32_t key_len = src->key_len;
+        memcpy(key, src->key, key_len);
+        for (size_t i = best; i < n; i++) {
+            if (sources[i].valid &&
+                kv_key_compare(sources[i].key, sources[i].key_len, key, key_len) == 0) {
+                source_next(lsm, &sources[i]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (sources[i].tables) sstable_iter_close(&sources[i].it);
+    }
+    free(sources);
+    free(key);
+    release_view(mem, imm, version);
+    return result;
+}
+
+// Upper bound: overwritten and deleted keys count until compaction drops them
+static size_t lsm_count(void* engine) {
+    lsm_t* lsm = engine;
+    memtable_t *mem, *imm;
+    version_t* version;
+
+    acquire_view(lsm, &mem, &imm, &version);
+    size_t count = skiplist_count(mem->list) + (imm ? skiplist_count(imm->list) : 0);
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        for (size_t i = 0; i < version->count[l]; i++) count += version->tables[l][i]->entries;
+    }
+    release_view(mem, imm, version);
+    return count;
+}
+
+static void lsm_get_stats(void* engine, kv_store_stats_t* stats) {
+    lsm_t* lsm = engine;
+    memtable_t *mem, *imm;
+    version_t* version;
+
+    stats->keys = lsm_count(lsm);
+
+    acquire_view(lsm, &mem, &imm, &version);
+    stats->memtable_bytes = memtable_bytes(mem) + (imm ? memtable_bytes(imm) : 0);
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        stats->sstables += version->count[l];
+        stats->sstable_bytes += version->bytes[l];
+    }
+    release_view(mem, imm, version);
+
+    stats->flushes = stat_load(&lsm->flushes);
+    pthread_mutex_lock(&lsm->lock);
+    stats->compactions = lsm->compactions;
+    pthread_mutex_unlock(&lsm->lock);
+    stats->compaction_bytes_read = stat_load(&lsm->compaction_bytes_read);
+    stats->compaction_bytes_written = stat_load(&lsm->compaction_bytes_written);
+    stats->write_stalls = stat_load(&lsm->write_stalls);
+    stats->block_reads = stat_load(&lsm->block_reads);
+    stats->bloom_negatives = stat_load(&lsm->bloom_negatives);
+
+    block_cache_stats_t cache;
+    block_cache_get_stats(lsm->cache, &cache);
+    stats->block_cache_hits = cache.hits;
+
+    if (lsm->wal) {
+        wal_stats_t wal;
+        wal_get_stats(lsm->wal, &wal);
+        stats->wal_records = wal.records;
+        stats->wal_bytes = wal.bytes;
+        stats->wal_batches = wal.batches;
+        stats->wal_fsyncs = wal.fsyncs;
+    }
+}
+
+static void lsm_dump_stats(void* engine, FILE* out) {
+    lsm_t* lsm = engine;
+    kv_store_stats_t stats = { 0 };
+    lsm_get_stats(lsm, &stats);
+
+    fprintf(out, "keys: %zu (estimated)\n", stats.keys);
+    fprintf(out, "memtable: %zu bytes\n", stats.memtable_bytes);
+    fprintf(out, "sstables: %zu (%llu bytes)\n",
+            stats.sstables, (unsigned long long)stats.sstable_bytes);
+    fprintf(out, "flushes: %llu, write stalls: %llu\n",
+            (unsigned long long)stats.flushes, (unsigned long long)stats.write_stalls);
+    fprintf(out, "compactions: %llu, read %llu bytes, wrote %llu bytes\n",
+            (unsigned long long)stats.compactions,
+            (unsigned long long)stats.compaction_bytes_read,
+            (unsigned long long)stats.compaction_bytes_written);
+    fprintf(out, "block reads: %llu, cache hits: %llu, bloom negatives: %llu\n",
+            (unsigned long long)stats.block_reads,
+            (unsigned long long)stats.block_cache_hits,
+            (unsigned long long)stats.bloom_negatives);
+    if (lsm->wal) {
+        fprintf(out, "wal: %llu records, %llu bytes, %llu writes, %llu fsyncs\n",
+                (unsigned long long)stats.wal_records,
+                (unsigned long long)stats.wal_bytes,
+                (unsigned long long)stats.wal_batches,
+                (unsigned long long)stats.wal_fsyncs);
+    }
+
+    memtable_t *mem, *imm;
+    version_t* version;
+    acquire_view(lsm, &mem, &imm, &version);
+    for (int l = 0; l < LSM_LEVELS; l++) {
+        if (version->count[l] == 0) continue;
+        fprintf(out, "  level %d: %4zu tables, %12llu bytes\n",
+                l, version->count[l], (unsigned long long)version->bytes[l]);
+    }
+    release_view(mem, imm, version);
+}
+
+const kv_engine_ops_t kv_lsm_engine = {
+    .name = "lsm",
+    .open = lsm_open,
+    .close = lsm_close,
+    .put = lsm_put,
+    .get = lsm_get,
+    .delete = lsm_delete,
+    .expire = lsm_expire,
+    .ttl = lsm_ttl,
+    .scan = lsm_scan,
+    .mput = lsm_mput,
+    .count = lsm_count,
+    .save = lsm_save,
+    .get_stats = lsm_get_stats,
+    .dump_stats = lsm_dump_stats,
+};
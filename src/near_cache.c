@@ -0,0 +1,180 @@
+#include "near_cache.h"
+#include "clock.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NEAR_CACHE_SEED 0x6e65617263616368ull
+#define NEAR_CACHE_INITIAL_BUCKETS 256
+
+typedef struct near_entry {
+    struct near_entry* chain;           // Next in the hash bucket
+    struct near_entry* newer;           // LRU list, most recent at the head
+    struct near_entry* older;
+    uint64_t hash;
+    uint64_t expires_at;                // 0: never
+    size_t key_len;
+    size_t value_len;
+    char data[];                        // Key, then value
+} near_entry_t;
+
+struct near_cache {
+    near_entry_t** buckets;
+    size_t bucket_count;                // Power of two
+    size_t max_bytes;
+    unsigned ttl_ms;
+    near_entry_t* newest;
+    near_entry_t* oldest;
+    kv_cache_stats_t stats;
+};
+
+static size_t entry_bytes(const near_entry_t* entry) {
+    return sizeof(*entry) + entry->key_len + entry->value_len;
+}
+
+near_cache_t* near_cache_create(size_t max_bytes, unsigned ttl_ms) {
+    near_cache_t* cache = calloc(1, sizeof(near_cache_t));
+    if (!cache) return NULL;
+    cache->bucket_count = NEAR_CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+    if (!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    cache->ttl_ms = ttl_ms;
+    return cache;
+}
+
+void near_cache_destroy(near_cache_t* cache) {
+    if (!cache) return;
+    while (cache->newest) {
+        near_entry_t* entry = cache->newest;
+        cache->newest = entry->older;
+        free(entry);
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+static near_entry_t** find(near_cache_t* cache, uint64_t hash, const char* key,
+                           size_t key_len) {
+    near_entry_t** link = &cache->buckets[hash & (cache->bucket_count - 1)];
+    while (*link && ((*link)->hash != hash || (*link)->key_len != key_len ||
+                     memcmp((*link)->data, key, key_len) != 0)) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void lru_unlink(near_cache_t* cache, near_entry_t* entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void lru_push(near_cache_t* cache, near_entry_t* entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+// Unlink the entry at link and free it
+static void drop(near_cache_t* cache, near_entry_t** link) {
+    near_entry_t* entry = *link;
+    *link = entry->chain;
+    lru_unlink(cache, entry);
+    cache->stats.entries--;
+    cache->stats.bytes -= entry_bytes(entry);
+    free(entry);
+}
+
+bool near_cache_get(near_cache_t* cache, const char* key, size_t key_len, char* value) {
+    uint64_t hash = kv_hash(key, key_len, NEAR_CACHE_SEED);
+    near_entry_t** link = find(cache, hash, key, key_len);
+    near_entry_t* entry = *link;
+    if (entry && entry->expires_at && clock_now_ms() >= entry->expires_at) {
+        drop(cache, link);
+        cache->stats.expirations++;
+        entry = NULL;
+    }
+    if (!entry) {
+        cache->stats.misses++;
+        return false;
+    }
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+    memcpy(value, entry->data + entry->key_len, entry->value_len);
+    value[entry->value_len] = '\0';
+    cache->stats.hits++;
+    return true;
+}
+
+void near_cache_put(near_cache_t* cache, const char* key, size_t key_len,
+                    const char* value, size_t value_len) {
+    uint64_t hash = kv_hash(key, key_len, NEAR_CACHE_SEED);
+    near_entry_t** link = find(cache, hash, key, key_len);
+    if (*link) drop(cache, link);
+
+    size_t bytes = sizeof(near_entry_t) + key_len + value_len;
+    if (bytes > cache->max_bytes) return;
+    while (cache->stats.bytes + bytes > cache->max_bytes) {
+        near_entry_t* oldest = cache->oldest;
+        drop(cache, find(cache, oldest->hash, oldest->data, oldest->key_len));
+        cache->stats.evictions++;
+    }
+    if (cache->stats.entries >= cache->bucket_count) {
+        KV_BUCKETS_GROW(cache->buckets, cache->bucket_count, near_entry_t, chain);
+    }
+
+    near_entry_t* entry = malloc(bytes);
+    if (!entry) return;
+    entry->hash = hash;
+    entry->expires_at = clock_deadline_ms(cache->ttl_ms);
+    entry->key_len = key_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, value, value_len);
+    size_t bucket = hash & (cache->bucket_count - 1);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push(cache, entry);
+    cache->stats.entries++;
+    cache->stats.bytes += bytes;
+}
+
+void near_cache_remove(near_cache_t* cache, const char* key, size_t key_len, bool pushed) {
+    near_entry_t** link = find(cache, kv_hash(key, key_len, NEAR_CACHE_SEED), key, key_len);
+    if (!*link) return;
+    drop(cache, link);
+    if (pushed) cache->stats.invalidations++;
+}
+
+void near_cache_clear(near_cache_t* cache, bool pushed) {
+    if (pushed) cache->stats.invalidations += cache->stats.entries;
+    while (cache->newest) {
+        near_entry_t* entry = cache->newest;
+        cache->newest = entry->older;
+        free(entry);
+    }
+    cache->oldest = NULL;
+    memset(cache->buckets, 0, cache->bucket_count * sizeof(*cache->buckets));
+    cache->stats.entries = 0;
+    cache->stats.bytes = 0;
+}
+
+void near_cache_stats(const near_cache_t* cache, kv_cache_stats_t* stats) {
+    *stats = cache->stats;
+}
@@ -0,0 +1,28 @@
+// Client-side LRU cache of GET results, for a connection tracked by the
+// server (kv_client_cache_enable)
+
+#ifndef NEAR_CACHE_H
+#define NEAR_CACHE_H
+
+#include "kv_store.h"
+
+// Entries are bounded by max_bytes, counting keys, values and their
+// bookkeeping, and each lapses ttl_ms after it was put (0: never). Not
+// thread-safe: it belongs to one client.
+typedef struct near_cache near_cache_t;
+
+near_cache_t* near_cache_create(size_t max_bytes, unsigned ttl_ms);
+void near_cache_destroy(near_cache_t* cache);
+
+// Copy key's value into value, a MAX_VALUE_SIZE buffer, NUL-terminated.
+// False on a miss, or if the entry has lapsed.
+bool near_cache_get(near_cache_t* cache, const char* key, size_t key_len, char* value);
+// Replace key's entry, evicting the least recently used to make room
+void near_cache_put(near_cache_t* cache, const char* key, size_t key_len,
+                    const char* value, size_t value_len);
+// Drop key's entry; pushed counts it as an invalidation from the server
+void near_cache_remove(near_cache_t* cache, const char* key, size_t key_len, bool pushed);
+void near_cache_clear(near_cache_t* cache, bool pushed);
+void near_cache_stats(const near_cache_t* cache, kv_cache_stats_t* stats);
+
+#endif // NEAR_CACHE_H
@@ -0,0 +1,140 @@
+// Version 2 wire protocol: compact length-prefixed frames
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "kv_store.h"
+#include <endian.h>
+
+// A v2 connection opens with a hello: "KV", the highest version the
+// client speaks and a zero byte. The server answers with the same four
+// bytes carrying the version it picked. A v1 message starts with its
+// type, never 'K', so the server tells the two apart by the first byte;
+// a v1-only server never answers, and the client falls back to v1.
+// Versions are KV_PROTO_V1 and KV_PROTO_V2 (kv_store.h).
+#define KV_HELLO_SIZE 4
+
+// Every frame after the hello is a header, then the key, the opcode's
+// fixed extras and the value. Integers are big-endian.
+//   byte 0      request: opcode (message_type_t); reply: status (kv_error_t)
+//   byte 1      flags
+//   bytes 2-3   key length
+//   bytes 4-7   value length
+//   bytes 8-11  request id, echoed by the reply
+// Extras: MSG_PUT_TTL and MSG_EXPIRE carry the TTL in ms (8 bytes), MSG_SCAN
+// its page limit (2 bytes). Replies carry no key or extras; GET replies
+// the value, TTL the ms left (8 bytes, -1: no expiry) and SCAN its items,
+// each a key length (2 bytes), value length (4 bytes), key and value.
+// MSG_SCAN requests hold the start key as key, the end key or prefix as
+// value, and the KV_SCAN_* flags.
+//
+// Multi-key requests have no key; the value lists up to KV_BATCH_MAX_KEYS
+// items. MGET and MDELETE items are a key length (2 bytes) and key, MSET
+// items are laid out like SCAN items. MGET replies hold, per key in
+// request order, a status (1 byte), a value length (4 bytes) and the
+// value; MSET and MDELETE replies one status byte per key, with the first
+// failure as the frame status.
+//
+// MSG_SHM_ATTACH, sent alone as the first request on a Unix socket
+// connection, asks for shared-memory rings (shm.h). The empty KV_SUCCESS
+// reply carries the region and eventfds; any other status leaves the
+// connection on the socket.
+//
+// MSG_TRACK, sent alone, has the server track the connection for a near
+// cache: with KV_FRAME_BCAST, writes to keys under the prefixes its value
+// lists (items as for MDELETE), otherwise those to keys the connection
+// GETs from then on; KV_FRAME_UNTRACK stops. From then on the server may
+// send MSG_INVALIDATE frames at any time between replies: request id 0,
+// the opcode as code and the key written as key, or no key when anything
+// may have changed.
+//
+// A server in a cluster (kv_server_set_cluster) answers a request for a
+// key another node owns KV_ERROR_MOVED, with that node's "host:port" as
+// value; a multi-key request gets it, for its first such key, as a whole.
+// MSG_CLUSTER, with no key, replies the node list: the placement (1 byte),
+// vnodes (2 bytes), then per node a length (2 bytes) and "host:port".
+//
+// MSG_REPLICATE, from a primary to its backup (kv_server_set_backup), has
+// no key, and an offset in the primary's stream of writes (8 bytes) as
+// extras; servers not started as backups answer KV_ERROR_INVALID_KEY. With
+// no flags its value is the WAL records (wal.h) from that offset on,
+// which must be where the backup reached, and the reply value the offset
+// after the last, once they are applied. KV_FRAME_REPL_QUERY, with no value, replies the id of the stream the backup follows, 0 for
+// none, and its offset (8 bytes each). KV_FRAME_REPL_FULL has the backup
+// delete up to a slice of its keys, replying KV_FRAME_MORE while some are
+// left; the first to find none has it sync the stream whose id is the
+// value from the offset on; KV_FRAME_REPL_PAGE values are records of a full sync, applied
+// without moving the offset; KV_FRAME_REPL_DONE, with the id again, ends
+// it, and only then does the backup follow the stream and QUERY name it.
+// All three reply the backup's offset. A backup that refuses an update
+// follows no stream until the next full sync. It is never refused as BUSY.
+//
+// An overloaded server may answer any request KV_ERROR_BUSY, with no value,
+// without having run it.
+#define KV_FRAME_HEADER_SIZE 12
+#define KV_FRAME_MAX_VALUE (64u * 1024 * 1024)  // Larger frames end the connection
+#define KV_FRAME_MORE 0x01              // SCAN reply: the scan may continue
+#define KV_FRAME_ATOMIC 0x01            // MSET request: apply as one write
+#define KV_FRAME_BCAST 0x01             // MSG_TRACK: by prefix
+#define KV_FRAME_UNTRACK 0x02           // MSG_TRACK: stop tracking
+#define KV_FRAME_REPL_QUERY 0x01        // MSG_REPLICATE: where the backup stands
+#define KV_FRAME_REPL_FULL 0x02         // MSG_REPLICATE: clear, then follow a stream
+#define KV_FRAME_REPL_PAGE 0x04         // MSG_REPLICATE: keys of a full sync
+#define KV_FRAME_REPL_DONE 0x08         // MSG_REPLICATE: the full sync is complete
+
+typedef struct {
+    uint8_t code;                       // Opcode, or status in a reply
+    uint8_t flags;
+    uint16_t key_len;
+    uint32_t value_len;
+    uint32_t id;
+} kv_frame_t;
+
+static inline void kv_put_u16(char* p, uint16_t v) { v = htobe16(v); memcpy(p, &v, sizeof(v)); }
+static inline void kv_put_u32(char* p, uint32_t v) { v = htobe32(v); memcpy(p, &v, sizeof(v)); }
+static inline void kv_put_u64(char* p, uint64_t v) { v = htobe64(v); memcpy(p, &v, sizeof(v)); }
+
+static inline uint16_t kv_get_u16(const char* p) { uint16_t v; memcpy(&v, p, sizeof(v)); return be16toh(v); }
+static inline uint32_t kv_get_u32(const char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return be32toh(v); }
+static inline uint64_t kv_get_u64(const char* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return be64toh(v); }
+
+static inline void kv_frame_encode(char* out, const kv_frame_t* frame) {
+    out[0] = (char)frame->code;
+    out[1] = (char)frame->flags;
+    kv_put_u16(out + 2, frame->key_len);
+    kv_put_u32(out + 4, frame->value_len);
+    kv_put_u32(out + 8, frame->id);
+}
+
+static inline void kv_frame_decode(const char* in, kv_frame_t* frame) {
+    frame->code = (uint8_t)in[0];
+    frame->flags = (uint8_t)in[1];
+    frame->key_len = kv_get_u16(in + 2);
+    frame->value_len = kv_get_u32(in + 4);
+    frame->id = kv_get_u32(in + 8);
+}
+
+// Bytes of extras a request with this opcode carries
+static inline size_t kv_frame_extra_len(uint8_t opcode) {
+    switch (opcode) {
+        case MSG_PUT_TTL:
+        case MSG_EXPIRE:
+        case MSG_REPLICATE: return sizeof(uint64_t);
+        case MSG_SCAN:   return sizeof(uint16_t);
+        default:         return 0;
+    }
+}
+
+static inline void kv_hello_encode(char* out, uint8_t version) {
+    out[0] = 'K';
+    out[1] = 'V';
+    out[2] = (char)version;
+    out[3] = 0;
+}
+
+// The version in a hello, or 0 if it is not one
+static inline uint8_t kv_hello_decode(const char* in) {
+    return in[0] == 'K' && in[1] == 'V' && in[3] == 0 ? (uint8_t)in[2] : 0;
+}
+
+#endif // PROTOCOL_H
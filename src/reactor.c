@@ -0,0 +1,1424 @@
+#define _GNU_SOURCE  // accept4, pthread_setaffinity_np
+#include "reactor.h"
+#include "log.h"
+#include "request.h"
+#include "protocol.h"
+#include "shm.h"
+#include "tracking.h"
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <time.h>
+
+struct conn;
+
+// Requests a connection handed to another shard's reactor, which sends
+// them back with the replies in their place. While any are out, replies
+// to the connection's later requests that run at home wait in messages
+// too, so everything goes out in request order.
+typedef struct shard_msg {
+    struct conn* conn;                  // NULL once the connection closed
+    unsigned origin;                    // Reactor the connection belongs to
+    unsigned shard;                     // Reactor running the requests
+    uint8_t version;                    // The connection's protocol
+    bool forwarded;                     // Else it holds replies made at home
+    bool returned;                      // Back home with the replies
+    bool failed;                        // The requests could not be run
+    unsigned requests;                  // Forwarded in it
+    conn_buf_t buf;                     // Requests, then their replies
+    struct shard_msg* next;             // In the connection's reply order
+    struct shard_msg* next_out;         // In an outbox
+} shard_msg_t;
+
+// Messages from one reactor to another: single producer, single consumer
+typedef struct {
+    uint64_t head;                      // Next slot to fill; producer only
+    uint64_t tail __attribute__((aligned(64)));  // Next slot to take; consumer only
+    shard_msg_t* slots[REACTOR_QUEUE_SLOTS];
+} __attribute__((aligned(64))) shard_queue_t;
+
+// A value pinned for MSG_ZEROCOPY sends, until the kernel says it is done
+// with the one numbered seq
+typedef struct {
+    uint32_t seq;
+    kv_value_ref_t ref;
+} zerocopy_pin_t;
+
+// One piece of the replies going out: bytes built in the buffer, or a
+// value pinned in the store
+typedef struct {
+    kv_value_ref_t* ref;                // The pinned value, or NULL
+    bool zerocopy;                      // Went out, at least partly, with MSG_ZEROCOPY
+    uint32_t seq;                       // Of the last such send
+} send_piece_t;
+
+typedef struct conn {
+    int fd;
+    uint32_t events;                    // Registered with epoll
+    uint8_t version;                    // Wire protocol, 0 until negotiated
+    bool local;                         // On the Unix socket
+    bool closed;                        // Waiting to be freed
+    shm_region_t* shm;                  // Rings in place of the socket, or NULL
+    tracking_sub_t* tracking;           // Sent MSG_TRACK, or NULL
+    int shm_doorbell;                   // eventfd the client rings
+    int shm_wake;                       // eventfd the client sleeps on
+    bool eof;                           // Peer done sending; close once answered
+    bool failed;                        // A forwarded request could not be run
+    bool dirty;                         // On the reactor's list to deliver to
+    bool backlog;                       // Requests in in held back for a later turn
+    bool ready;                         // On the reactor's list of turns to take
+    bool ring_paused;                   // Shared memory: stopped taking requests
+    bool zerocopy;                      // SO_ZEROCOPY is on
+    bool zerocopy_off;                  // Not possible, or the kernel copies anyway
+    bool lingering;                     // Closed, but the kernel still reads its pins
+    uint32_t zerocopy_seq;              // Number of the next MSG_ZEROCOPY send
+    zerocopy_pin_t* zerocopy_pins;      // Values MSG_ZEROCOPY sends may still read
+    size_t zerocopy_count;
+    size_t zerocopy_size;
+    uint64_t backlog_since;             // When the held-back requests arrived, in ms
+    uint64_t ready_round;               // Loop pass it joined the list in
+    unsigned inflight;                  // Requests at other shards
+    conn_buf_t in;                      // Start of a request cut short, or
+                                        // requests waiting for other shards
+    conn_buf_t out;                     // Replies the socket has not taken yet
+    shard_msg_t* replies;               // Reply order while requests are out
+    shard_msg_t* replies_tail;
+    shard_msg_t* last_forward;          // Still in the outbox, open to more requests
+    unsigned outstanding;               // Forwarded messages not back yet
+    struct conn* next_dirty;
+    struct conn* next_ready;
+    struct conn* prev;                  // The reactor's connections
+    struct conn* next;
+} conn_t;
+
+typedef struct reactor {
+    kv_server_t* server;
+    unsigned index;                     // Also the shard it owns when sharded
+    unsigned count;                     // Reactors, each owning a shard if above one
+    struct reactor* all;
+    shard_queue_t* queues;              // Sharded: queues[from * count + to]
+    shard_msg_t** outbox;               // Per reactor: messages not queued yet
+    shard_msg_t** outbox_tail;
+    size_t outbox_waiting;              // Messages in the outboxes
+    conn_t* dirty;                      // Connections with replies back from shards
+    int doorbell;                       // eventfd rung after queueing to this reactor
+    int cpu;                            // Pinned to, or -1
+    kv_tracking_t* tracking;            // Readers for near caches, or NULL
+    tracking_inbox_t inbox;             // Its connections with invalidations to send
+    uint64_t forwarded;                 // Requests handed to other shards
+    int epfd;
+    int listen_fd;
+    bool own_listener;
+    pthread_t thread;
+    char* scratch;                      // REACTOR_READ_SIZE receive buffer
+    conn_buf_t replies;                 // Built here, then sent straight away
+    struct iovec* iov;                  // The replies laid out for sendmsg
+    send_piece_t* pieces;               // What each iovec is
+    size_t pieces_size;
+    conn_t* conns;
+    conn_t* lingering;                  // Closed, waiting for MSG_ZEROCOPY sends
+    conn_t* closed;                     // Freed once no event can name them
+    conn_t* ready;                      // Turns to take, oldest first
+    conn_t* ready_tail;
+    uint64_t round;                     // Passes of the loop
+    size_t connections;
+    uint64_t shm_connections;           // Attached to shared memory
+    uint64_t shed;                      // Requests answered KV_ERROR_BUSY
+    uint64_t requests;
+    uint64_t syscalls;                  // Made by the loop, to compare with io_uring
+} reactor_t;
+
+bool reactor_admit(kv_server_t* server) {
+    unsigned limit = server->options.max_connections;
+    if (__atomic_add_fetch(&server->connections, 1, __ATOMIC_RELAXED) <= limit || limit == 0) {
+        return true;
+    }
+    __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+    if (__atomic_fetch_add(&server->refused, 1, __ATOMIC_RELAXED) == 0) {
+        log_warn("Refusing connections beyond the limit of %u", limit);
+    }
+    return false;
+}
+
+void reactor_release(kv_server_t* server) {
+    __atomic_sub_fetch(&server->connections, 1, __ATOMIC_RELAXED);
+}
+
+// For the latency budget; the coarse clock costs no syscall
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void reactor_report(const char* backend, uint64_t requests, uint64_t syscalls) {
+    log_info("%s: %llu requests, %llu syscalls (%.2f per request)", backend,
+             (unsigned long long)requests, (unsigned long long)syscalls,
+             requests ? (double)syscalls / (double)requests : 0.0);
+}
+
+int reactor_listen(int port, bool reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int opt = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int reactor_listen_unix(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (bound < 0 && errno == EADDRINUSE) {
+        // Replace the file only if nothing answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) < 0 &&
+            errno == ECONNREFUSED && unlink(path) == 0) {
+            bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+        } else {
+            errno = EADDRINUSE;
+        }
+        if (probe >= 0) close(probe);
+    }
+    if (bound < 0 || listen(fd, SOMAXCONN) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static void msg_free(shard_msg_t* msg) {
+    conn_buf_free(&msg->buf);
+    free(msg);
+}
+
+static shard_msg_t* msg_create(reactor_t* reactor, conn_t* conn, bool forwarded) {
+    shard_msg_t* msg = calloc(1, sizeof(*msg));
+    if (!msg) return NULL;
+    msg->conn = conn;
+    msg->origin = reactor->index;
+    msg->shard = reactor->index;
+    msg->version = conn->version;
+    msg->forwarded = forwarded;
+
+    if (conn->replies_tail) {
+        conn->replies_tail->next = msg;
+    } else {
+        conn->replies = msg;
+    }
+    conn->replies_tail = msg;
+    return msg;
+}
+
+// Take a turn after every connection already waiting for one
+static void ready_add(reactor_t* reactor, conn_t* conn) {
+    if (conn->ready) return;
+    conn->ready = true;
+    conn->ready_round = reactor->round;
+    conn->next_ready = NULL;
+    if (reactor->ready_tail) {
+        reactor->ready_tail->next_ready = conn;
+    } else {
+        reactor->ready = conn;
+    }
+    reactor->ready_tail = conn;
+}
+
+static void ready_remove(reactor_t* reactor, conn_t* conn) {
+    conn_t* prev = NULL;
+    for (conn_t* at = reactor->ready; at != conn; at = at->next_ready) prev = at;
+    if (prev) {
+        prev->next_ready = conn->next_ready;
+    } else {
+        reactor->ready = conn->next_ready;
+    }
+    if (reactor->ready_tail == conn) reactor->ready_tail = prev;
+    conn->ready = false;
+}
+
+// Release the values of the MSG_ZEROCOPY sends numbered first to last
+static void zerocopy_done(conn_t* conn, uint32_t first, uint32_t last) {
+    size_t kept = 0;
+    for (size_t i = 0; i < conn->zerocopy_count; i++) {
+        zerocopy_pin_t* pin = &conn->zerocopy_pins[i];
+        if (pin->seq - first <= last - first) {
+            pin->ref.release(pin->ref.pin);
+        } else {
+            conn->zerocopy_pins[kept++] = *pin;
+        }
+    }
+    conn->zerocopy_count = kept;
+}
+
+// Take the kernel's notices of the MSG_ZEROCOPY sends it is done with
+// from the socket's error queue. Returns false if the socket failed.
+static bool zerocopy_reap(reactor_t* reactor, conn_t* conn) {
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        reactor->syscalls++;
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            break;                      // None left
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // The kernel copied after all, as over loopback: stop asking
+            if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !conn->zerocopy_off) {
+                log_debug("MSG_ZEROCOPY sends were copied; using plain sends");
+                conn->zerocopy_off = true;
+            }
+            zerocopy_done(conn, err.ee_info, err.ee_data);
+        }
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    reactor->syscalls++;
+    return getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+}
+
+// Close the socket; the conn_t goes once no event can name it
+static void conn_finish(reactor_t* reactor, conn_t* conn) {
+    close(conn->fd);                    // Also leaves the epoll set
+    reactor->syscalls++;
+    reactor_release(reactor->server);
+    zerocopy_done(conn, 0, UINT32_MAX);
+    free(conn->zerocopy_pins);
+
+    // Its other descriptor may have an event later in the same batch
+    conn->closed = true;
+    conn->next = reactor->closed;
+    reactor->closed = conn;
+}
+
+// Closed while MSG_ZEROCOPY sends may still read values it pinned: shut
+// the socket down but keep it, and the pins, until the kernel is done
+// with them. Returns false if there is nothing to wait for.
+static bool conn_linger(reactor_t* reactor, conn_t* conn) {
+    reactor->syscalls += 2;
+    shutdown(conn->fd, SHUT_RDWR);
+    zerocopy_reap(reactor, conn);
+    // Edge-triggered: a hang-up would otherwise be reported on every pass
+    struct epoll_event ev = { .events = EPOLLET, .data.ptr = conn };
+    if (conn->zerocopy_count == 0 ||
+        epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        return false;
+    }
+    conn->lingering = true;
+    conn->prev = NULL;
+    conn->next = reactor->lingering;
+    if (reactor->lingering) reactor->lingering->prev = conn;
+    reactor->lingering = conn;
+    return true;
+}
+
+// The kernel is done with a lingering connection
+static void conn_lingered(reactor_t* reactor, conn_t* conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        reactor->lingering = conn->next;
+    }
+    if (conn->next) conn->next->prev = conn->prev;
+    conn_finish(reactor, conn);
+}
+
+static void conn_close(reactor_t* reactor, conn_t* conn) {
+    if (conn->ready) ready_remove(reactor, conn);
+    if (conn->tracking) tracking_unsubscribe(conn->tracking);
+    if (conn->shm) {
+        close(conn->shm_doorbell);
+        close(conn->shm_wake);
+        shm_region_unmap(conn->shm);
+        reactor->syscalls += 3;
+    }
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        reactor->conns = conn->next;
+    }
+    if (conn->next) conn->next->prev = conn->prev;
+    reactor->connections--;
+
+    // Messages still out are freed where they turn up
+    while (conn->replies) {
+        shard_msg_t* msg = conn->replies;
+        conn->replies = msg->next;
+        if (msg->forwarded && !msg->returned) {
+            msg->conn = NULL;
+        } else {
+            msg_free(msg);
+        }
+    }
+    conn_buf_free(&conn->in);
+    conn_buf_free(&conn->out);
+    conn_buf_reset(&reactor->replies);  // What it had built when it failed
+
+    if (conn->zerocopy_count > 0 && conn_linger(reactor, conn)) return;
+    conn_finish(reactor, conn);
+}
+
+static void free_closed(reactor_t* reactor) {
+    while (reactor->closed) {
+        conn_t* conn = reactor->closed;
+        reactor->closed = conn->next;
+        free(conn);
+    }
+}
+
+// Read while replies are not piling up and no requests are held back, and
+// wait to write while replies are pending
+static bool conn_update_events(reactor_t* reactor, conn_t* conn) {
+    if (conn->shm) {
+        // The doorbell serves for both; ring it to go back to the ring
+        if (conn->ring_paused && !conn->backlog) {
+            conn->ring_paused = false;
+            reactor->syscalls++;
+            shm_ring_bell(conn->shm_doorbell);
+        }
+        return true;
+    }
+    uint32_t events = 0;
+    if (!conn->eof && !conn->backlog && conn->out.len < REACTOR_MAX_PENDING) events |= EPOLLIN;
+    if (conn->out.len > 0) events |= EPOLLOUT;
+    if (events == conn->events) return true;
+
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    reactor->syscalls++;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) return false;
+    conn->events = events;
+    return true;
+}
+
+// Write as much of data as the reply ring takes, ringing the client if it
+// sleeps. A full ring gets the client to ring back once it makes room.
+static size_t shm_send(reactor_t* reactor, conn_t* conn, const char* data, size_t len) {
+    shm_ring_t* ring = &conn->shm->replies;
+    size_t sent = shm_ring_write(ring, data, len);
+    while (sent < len && !shm_ring_wait_writable(ring)) {
+        sent += shm_ring_write(ring, data + sent, len - sent);
+    }
+    if (sent > 0 && shm_ring_reader_asleep(ring)) {
+        reactor->syscalls++;
+        shm_ring_bell(conn->shm_wake);
+    }
+    return sent;
+}
+
+// Send as much of data as the socket takes. Returns the bytes sent, or -1
+// if the connection failed.
+static ssize_t send_some(reactor_t* reactor, conn_t* conn, const char* data, size_t len) {
+    if (conn->shm) return (ssize_t)shm_send(reactor, conn, data, len);
+    size_t sent = 0;
+    while (sent < len) {
+        reactor->syscalls++;
+        ssize_t n = send(conn->fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    return (ssize_t)sent;
+}
+
+static bool conn_flush(reactor_t* reactor, conn_t* conn) {
+    ssize_t sent = send_some(reactor, conn, conn->out.data, conn->out.len);
+    if (sent < 0) return false;
+    conn_buf_consume(&conn->out, (size_t)sent);
+    if (conn->out.len == 0) conn_buf_free(&conn->out);
+    return true;
+}
+
+// Lay the replies out in reactor->iov, with each pinned value in its
+// place. Returns the number of pieces, or 0 if out of memory.
+static size_t replies_pieces(reactor_t* reactor, conn_buf_t* replies) {
+    size_t most = replies->pin_count * 2 + 1;
+    if (most > reactor->pieces_size) {
+        struct iovec* iov = realloc(reactor->iov, most * sizeof(*iov));
+        if (iov) reactor->iov = iov;
+        send_piece_t* pieces = realloc(reactor->pieces, most * sizeof(*pieces));
+        if (pieces) reactor->pieces = pieces;
+        if (!iov || !pieces) return 0;
+        reactor->pieces_size = most;
+    }
+
+    size_t count = 0, from = 0;
+    for (size_t i = 0; i <= replies->pin_count; i++) {
+        size_t to = i < replies->pin_count ? replies->pins[i].at : replies->len;
+        if (to > from) {
+            reactor->iov[count] = (struct iovec){ replies->data + from, to - from };
+            reactor->pieces[count++] = (send_piece_t){ .ref = NULL };
+        }
+        from = to;
+        if (i == replies->pin_count) break;
+        kv_value_ref_t* ref = &replies->pins[i].ref;
+        reactor->iov[count] = (struct iovec){ (void*)ref->data, ref->len };
+        reactor->pieces[count++] = (send_piece_t){ .ref = ref };
+    }
+    return count;
+}
+
+// Whether a piece with len bytes left goes out with MSG_ZEROCOPY, turning
+// it on for the socket the first time
+static bool zerocopy_wanted(reactor_t* reactor, conn_t* conn, const send_piece_t* piece,
+                            size_t len) {
+    size_t min = reactor->server->options.zerocopy_min;
+    if (!piece->ref || min == 0 || len < min || conn->zerocopy_off) return false;
+    if (conn->zerocopy) return true;
+    int on = 1;
+    reactor->syscalls++;
+    conn->zerocopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    conn->zerocopy_off = !conn->zerocopy;
+    return conn->zerocopy;
+}
+
+// Send the pieces from *at on until the socket stops taking them, leaving
+// *at and its iovec at the first byte not sent. Pieces go out together,
+// except values for MSG_ZEROCOPY, which go alone. Returns false if the
+// connection failed.
+static bool send_pieces(reactor_t* reactor, conn_t* conn, size_t count, size_t* at) {
+    struct iovec* iov = reactor->iov;
+    while (*at < count) {
+        size_t i = *at, n_iov = 1;
+        ssize_t n;
+        bool zerocopy = false;
+        if (conn->shm) {
+            n = (ssize_t)shm_send(reactor, conn, iov[i].iov_base, iov[i].iov_len);
+        } else {
+            zerocopy = zerocopy_wanted(reactor, conn, &reactor->pieces[i], iov[i].iov_len);
+            while (!zerocopy && i + n_iov < count && n_iov < IOV_MAX &&
+                   !zerocopy_wanted(reactor, conn, &reactor->pieces[i + n_iov],
+                                    iov[i + n_iov].iov_len)) {
+                n_iov++;
+            }
+            struct msghdr msg = { .msg_iov = iov + i, .msg_iovlen = n_iov };
+            reactor->syscalls++;
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (n < 0 && zerocopy && errno == ENOBUFS) {
+                conn->zerocopy_off = true;  // No memory for notices: copy instead
+                continue;
+            }
+            if (n <= 0) return false;
+        }
+        if (zerocopy) {
+            reactor->pieces[i].zerocopy = true;
+            reactor->pieces[i].seq = conn->zerocopy_seq++;
+        }
+
+        for (size_t left = (size_t)n; left > 0; ) {
+            size_t take = left < iov[*at].iov_len ? left : iov[*at].iov_len;
+            iov[*at].iov_base = (char*)iov[*at].iov_base + take;
+            iov[*at].iov_len -= take;
+            left -= take;
+            if (iov[*at].iov_len == 0) (*at)++;
+        }
+        if (conn->shm && *at == i) return true;  // The ring is full
+    }
+    return true;
+}
+
+// Send replies holding pinned values in one gathered sendmsg, the values
+// read from where they are stored. What the socket does not take is
+// copied to the connection. Values MSG_ZEROCOPY sends may still read stay
+// pinned, by the connection, until the kernel says it is done with them.
+static bool conn_send_pinned(reactor_t* reactor, conn_t* conn) {
+    conn_buf_t* replies = &reactor->replies;
+    size_t count = replies_pieces(reactor, replies), at = 0;
+    bool ok = count > 0;
+    if (ok && !conn->shm && reactor->server->options.zerocopy_min > 0 &&
+        conn->zerocopy_size - conn->zerocopy_count < replies->pin_count) {
+        size_t size = conn->zerocopy_count + replies->pin_count;
+        zerocopy_pin_t* pins = realloc(conn->zerocopy_pins, size * sizeof(*pins));
+        if (pins) {
+            conn->zerocopy_pins = pins;
+            conn->zerocopy_size = size;
+        }
+        ok = pins != NULL;
+    }
+    ok = ok && send_pieces(reactor, conn, count, &at);
+
+    for (size_t i = 0; i < count; i++) {
+        send_piece_t* piece = &reactor->pieces[i];
+        if (ok && i >= at) {
+            ok = conn_buf_append(&conn->out, reactor->iov[i].iov_base, reactor->iov[i].iov_len);
+        }
+        if (piece->zerocopy) {
+            conn->zerocopy_pins[conn->zerocopy_count++] =
+                (zerocopy_pin_t){ .seq = piece->seq, .ref = *piece->ref };
+            piece->ref->release = NULL; // Now the connection's
+        }
+    }
+    conn_buf_reset(replies);
+    return ok;
+}
+
+// Send the replies built in the reactor's buffer, or those the connection
+// kept; the connection keeps only what the socket did not take
+static bool conn_send(reactor_t* reactor, conn_t* conn) {
+    conn_buf_t* replies = &reactor->replies;
+    if (replies->len == 0) return conn_flush(reactor, conn);
+    if (replies->pin_count > 0) return conn_send_pinned(reactor, conn);
+    ssize_t sent = send_some(reactor, conn, replies->data, replies->len);
+    bool ok = sent >= 0 &&
+              conn_buf_append(&conn->out, replies->data + sent, replies->len - (size_t)sent);
+    replies->len = 0;
+    return ok;
+}
+
+// Where replies to requests run here go: behind any waiting on other
+// shards, else behind those still unsent, else straight out
+static conn_buf_t* conn_reply_buf(reactor_t* reactor, conn_t* conn) {
+    if (conn->replies) {
+        if (!conn->replies_tail->forwarded) return &conn->replies_tail->buf;
+        shard_msg_t* msg = msg_create(reactor, conn, false);
+        return msg ? &msg->buf : NULL;
+    }
+    return conn->out.len > 0 ? &conn->out : &reactor->replies;
+}
+
+static void outbox_add(reactor_t* reactor, unsigned to, shard_msg_t* msg) {
+    msg->next_out = NULL;
+    if (reactor->outbox_tail[to]) {
+        reactor->outbox_tail[to]->next_out = msg;
+    } else {
+        reactor->outbox[to] = msg;
+    }
+    reactor->outbox_tail[to] = msg;
+    reactor->outbox_waiting++;
+}
+
+typedef struct {
+    reactor_t* reactor;
+    conn_t* conn;
+} route_ctx_t;
+
+static conn_buf_t* forward_request(void* ctx, unsigned shard, uint8_t version,
+                                   const char* data, size_t len) {
+    route_ctx_t* route = ctx;
+    reactor_t* reactor = route->reactor;
+    conn_t* conn = route->conn;
+
+    // Requests in a row for one shard travel together
+    shard_msg_t* msg = conn->last_forward;
+    shard_msg_t* after = msg ? msg->next : NULL;
+    if (!msg || msg->shard != shard || after != conn->replies_tail || after->buf.len > 0) {
+        msg = msg_create(reactor, conn, true);
+        if (!msg) return NULL;
+        msg->shard = shard;
+        msg->version = version;
+        outbox_add(reactor, shard, msg);
+        conn->last_forward = msg;
+        conn->outstanding++;
+        after = NULL;
+    }
+    if (!conn_buf_append(&msg->buf, data, len)) return NULL;
+    msg->requests++;
+    conn->inflight++;
+    reactor->forwarded++;
+
+    if (!after && !(after = msg_create(reactor, conn, false))) return NULL;
+    return &after->buf;
+}
+
+static bool requests_settled(void* ctx) {
+    route_ctx_t* route = ctx;
+    return route->conn->outstanding == 0;
+}
+
+// Answer MSG_SHM_ATTACH with a region of rings and the two eventfds, and
+// serve the connection through them from now on. Returns 0 if the rings
+// could not be set up, so the request is refused as usual, or -1 if the
+// reply could not be sent.
+static int conn_attach_shm(reactor_t* reactor, conn_t* conn, uint32_t id) {
+    int memfd;
+    shm_region_t* region = shm_region_create(&memfd);
+    if (!region) {
+        log_warn("Failed to create shared memory: %s", strerror(errno));
+        return 0;
+    }
+    int doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    reactor->syscalls += 4;             // memfd_create, ftruncate, mmap, epoll_ctl
+    if (doorbell < 0 || wake < 0 ||
+        epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, doorbell, &ev) < 0) {
+        log_warn("Failed to set up shared memory: %s", strerror(errno));
+        if (doorbell >= 0) close(doorbell);
+        if (wake >= 0) close(wake);
+        close(memfd);
+        shm_region_unmap(region);
+        return 0;
+    }
+
+    char reply[KV_FRAME_HEADER_SIZE];
+    kv_frame_t frame = { .code = KV_SUCCESS, .id = id };
+    kv_frame_encode(reply, &frame);
+    int fds[3] = { memfd, doorbell, wake };
+    bool sent = shm_send_fds(conn->fd, reply, sizeof(reply), fds, 3);
+    close(memfd);                       // The mappings keep the memory
+    reactor->syscalls += 2;
+    conn->shm = region;
+    conn->shm_doorbell = doorbell;
+    conn->shm_wake = wake;
+    if (!sent) return -1;               // conn_close frees the rings
+
+    // From now on the socket only tells when the client hangs up
+    struct epoll_event hangup = { .events = EPOLLRDHUP, .data.ptr = conn };
+    reactor->syscalls++;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, conn->fd, &hangup) < 0) return -1;
+    conn->events = EPOLLRDHUP;
+    reactor->shm_connections++;
+    log_debug("Client attached to shared memory");
+    return 1;
+}
+
+// Whether data is just a MSG_SHM_ATTACH the connection may be granted: the
+// first request on a Unix socket connection, sent alone
+static bool shm_attach_request(reactor_t* reactor, conn_t* conn, const char* data,
+                               size_t len, kv_frame_t* frame) {
+    if (!conn->local || conn->shm || !reactor->server->options.shm ||
+        conn->version != KV_PROTO_V2 || conn->in.len > 0 || len != KV_FRAME_HEADER_SIZE ||
+        conn->replies || conn->out.len > 0 || reactor->replies.len > 0) {
+        return false;
+    }
+    kv_frame_decode(data, frame);
+    return frame->code == MSG_SHM_ATTACH && frame->key_len == 0 && frame->value_len == 0;
+}
+
+// Whether data is just a MSG_TRACK, sent alone so that its reply and the
+// invalidations cannot pass any other reply
+static bool track_request(reactor_t* reactor, conn_t* conn, const char* data, size_t len,
+                          kv_frame_t* frame) {
+    if (!reactor->tracking || conn->version != KV_PROTO_V2 || conn->in.len > 0 ||
+        len < KV_FRAME_HEADER_SIZE || conn->replies || conn->out.len > 0 ||
+        reactor->replies.len > 0) {
+        return false;
+    }
+    kv_frame_decode(data, frame);
+    return frame->code == MSG_TRACK && frame->key_len == 0 &&
+           len == KV_FRAME_HEADER_SIZE + (size_t)frame->value_len;
+}
+
+// Start tracking the connection as MSG_TRACK asks, or stop, and answer it
+static bool conn_track(reactor_t* reactor, conn_t* conn, const char* data,
+                       const kv_frame_t* frame) {
+    if (conn->tracking) {
+        tracking_unsubscribe(conn->tracking);
+        conn->tracking = NULL;
+    }
+    kv_error_t status = KV_SUCCESS;
+    if (!(frame->flags & KV_FRAME_UNTRACK)) {
+        conn->tracking = tracking_subscribe(reactor->tracking, &reactor->inbox, conn,
+                                            frame->flags, data + KV_FRAME_HEADER_SIZE,
+                                            frame->value_len);
+        if (!conn->tracking) status = KV_ERROR_INVALID_KEY;
+    }
+    char reply[KV_FRAME_HEADER_SIZE];
+    kv_frame_t answer = { .code = (uint8_t)status, .id = frame->id };
+    kv_frame_encode(reply, &answer);
+    reactor->requests++;
+    return conn_buf_append(conn_reply_buf(reactor, conn), reply, sizeof(reply));
+}
+
+// Send a connection the invalidations queued for it, from the inbox
+static void tracking_send(void* ctx, void* owner, tracking_sub_t* sub) {
+    reactor_t* reactor = ctx;
+    conn_t* conn = owner;
+    // A client that stopped reading is not kept up to date without bound
+    bool ok = tracking_take(sub, &conn->out) &&
+              conn->out.len <= REACTOR_MAX_PENDING * REACTOR_TRACKING_SLACK &&
+              conn_flush(reactor, conn) && conn_update_events(reactor, conn);
+    if (!ok) {
+        log_warn("Dropping a near cache client that is not keeping up");
+        conn_close(reactor, conn);
+    }
+}
+
+// Run the requests in data, just read, or with data NULL those kept in the
+// connection. What cannot run yet is kept for later, and so is what is
+// beyond the connection's turn.
+static bool conn_run(reactor_t* reactor, conn_t* conn, const char* data, size_t len) {
+    kv_frame_t attach;
+    if (data && shm_attach_request(reactor, conn, data, len, &attach)) {
+        int attached = conn_attach_shm(reactor, conn, attach.id);
+        if (attached != 0) return attached > 0;
+    }
+    kv_frame_t track;
+    if (data && track_request(reactor, conn, data, len, &track)) {
+        return conn_track(reactor, conn, data, &track);
+    }
+
+    // Usually whole requests arrive and run straight from the scratch
+    // buffer; only a request cut short is copied to the connection
+    if (conn->in.len > 0) {
+        if (data && !conn_buf_append(&conn->in, data, len)) return false;
+        data = conn->in.data;
+        len = conn->in.len;
+    }
+    if (!data) return true;
+
+    // A turn runs up to max_inflight requests, fewer while some are at
+    // other shards. Requests held back past the latency budget are shed.
+    const kv_server_options_t* options = &reactor->server->options;
+    request_limits_t limits = { .max_requests = options->max_inflight,
+                                .tracking = conn->tracking };
+    if (conn->backlog && options->latency_budget_ms > 0 &&
+        monotonic_ms() - conn->backlog_since > options->latency_budget_ms) {
+        limits.max_requests = 0;
+        limits.shed = true;
+    } else if (limits.max_requests > 0 && conn->inflight >= limits.max_requests) {
+        limits.capped = true;           // Not until some come back
+    } else {
+        limits.max_requests -= limits.max_requests > 0 ? conn->inflight : 0;
+    }
+
+    ssize_t used = 0;
+    if (!limits.capped) {
+        conn_buf_t* out = conn_reply_buf(reactor, conn);
+        if (!out) return false;
+        route_ctx_t ctx = { .reactor = reactor, .conn = conn };
+        request_router_t router = { .self = reactor->index, .forward = forward_request,
+                                    .settled = requests_settled, .ctx = &ctx };
+        used = request_process(&reactor->server->shards, reactor->count > 1 ? &router : NULL,
+                               &limits, &conn->version, data, len, out, &reactor->requests);
+        if (used < 0) return false;
+    }
+    if (limits.shed) {
+        reactor->shed += limits.handled;
+        log_debug("Shed %zu requests waiting over %u ms", limits.handled,
+                  options->latency_budget_ms);
+    }
+
+    if (conn->in.len > 0) {
+        conn_buf_consume(&conn->in, (size_t)used);
+        if (conn->in.len == 0) conn_buf_free(&conn->in);
+    } else if ((size_t)used < len &&
+               !conn_buf_append(&conn->in, data + used, len - (size_t)used)) {
+        return false;
+    }
+
+    // Stop reading until the next turn, or with every request allowed at
+    // other shards, until some come back
+    if (limits.capped && !conn->backlog) conn->backlog_since = monotonic_ms();
+    conn->backlog = limits.capped;
+    if (conn->backlog && conn->inflight < options->max_inflight) ready_add(reactor, conn);
+    return true;
+}
+
+// Run what the socket has, up to REACTOR_READS_PER_EVENT reads, and send
+// all the replies at once
+static bool conn_readable(reactor_t* reactor, conn_t* conn) {
+    bool open = true;
+    for (int i = 0; i < REACTOR_READS_PER_EVENT && !conn->backlog &&
+                    conn->out.len + reactor->replies.len < REACTOR_MAX_PENDING; i++) {
+        reactor->syscalls++;
+        ssize_t n = recv(conn->fd, reactor->scratch, REACTOR_READ_SIZE, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0 || !conn_run(reactor, conn, reactor->scratch, (size_t)n)) {
+            open = false;               // Still answer what came before
+            break;
+        }
+        if ((size_t)n < REACTOR_READ_SIZE) break;  // Drained the socket
+    }
+
+    // One send for every reply of every read
+    bool sent = conn_send(reactor, conn);
+    if (!open && sent && conn->replies) {
+        conn->eof = true;               // Some answers are still at other shards
+        return true;
+    }
+    return open && sent;
+}
+
+// The client rang: send what the reply ring had no room for, then run
+// what the request ring holds, as conn_readable does for a socket
+static bool shm_readable(reactor_t* reactor, conn_t* conn) {
+    uint64_t rung;
+    reactor->syscalls++;
+    if (read(conn->shm_doorbell, &rung, sizeof(rung)) < 0) {
+        // Rung again after this read, so read below or next time round
+    }
+    if (conn->out.len > 0 && !conn_flush(reactor, conn)) return false;
+
+    shm_ring_t* ring = &conn->shm->requests;
+    bool open = true, more = false;
+    for (int i = 0; open; ) {
+        if (conn->backlog) {
+            conn->ring_paused = true;   // Until its next turn
+            break;
+        }
+        if (i == REACTOR_READS_PER_EVENT ||
+            conn->out.len + reactor->replies.len >= REACTOR_MAX_PENDING) {
+            more = true;                // Back after the other connections
+            break;
+        }
+        size_t n = shm_ring_read(ring, reactor->scratch, REACTOR_READ_SIZE);
+        if (n == 0) {
+            if (shm_ring_wait_readable(ring)) break;
+            continue;                   // Arrived just now
+        }
+        if (shm_ring_writer_asleep(ring)) {
+            reactor->syscalls++;
+            shm_ring_bell(conn->shm_wake);
+        }
+        open = conn_run(reactor, conn, reactor->scratch, n);
+        i++;
+    }
+
+    // One write to the ring for every reply. Requests left in the ring
+    // wait for the doorbell: rung here, or by the client once it makes
+    // room for replies that did not fit.
+    bool sent = conn_send(reactor, conn);
+    if (more && conn->out.len == 0) {
+        reactor->syscalls++;
+        shm_ring_bell(conn->shm_doorbell);
+    }
+    return open && sent;
+}
+
+// Pass on replies that are ready, in order; then run the requests that
+// waited for them
+static bool conn_deliver(reactor_t* reactor, conn_t* conn) {
+    if (conn->failed) return false;
+    while (conn->replies && (!conn->replies->forwarded || conn->replies->returned)) {
+        shard_msg_t* msg = conn->replies;
+        conn->replies = msg->next;
+        if (!conn->replies) conn->replies_tail = NULL;
+        bool ok = conn_buf_append(&conn->out, msg->buf.data, msg->buf.len);
+        msg_free(msg);
+        if (!ok) return false;
+    }
+    if ((conn->outstanding == 0 || conn->backlog) && !conn->eof &&
+        !conn_run(reactor, conn, NULL, 0)) {
+        return false;
+    }
+    if (!conn_send(reactor, conn)) return false;
+    if (conn->eof && !conn->replies) return false;
+    return conn_update_events(reactor, conn);
+}
+
+// A connection holding requests back takes its turn
+static bool conn_turn(reactor_t* reactor, conn_t* conn) {
+    return !conn->failed && conn_run(reactor, conn, NULL, 0) && conn_send(reactor, conn) &&
+           conn_update_events(reactor, conn);
+}
+
+// Give every connection that was waiting before this pass of the loop its
+// turn; those still holding requests back go to the end of the line
+static void reactor_turns(reactor_t* reactor) {
+    while (reactor->ready && reactor->ready->ready_round < reactor->round) {
+        conn_t* conn = reactor->ready;
+        reactor->ready = conn->next_ready;
+        if (!reactor->ready) reactor->ready_tail = NULL;
+        conn->ready = false;
+        if (!conn_turn(reactor, conn)) {
+            log_debug("Client disconnected");
+            conn_close(reactor, conn);
+        }
+    }
+}
+
+static bool queue_push(shard_queue_t* queue, shard_msg_t* msg) {
+    uint64_t head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == REACTOR_QUEUE_SLOTS) {
+        return false;
+    }
+    queue->slots[head & (REACTOR_QUEUE_SLOTS - 1)] = msg;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static shard_msg_t* queue_pop(shard_queue_t* queue) {
+    uint64_t tail = queue->tail;
+    if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return NULL;
+    shard_msg_t* msg = queue->slots[tail & (REACTOR_QUEUE_SLOTS - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return msg;
+}
+
+// Queue what the outboxes hold, ringing each reactor given something once.
+// Whatever a full queue does not take waits for the next round.
+static void reactor_dispatch(reactor_t* reactor) {
+    for (unsigned to = 0; to < reactor->count && reactor->outbox_waiting > 0; to++) {
+        shard_msg_t* msg = reactor->outbox[to];
+        if (!msg) continue;
+
+        shard_queue_t* queue = &reactor->queues[reactor->index * reactor->count + to];
+        bool queued = false;
+        while (msg) {
+            shard_msg_t* next = msg->next_out;
+            // Once queued it belongs to the other reactor until it returns
+            conn_t* conn = msg->origin == reactor->index ? msg->conn : NULL;
+            if (conn && conn->last_forward == msg) conn->last_forward = NULL;
+            if (!queue_push(queue, msg)) break;
+            reactor->outbox_waiting--;
+            queued = true;
+            msg = next;
+        }
+        reactor->outbox[to] = msg;
+        if (!msg) reactor->outbox_tail[to] = NULL;
+
+        reactor->syscalls += queued;
+        if (queued) shm_ring_bell(reactor->all[to].doorbell);
+    }
+}
+
+// Run requests another reactor forwarded, and send them back
+static void msg_run(reactor_t* reactor, shard_msg_t* msg) {
+    conn_buf_t replies = { 0 };
+    uint8_t version = msg->version;
+    ssize_t used = request_process(&reactor->server->shards, NULL, NULL, &version,
+                                   msg->buf.data, msg->buf.len, &replies, &reactor->requests);
+    msg->failed = used < 0 || (size_t)used != msg->buf.len;
+    conn_buf_free(&msg->buf);
+    msg->buf = replies;
+    outbox_add(reactor, msg->origin, msg);
+}
+
+// Take in everything other reactors queued: requests to run here, and
+// replies to requests this reactor forwarded
+static void reactor_receive(reactor_t* reactor) {
+    uint64_t rung;
+    reactor->syscalls++;
+    if (read(reactor->doorbell, &rung, sizeof(rung)) < 0) {
+        // Rung again after this read, so taken in below or next time round
+    }
+
+    for (unsigned from = 0; from < reactor->count; from++) {
+        shard_queue_t* queue = &reactor->queues[from * reactor->count + reactor->index];
+        shard_msg_t* msg;
+        while (from != reactor->index && (msg = queue_pop(queue))) {
+            if (msg->origin != reactor->index) {
+                msg_run(reactor, msg);
+                continue;
+            }
+            conn_t* conn = msg->conn;
+            if (!conn) {
+                msg_free(msg);          // The connection closed meanwhile
+                continue;
+            }
+            msg->returned = true;
+            conn->outstanding--;
+            conn->inflight -= msg->requests;
+            if (msg->failed) conn->failed = true;
+            if (!conn->dirty) {
+                conn->dirty = true;
+                conn->next_dirty = reactor->dirty;
+                reactor->dirty = conn;
+            }
+        }
+    }
+
+    // One send per connection for all the replies that came back
+    while (reactor->dirty) {
+        conn_t* conn = reactor->dirty;
+        reactor->dirty = conn->next_dirty;
+        conn->dirty = false;
+        if (!conn_deliver(reactor, conn)) {
+            log_debug("Client disconnected");
+            conn_close(reactor, conn);
+        }
+    }
+}
+
+static void accept_connections(reactor_t* reactor, int listen_fd) {
+    bool local = listen_fd == reactor->server->unix_socket;
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        reactor->syscalls++;
+        int fd = accept4(listen_fd, (struct sockaddr*)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if (!reactor_admit(reactor->server)) {
+            close(fd);
+            continue;
+        }
+
+        int opt = 1;
+        if (!local) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        reactor->syscalls += 2 - local; // setsockopt, epoll_ctl
+
+        conn_t* conn = calloc(1, sizeof(conn_t));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if (!conn || epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            log_error("Failed to register connection: %s", strerror(errno));
+            free(conn);
+            close(fd);
+            reactor_release(reactor->server);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->local = local;
+        conn->next = reactor->conns;
+        if (reactor->conns) reactor->conns->prev = conn;
+        reactor->conns = conn;
+        reactor->connections++;
+
+        if (local) {
+            log_debug("New connection on %s", reactor->server->unix_path);
+        } else if (log_enabled(LOG_DEBUG)) {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+            log_debug("New connection from %s:%d", client_ip, ntohs(addr.sin_port));
+        }
+    }
+}
+
+static void* reactor_loop(void* arg) {
+    reactor_t* reactor = arg;
+    kv_server_t* server = reactor->server;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (reactor->cpu >= 0) {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(reactor->cpu, &cpu);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+    }
+
+    while (server->is_running) {
+        reactor->round++;
+        reactor->syscalls++;
+        // Turns waiting are taken straight after this; messages a full
+        // queue turned away are retried shortly
+        int n = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS,
+                           reactor->ready ? 0 : reactor->outbox_waiting > 0 ? 1 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &server->wake_fd) continue;  // Loop condition decides
+            if (source == &reactor->doorbell) {
+                reactor_receive(reactor);
+                continue;
+            }
+            if (source == &reactor->inbox) {
+                tracking_inbox_drain(&reactor->inbox, tracking_send, reactor);
+                continue;
+            }
+            if (source == NULL) {
+                accept_connections(reactor, reactor->listen_fd);
+                continue;
+            }
+            if (source == &server->unix_socket) {
+                accept_connections(reactor, server->unix_socket);
+                continue;
+            }
+
+            conn_t* conn = source;
+            uint32_t ev = events[i].events;
+            bool ok;
+            if (conn->closed) continue;
+            if (conn->lingering) {
+                zerocopy_reap(reactor, conn);
+                if (conn->zerocopy_count == 0) conn_lingered(reactor, conn);
+                continue;
+            }
+            if (conn->shm) {
+                // Only the socket reports hang-ups, only the doorbell input
+                ok = !(ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) && shm_readable(reactor, conn);
+            } else {
+                // Notices of MSG_ZEROCOPY sends done arrive as errors too
+                ok = (!(ev & EPOLLERR) || (conn->zerocopy && zerocopy_reap(reactor, conn))) &&
+                     !(conn->eof && (ev & EPOLLHUP));
+                if (ok && (ev & EPOLLOUT)) ok = conn_flush(reactor, conn);
+                if (ok && !conn->eof && (ev & (EPOLLIN | EPOLLHUP))) {
+                    ok = conn_readable(reactor, conn);
+                }
+                if (ok) ok = conn_update_events(reactor, conn);
+            }
+            if (!ok) {
+                log_debug("Client disconnected");
+                conn_close(reactor, conn);
+            }
+        }
+        reactor_turns(reactor);
+        free_closed(reactor);
+        if (reactor->outbox_waiting > 0) reactor_dispatch(reactor);
+    }
+    return NULL;
+}
+
+static bool reactor_init(reactor_t* reactor, kv_server_t* server, bool first) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->server = server;
+    reactor->listen_fd = -1;
+    reactor->doorbell = -1;
+    reactor->cpu = -1;
+    reactor->inbox.bell = -1;
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->scratch = malloc(REACTOR_READ_SIZE);
+    reactor->replies.pin_min = REACTOR_PIN_MIN;
+    if (reactor->epfd < 0 || !reactor->scratch) return false;
+
+    // Reactors past the first get their own listener when they can
+    uint32_t listen_events = EPOLLIN;
+    if (first || !server->reuseport ||
+        (reactor->listen_fd = reactor_listen(server->port, true)) < 0) {
+        reactor->listen_fd = server->socket;
+        // Wake only one of the reactors sharing the listener per connection
+        if (!server->reuseport || !first) listen_events |= EPOLLEXCLUSIVE;
+    } else {
+        reactor->own_listener = true;
+    }
+
+    // Every reactor takes its turn at the Unix socket
+    struct epoll_event listen_ev = { .events = listen_events, .data.ptr = NULL };
+    struct epoll_event unix_ev = { .events = EPOLLIN | EPOLLEXCLUSIVE,
+                                   .data.ptr = &server->unix_socket };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &server->wake_fd };
+    return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->listen_fd, &listen_ev) == 0 &&
+           (server->unix_socket < 0 ||
+            epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, server->unix_socket, &unix_ev) == 0) &&
+           epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, server->wake_fd, &wake_ev) == 0;
+}
+
+// Sharded: one queue to every other reactor, and a doorbell for theirs
+static bool reactor_init_shard(reactor_t* reactor, reactor_t* all, unsigned index,
+                               unsigned count, shard_queue_t* queues) {
+    reactor->index = index;
+    reactor->count = count;
+    reactor->all = all;
+    reactor->queues = queues;
+    reactor->outbox = calloc(count, sizeof(*reactor->outbox));
+    reactor->outbox_tail = calloc(count, sizeof(*reactor->outbox_tail));
+    reactor->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &reactor->doorbell };
+    return reactor->outbox && reactor->outbox_tail && reactor->doorbell >= 0 &&
+           epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->doorbell, &ev) == 0;
+}
+
+// Near caches: an inbox for invalidations to this reactor's connections
+static bool reactor_init_tracking(reactor_t* reactor, kv_tracking_t* tracking) {
+    if (!tracking) return true;
+    reactor->tracking = tracking;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &reactor->inbox };
+    return tracking_inbox_init(&reactor->inbox) &&
+           epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->inbox.bell, &ev) == 0;
+}
+
+static void reactor_cleanup(reactor_t* reactor) {
+    while (reactor->conns) conn_close(reactor, reactor->conns);
+    while (reactor->lingering) conn_lingered(reactor, reactor->lingering);
+    free_closed(reactor);
+    tracking_inbox_destroy(&reactor->inbox);
+    if (reactor->own_listener) close(reactor->listen_fd);
+    if (reactor->epfd >= 0) close(reactor->epfd);
+    conn_buf_free(&reactor->replies);
+    free(reactor->iov);
+    free(reactor->pieces);
+    free(reactor->scratch);
+}
+
+// Free the messages in flight once every reactor has stopped and closed
+// its connections
+static void shards_cleanup(reactor_t* reactors, unsigned count, shard_queue_t* queues) {
+    for (unsigned i = 0; i < count; i++) {
+        reactor_t* reactor = &reactors[i];
+        for (unsigned to = 0; reactor->outbox && to < count; to++) {
+            while (reactor->outbox[to]) {
+                shard_msg_t* msg = reactor->outbox[to];
+                reactor->outbox[to] = msg->next_out;
+                msg_free(msg);
+            }
+        }
+        free(reactor->outbox);
+        free(reactor->outbox_tail);
+        if (reactor->doorbell >= 0) close(reactor->doorbell);
+    }
+    for (size_t q = 0; queues && q < (size_t)count * count; q++) {
+        shard_msg_t* msg;
+        while ((msg = queue_pop(&queues[q]))) msg_free(msg);
+    }
+    free(queues);
+}
+
+// Pin each shard's reactor to a CPU of its own among those allowed. Pages
+// are placed on the node of the CPU that first touches them, so the
+// memory a shard grows into is local to its reactor as well.
+static void assign_cpus(reactor_t* reactors, unsigned count) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    int cpus = CPU_COUNT(&allowed);
+    for (unsigned i = 0; i < count && cpus > 0; i++) {
+        int nth = (int)(i % (unsigned)cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+                reactors[i].cpu = cpu;
+                break;
+            }
+        }
+    }
+}
+
+bool reactor_run(kv_server_t* server) {
+    unsigned count = server->options.reactors;
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    // Every shard needs its reactor, or requests forwarded to it would wait
+    // forever
+    bool sharded = server->shards.count > 1;
+    if (sharded) count = server->shards.count;
+
+    reactor_t* reactors = calloc(count, sizeof(reactor_t));
+    shard_queue_t* queues = NULL;
+    if (sharded && posix_memalign((void**)&queues, 64,
+                                  (size_t)count * count * sizeof(*queues)) == 0) {
+        memset(queues, 0, (size_t)count * count * sizeof(*queues));
+    }
+    kv_tracking_t* tracking = NULL;
+    if (server->options.tracking_keys > 0 &&
+        !(tracking = tracking_create(server->options.tracking_keys))) {
+        log_warn("Failed to set up tracking; near caches are refused");
+    }
+    if (!reactors || (sharded && !queues)) {
+        tracking_destroy(tracking);
+        free(reactors);
+        free(queues);
+        return false;
+    }
+
+    unsigned ready = 0;
+    while (ready < count && reactor_init(&reactors[ready], server, ready == 0) &&
+           (!sharded || reactor_init_shard(&reactors[ready], reactors, ready, count, queues)) &&
+           reactor_init_tracking(&reactors[ready], tracking)) {
+        ready++;
+    }
+    if (ready < count) {
+        reactor_cleanup(&reactors[ready]);
+        if (ready == 0 || sharded) {
+            log_error("Failed to start an event loop: %s", strerror(errno));
+            for (unsigned i = 0; i < ready; i++) reactor_cleanup(&reactors[i]);
+            if (sharded) shards_cleanup(reactors, ready + 1, NULL);
+            tracking_destroy(tracking);
+            free(queues);
+            free(reactors);
+            return false;
+        }
+        log_warn("running %u of %u event loops", ready, count);
+    }
+    log_info("Serving with %u event loop%s%s%s", ready, ready > 1 ? "s" : "",
+             server->reuseport && ready > 1 ? " (SO_REUSEPORT)" : "",
+             sharded ? ", one per shard" : "");
+
+    for (unsigned i = 0; tracking && i < server->shards.count; i++) {
+        kv_store_watch(server->shards.stores[i], tracking_written, tracking);
+    }
+
+    cpu_set_t saved;
+    bool pinned = sharded && sched_getaffinity(0, sizeof(saved), &saved) == 0;
+    if (pinned) assign_cpus(reactors, count);
+
+    unsigned started = 1;
+    while (started < ready &&
+           pthread_create(&reactors[started].thread, NULL, reactor_loop, &reactors[started]) == 0) {
+        started++;
+    }
+    if (started < ready && sharded) {
+        log_error("Failed to start an event loop for every shard");
+        kv_server_request_stop(server);
+    }
+    // A listener nobody accepts on would strand the connections sent to it
+    for (unsigned i = started; i < ready; i++) reactor_cleanup(&reactors[i]);
+    ready = started;
+
+    reactor_loop(&reactors[0]);
+    for (unsigned i = 1; i < started; i++) pthread_join(reactors[i].thread, NULL);
+    if (pinned) sched_setaffinity(0, sizeof(saved), &saved);
+
+    uint64_t requests = 0, syscalls = 0, forwarded = 0, shm_connections = 0, shed = 0;
+    for (unsigned i = 0; i < ready; i++) {
+        requests += reactors[i].requests;
+        syscalls += reactors[i].syscalls;
+        forwarded += reactors[i].forwarded;
+        shm_connections += reactors[i].shm_connections;
+        shed += reactors[i].shed;
+        reactor_cleanup(&reactors[i]);
+    }
+    reactor_report("epoll", requests, syscalls);
+    if (shed > 0) {
+        log_info("epoll: %llu requests shed past the latency budget", (unsigned long long)shed);
+    }
+    if (server->unix_socket >= 0) {
+        log_info("epoll: %llu connections attached to shared memory",
+                 (unsigned long long)shm_connections);
+    }
+    if (sharded) {
+        log_info("epoll: %llu requests forwarded to another shard",
+                 (unsigned long long)forwarded);
+        shards_cleanup(reactors, count, queues);
+    }
+    if (tracking) {
+        for (unsigned i = 0; i < server->shards.count; i++) {
+            kv_store_watch(server->shards.stores[i], NULL, NULL);
+        }
+        uint64_t pushed, forgotten;
+        tracking_stats(tracking, &pushed, &forgotten);
+        log_info("epoll: %llu invalidations pushed to near caches, %llu keys forgotten",
+                 (unsigned long long)pushed, (unsigned long long)forgotten);
+        tracking_destroy(tracking);
+    }
+    free(reactors);
+    return true;
+}
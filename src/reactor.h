@@ -0,0 +1,80 @@
+// Event-driven connection handling with epoll
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "kv_store.h"
+
+// Each reactor thread owns an epoll set, a listener and every connection
+// it accepts, so connections never move between threads and need no
+// locks. With SO_REUSEPORT the kernel spreads new connections over the
+// reactors' listeners; without it they share the server's listener.
+// Sockets are non-blocking: a reactor reads whatever has arrived, runs
+// every complete request in it and writes the replies, keeping what the
+// socket does not take until it is writable again. An idle connection
+// costs a socket and a conn_t, no thread or buffers.
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_SIZE (64 * 1024)   // Per-reactor receive buffer
+#define REACTOR_READS_PER_EVENT 4       // Before moving on to other connections
+#define REACTOR_MAX_PENDING (1024 * 1024) // Unsent reply bytes that pause reading
+// Invalidations for a near cache keep coming while reading is paused; a
+// connection with this many times the above unsent is closed instead
+#define REACTOR_TRACKING_SLACK 16
+
+// A sharded server runs one reactor per shard, pinned to a CPU. A
+// connection stays with the reactor that accepted it; requests for keys
+// of another shard are copied to that shard's reactor over a lock-free
+// queue, one per pair of reactors, and their replies come back the same
+// way to go out in request order. Consecutive requests for one shard
+// travel as one message, and each reactor rings another's eventfd at most
+// once per pass of its loop.
+#define REACTOR_QUEUE_SLOTS 256         // Messages in flight from one reactor to another
+
+// Connections on the Unix socket are served like any other, and may trade
+// the socket for shared-memory rings (shm.h). The reactor then waits on
+// the connection's doorbell eventfd instead of its socket, reading
+// requests from one ring and writing replies to the other; it watches
+// the socket only for the client hanging up.
+
+// Connections take turns: one runs at most options.max_inflight requests
+// (fewer while some are at other shards), then holds the rest back and
+// stops reading until every other connection with work has had its turn.
+// Held-back requests that have waited longer than the latency budget are
+// all answered KV_ERROR_BUSY at the connection's next turn instead of
+// run, which keeps a queue too long to serve in time from growing the
+// tail latency of everyone behind it.
+
+// GET values of REACTOR_PIN_MIN bytes or more are not copied into the
+// replies: the entry holding one is pinned (kv_store_get_ref) and the
+// value gathered from where it lies into the reply's sendmsg, then
+// released. Those of options.zerocopy_min bytes or more go out over TCP
+// with MSG_ZEROCOPY instead, and the kernel reads them while the loop
+// moves on; the connection keeps each pinned until the socket's error
+// queue says that send is done, even past closing, when the socket is
+// shut down but kept open to hear it. Where the kernel reports copying
+// anyway, as over loopback, the connection goes back to plain sends.
+#define REACTOR_PIN_MIN (4 * 1024)
+
+// Listening TCP socket on port, non-blocking, optionally with
+// SO_REUSEPORT. Returns -1 with errno set on failure.
+int reactor_listen(int port, bool reuseport);
+
+// Listening Unix socket at path, non-blocking. A stale socket file left by
+// a server that is gone is replaced. Returns -1 with errno set on failure.
+int reactor_listen_unix(const char* path);
+
+// Count a new connection against options.max_connections, shared by every
+// loop. Returns false, and the connection is to be refused, if it is over.
+bool reactor_admit(kv_server_t* server);
+// The connection admitted has closed
+void reactor_release(kv_server_t* server);
+
+// Print how many syscalls the loops made per request served
+void reactor_report(const char* backend, uint64_t requests, uint64_t syscalls);
+
+// Run server->options.reactors reactors (one per shard when sharded), the
+// first on the calling thread, until the server is stopped. Returns false
+// if none could start, or when sharded, if any could not.
+bool reactor_run(kv_server_t* server);
+
+#endif // REACTOR_H
@@ -0,0 +1,920 @@
+#include "replication.h"
+#include "clock.h"
+#include "hash.h"
+#include "log.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REPL_STRIPE_SEED 0x7265706c73747269ull
+#define REPL_ID_SEED 0x7265706c2d696421ull
+#define REPL_TIMEOUT_SEC 1              // Connecting and the handshake
+#define REPL_ACK_SIZE (KV_FRAME_HEADER_SIZE + sizeof(uint64_t))
+#define REPL_STACK_RECORD 512           // Records this small are encoded on the stack
+#define REPL_CLEAR_KEYS 1024            // Deleted at a time when a backup is cleared
+#define REPL_PAGES_PER_SEC 10           // Under a sync rate, pages are cut this small
+#define REPL_MIN_PAGE 4096
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t size;
+} repl_buf_t;
+
+typedef struct {
+    uint64_t end;                       // Backup's offset once it is applied
+    uint64_t since;                     // When its oldest record was appended, 0: a page
+} repl_inflight_t;
+
+// Keys, and values if wanted, of one scan of a store
+typedef struct {
+    repl_buf_t buf;                     // Per key: key and value length (4 each), both
+    size_t count;
+    size_t max_count;
+    size_t max_bytes;
+    const char* skip;                   // A key not to collect, the last page's last
+    size_t skip_len;
+    bool values;
+    bool full;                          // Stopped at max_count or max_bytes
+    bool failed;
+} repl_page_t;
+
+struct replication {
+    const kv_shards_t* shards;          // Paged through by full syncs
+    struct sockaddr_in addr;
+    char name[INET_ADDRSTRLEN + 8];
+    uint64_t id;                        // Tells backups this stream from others
+    size_t sync_rate;                   // Page bytes/s of a full sync, 0: no limit
+    size_t page_size;                   // Bytes a page of it holds about
+    pthread_mutex_t stripes[REPL_STRIPES];
+
+    pthread_mutex_t lock;               // Guards the fields up to the sender's own
+    char* backlog;                      // Ring of the stream's last backlog_size bytes
+    size_t backlog_size;
+    uint64_t offset;                    // End of the stream
+    uint64_t lost;                      // The stream before this is not all in the ring
+    uint64_t taken;                     // Handed to the sender up to here
+    uint64_t pending_since;             // clock_now_ms of the first record past taken
+    uint64_t oldest;                    // Of the oldest record sent but not acked, 0: none
+    bool stopping;
+    kv_repl_stats_t stats;              // Bar offset and lag, filled in by repl_stats
+    int bell;                           // eventfd: records past taken, or stop
+
+    // The sender's own
+    pthread_t thread;
+    int fd;                             // -1 while disconnected
+    uint64_t sent;                      // Stream framed up to here
+    uint64_t taken_since;               // pending_since when taken last moved
+    repl_buf_t out;                     // Frames not yet written
+    size_t out_at;
+    char in[REPL_ACK_SIZE * REPL_MAX_INFLIGHT];
+    size_t in_len;
+    repl_inflight_t inflight[REPL_MAX_INFLIGHT];
+    size_t inflight_head;
+    size_t inflight_count;
+    uint64_t acked;
+    uint32_t next_id;
+
+    // A full sync under way
+    bool syncing;
+    bool clearing;                      // Until the backup finds its stores clear
+    unsigned sync_store;                // Being paged through
+    char* sync_after;                   // Its last key sent, or NULL
+    size_t sync_after_len;
+    uint64_t sync_began;                // clock_now_ms
+    uint64_t sync_bytes;                // Of pages sent
+    uint64_t sync_keys;
+    repl_page_t page;
+};
+
+struct repl_replica {
+    pthread_mutex_t lock;
+    uint64_t id;                        // Stream followed, 0: none yet
+    uint64_t syncing;                   // Stream whose full sync is under way, 0: none
+    uint64_t offset;                    // Applied up to here
+};
+
+static bool buf_reserve(repl_buf_t* buf, size_t more) {
+    if (buf->size - buf->len >= more) return true;
+    size_t size = buf->size ? buf->size : 4096;
+    while (size - buf->len < more) size *= 2;
+    char* data = realloc(buf->data, size);
+    if (!data) return false;
+    buf->data = data;
+    buf->size = size;
+    return true;
+}
+
+static bool collect_page(void* ctx, const char* key, size_t key_len,
+                         const char* value, size_t value_len) {
+    repl_page_t* page = ctx;
+    if (page->skip && key_len == page->skip_len && memcmp(key, page->skip, key_len) == 0) {
+        return true;
+    }
+    if (!page->values) value_len = 0;
+    if (!buf_reserve(&page->buf, 2 * sizeof(uint32_t) + key_len + value_len)) {
+        page->failed = true;
+        return false;
+    }
+    char* p = page->buf.data + page->buf.len;
+    uint32_t lens[2] = { (uint32_t)key_len, (uint32_t)value_len };
+    memcpy(p, lens, sizeof(lens));
+    memcpy(p + sizeof(lens), key, key_len);
+    memcpy(p + sizeof(lens) + key_len, value, value_len);
+    page->buf.len += sizeof(lens) + key_len + value_len;
+    page->full = ++page->count == page->max_count || page->buf.len >= page->max_bytes;
+    return !page->full;
+}
+
+// Scan store into page from start, which is skipped if it is page->skip
+static kv_error_t scan_page(kv_store_t* store, const char* start, size_t start_len,
+                            repl_page_t* page) {
+    page->buf.len = 0;
+    page->count = 0;
+    page->full = false;
+    page->failed = false;
+    kv_error_t result = kv_store_scan(store, start, start_len, NULL, 0, collect_page, page);
+    return result == KV_SUCCESS && page->failed ? KV_ERROR_NO_SPACE : result;
+}
+
+// The item of page at *at, moving *at past it
+static void page_item(const repl_page_t* page, size_t* at, kv_batch_item_t* item) {
+    uint32_t lens[2];
+    memcpy(lens, page->buf.data + *at, sizeof(lens));
+    item->key = page->buf.data + *at + sizeof(lens);
+    item->key_len = lens[0];
+    item->value = item->key + lens[0];
+    item->value_len = lens[1];
+    *at += sizeof(lens) + lens[0] + lens[1];
+}
+
+// Copy len bytes of the stream at offset into the ring, or out of it;
+// under lock
+static void ring_write(replication_t* repl, uint64_t offset, const char* data, size_t len) {
+    size_t at = (size_t)(offset % repl->backlog_size);
+    size_t first = repl->backlog_size - at < len ? repl->backlog_size - at : len;
+    memcpy(repl->backlog + at, data, first);
+    memcpy(repl->backlog, data + first, len - first);
+}
+
+static void ring_read(const replication_t* repl, uint64_t offset, void* out, size_t len) {
+    size_t at = (size_t)(offset % repl->backlog_size);
+    size_t first = repl->backlog_size - at < len ? repl->backlog_size - at : len;
+    memcpy(out, repl->backlog + at, first);
+    memcpy((char*)out + first, repl->backlog, len - first);
+}
+
+// Whether the ring has all of the stream from offset to its end; under lock
+static bool ring_holds(const replication_t* repl, uint64_t offset) {
+    return offset >= repl->lost && offset <= repl->offset &&
+           repl->offset - offset <= repl->backlog_size;
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Connect, say hello and ask the backup which stream it follows and how
+// far it got, blocking under timeouts; then nonblocking. The socket, or -1.
+static int open_backup(replication_t* repl, uint64_t* id, uint64_t* offset) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+    struct timeval tv = { .tv_sec = REPL_TIMEOUT_SEC };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&repl->addr, sizeof(repl->addr)) < 0) {
+        log_debug("Connection to backup %s failed: %s", repl->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    char hello[KV_HELLO_SIZE];
+    kv_hello_encode(hello, KV_PROTO_V2);
+    if (!send_all(fd, hello, sizeof(hello)) || !recv_all(fd, hello, sizeof(hello)) ||
+        kv_hello_decode(hello) != KV_PROTO_V2) {
+        log_error("Backup %s does not speak protocol v2", repl->name);
+        close(fd);
+        return -1;
+    }
+
+    char query[REPL_ACK_SIZE] = { 0 };
+    kv_frame_t frame = { .code = MSG_REPLICATE, .flags = KV_FRAME_REPL_QUERY,
+                         .id = repl->next_id++ };
+    kv_frame_encode(query, &frame);
+    char reply[2 * sizeof(uint64_t)];
+    bool answered = send_all(fd, query, sizeof(query)) &&
+                    recv_all(fd, query, KV_FRAME_HEADER_SIZE);
+    if (answered) kv_frame_decode(query, &frame);
+    if (!answered || frame.code != KV_SUCCESS || frame.value_len != sizeof(reply) ||
+        !recv_all(fd, reply, sizeof(reply))) {
+        log_error("Backup %s would not say where it stands", repl->name);
+        close(fd);
+        return -1;
+    }
+    *id = kv_get_u64(reply);
+    *offset = kv_get_u64(reply + sizeof(uint64_t));
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Make room in out for a frame's header and extras; where they go, or
+// SIZE_MAX. The value is appended after them, then frame_end queues it.
+static size_t frame_begin(replication_t* repl) {
+    if (!buf_reserve(&repl->out, REPL_ACK_SIZE)) return SIZE_MAX;
+    size_t header_at = repl->out.len;
+    repl->out.len += REPL_ACK_SIZE;
+    return header_at;
+}
+
+static void frame_end(replication_t* repl, size_t header_at, uint8_t flags, uint64_t start,
+                      uint64_t end, uint64_t since) {
+    size_t value_len = repl->out.len - header_at - REPL_ACK_SIZE;
+    kv_frame_t frame = { .code = MSG_REPLICATE, .flags = flags,
+                         .value_len = (uint32_t)value_len, .id = repl->next_id++ };
+    kv_frame_encode(repl->out.data + header_at, &frame);
+    kv_put_u64(repl->out.data + header_at + KV_FRAME_HEADER_SIZE, start);
+    size_t slot = (repl->inflight_head + repl->inflight_count++) % REPL_MAX_INFLIGHT;
+    repl->inflight[slot] = (repl_inflight_t){ .end = end, .since = since };
+}
+
+static void sync_end(replication_t* repl) {
+    free(repl->sync_after);
+    repl->sync_after = NULL;
+    repl->syncing = false;
+    repl->clearing = false;
+}
+
+// Stream to the backup from the offset it reached, if it follows this
+// stream and the ring still has it; otherwise have it clear its stores
+// and start a full sync. False if out of memory.
+static bool start_stream(replication_t* repl, uint64_t backup_id, uint64_t backup_offset) {
+    repl->out.len = 0;
+    repl->out_at = 0;
+    repl->in_len = 0;
+    repl->inflight_count = 0;
+
+    pthread_mutex_lock(&repl->lock);
+    bool partial = backup_id == repl->id && ring_holds(repl, backup_offset);
+    uint64_t start = partial ? backup_offset : repl->offset;
+    repl->taken = start;
+    repl->pending_since = clock_now_ms();
+    repl->oldest = 0;
+    repl->stats.connected = true;
+    repl->stats.syncing = !partial;
+    if (partial) {
+        repl->stats.partial_syncs++;
+    } else {
+        repl->stats.full_syncs++;
+    }
+    repl->stats.acked = start;
+    pthread_mutex_unlock(&repl->lock);
+    repl->sent = start;
+    repl->acked = start;
+
+    if (partial) {
+        log_info("Resuming backup %s at offset %llu", repl->name, (unsigned long long)start);
+        return true;
+    }
+    log_info("Full sync to backup %s", repl->name);
+    repl->syncing = true;
+    repl->clearing = true;
+    repl->sync_store = 0;
+    repl->sync_began = clock_now_ms();
+    repl->sync_bytes = 0;
+    repl->sync_keys = 0;
+    return true;
+}
+
+// Frame a FULL, which has the backup clear a slice of its stores, taking
+// the stream from here: the one the backup finds clear is where it starts.
+// False if out of memory.
+static bool send_full(replication_t* repl) {
+    pthread_mutex_lock(&repl->lock);
+    uint64_t start = repl->offset;
+    repl->taken = start;
+    repl->pending_since = clock_now_ms();
+    pthread_mutex_unlock(&repl->lock);
+    repl->sent = start;
+    repl->acked = start;
+
+    size_t header_at = frame_begin(repl);
+    if (header_at == SIZE_MAX || !buf_reserve(&repl->out, sizeof(uint64_t))) return false;
+    kv_put_u64(repl->out.data + repl->out.len, repl->id);
+    repl->out.len += sizeof(uint64_t);
+    frame_end(repl, header_at, KV_FRAME_REPL_FULL, start, start, 0);
+    return true;
+}
+
+static void disconnect(replication_t* repl, const char* why) {
+    log_warn("Lost backup %s: %s", repl->name, why);
+    close(repl->fd);
+    repl->fd = -1;
+    sync_end(repl);
+    pthread_mutex_lock(&repl->lock);
+    repl->stats.connected = false;
+    repl->stats.syncing = false;
+    pthread_mutex_unlock(&repl->lock);
+}
+
+// ms until the full sync may send its next page, keeping to sync_rate
+static int throttle_wait(const replication_t* repl) {
+    if (!repl->sync_rate) return 0;
+    uint64_t due = repl->sync_began + repl->sync_bytes * 1000 / repl->sync_rate;
+    uint64_t now = clock_now_ms();
+    return due > now ? (int)(due - now) : 0;
+}
+
+// Frame the end of the full sync, after its last page: the backup
+// follows the stream, and may resume it, only from here
+static bool send_done(replication_t* repl) {
+    size_t header_at = frame_begin(repl);
+    if (header_at == SIZE_MAX || !buf_reserve(&repl->out, sizeof(uint64_t))) return false;
+    kv_put_u64(repl->out.data + repl->out.len, repl->id);
+    repl->out.len += sizeof(uint64_t);
+    frame_end(repl, header_at, KV_FRAME_REPL_DONE, repl->sent, repl->sent, 0);
+
+    log_info("Full sync to backup %s sent %llu keys, %llu bytes in %llu ms", repl->name,
+             (unsigned long long)repl->sync_keys, (unsigned long long)repl->sync_bytes,
+             (unsigned long long)(clock_now_ms() - repl->sync_began));
+    sync_end(repl);
+    pthread_mutex_lock(&repl->lock);
+    repl->stats.syncing = false;
+    pthread_mutex_unlock(&repl->lock);
+    return true;
+}
+
+// Frame the next page of the full sync, each key a PUT with what is left
+// of its TTL, or once every store is paged through, its end. False if out
+// of memory or the store fails.
+static bool send_page(replication_t* repl) {
+    if (repl->sync_store == repl->shards->count) return send_done(repl);
+    kv_store_t* store = repl->shards->stores[repl->sync_store];
+    repl->page.max_count = SIZE_MAX;
+    repl->page.max_bytes = repl->page_size;
+    repl->page.values = true;
+    repl->page.skip = repl->sync_after;
+    repl->page.skip_len = repl->sync_after_len;
+    kv_error_t result = scan_page(store, repl->sync_after, repl->sync_after_len, &repl->page);
+    if (result != KV_SUCCESS) {
+        log_error("Full sync could not read the store: %d", result);
+        return false;
+    }
+
+    size_t header_at = frame_begin(repl);
+    if (header_at == SIZE_MAX) return false;
+    kv_batch_item_t item = { 0 };
+    for (size_t at = 0; at < repl->page.buf.len;) {
+        page_item(&repl->page, &at, &item);
+        // Gone since the scan; the stream that follows the pages says so
+        int64_t ttl_ms;
+        if (kv_store_ttl(store, item.key, item.key_len, &ttl_ms) != KV_SUCCESS || ttl_ms == 0) {
+            continue;
+        }
+        uint64_t expires_at = ttl_ms < 0 ? 0 : clock_deadline_ms((uint64_t)ttl_ms);
+        size_t len = wal_record_size(WAL_PUT, item.key_len, item.value_len, expires_at);
+        if (!buf_reserve(&repl->out, len)) return false;
+        wal_record_encode(repl->out.data + repl->out.len, WAL_PUT, item.key, item.key_len,
+                          item.value, item.value_len, expires_at);
+        repl->out.len += len;
+        repl->sync_keys++;
+    }
+    size_t bytes = repl->out.len - header_at - REPL_ACK_SIZE;
+    if (bytes == 0) {
+        repl->out.len = header_at;
+    } else {
+        frame_end(repl, header_at, KV_FRAME_REPL_PAGE, repl->sent, repl->sent, 0);
+        repl->sync_bytes += bytes;
+        pthread_mutex_lock(&repl->lock);
+        repl->stats.batches++;
+        repl->stats.sync_bytes += bytes;
+        pthread_mutex_unlock(&repl->lock);
+    }
+
+    if (repl->page.full) {
+        char* after = malloc(item.key_len);
+        if (!after) return false;
+        memcpy(after, item.key, item.key_len);
+        free(repl->sync_after);
+        repl->sync_after = after;
+        repl->sync_after_len = item.key_len;
+        return true;
+    }
+    free(repl->sync_after);
+    repl->sync_after = NULL;
+    repl->sync_after_len = 0;
+    repl->sync_store++;
+    return true;
+}
+
+// Frame records from the ring, whole ones up to REPL_MAX_FRAME bytes a
+// frame, while the window has room. False if the backup fell behind the
+// ring, or out of memory.
+static bool frame_records(replication_t* repl) {
+    bool ok = true;
+    pthread_mutex_lock(&repl->lock);
+    if (repl->sent == repl->taken && repl->offset > repl->taken) {
+        repl->taken_since = repl->pending_since;
+        repl->taken = repl->offset;
+    }
+    while (ok && repl->inflight_count < REPL_MAX_INFLIGHT && repl->sent < repl->taken) {
+        ok = ring_holds(repl, repl->sent);
+        uint64_t left = repl->taken - repl->sent;
+        size_t len = 0;
+        while (ok && len < left) {
+            wal_record_header_t header;
+            ring_read(repl, repl->sent + len, &header, sizeof(header));
+            size_t expiry_len = header.flags & WAL_HAS_EXPIRY ? sizeof(uint64_t) : 0;
+            size_t next = sizeof(header) + expiry_len + header.key_len + header.value_len;
+            if (len > 0 && len + next > REPL_MAX_FRAME) break;
+            len += next;
+        }
+        size_t header_at = ok ? frame_begin(repl) : SIZE_MAX;
+        ok = header_at != SIZE_MAX && buf_reserve(&repl->out, len);
+        if (!ok) break;
+        ring_read(repl, repl->sent, repl->out.data + repl->out.len, len);
+        repl->out.len += len;
+        frame_end(repl, header_at, 0, repl->sent, repl->sent + len, repl->taken_since);
+        repl->sent += len;
+        repl->stats.batches++;
+
+        // Writers wait while a frame is copied, not while all are
+        pthread_mutex_unlock(&repl->lock);
+        pthread_mutex_lock(&repl->lock);
+    }
+    pthread_mutex_unlock(&repl->lock);
+    return ok;
+}
+
+static bool flush(replication_t* repl) {
+    while (repl->out_at < repl->out.len) {
+        ssize_t n = send(repl->fd, repl->out.data + repl->out_at, repl->out.len - repl->out_at,
+                         MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        repl->out_at += (size_t)n;
+    }
+    repl->out.len = 0;
+    repl->out_at = 0;
+    return true;
+}
+
+// Frame what the window and the throttle allow and write it out. NULL,
+// or why the backup must go; *timeout is cut to when the next page is due.
+static const char* pump(replication_t* repl, int* timeout) {
+    if (repl->clearing) {
+        // One FULL at a time, until one is acked without KV_FRAME_MORE
+        if (repl->inflight_count == 0 && !send_full(repl)) return "out of memory";
+    }
+    while (repl->syncing && !repl->clearing && repl->inflight_count < REPL_MAX_INFLIGHT) {
+        int wait = repl->sync_store < repl->shards->count ? throttle_wait(repl) : 0;
+        if (wait > 0) {
+            *timeout = wait;
+            break;
+        }
+        if (!send_page(repl)) return "full sync failed";
+    }
+    bool held;
+    if (repl->syncing) {
+        // The stream from where the pages began is sent once they are done
+        pthread_mutex_lock(&repl->lock);
+        held = ring_holds(repl, repl->sent);
+        pthread_mutex_unlock(&repl->lock);
+    } else {
+        held = frame_records(repl);
+    }
+    if (!held) return "fell behind the backlog";
+    return flush(repl) ? NULL : strerror(errno);
+}
+
+// Take in acks, each the offset the backup applied up to. NULL, or why
+// the connection is no good.
+static const char* read_acks(replication_t* repl) {
+    ssize_t n = recv(repl->fd, repl->in + repl->in_len, sizeof(repl->in) - repl->in_len, 0);
+    if (n == 0) return "connection closed";
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return NULL;
+        return strerror(errno);
+    }
+    repl->in_len += (size_t)n;
+
+    size_t at = 0;
+    uint64_t acked = repl->acked;
+    while (repl->in_len - at >= KV_FRAME_HEADER_SIZE) {
+        kv_frame_t reply;
+        kv_frame_decode(repl->in + at, &reply);
+        if (reply.code != KV_SUCCESS) return "update refused";
+        if (reply.value_len != sizeof(uint64_t) || repl->inflight_count == 0) {
+            return "unexpected reply";
+        }
+        if (repl->in_len - at < REPL_ACK_SIZE) break;
+        acked = kv_get_u64(repl->in + at + KV_FRAME_HEADER_SIZE);
+        if (acked != repl->inflight[repl->inflight_head].end) return "ack out of order";
+        if (repl->clearing && !(reply.flags & KV_FRAME_MORE)) {
+            // The pages start now, so the throttle does not count the clear
+            repl->clearing = false;
+            repl->sync_began = clock_now_ms();
+            log_info("Backup %s cleared, stream from offset %llu", repl->name,
+                     (unsigned long long)acked);
+        }
+        repl->inflight_head = (repl->inflight_head + 1) % REPL_MAX_INFLIGHT;
+        repl->inflight_count--;
+        at += REPL_ACK_SIZE;
+    }
+    memmove(repl->in, repl->in + at, repl->in_len - at);
+    repl->in_len -= at;
+    repl->acked = acked;
+    return NULL;
+}
+
+// Publish how far the backup got and since when it has lagged
+static void publish(replication_t* repl) {
+    uint64_t oldest = 0;
+    for (size_t i = 0; i < repl->inflight_count && !oldest; i++) {
+        oldest = repl->inflight[(repl->inflight_head + i) % REPL_MAX_INFLIGHT].since;
+    }
+    pthread_mutex_lock(&repl->lock);
+    if (repl->fd >= 0) {
+        if (!oldest && repl->sent < repl->taken) oldest = repl->taken_since;
+        repl->oldest = oldest;
+        repl->stats.acked = repl->acked;
+    }
+    pthread_mutex_unlock(&repl->lock);
+}
+
+static void* sender_main(void* arg) {
+    replication_t* repl = arg;
+    uint64_t retry_at = 0;
+    for (;;) {
+        pthread_mutex_lock(&repl->lock);
+        bool stopping = repl->stopping;
+        pthread_mutex_unlock(&repl->lock);
+        if (stopping) break;
+
+        struct pollfd fds[2] = { { .fd = repl->bell, .events = POLLIN } };
+        int timeout = -1;
+        if (repl->fd < 0) {
+            uint64_t now = clock_now_ms();
+            if (now >= retry_at) {
+                uint64_t backup_id, backup_offset;
+                repl->fd = open_backup(repl, &backup_id, &backup_offset);
+                if (repl->fd >= 0) {
+                    if (!start_stream(repl, backup_id, backup_offset)) {
+                        disconnect(repl, "out of memory");
+                    }
+                    continue;
+                }
+                retry_at = now + REPL_RETRY_MS;
+            }
+            timeout = (int)(retry_at - now > REPL_RETRY_MS ? REPL_RETRY_MS : retry_at - now);
+        } else {
+            const char* failed = pump(repl, &timeout);
+            if (failed) {
+                disconnect(repl, failed);
+                continue;
+            }
+            fds[1].fd = repl->fd;
+            fds[1].events = POLLIN | (repl->out_at < repl->out.len ? POLLOUT : 0);
+        }
+
+        if (poll(fds, repl->fd < 0 ? 1 : 2, timeout) < 0 && errno != EINTR) {
+            log_error("Replication poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t rung;
+            if (read(repl->bell, &rung, sizeof(rung)) < 0) rung = 0;
+        }
+        if (repl->fd >= 0 && (fds[1].revents & (POLLIN | POLLERR | POLLHUP))) {
+            const char* failed = read_acks(repl);
+            if (failed) disconnect(repl, failed);
+        }
+        publish(repl);
+    }
+    return NULL;
+}
+
+// Different for every run, so a restarted primary's stream is not taken
+// for the one a backup followed before
+static uint64_t stream_id(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t seed[3] = { (uint64_t)ts.tv_sec, (uint64_t)ts.tv_nsec, (uint64_t)getpid() };
+    uint64_t id = kv_hash((const char*)seed, sizeof(seed), REPL_ID_SEED);
+    return id ? id : 1;
+}
+
+replication_t* repl_create(const kv_shards_t* shards, const char* host, int port,
+                           size_t backlog, size_t sync_rate) {
+    replication_t* repl = calloc(1, sizeof(replication_t));
+    if (!repl) return NULL;
+    repl->addr.sin_family = AF_INET;
+    repl->addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &repl->addr.sin_addr) <= 0) {
+        log_error("Invalid backup address: %s", host);
+        free(repl);
+        return NULL;
+    }
+    snprintf(repl->name, sizeof(repl->name), "%s:%d", host, port);
+    repl->shards = shards;
+    repl->id = stream_id();
+    repl->sync_rate = sync_rate;
+    repl->page_size = REPL_MAX_FRAME;
+    if (sync_rate && sync_rate / REPL_PAGES_PER_SEC < REPL_MAX_FRAME) {
+        // Small enough that the throttle paces it, not one page in a burst
+        repl->page_size = sync_rate / REPL_PAGES_PER_SEC > REPL_MIN_PAGE
+                              ? sync_rate / REPL_PAGES_PER_SEC : REPL_MIN_PAGE;
+    }
+    repl->fd = -1;
+    repl->backlog_size = backlog > REPL_MIN_BACKLOG ? backlog : REPL_MIN_BACKLOG;
+    repl->backlog = malloc(repl->backlog_size);
+    repl->bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!repl->backlog || repl->bell < 0) {
+        log_error("Failed to allocate a %zu byte replication backlog", repl->backlog_size);
+        if (repl->bell >= 0) close(repl->bell);
+        free(repl->backlog);
+        free(repl);
+        return NULL;
+    }
+    for (int i = 0; i < REPL_STRIPES; i++) pthread_mutex_init(&repl->stripes[i], NULL);
+    pthread_mutex_init(&repl->lock, NULL);
+    if (pthread_create(&repl->thread, NULL, sender_main, repl) != 0) {
+        repl->thread = 0;
+        repl_destroy(repl);
+        return NULL;
+    }
+    return repl;
+}
+
+void repl_destroy(replication_t* repl) {
+    if (!repl) return;
+    pthread_mutex_lock(&repl->lock);
+    repl->stopping = true;
+    pthread_mutex_unlock(&repl->lock);
+    uint64_t one = 1;
+    if (write(repl->bell, &one, sizeof(one)) < 0) log_error("Waking the sender failed");
+    if (repl->thread) pthread_join(repl->thread, NULL);
+
+    if (repl->fd >= 0) close(repl->fd);
+    close(repl->bell);
+    for (int i = 0; i < REPL_STRIPES; i++) pthread_mutex_destroy(&repl->stripes[i]);
+    pthread_mutex_destroy(&repl->lock);
+    free(repl->sync_after);
+    free(repl->page.buf.data);
+    free(repl->backlog);
+    free(repl->out.data);
+    free(repl);
+}
+
+void repl_stats(replication_t* repl, kv_repl_stats_t* stats) {
+    pthread_mutex_lock(&repl->lock);
+    *stats = repl->stats;
+    stats->offset = repl->offset;
+    stats->lag_bytes = repl->offset - stats->acked;
+    uint64_t since = repl->oldest;
+    if (!since && repl->offset > repl->taken) since = repl->pending_since;
+    pthread_mutex_unlock(&repl->lock);
+    uint64_t now = clock_now_ms();
+    stats->lag_ms = since && now > since ? now - since : 0;
+}
+
+static unsigned stripe_of(const char* key, size_t key_len) {
+    return (unsigned)(kv_hash(key, key_len, REPL_STRIPE_SEED) % REPL_STRIPES);
+}
+
+unsigned repl_lock(replication_t* repl, const char* key, size_t key_len) {
+    unsigned stripe = stripe_of(key, key_len);
+    pthread_mutex_lock(&repl->stripes[stripe]);
+    return stripe;
+}
+
+void repl_unlock(replication_t* repl, unsigned stripe) {
+    pthread_mutex_unlock(&repl->stripes[stripe]);
+}
+
+// In ascending order, so batches cannot deadlock
+uint64_t repl_lock_batch(replication_t* repl, const kv_batch_item_t* items, size_t count) {
+    uint64_t stripes = 0;
+    for (size_t i = 0; i < count; i++) stripes |= 1ull << stripe_of(items[i].key, items[i].key_len);
+    for (unsigned i = 0; i < REPL_STRIPES; i++) {
+        if (stripes & (1ull << i)) pthread_mutex_lock(&repl->stripes[i]);
+    }
+    return stripes;
+}
+
+void repl_unlock_batch(replication_t* repl, uint64_t stripes) {
+    for (unsigned i = 0; i < REPL_STRIPES; i++) {
+        if (stripes & (1ull << i)) pthread_mutex_unlock(&repl->stripes[i]);
+    }
+}
+
+void repl_append(replication_t* repl, wal_record_type_t type, const char* key, size_t key_len,
+                 const char* value, size_t value_len, uint64_t expires_at) {
+    // Encoded before the lock, which then only covers the copy
+    size_t len = wal_record_size(type, key_len, value_len, expires_at);
+    char small[REPL_STACK_RECORD];
+    char* record = len <= sizeof(small) ? small : malloc(len);
+    if (record) wal_record_encode(record, type, key, key_len, value, value_len, expires_at);
+
+    pthread_mutex_lock(&repl->lock);
+    bool ring = repl->offset == repl->taken;
+    if (ring) repl->pending_since = clock_now_ms();
+    if (record && len <= repl->backlog_size) {
+        ring_write(repl, repl->offset, record, len);
+        repl->offset += len;
+    } else {
+        // A hole in the stream: a backup short of it has to sync in full
+        repl->offset += len;
+        repl->lost = repl->offset;
+    }
+    repl->stats.records++;
+    pthread_mutex_unlock(&repl->lock);
+    if (record != small) free(record);
+
+    // Once per batch the sender takes, not per record
+    uint64_t one = 1;
+    if (ring && write(repl->bell, &one, sizeof(one)) < 0) log_error("Waking the sender failed");
+}
+
+repl_replica_t* repl_replica_create(void) {
+    repl_replica_t* replica = calloc(1, sizeof(repl_replica_t));
+    if (replica) pthread_mutex_init(&replica->lock, NULL);
+    return replica;
+}
+
+void repl_replica_destroy(repl_replica_t* replica) {
+    if (!replica) return;
+    pthread_mutex_destroy(&replica->lock);
+    free(replica);
+}
+
+// Delete up to REPL_CLEAR_KEYS keys, one slice of clearing the stores for
+// a full sync, so that a large store holds up the event loop a slice at a
+// time. *cleared once no key is left; false if some key would not go.
+static bool clear_slice(const kv_shards_t* shards, bool* cleared) {
+    repl_page_t page = { .max_bytes = REPL_MAX_FRAME };
+    kv_batch_item_t* items = malloc(REPL_CLEAR_KEYS * sizeof(*items));
+    kv_error_t* results = malloc(REPL_CLEAR_KEYS * sizeof(*results));
+    bool ok = items && results;
+    size_t left = REPL_CLEAR_KEYS;
+    for (unsigned i = 0; ok && left > 0 && i < shards->count; i++) {
+        kv_store_t* store = shards->stores[i];
+        while (left > 0) {
+            page.max_count = left;
+            ok = scan_page(store, NULL, 0, &page) == KV_SUCCESS;
+            if (!ok || page.count == 0) break;
+            for (size_t n = 0, at = 0; n < page.count; n++) page_item(&page, &at, &items[n]);
+            kv_store_mdelete(store, items, page.count, results);
+            // Keys that cannot be deleted would come back on every page
+            ok = false;
+            for (size_t n = 0; n < page.count && !ok; n++) ok = results[n] == KV_SUCCESS;
+            if (!ok) break;
+            left -= page.count;
+        }
+    }
+    // A slice that ran out of keys cleared the last of them
+    *cleared = left > 0;
+    free(page.buf.data);
+    free(items);
+    free(results);
+    return ok;
+}
+
+// Replay one record as the primary applied it. Expiry times are absolute,
+// so a key past its time by now is deleted rather than written.
+static kv_error_t apply_record(kv_store_t* store, const wal_record_t* record, uint64_t now) {
+    bool expired = record->expires_at && record->expires_at <= now;
+    uint64_t ttl_ms = record->expires_at && !expired ? record->expires_at - now : 0;
+    kv_error_t result;
+    if (record->type == WAL_DELETE || expired) {
+        result = kv_store_delete(store, record->key, record->key_len);
+    } else if (record->type == WAL_PUT) {
+        result = kv_store_put_ttl(store, record->key, record->key_len, record->value,
+                                  record->value_len, ttl_ms);
+    } else {
+        result = kv_store_expire(store, record->key, record->key_len, ttl_ms);
+    }
+    // The primary may have written a key the backup never had
+    return result == KV_ERROR_NOT_FOUND ? KV_SUCCESS : result;
+}
+
+// Apply the WAL records data holds. Writes that fail are logged and
+// skipped; KV_ERROR_INVALID_KEY if a record is corrupt.
+static kv_error_t apply_records(const kv_shards_t* shards, const char* data, size_t len) {
+    uint64_t now = clock_now_ms();
+    size_t at = 0;
+    while (at < len) {
+        wal_record_t record;
+        ssize_t size = wal_record_decode(data + at, len - at, &record);
+        if (size <= 0) {
+            log_error("Corrupt replication record at byte %zu", at);
+            return KV_ERROR_INVALID_KEY;
+        }
+        kv_store_t* store = kv_shard_store(shards, record.key, record.key_len);
+        kv_error_t result = apply_record(store, &record, now);
+        if (result != KV_SUCCESS) {
+            log_warn("Replicated write to %.*s failed: %d", (int)record.key_len, record.key,
+                     result);
+        }
+        at += (size_t)size;
+    }
+    return KV_SUCCESS;
+}
+
+kv_error_t repl_receive(const kv_shards_t* shards, uint8_t flags, uint64_t start,
+                        const char* data, size_t len, char* reply, size_t* reply_len,
+                        bool* more) {
+    repl_replica_t* replica = shards->replica;
+    *reply_len = 0;
+    *more = false;
+    if (!replica) return KV_ERROR_INVALID_KEY;
+    kv_error_t result = KV_SUCCESS;
+    pthread_mutex_lock(&replica->lock);
+    if (flags & KV_FRAME_REPL_QUERY) {
+        kv_put_u64(reply, replica->id);
+        kv_put_u64(reply + sizeof(uint64_t), replica->offset);
+        *reply_len = 2 * sizeof(uint64_t);
+    } else if (flags & KV_FRAME_REPL_FULL) {
+        // Nothing to resume until the sync ends: a link lost part way
+        // through leaves keys that only another full sync brings
+        replica->id = 0;
+        replica->syncing = 0;
+        replica->offset = start;
+        bool cleared = false;
+        if (len != sizeof(uint64_t) || kv_get_u64(data) == 0) {
+            result = KV_ERROR_INVALID_KEY;
+        } else if (!clear_slice(shards, &cleared)) {
+            log_error("Could not clear the stores for a full sync");
+            result = KV_ERROR_IO;
+        } else if (!cleared) {
+            *more = true;  // The primary sends FULL again for the next slice
+        } else {
+            replica->syncing = kv_get_u64(data);
+            log_info("Full sync from the primary, its stream from offset %llu",
+                     (unsigned long long)start);
+        }
+    } else if (flags & (KV_FRAME_REPL_PAGE | KV_FRAME_REPL_DONE)) {
+        if (!replica->syncing) {
+            result = KV_ERROR_INVALID_KEY;  // No full sync under way
+        } else if (flags & KV_FRAME_REPL_PAGE) {
+            result = apply_records(shards, data, len);
+        } else if (len != sizeof(uint64_t) || kv_get_u64(data) != replica->syncing) {
+            result = KV_ERROR_INVALID_KEY;
+        } else {
+            replica->id = replica->syncing;
+            replica->syncing = 0;
+            log_info("Full sync from the primary done");
+        }
+    } else if (!replica->id) {
+        result = KV_ERROR_INVALID_KEY;  // Stream without a full sync first
+    } else if (start != replica->offset) {
+        log_warn("Replication stream at offset %llu, expected %llu",
+                 (unsigned long long)start, (unsigned long long)replica->offset);
+        result = KV_ERROR_INVALID_KEY;
+    } else {
+        result = apply_records(shards, data, len);
+        if (result == KV_SUCCESS) replica->offset += len;
+    }
+    if (!(flags & KV_FRAME_REPL_QUERY)) {
+        // Nothing to resume from after a damaged update
+        if (result != KV_SUCCESS) {
+            replica->id = 0;
+            replica->syncing = 0;
+        }
+        kv_put_u64(reply, replica->offset);
+        if (result == KV_SUCCESS) *reply_len = sizeof(uint64_t);
+    }
+    pthread_mutex_unlock(&replica->lock);
+    return result;
+}
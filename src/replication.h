@@ -0,0 +1,71 @@
+// Primary-to-backup replication (kv_server_set_backup)
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "kv_store.h"
+#include "wal.h"
+
+// Every write to the primary's stores goes into one stream as a WAL record,
+// at a byte offset that only grows, and the latest backlog bytes of it stay
+// in a ring. Writers copy their record in and return; a sender thread cuts
+// what is new into MSG_REPLICATE frames of at most REPL_MAX_FRAME bytes and
+// sends them to the backup, which applies each and acks the offset it
+// reached. Up to REPL_MAX_INFLIGHT frames go out before the first ack, so
+// the round trip is never waited on. A key's write and its record happen
+// under one of REPL_STRIPES locks, so each key's records are in the order
+// they were applied.
+//
+// On connecting, the sender asks the backup which stream it follows and
+// how far it got. One that left off within the ring carries on from there
+// (partial resync). Any other is cleared and sent every key, page by page
+// at no more than sync_rate bytes/s, while writes go on; then it is told
+// the sync is done and gets the stream from where it stood when the pages
+// began, which brings every key up to date (full sync). The backup applies
+// each frame on the event loop that reads it, stalling that loop's other
+// connections meanwhile, so it is cleared REPL_CLEAR_KEYS keys per FULL
+// frame, sent again until one finds nothing left, and pages are no larger
+// than stream frames. A backup that
+// loses the link before the end has nothing to resume and syncs again. A
+// backup that falls further behind than the ring is dropped and synced
+// again; the sender retries every REPL_RETRY_MS while it cannot reach it.
+#define REPL_STRIPES 64
+#define REPL_MAX_FRAME (256 * 1024)
+#define REPL_MAX_INFLIGHT 64
+#define REPL_MIN_BACKLOG (4 * REPL_MAX_FRAME)
+#define REPL_RETRY_MS 1000
+
+typedef struct replication replication_t;
+
+// Replicate the writes to shards, which must outlive it, to the server at
+// host, an IPv4 address. The backup need not be up yet. NULL if host is
+// not an address.
+replication_t* repl_create(const kv_shards_t* shards, const char* host, int port,
+                           size_t backlog, size_t sync_rate);
+// Once no store writes to it
+void repl_destroy(replication_t* repl);
+void repl_stats(replication_t* repl, kv_repl_stats_t* stats);
+
+// Held around a write and its repl_append; returns what to unlock
+unsigned repl_lock(replication_t* repl, const char* key, size_t key_len);
+void repl_unlock(replication_t* repl, unsigned stripe);
+uint64_t repl_lock_batch(replication_t* repl, const kv_batch_item_t* items, size_t count);
+void repl_unlock_batch(replication_t* repl, uint64_t stripes);
+// A write that succeeded; expires_at as for the WAL
+void repl_append(replication_t* repl, wal_record_type_t type, const char* key, size_t key_len,
+                 const char* value, size_t value_len, uint64_t expires_at);
+
+// Backup side: which primary's stream the server follows and how far,
+// kept for as long as it runs
+typedef struct repl_replica repl_replica_t;
+
+repl_replica_t* repl_replica_create(void);
+void repl_replica_destroy(repl_replica_t* replica);
+// Handle a MSG_REPLICATE frame with these flags, extras and value, writing
+// the reply value (at most 16 bytes) to reply; *more if a FULL frame left
+// keys to clear. Runs on the event loop that took the frame.
+kv_error_t repl_receive(const kv_shards_t* shards, uint8_t flags, uint64_t start,
+                        const char* data, size_t len, char* reply, size_t* reply_len,
+                        bool* more);
+
+#endif // REPLICATION_H
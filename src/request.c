@@ -0,0 +1,822 @@
+#include "request.h"
+#include "cluster.h"
+#include "log.h"
+#include "protocol.h"
+#include "replication.h"
+#include "skiplist.h"
+#include "tracking.h"
+#include <stddef.h>
+
+bool conn_buf_reserve(conn_buf_t* buf, size_t more) {
+    if (buf->size - buf->len >= more) return true;
+    size_t size = buf->size ? buf->size : 4096;
+    while (size - buf->len < more) size *= 2;
+    char* data = realloc(buf->data, size);
+    if (!data) return false;
+    buf->data = data;
+    buf->size = size;
+    return true;
+}
+
+bool conn_buf_append(conn_buf_t* buf, const void* data, size_t len) {
+    if (len == 0) return true;
+    if (!conn_buf_reserve(buf, len)) return false;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+bool conn_buf_pin(conn_buf_t* buf, const kv_value_ref_t* ref) {
+    if (buf->pin_count == buf->pin_size) {
+        size_t size = buf->pin_size ? buf->pin_size * 2 : 16;
+        conn_pin_t* pins = realloc(buf->pins, size * sizeof(conn_pin_t));
+        if (!pins) {
+            ref->release(ref->pin);
+            return false;
+        }
+        buf->pins = pins;
+        buf->pin_size = size;
+    }
+    buf->pins[buf->pin_count++] = (conn_pin_t){ .at = buf->len, .ref = *ref };
+    return true;
+}
+
+void conn_buf_consume(conn_buf_t* buf, size_t n) {
+    if (n >= buf->len) {
+        buf->len = 0;
+        return;
+    }
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+}
+
+void conn_buf_reset(conn_buf_t* buf) {
+    for (size_t i = 0; i < buf->pin_count; i++) {
+        kv_value_ref_t* ref = &buf->pins[i].ref;
+        if (ref->release) ref->release(ref->pin);
+    }
+    buf->pin_count = 0;
+    buf->len = 0;
+}
+
+void conn_buf_free(conn_buf_t* buf) {
+    conn_buf_reset(buf);
+    free(buf->data);
+    free(buf->pins);
+    buf->data = NULL;
+    buf->pins = NULL;
+    buf->len = buf->size = buf->pin_size = 0;
+}
+
+size_t request_size(const char* data, size_t len) {
+    message_type_t type;
+    if (len < sizeof(type)) return 0;
+    memcpy(&type, data, sizeof(type));
+    size_t size = sizeof(kv_message_t) + (type == MSG_PUT_TTL ? sizeof(uint64_t) : 0);
+    return len >= size ? size : 0;
+}
+
+typedef struct {
+    kv_scan_item_t* items;
+    size_t count;
+    size_t limit;
+} scan_page_t;
+
+static bool add_scan_item(void* ctx, const char* key, size_t key_len,
+                          const char* value, size_t value_len) {
+    scan_page_t* page = ctx;
+    // Longer keys cannot be named in a message, so clients never see them
+    if (key_len > MAX_KEY_SIZE) return true;
+
+    kv_scan_item_t* item = &page->items[page->count++];
+    memset(item, 0, sizeof(*item));
+    item->key_len = (uint32_t)key_len;
+    item->value_len = (uint32_t)value_len;
+    memcpy(item->key, key, key_len);
+    memcpy(item->value, value, value_len < MAX_VALUE_SIZE ? value_len : MAX_VALUE_SIZE);
+    return page->count < page->limit;
+}
+
+// Smallest key above every key with this prefix. Returns false if there is
+// none (the prefix is empty or all 0xFF).
+static bool prefix_end(const char* prefix, size_t len, char* end, size_t* end_len) {
+    while (len > 0 && (uint8_t)prefix[len - 1] == 0xFF) len--;
+    if (len == 0) return false;
+    memcpy(end, prefix, len);
+    end[len - 1] = (char)((uint8_t)end[len - 1] + 1);
+    *end_len = len;
+    return true;
+}
+
+// Visit one page of a scan from key (or just past it with KV_SCAN_AFTER)
+// up to bound, an end key or with KV_SCAN_PREFIX a prefix
+static kv_error_t scan_page(const kv_shards_t* shards, uint8_t flags, const char* key, size_t key_len,
+                            const char* bound, size_t bound_len, kv_scan_fn visit, void* ctx) {
+    size_t start_size = key_len + 1 > bound_len ? key_len + 1 : bound_len;
+    char* start = malloc(start_size + bound_len);
+    if (!start) return KV_ERROR_NO_SPACE;
+    char* end = start + start_size;
+
+    // Resuming after a key starts at its successor, the key plus a NUL
+    size_t start_len = key_len;
+    memcpy(start, key, key_len);
+    if (flags & KV_SCAN_AFTER) start[start_len++] = '\0';
+
+    size_t end_len = bound_len;
+    bool bounded = bound_len > 0;
+    if (flags & KV_SCAN_PREFIX) {
+        if (kv_key_compare(start, start_len, bound, bound_len) < 0) {
+            memcpy(start, bound, bound_len);
+            start_len = bound_len;
+        }
+        bounded = prefix_end(bound, bound_len, end, &end_len);
+    } else {
+        memcpy(end, bound, bound_len);
+    }
+
+    kv_error_t result = kv_shards_scan(shards, start, start_len, bounded ? end : NULL, end_len,
+                                       visit, ctx);
+    free(start);
+    return result;
+}
+
+static size_t scan_limit(size_t limit) {
+    return limit == 0 || limit > KV_SCAN_MAX_PAGE ? KV_SCAN_MAX_PAGE : limit;
+}
+
+// Serve one page of a scan, built in place at the end of out
+static bool handle_scan(const kv_shards_t* shards, const kv_message_t* message, size_t key_len,
+                        conn_buf_t* out) {
+    kv_scan_request_t request;
+    memcpy(&request, message->value, sizeof(request));
+    size_t bound_len = strnlen(request.bound, MAX_KEY_SIZE);
+    size_t limit = scan_limit(request.limit);
+
+    size_t header = sizeof(kv_error_t) + sizeof(kv_scan_reply_t);
+    if (!conn_buf_reserve(out, header + limit * sizeof(kv_scan_item_t))) return false;
+    char* reply = out->data + out->len;
+    scan_page_t page = { .items = (kv_scan_item_t*)(reply + header), .limit = limit };
+    kv_error_t result = scan_page(shards, request.flags, message->key, key_len,
+                                  request.bound, bound_len, add_scan_item, &page);
+
+    memcpy(reply, &result, sizeof(result));
+    if (result != KV_SUCCESS) {
+        out->len += sizeof(result);
+    } else {
+        kv_scan_reply_t info = { .count = (uint32_t)page.count, .more = page.count == limit };
+        memcpy(reply + sizeof(result), &info, sizeof(info));
+        out->len += header + page.count * sizeof(kv_scan_item_t);
+    }
+    log_debug("SCAN %.*s: %d, %zu keys", (int)key_len, message->key, result, page.count);
+    return true;
+}
+
+// Execute one complete request and append its reply. Single-key requests
+// run on store, their key's shard.
+static bool handle_request(const kv_shards_t* shards, kv_store_t* store, const char* data,
+                           conn_buf_t* out) {
+    kv_message_t message;
+    memcpy(&message, data, sizeof(message));
+
+    // Message fields are NUL-padded, not necessarily NUL-terminated
+    int key_len = (int)strnlen(message.key, MAX_KEY_SIZE);
+    int value_len = (int)strnlen(message.value, MAX_VALUE_SIZE);
+
+    log_debug("Received command: %d, Key: %.*s", message.type, key_len, message.key);
+
+    kv_error_t result;
+    char value[MAX_VALUE_SIZE];
+    size_t stored_len;
+
+    switch (message.type) {
+        case MSG_PUT:
+            result = kv_store_put(store, message.key, key_len, message.value, value_len);
+            log_debug("PUT %.*s (%d bytes): %d", key_len, message.key, value_len, result);
+            return conn_buf_append(out, &result, sizeof(result));
+
+        case MSG_GET:
+            result = kv_store_get(store, message.key, key_len,
+                                  value, MAX_VALUE_SIZE - 1, &stored_len);
+            if (result == KV_ERROR_NO_SPACE) {
+                result = KV_ERROR_VALUE_TOO_LARGE;  // Does not fit a message
+            }
+            log_debug("GET %.*s: %d", key_len, message.key, result);
+            if (!conn_buf_append(out, &result, sizeof(result))) return false;
+            if (result != KV_SUCCESS) return true;
+            memset(value + stored_len, 0, MAX_VALUE_SIZE - stored_len);
+            return conn_buf_append(out, value, MAX_VALUE_SIZE);
+
+        case MSG_DELETE:
+            result = kv_store_delete(store, message.key, key_len);
+            log_debug("DELETE %.*s: %d", key_len, message.key, result);
+            return conn_buf_append(out, &result, sizeof(result));
+
+        case MSG_SCAN:
+            return handle_scan(shards, &message, (size_t)key_len, out);
+
+        case MSG_PUT_TTL: {
+            uint64_t ttl_ms;
+            memcpy(&ttl_ms, data + sizeof(message), sizeof(ttl_ms));
+            result = kv_store_put_ttl(store, message.key, key_len,
+                                      message.value, value_len, ttl_ms);
+            log_debug("PUT %.*s (%d bytes) ttl %llu ms: %d", key_len, message.key,
+                      value_len, (unsigned long long)ttl_ms, result);
+            return conn_buf_append(out, &result, sizeof(result));
+        }
+
+        case MSG_EXPIRE: {
+            uint64_t ttl_ms;
+            memcpy(&ttl_ms, message.value, sizeof(ttl_ms));
+            result = kv_store_expire(store, message.key, key_len, ttl_ms);
+            log_debug("EXPIRE %.*s %llu ms: %d", key_len, message.key,
+                      (unsigned long long)ttl_ms, result);
+            return conn_buf_append(out, &result, sizeof(result));
+        }
+
+        case MSG_TTL: {
+            int64_t ttl_ms = -1;
+            char reply[sizeof(result) + sizeof(ttl_ms)];
+            result = kv_store_ttl(store, message.key, key_len, &ttl_ms);
+            memcpy(reply, &result, sizeof(result));
+            memcpy(reply + sizeof(result), &ttl_ms, sizeof(ttl_ms));
+            log_debug("TTL %.*s: %d, %lld ms", key_len, message.key, result,
+                      (long long)ttl_ms);
+            return conn_buf_append(out, reply,
+                                   result == KV_SUCCESS ? sizeof(reply) : sizeof(result));
+        }
+
+        default:
+            log_warn("Unknown command received: %d", message.type);
+            result = KV_ERROR_INVALID_KEY;
+            return conn_buf_append(out, &result, sizeof(result));
+    }
+}
+
+// Append a v2 reply carrying value_len bytes of value
+static bool frame_reply(conn_buf_t* out, uint32_t id, kv_error_t status, uint8_t flags,
+                        const void* value, size_t value_len) {
+    if (!conn_buf_reserve(out, KV_FRAME_HEADER_SIZE + value_len)) return false;
+    kv_frame_t reply = { .code = (uint8_t)status, .flags = flags,
+                         .value_len = (uint32_t)value_len, .id = id };
+    kv_frame_encode(out->data + out->len, &reply);
+    if (value_len > 0) memcpy(out->data + out->len + KV_FRAME_HEADER_SIZE, value, value_len);
+    out->len += KV_FRAME_HEADER_SIZE + value_len;
+    return true;
+}
+
+// A value at least out->pin_min long stays in the store, pinned until it
+// is sent; shorter ones are copied from the same lookup
+static bool frame_get_pinned(kv_store_t* store, const kv_frame_t* frame, const char* key,
+                             conn_buf_t* out) {
+    kv_value_ref_t ref;
+    kv_error_t result = kv_store_get_ref(store, key, frame->key_len, &ref);
+    log_debug("GET %.*s: %d", (int)frame->key_len, key, result);
+    if (result != KV_SUCCESS) return frame_reply(out, frame->id, result, 0, NULL, 0);
+    if (ref.len < out->pin_min) {
+        bool ok = frame_reply(out, frame->id, result, 0, ref.data, ref.len);
+        ref.release(ref.pin);
+        return ok;
+    }
+
+    if (!conn_buf_reserve(out, KV_FRAME_HEADER_SIZE)) {
+        ref.release(ref.pin);
+        return false;
+    }
+    kv_frame_t reply = { .code = (uint8_t)result, .id = frame->id,
+                         .value_len = (uint32_t)ref.len };
+    kv_frame_encode(out->data + out->len, &reply);
+    out->len += KV_FRAME_HEADER_SIZE;
+    return conn_buf_pin(out, &ref);
+}
+
+// Copy the value straight into out, growing it if the value does not fit
+static bool frame_get(kv_store_t* store, const kv_frame_t* frame, const char* key,
+                      conn_buf_t* out) {
+    if (out->pin_min > 0 && kv_store_can_pin(store)) {
+        return frame_get_pinned(store, frame, key, out);
+    }
+
+    kv_error_t result;
+    size_t stored = 0;
+    do {
+        if (!conn_buf_reserve(out, KV_FRAME_HEADER_SIZE + stored)) return false;
+        result = kv_store_get(store, key, frame->key_len, out->data + out->len + KV_FRAME_HEADER_SIZE,
+                              out->size - out->len - KV_FRAME_HEADER_SIZE, &stored);
+    } while (result == KV_ERROR_NO_SPACE);  // Retried at the size it has now
+
+    kv_frame_t reply = { .code = (uint8_t)result, .id = frame->id,
+                         .value_len = result == KV_SUCCESS ? (uint32_t)stored : 0 };
+    kv_frame_encode(out->data + out->len, &reply);
+    out->len += KV_FRAME_HEADER_SIZE + reply.value_len;
+    log_debug("GET %.*s: %d", (int)frame->key_len, key, result);
+    return true;
+}
+
+typedef struct {
+    conn_buf_t* out;
+    size_t count;
+    size_t limit;
+    bool failed;                        // out could not grow
+} frame_page_t;
+
+static bool add_frame_item(void* ctx, const char* key, size_t key_len,
+                           const char* value, size_t value_len) {
+    frame_page_t* page = ctx;
+    // As in v1: a kv_scan_t resumes from a key of at most MAX_KEY_SIZE bytes
+    if (key_len > MAX_KEY_SIZE) return true;
+
+    size_t size = sizeof(uint16_t) + sizeof(uint32_t) + key_len + value_len;
+    if (!conn_buf_reserve(page->out, size)) {
+        page->failed = true;
+        return false;
+    }
+    char* item = page->out->data + page->out->len;
+    kv_put_u16(item, (uint16_t)key_len);
+    kv_put_u32(item + 2, (uint32_t)value_len);
+    memcpy(item + 6, key, key_len);
+    memcpy(item + 6 + key_len, value, value_len);
+    page->out->len += size;
+    return ++page->count < page->limit;
+}
+
+// One page of a scan: the header goes in front of the items once they
+// are all in out
+static bool frame_scan(const kv_shards_t* shards, const kv_frame_t* frame, const char* key,
+                       const char* extra, const char* bound, conn_buf_t* out) {
+    size_t header_at = out->len;
+    if (!conn_buf_reserve(out, KV_FRAME_HEADER_SIZE)) return false;
+    out->len += KV_FRAME_HEADER_SIZE;
+
+    frame_page_t page = { .out = out, .limit = scan_limit(kv_get_u16(extra)) };
+    kv_error_t result = frame->value_len > MAX_KEY_LENGTH
+        ? KV_ERROR_INVALID_KEY
+        : scan_page(shards, frame->flags, key, frame->key_len, bound, frame->value_len,
+                    add_frame_item, &page);
+    if (page.failed) return false;
+    if (result != KV_SUCCESS) out->len = header_at + KV_FRAME_HEADER_SIZE;
+
+    kv_frame_t reply = {
+        .code = (uint8_t)result,
+        .flags = result == KV_SUCCESS && page.count == page.limit ? KV_FRAME_MORE : 0,
+        .value_len = (uint32_t)(out->len - header_at - KV_FRAME_HEADER_SIZE),
+        .id = frame->id,
+    };
+    kv_frame_encode(out->data + header_at, &reply);
+    log_debug("SCAN %.*s: %d, %zu keys", (int)frame->key_len, key, result, page.count);
+    return true;
+}
+
+// Split the value of a multi-key request into its items, which point into
+// data. MSET items carry values.
+static kv_error_t parse_batch(const char* data, size_t len, bool values,
+                              kv_batch_item_t** items, size_t* count) {
+    size_t head = sizeof(uint16_t) + (values ? sizeof(uint32_t) : 0);
+    size_t n = 0;
+    for (size_t at = 0; at < len; n++) {
+        if (len - at < head || n == KV_BATCH_MAX_KEYS) return KV_ERROR_INVALID_KEY;
+        size_t size = kv_get_u16(data + at) + (values ? kv_get_u32(data + at + 2) : 0);
+        if (len - at - head < size) return KV_ERROR_INVALID_KEY;
+        at += head + size;
+    }
+
+    *items = malloc((n ? n : 1) * sizeof(**items));
+    if (!*items) return KV_ERROR_NO_SPACE;
+    const char* at = data;
+    for (size_t i = 0; i < n; i++) {
+        kv_batch_item_t* item = &(*items)[i];
+        item->key_len = kv_get_u16(at);
+        item->value_len = values ? kv_get_u32(at + 2) : 0;
+        item->key = at + head;
+        item->value = item->key + item->key_len;
+        at = item->value + item->value_len;
+    }
+    *count = n;
+    return KV_SUCCESS;
+}
+
+typedef struct {
+    conn_buf_t* out;
+    size_t bytes;                       // Of the reply so far
+    bool failed;                        // out could not grow
+} frame_mget_t;
+
+static void add_mget_value(void* ctx, size_t index, kv_error_t status,
+                           const char* value, size_t value_len) {
+    (void)index;
+    frame_mget_t* reply = ctx;
+    // Values past what one frame can carry are reported, not sent
+    if (reply->bytes + 5 + value_len > KV_FRAME_MAX_VALUE) {
+        status = KV_ERROR_VALUE_TOO_LARGE;
+        value_len = 0;
+    }
+    if (reply->failed || !conn_buf_reserve(reply->out, 5 + value_len)) {
+        reply->failed = true;
+        return;
+    }
+    char* at = reply->out->data + reply->out->len;
+    at[0] = (char)status;
+    kv_put_u32(at + 1, (uint32_t)value_len);
+    if (value_len > 0) memcpy(at + 5, value, value_len);
+    reply->out->len += 5 + value_len;
+    reply->bytes += 5 + value_len;
+}
+
+// MGET, MSET and MDELETE: the header goes in front of the per-key results
+// once they are all in out
+static bool frame_batch(const kv_shards_t* shards, const kv_frame_t* frame, const char* value,
+                        conn_buf_t* out) {
+    static const char* const names[] = { "MGET", "MSET", "MDELETE" };
+    const char* name = names[frame->code - MSG_MGET];
+    kv_batch_item_t* items = NULL;
+    size_t count = 0;
+    kv_error_t result = frame->key_len > 0
+        ? KV_ERROR_INVALID_KEY
+        : parse_batch(value, frame->value_len, frame->code == MSG_MSET, &items, &count);
+    if (result != KV_SUCCESS) {
+        log_debug("%s: %d", name, result);
+        return frame_reply(out, frame->id, result, 0, NULL, 0);
+    }
+
+    size_t header_at = out->len;
+    bool ok = conn_buf_reserve(out, KV_FRAME_HEADER_SIZE + count);
+    if (ok && frame->code == MSG_MGET) {
+        out->len += KV_FRAME_HEADER_SIZE;
+        frame_mget_t reply = { .out = out };
+        result = kv_shards_mget(shards, items, count, add_mget_value, &reply);
+        ok = !reply.failed;
+        if (result != KV_SUCCESS) out->len = header_at + KV_FRAME_HEADER_SIZE;
+    } else if (ok) {
+        out->len += KV_FRAME_HEADER_SIZE;
+        kv_error_t* results = malloc((count ? count : 1) * sizeof(*results));
+        ok = results != NULL;
+        if (ok && frame->code == MSG_MSET) {
+            result = kv_shards_mset(shards, items, count, frame->flags & KV_FRAME_ATOMIC,
+                                    results);
+        } else if (ok) {
+            result = kv_shards_mdelete(shards, items, count, results);
+        }
+        for (size_t i = 0; ok && i < count; i++) out->data[out->len++] = (char)results[i];
+        free(results);
+    }
+    free(items);
+    if (!ok) return false;
+
+    kv_frame_t reply = { .code = (uint8_t)result, .id = frame->id,
+                         .value_len = (uint32_t)(out->len - header_at - KV_FRAME_HEADER_SIZE) };
+    kv_frame_encode(out->data + header_at, &reply);
+    log_debug("%s %zu keys: %d", name, count, result);
+    return true;
+}
+
+// MSG_CLUSTER: the node list, for clients to place keys by
+static bool frame_cluster(const kv_shards_t* shards, const kv_frame_t* frame,
+                          conn_buf_t* out) {
+    if (!shards->cluster) {
+        log_debug("CLUSTER: not in one");
+        return frame_reply(out, frame->id, KV_ERROR_INVALID_KEY, 0, NULL, 0);
+    }
+    char* map;
+    size_t len;
+    if (!cluster_map_encode(shards->cluster, &map, &len)) {
+        return frame_reply(out, frame->id, KV_ERROR_NO_SPACE, 0, NULL, 0);
+    }
+    bool ok = frame_reply(out, frame->id, KV_SUCCESS, 0, map, len);
+    free(map);
+    return ok;
+}
+
+// Execute one complete v2 frame and append its reply, as handle_request
+static bool handle_frame(const kv_shards_t* shards, kv_store_t* store, const kv_frame_t* frame,
+                         const char* payload, conn_buf_t* out) {
+    const char* key = payload;
+    const char* extra = key + frame->key_len;
+    const char* value = extra + kv_frame_extra_len(frame->code);
+    int key_len = (int)frame->key_len;
+    kv_error_t result;
+
+    switch (frame->code) {
+        case MSG_PUT:
+            result = kv_store_put(store, key, frame->key_len, value, frame->value_len);
+            log_debug("PUT %.*s (%u bytes): %d", key_len, key, frame->value_len, result);
+            break;
+
+        case MSG_GET:
+            return frame_get(store, frame, key, out);
+
+        case MSG_DELETE:
+            result = kv_store_delete(store, key, frame->key_len);
+            log_debug("DELETE %.*s: %d", key_len, key, result);
+            break;
+
+        case MSG_SCAN:
+            return frame_scan(shards, frame, key, extra, value, out);
+
+        case MSG_PUT_TTL: {
+            uint64_t ttl_ms = kv_get_u64(extra);
+            result = kv_store_put_ttl(store, key, frame->key_len, value, frame->value_len, ttl_ms);
+            log_debug("PUT %.*s (%u bytes) ttl %llu ms: %d", key_len, key, frame->value_len,
+                      (unsigned long long)ttl_ms, result);
+            break;
+        }
+
+        case MSG_EXPIRE: {
+            uint64_t ttl_ms = kv_get_u64(extra);
+            result = kv_store_expire(store, key, frame->key_len, ttl_ms);
+            log_debug("EXPIRE %.*s %llu ms: %d", key_len, key, (unsigned long long)ttl_ms, result);
+            break;
+        }
+
+        case MSG_TTL: {
+            int64_t ttl_ms = -1;
+            char reply[sizeof(uint64_t)];
+            result = kv_store_ttl(store, key, frame->key_len, &ttl_ms);
+            kv_put_u64(reply, (uint64_t)ttl_ms);
+            log_debug("TTL %.*s: %d, %lld ms", key_len, key, result, (long long)ttl_ms);
+            return frame_reply(out, frame->id, result, 0, reply,
+                               result == KV_SUCCESS ? sizeof(reply) : 0);
+        }
+
+        case MSG_MGET:
+        case MSG_MSET:
+        case MSG_MDELETE:
+            return frame_batch(shards, frame, value, out);
+
+        case MSG_SHM_ATTACH:
+            // Granted by the epoll loops before requests get here (reactor.c)
+            result = KV_ERROR_INVALID_KEY;
+            log_debug("Shared memory not offered on this connection");
+            break;
+
+        case MSG_TRACK:
+            // Also taken by the epoll loops, when sent alone (reactor.c)
+            result = KV_ERROR_INVALID_KEY;
+            log_debug("Tracking not offered on this connection");
+            break;
+
+        case MSG_CLUSTER:
+            return frame_cluster(shards, frame, out);
+
+        case MSG_REPLICATE: {
+            if (!shards->replica) {
+                // Not started as a backup: a full sync would clear every key
+                result = KV_ERROR_INVALID_KEY;
+                log_warn("Replication refused: not a backup server");
+                break;
+            }
+            uint64_t offset = kv_get_u64(extra);
+            char reply[2 * sizeof(uint64_t)];
+            size_t reply_len;
+            bool more;
+            result = repl_receive(shards, frame->flags, offset, value, frame->value_len,
+                                  reply, &reply_len, &more);
+            log_debug("REPLICATE %u bytes at %llu, flags %u: %d", frame->value_len,
+                      (unsigned long long)offset, frame->flags, result);
+            return frame_reply(out, frame->id, result, more ? KV_FRAME_MORE : 0, reply,
+                               reply_len);
+        }
+
+        default:
+            log_warn("Unknown command received: %d", frame->code);
+            result = KV_ERROR_INVALID_KEY;
+            break;
+    }
+    return frame_reply(out, frame->id, result, 0, NULL, 0);
+}
+
+// Settle the protocol from the connection's first bytes, answering a v2
+// hello. Returns the bytes consumed, 0 if more must arrive first, or -1.
+static ssize_t negotiate(uint8_t* version, const char* data, size_t len, conn_buf_t* out) {
+    if (len == 0) return 0;
+    if (data[0] != 'K') {
+        *version = KV_PROTO_V1;
+        return 0;
+    }
+    if (len < KV_HELLO_SIZE) return 0;
+
+    uint8_t wanted = kv_hello_decode(data);
+    if (wanted == 0) return -1;
+    *version = wanted < KV_PROTO_V2 ? wanted : KV_PROTO_V2;
+
+    char hello[KV_HELLO_SIZE];
+    kv_hello_encode(hello, *version);
+    if (!conn_buf_append(out, hello, sizeof(hello))) return -1;
+    log_debug("Client speaks protocol v%u", *version);
+    return KV_HELLO_SIZE;
+}
+
+// The shard a v1 request's key is in, or -1 if it has no key
+static int message_shard(const kv_shards_t* shards, const char* data) {
+    message_type_t type;
+    memcpy(&type, data, sizeof(type));
+    const char* key = data + offsetof(kv_message_t, key);
+    switch (type) {
+        case MSG_PUT:
+        case MSG_GET:
+        case MSG_DELETE:
+        case MSG_PUT_TTL:
+        case MSG_EXPIRE:
+        case MSG_TTL:
+            return (int)kv_shard_of(shards, key, strnlen(key, MAX_KEY_SIZE));
+        default:
+            return -1;
+    }
+}
+
+// The shard every key of a multi-key request is in, or -1 if they are
+// spread over several or the request is malformed
+static int batch_shard(const kv_shards_t* shards, const char* data, size_t len, bool values) {
+    size_t head = sizeof(uint16_t) + (values ? sizeof(uint32_t) : 0);
+    int shard = -1;
+    for (size_t at = 0, n = 0; at < len; n++) {
+        if (len - at < head || n == KV_BATCH_MAX_KEYS) return -1;
+        size_t key_len = kv_get_u16(data + at);
+        size_t size = key_len + (values ? kv_get_u32(data + at + 2) : 0);
+        if (len - at - head < size) return -1;
+        int owner = (int)kv_shard_of(shards, data + at + head, key_len);
+        if (shard >= 0 && owner != shard) return -1;
+        shard = owner;
+        at += head + size;
+    }
+    return shard;
+}
+
+// The one shard a v2 frame touches, or -1
+static int frame_shard(const kv_shards_t* shards, const kv_frame_t* frame, const char* payload) {
+    switch (frame->code) {
+        case MSG_PUT:
+        case MSG_GET:
+        case MSG_DELETE:
+        case MSG_PUT_TTL:
+        case MSG_EXPIRE:
+        case MSG_TTL:
+            return (int)kv_shard_of(shards, payload, frame->key_len);
+        case MSG_MGET:
+        case MSG_MSET:
+        case MSG_MDELETE:
+            if (frame->key_len > 0) return -1;
+            return batch_shard(shards, payload + kv_frame_extra_len(frame->code),
+                               frame->value_len, frame->code == MSG_MSET);
+        default:
+            return -1;
+    }
+}
+
+// Another node of the cluster owning key, or -1 if it is this one's
+static int cluster_moved(const kv_shards_t* shards, const char* key, size_t key_len) {
+    unsigned owner = cluster_map_owner(shards->cluster, key, key_len);
+    return owner == shards->cluster_self ? -1 : (int)owner;
+}
+
+// The other node owning the key of a v1 request, or -1
+static int message_moved(const kv_shards_t* shards, const char* data) {
+    if (message_shard(shards, data) < 0) return -1;  // It has no key
+    const char* key = data + offsetof(kv_message_t, key);
+    return cluster_moved(shards, key, strnlen(key, MAX_KEY_SIZE));
+}
+
+// The other node owning a key of a v2 frame, the first such for a
+// multi-key one, or -1. Malformed batches are left to fail as usual.
+static int frame_moved(const kv_shards_t* shards, const kv_frame_t* frame, const char* payload) {
+    switch (frame->code) {
+        case MSG_PUT:
+        case MSG_GET:
+        case MSG_DELETE:
+        case MSG_PUT_TTL:
+        case MSG_EXPIRE:
+        case MSG_TTL:
+            return cluster_moved(shards, payload, frame->key_len);
+        case MSG_MGET:
+        case MSG_MSET:
+        case MSG_MDELETE: {
+            if (frame->key_len > 0) return -1;
+            bool values = frame->code == MSG_MSET;
+            size_t head = sizeof(uint16_t) + (values ? sizeof(uint32_t) : 0);
+            const char* data = payload;
+            size_t len = frame->value_len;
+            for (size_t at = 0; len - at >= head;) {
+                size_t key_len = kv_get_u16(data + at);
+                size_t size = key_len + (values ? kv_get_u32(data + at + 2) : 0);
+                if (len - at - head < size) return -1;
+                int owner = cluster_moved(shards, data + at + head, key_len);
+                if (owner >= 0) return owner;
+                at += head + size;
+            }
+            return -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+typedef enum {
+    ROUTE_HERE,                         // Run it on the calling thread
+    ROUTE_FORWARDED,                    // Handed to its shard's owner
+    ROUTE_WAIT,                         // Reaches into several shards: not until settled
+    ROUTE_FAILED,                       // Could not be forwarded
+} route_t;
+
+// Where a request for shard (-1: several or none) runs. Forwarding moves
+// *out to where the replies to later requests go.
+static route_t route_request(const request_router_t* router, int shard, uint8_t version,
+                             const char* data, size_t size, conn_buf_t** out) {
+    if (!router || (shard >= 0 && (unsigned)shard == router->self)) return ROUTE_HERE;
+    if (shard < 0) return router->settled(router->ctx) ? ROUTE_HERE : ROUTE_WAIT;
+    conn_buf_t* next = router->forward(router->ctx, (unsigned)shard, version, data, size);
+    if (!next) return ROUTE_FAILED;
+    *out = next;
+    return ROUTE_FORWARDED;
+}
+
+// Whether the limits leave the next request for a later call
+static bool limit_reached(request_limits_t* limits) {
+    if (!limits || limits->max_requests == 0 || limits->handled < limits->max_requests) {
+        return false;
+    }
+    limits->capped = true;
+    return true;
+}
+
+ssize_t request_process(const kv_shards_t* shards, const request_router_t* router,
+                        request_limits_t* limits, uint8_t* version, const char* data,
+                        size_t len, conn_buf_t* out, uint64_t* count) {
+    size_t done = 0, size;
+    if (*version == 0) {
+        ssize_t used = negotiate(version, data, len, out);
+        if (used < 0) return -1;
+        done = (size_t)used;
+    }
+
+    if (*version == KV_PROTO_V1) {
+        while ((size = request_size(data + done, len - done)) > 0) {
+            if (limit_reached(limits)) break;
+            if (limits && limits->shed) {
+                kv_error_t busy = KV_ERROR_BUSY;
+                if (!conn_buf_append(out, &busy, sizeof(busy))) return -1;
+                limits->handled++;
+                done += size;
+                continue;
+            }
+            if (shards->cluster && message_moved(shards, data + done) >= 0) {
+                kv_error_t moved = KV_ERROR_MOVED;  // v1 cannot say where to
+                if (!conn_buf_append(out, &moved, sizeof(moved))) return -1;
+                if (limits) limits->handled++;
+                done += size;
+                continue;
+            }
+            int shard = shards->count == 1 ? 0 : message_shard(shards, data + done);
+            route_t route = route_request(router, shard, *version, data + done, size, &out);
+            if (route == ROUTE_FAILED) return -1;
+            if (route == ROUTE_WAIT) break;
+            if (route == ROUTE_HERE) {
+                kv_store_t* store = shards->stores[shard < 0 ? 0 : shard];
+                if (!handle_request(shards, store, data + done, out)) return -1;
+                if (count) (*count)++;
+            }
+            if (limits) limits->handled++;
+            done += size;
+        }
+        return (ssize_t)done;
+    }
+
+    while (*version != 0 && len - done >= KV_FRAME_HEADER_SIZE) {
+        kv_frame_t frame;
+        kv_frame_decode(data + done, &frame);
+        if (frame.value_len > KV_FRAME_MAX_VALUE) return -1;
+        size = KV_FRAME_HEADER_SIZE + frame.key_len + kv_frame_extra_len(frame.code) +
+               frame.value_len;
+        if (len - done < size) break;   // The rest has yet to arrive
+        if (limit_reached(limits)) break;
+        if (limits && limits->shed && (frame.code != MSG_REPLICATE || !shards->replica)) {
+            if (!frame_reply(out, frame.id, KV_ERROR_BUSY, 0, NULL, 0)) return -1;
+            limits->handled++;
+            done += size;
+            continue;
+        }
+
+        const char* payload = data + done + KV_FRAME_HEADER_SIZE;
+        int moved = shards->cluster ? frame_moved(shards, &frame, payload) : -1;
+        if (moved >= 0) {
+            const char* owner = cluster_map_node(shards->cluster, (unsigned)moved);
+            if (!frame_reply(out, frame.id, KV_ERROR_MOVED, 0, owner, strlen(owner))) return -1;
+            if (limits) limits->handled++;
+            done += size;
+            continue;
+        }
+        int shard = shards->count == 1 ? 0 : frame_shard(shards, &frame, payload);
+        route_t route = route_request(router, shard, *version, data + done, size, &out);
+        if (route == ROUTE_FAILED) return -1;
+        if (route == ROUTE_WAIT) break;
+        // Noted before the GET runs, so a write after it is always heard of
+        if (limits && limits->tracking && frame.code == MSG_GET) {
+            tracking_read(limits->tracking, payload, frame.key_len);
+        }
+        if (route == ROUTE_HERE) {
+            kv_store_t* store = shards->stores[shard < 0 ? 0 : shard];
+            if (!handle_frame(shards, store, &frame, payload, out)) return -1;
+            if (count) (*count)++;
+        }
+        if (limits) limits->handled++;
+        done += size;
+    }
+    return (ssize_t)done;
+}
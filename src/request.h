@@ -0,0 +1,84 @@
+// Client request parsing and execution, shared by every connection loop
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "kv_store.h"
+
+// A stored value that goes out from where it lies, after the first at
+// bytes of the buffer holding it
+typedef struct {
+    size_t at;
+    kv_value_ref_t ref;                 // Released with the buffer unless cleared
+} conn_pin_t;
+
+// Growable byte buffer for a connection's pending input or output. One
+// that is sent and reset as a whole may set pin_min: GET values at least
+// that long are then pinned in the store (kv_store_get_ref) rather than
+// copied in, and its bytes are those of data with each pin in its place.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t size;
+    size_t pin_min;                     // 0: copy every value
+    conn_pin_t* pins;                   // In order of at
+    size_t pin_count;
+    size_t pin_size;
+} conn_buf_t;
+
+bool conn_buf_reserve(conn_buf_t* buf, size_t more);
+bool conn_buf_append(conn_buf_t* buf, const void* data, size_t len);
+// Place ref at the end of buf, which takes it over even on failure
+bool conn_buf_pin(conn_buf_t* buf, const kv_value_ref_t* ref);
+// Drop the first n bytes; never used with pins
+void conn_buf_consume(conn_buf_t* buf, size_t n);
+// Empty buf, releasing its pins but keeping its memory
+void conn_buf_reset(conn_buf_t* buf);
+void conn_buf_free(conn_buf_t* buf);
+
+// Bytes the v1 request at the front of data takes, or 0 if fewer than
+// that many have arrived. Requests are a kv_message_t, plus the TTL for
+// MSG_PUT_TTL.
+size_t request_size(const char* data, size_t len);
+
+// Hands requests for keys of another shard to the thread that owns it
+// (reactor.c). Requests that reach into several shards run on the calling
+// thread, but only once every request forwarded before them is answered.
+typedef struct {
+    unsigned self;                      // Shard owned by the calling thread
+    // Take a copy of the complete request at data, to run on shard.
+    // Returns where the replies to the requests after it go, or NULL if
+    // out of memory.
+    conn_buf_t* (*forward)(void* ctx, unsigned shard, uint8_t version,
+                           const char* data, size_t len);
+    // Whether every request forwarded so far has been answered
+    bool (*settled)(void* ctx);
+    void* ctx;
+} request_router_t;
+
+struct tracking_sub;
+
+// How much of its input one call may run (reactor.c)
+typedef struct {
+    size_t max_requests;                // Leave the rest after this many; 0 for all
+    bool shed;                          // Answer each KV_ERROR_BUSY instead of running it
+    size_t handled;                     // Out: requests run, forwarded or shed
+    bool capped;                        // Out: stopped at max_requests with more to run
+    struct tracking_sub* tracking;      // GETs are noted for it (tracking.h)
+} request_limits_t;
+
+// Run every complete request in data, in order, appending the replies to
+// out. A request cut short by the end of data is left for the next call,
+// as is everything from a request waiting for the router to settle, and
+// with limits everything past limits->max_requests.
+// Single-key requests run on their key's shard; with a router, only those
+// of router->self do, and the rest are forwarded. *version is the
+// connection's protocol (protocol.h): 0 until its first bytes settle it,
+// as a v2 hello or a v1 message. Returns the bytes consumed, or -1 if out
+// could not grow or a v2 frame is malformed. The number of requests run
+// here is added to *count unless it is NULL.
+ssize_t request_process(const kv_shards_t* shards, const request_router_t* router,
+                        request_limits_t* limits, uint8_t* version, const char* data,
+                        size_t len, conn_buf_t* out, uint64_t* count);
+
+#endif // REQUEST_H
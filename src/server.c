@@ -1,4 +1,11 @@
+#define _GNU_SOURCE  // accept4
 #include "kv_store.h"
+#include "cluster.h"
+#include "log.h"
+#include "reactor.h"
+#include "replication.h"
+#include "uring.h"
+#include "request.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,195 +16,303 @@
 #include <pthread.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 // Structure for thread arguments
 typedef struct {
     int client_socket;
-    kv_store_t* store;
+    kv_server_t* server;
 } client_thread_args;
 
-// Handle client connection
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Threaded mode: serve one connection with blocking calls
 static void* handle_client_connection(void* arg) {
     client_thread_args* args = (client_thread_args*)arg;
     int client_socket = args->client_socket;
-    kv_store_t* store = args->store;
+    kv_server_t* server = args->server;
+    const kv_shards_t* shards = &server->shards;
     free(args);
 
-    printf("New client handler started\n");
+    log_debug("New client handler started");
 
-    while (1) {
-        // Receive message from client
-        kv_message_t message;
-        ssize_t recv_size = recv(client_socket, &message, sizeof(message), 0);
-        
-        if (recv_size <= 0) {
-            printf("Client disconnected\n");
-            break;
-        }
+    conn_buf_t in = { 0 }, out = { 0 };
+    uint8_t version = 0;
+    while (conn_buf_reserve(&in, sizeof(kv_message_t) + sizeof(uint64_t))) {
+        ssize_t recv_size = recv(client_socket, in.data + in.len, in.size - in.len, 0);
+        if (recv_size < 0 && errno == EINTR) continue;
+        if (recv_size <= 0) break;
+        in.len += (size_t)recv_size;
 
-        printf("Received command: %d, Key: %s\n", message.type, message.key);
-
-        kv_error_t result;
-        char value[MAX_VALUE_SIZE];
-
-        // Process message
-        switch (message.type) {
-            case MSG_PUT:
-                result = kv_store_put(store, message.key, message.value);
-                send(client_socket, &result, sizeof(result), 0);
-                printf("PUT %s=%s: %d\n", message.key, message.value, result);
-                break;
-
-            case MSG_GET:
-                result = kv_store_get(store, message.key, value);
-                send(client_socket, &result, sizeof(result), 0);
-                if (result == KV_SUCCESS) {
-                    send(client_socket, value, MAX_VALUE_SIZE, 0);
-                }
-                printf("GET %s: %d\n", message.key, result);
-                break;
-
-            case MSG_DELETE:
-                result = kv_store_delete(store, message.key);
-                send(client_socket, &result, sizeof(result), 0);
-                printf("DELETE %s: %d\n", message.key, result);
-                break;
-
-            default:
-                printf("Unknown command received: %d\n", message.type);
-                result = KV_ERROR_INVALID_KEY;
-                send(client_socket, &result, sizeof(result), 0);
-                break;
-        }
+        ssize_t used = request_process(shards, NULL, NULL, &version, in.data, in.len, &out, NULL);
+        if (used < 0 || !send_all(client_socket, out.data, out.len)) break;
+        out.len = 0;
+        conn_buf_consume(&in, (size_t)used);
     }
 
+    log_debug("Client disconnected");
+    conn_buf_free(&in);
+    conn_buf_free(&out);
     close(client_socket);
-    printf("Client handler finished\n");
+    reactor_release(server);
+    log_debug("Client handler finished");
     return NULL;
 }
 
+void kv_server_options_init(kv_server_options_t* options) {
+    options->reactors = 0;
+    options->threaded = false;
+    options->io_uring = false;
+    options->unix_path = NULL;
+    options->shm = true;
+    options->max_connections = DEFAULT_MAX_CONNECTIONS;
+    options->max_inflight = DEFAULT_MAX_INFLIGHT;
+    options->latency_budget_ms = DEFAULT_LATENCY_BUDGET_MS;
+    options->zerocopy_min = 0;
+    options->tracking_keys = DEFAULT_TRACKING_KEYS;
+    options->repl_backlog = DEFAULT_REPL_BACKLOG;
+    options->repl_sync_rate = DEFAULT_REPL_SYNC_RATE;
+    options->backup = false;
+}
+
+// Allow as many connections as the hard descriptor limit permits
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
 kv_server_t* kv_server_create(kv_store_t* store, int port) {
-    printf("Creating server on port %d\n", port);
+    kv_server_options_t options;
+    kv_server_options_init(&options);
+    return kv_server_create_with_options(store, port, &options);
+}
+
+kv_server_t* kv_server_create_with_options(kv_store_t* store, int port,
+                                           const kv_server_options_t* options) {
+    log_info("Creating server on port %d", port);
     
     kv_server_t* server = (kv_server_t*)malloc(sizeof(kv_server_t));
     if (!server) {
-        perror("Failed to allocate server structure");
+        log_error("Failed to allocate server structure: %s", strerror(errno));
         return NULL;
     }
 
     // Initialize server structure
     server->store = store;
+    server->shards = (kv_shards_t){ .stores = &server->store, .count = 1 };
+    server->port = port;
+    server->options = *options;
     server->socket = -1;
+    server->unix_socket = -1;
+    server->unix_path[0] = '\0';
     server->is_running = false;
-    server->backup_socket = -1;
-    memset(server->client_sockets, -1, sizeof(server->client_sockets));
-
-    // Create socket
-    server->socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->socket < 0) {
-        perror("Socket creation failed");
+    server->repl = NULL;
+    server->replica = NULL;
+    server->cluster = NULL;
+    server->connections = 0;
+    server->refused = 0;
+
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->wake_fd < 0) {
+        log_error("eventfd failed: %s", strerror(errno));
         free(server);
         return NULL;
     }
 
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
-        close(server->socket);
+    raise_fd_limit();
+
+    // Listen, with SO_REUSEPORT if the other reactors can use it too. That
+    // would also let a second server on the port quietly take a share of
+    // the connections, so first make sure nothing else listens there.
+    server->reuseport = !options->threaded;
+    if (server->reuseport) {
+        int probe = reactor_listen(port, false);
+        if (probe < 0) {
+            log_error("Listen failed: %s", strerror(errno));
+            close(server->wake_fd);
+            free(server);
+            return NULL;
+        }
+        close(probe);
+    }
+    server->socket = reactor_listen(port, server->reuseport);
+    if (server->socket < 0 && server->reuseport) {
+        server->reuseport = false;
+        server->socket = reactor_listen(port, false);
+    }
+    if (server->socket < 0) {
+        log_error("Listen failed: %s", strerror(errno));
+        close(server->wake_fd);
         free(server);
         return NULL;
     }
 
-    // Setup server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-
-    // Bind socket
-    if (bind(server->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server->socket);
-        free(server);
-        return NULL;
+    if (options->unix_path) {
+        if (strlen(options->unix_path) >= sizeof(server->unix_path) ||
+            (server->unix_socket = reactor_listen_unix(options->unix_path)) < 0) {
+            log_error("Listen on %s failed: %s", options->unix_path, strerror(errno));
+            close(server->socket);
+            close(server->wake_fd);
+            free(server);
+            return NULL;
+        }
+        strcpy(server->unix_path, options->unix_path);
+        server->options.unix_path = server->unix_path;
+        log_info("Listening on %s", server->unix_path);
     }
 
-    // Listen
-    if (listen(server->socket, MAX_CLIENTS) < 0) {
-        perror("Listen failed");
-        close(server->socket);
-        free(server);
-        return NULL;
+    // Only a server started as a backup lets a primary connect to it
+    if (options->backup) {
+        server->replica = repl_replica_create();
+        if (!server->replica) {
+            kv_server_destroy(server);
+            return NULL;
+        }
+        server->shards.replica = server->replica;
     }
 
-    printf("Server created successfully\n");
+    log_info("Server created successfully");
     return server;
 }
 
-void kv_server_start(kv_server_t* server) {
-    if (!server || server->is_running) {
-        return;
+kv_server_t* kv_server_create_sharded(kv_shards_t* shards, int port,
+                                      const kv_server_options_t* options) {
+    kv_server_options_t sharded = *options;
+    sharded.reactors = shards->count;
+    kv_server_t* server = kv_server_create_with_options(shards->stores[0], port, &sharded);
+    if (server) {
+        server->shards = *shards;
+        server->shards.replica = server->replica;
     }
+    return server;
+}
 
-    printf("Starting server...\n");
-    server->is_running = true;
+// Threaded mode: accept on the calling thread and give every connection a
+// thread of its own
+static void serve_threaded(kv_server_t* server) {
+    struct pollfd fds[3] = {
+        { .fd = server->wake_fd, .events = POLLIN },
+        { .fd = server->socket, .events = POLLIN },
+        { .fd = server->unix_socket, .events = POLLIN },  // Ignored while -1
+    };
 
     // Accept client connections
     while (server->is_running) {
+        if (poll(fds, 3, -1) < 0) continue;
+        int listener = (fds[1].revents & POLLIN) ? server->socket
+                     : (fds[2].revents & POLLIN) ? server->unix_socket : -1;
+        if (listener < 0) continue;
+
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
 
         // Accept connection
-        int client_socket = accept(server->socket, 
-                                 (struct sockaddr*)&client_addr,
-                                 &client_addr_len);
+        int client_socket = accept4(listener,
+                                    (struct sockaddr*)&client_addr,
+                                    &client_addr_len, SOCK_CLOEXEC);
 
         if (client_socket < 0) {
-            perror("Accept failed");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("Accept failed: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if (!reactor_admit(server)) {
+            close(client_socket);
             continue;
         }
 
         // Print client information
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        printf("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+        if (listener == server->unix_socket) {
+            log_debug("New connection on %s", server->unix_path);
+        } else if (log_enabled(LOG_DEBUG)) {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+            log_debug("New connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        }
 
         // Create thread arguments
         client_thread_args* args = malloc(sizeof(client_thread_args));
         if (!args) {
-            perror("Failed to allocate thread arguments");
+            log_error("Failed to allocate thread arguments: %s", strerror(errno));
             close(client_socket);
+            reactor_release(server);
             continue;
         }
         args->client_socket = client_socket;
-        args->store = server->store;
+        args->server = server;
 
         // Create thread for client
         pthread_t thread;
         if (pthread_create(&thread, NULL, handle_client_connection, args) != 0) {
-            perror("Failed to create thread");
+            log_error("Failed to create thread: %s", strerror(errno));
             free(args);
             close(client_socket);
+            reactor_release(server);
             continue;
         }
         pthread_detach(thread);
     }
 }
 
+void kv_server_start(kv_server_t* server) {
+    if (!server || server->is_running) {
+        return;
+    }
+
+    log_info("Starting server...");
+    server->is_running = true;
+
+    if (server->shards.count > 1 && (server->options.threaded || server->options.io_uring)) {
+        log_warn("requests run on the thread that read them: only the epoll loops "
+                 "hand them to their shard's owner");
+    }
+    if (!server->options.threaded) {
+        if (server->options.io_uring) {
+            if (uring_run(server)) return;
+            log_warn("falling back to epoll");
+        }
+        if (reactor_run(server)) return;
+        log_warn("falling back to a thread per connection");
+    }
+    log_info("Serving with a thread per connection");
+    serve_threaded(server);
+}
+
+void kv_server_request_stop(kv_server_t* server) {
+    uint64_t one = 1;
+    server->is_running = false;
+    // Stays readable, so every event loop sees it
+    if (write(server->wake_fd, &one, sizeof(one)) < 0) {
+        // Already signalled often enough to overflow the counter
+    }
+}
+
 void kv_server_stop(kv_server_t* server) {
     if (!server) return;
 
-    printf("Stopping server...\n");
+    log_info("Stopping server...");
     server->is_running = false;
 
-    // Close all client connections
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->client_sockets[i] != -1) {
-            close(server->client_sockets[i]);
-            server->client_sockets[i] = -1;
-        }
+    if (server->refused > 0) {
+        log_info("%llu connections refused at the limit of %u",
+                 (unsigned long long)server->refused, server->options.max_connections);
     }
 
     // Close server socket
@@ -205,49 +320,81 @@ void kv_server_stop(kv_server_t* server) {
         close(server->socket);
         server->socket = -1;
     }
+    if (server->unix_socket != -1) {
+        close(server->unix_socket);
+        server->unix_socket = -1;
+        unlink(server->unix_path);
+    }
+    if (server->wake_fd != -1) {
+        close(server->wake_fd);
+        server->wake_fd = -1;
+    }
 
-    printf("Server stopped\n");
+    log_info("Server stopped");
+}
+
+// Point every store at a new stream, or none, and let the old one go
+static void replace_backup(kv_server_t* server, replication_t* repl) {
+    for (unsigned i = 0; i < server->shards.count; i++) {
+        kv_store_replicate(server->shards.stores[i], repl);
+    }
+    repl_destroy(server->repl);
+    server->repl = repl;
 }
 
 void kv_server_destroy(kv_server_t* server) {
     if (!server) return;
 
     kv_server_stop(server);
+    replace_backup(server, NULL);
+    repl_replica_destroy(server->replica);
+    cluster_map_destroy(server->cluster);
     free(server);
-    printf("Server destroyed\n");
+    log_info("Server destroyed");
 }
 
 bool kv_server_set_backup(kv_server_t* server, const char* host, int port) {
-    if (!server || !host) return false;
+    if (!server || !host || server->is_running) return false;
+    if (server->replica) {
+        log_error("A backup server cannot have a backup of its own");
+        return false;
+    }
 
-    printf("Setting up backup server %s:%d\n", host, port);
+    replication_t* repl = repl_create(&server->shards, host, port, server->options.repl_backlog,
+                                      server->options.repl_sync_rate);
+    if (!repl) return false;
+    replace_backup(server, repl);
+    log_info("Replicating to backup server %s:%d", host, port);
+    return true;
+}
 
-    struct sockaddr_in backup_addr;
-    backup_addr.sin_family = AF_INET;
-    backup_addr.sin_port = htons(port);
+bool kv_server_backup_stats(kv_server_t* server, kv_repl_stats_t* stats) {
+    if (!server || !server->repl) return false;
+    repl_stats(server->repl, stats);
+    return true;
+}
 
-    if (inet_pton(AF_INET, host, &backup_addr.sin_addr) <= 0) {
-        perror("Invalid backup address");
-        return false;
-    }
+bool kv_server_set_cluster(kv_server_t* server, const char* const* nodes, size_t count,
+                           const char* self, uint8_t placement, unsigned vnodes) {
+    if (!server || !nodes || !self || server->is_running) return false;
 
-    int backup_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (backup_socket < 0) {
-        perror("Backup socket creation failed");
+    cluster_map_t* map = cluster_map_create(nodes, count, placement, vnodes);
+    if (!map) {
+        log_error("Invalid cluster of %zu nodes", count);
         return false;
     }
-
-    if (connect(backup_socket, (struct sockaddr*)&backup_addr, sizeof(backup_addr)) < 0) {
-        perror("Backup connection failed");
-        close(backup_socket);
+    int index = cluster_map_find(map, self);
+    if (index < 0) {
+        log_error("Cluster does not list this node, %s", self);
+        cluster_map_destroy(map);
         return false;
     }
 
-    if (server->backup_socket != -1) {
-        close(server->backup_socket);
-    }
-
-    server->backup_socket = backup_socket;
-    printf("Backup server connected successfully\n");
+    cluster_map_destroy(server->cluster);
+    server->cluster = map;
+    server->shards.cluster = map;
+    server->shards.cluster_self = (unsigned)index;
+    log_info("Node %d of a cluster of %zu (%s)", index, count,
+             placement == KV_PLACEMENT_SLOTS ? "hash slots" : "hash ring");
     return true;
-}
\ No newline at end of file
+}
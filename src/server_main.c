@@ -1,63 +1,370 @@
 #include "kv_store.h"
+#include "log.h"
+#include <getopt.h>
 #include <signal.h>
 
-static volatile bool running = true;
+static kv_server_t* volatile running_server;
 
 void handle_signal(int sig) {
-    if (sig == SIGINT || sig == SIGTERM) {
-        printf("\nShutting down server...\n");
-        running = false;
+    if ((sig == SIGINT || sig == SIGTERM) && running_server) {
+        kv_server_request_stop(running_server);
     }
 }
 
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] [port] [backup_host backup_port]\n", program);
+    printf("\nOptions:\n");
+    printf("  --engine <name>            Storage engine: hash, lsm (default hash)\n");
+    printf("  --max-value-size <bytes>   Largest value accepted (default %d)\n",
+           DEFAULT_MAX_VALUE_LENGTH);
+    printf("  --maxmemory <bytes>        Hash: cache mode, evict keys beyond this much\n");
+    printf("                             entry memory (default 0, never evict)\n");
+    printf("  --fsync <policy>           WAL fsync policy: always, interval, never\n");
+    printf("                             (default interval)\n");
+    printf("  --fsync-interval-ms <ms>   fsync period for the interval policy (default 1000)\n");
+    printf("  --no-wal                   Disable the write-ahead log\n");
+    printf("  --snapshot-interval-ms <ms>\n");
+    printf("                             Background snapshot period, 0 to disable\n");
+    printf("                             (default 60000)\n");
+    printf("  --snapshot-min-changes <n> Writes needed to trigger a periodic snapshot\n");
+    printf("                             (default 1)\n");
+    printf("  --memtable-size <bytes>    LSM: flush the memtable beyond this (default 4 MB)\n");
+    printf("  --block-cache-size <bytes> LSM: SSTable block cache (default 64 MB)\n");
+    printf("  --compaction-threads <n>   LSM: background compaction workers (default 2)\n");
+    printf("  --reactors <n>             Event loop threads (default one per CPU)\n");
+    printf("  --shards <n>               Split the store into n shards, each served by\n");
+    printf("                             its own pinned event loop; 0 for one per CPU\n");
+    printf("  --threaded                 Serve each connection on its own thread\n");
+    printf("  --io-uring                 Event loops on io_uring, falling back to epoll\n");
+    printf("  --unix <path>              Unix socket for clients on this host\n");
+    printf("                             (default /tmp/kvstore-<port>.sock)\n");
+    printf("  --no-unix                  Serve TCP only\n");
+    printf("  --no-shm                   Keep Unix socket clients off shared memory\n");
+    printf("  --max-connections <n>      Open connections at once, 0 for no limit\n");
+    printf("                             (default %d)\n", DEFAULT_MAX_CONNECTIONS);
+    printf("  --max-inflight <n>         Requests a connection runs per turn or has at\n");
+    printf("                             other shards, 0 for no limit (default %d)\n",
+           DEFAULT_MAX_INFLIGHT);
+    printf("  --latency-budget-ms <ms>   Answer requests held back longer than this\n");
+    printf("                             KV_ERROR_BUSY, 0 never (default %d)\n",
+           DEFAULT_LATENCY_BUDGET_MS);
+    printf("  --zerocopy-min <bytes>     Send GET values this long with MSG_ZEROCOPY,\n");
+    printf("                             0 never (default 0)\n");
+    printf("  --tracking-keys <n>        Keys whose readers are tracked for near caches,\n");
+    printf("                             0 to refuse them (default %d)\n",
+           DEFAULT_TRACKING_KEYS);
+    printf("  --repl-backlog <bytes>     Latest writes kept to resume a backup from\n");
+    printf("                             (default %d)\n", DEFAULT_REPL_BACKLOG);
+    printf("  --repl-sync-rate <bytes>   Most a full sync sends a backup per second,\n");
+    printf("                             0 for no limit (default %d)\n",
+           DEFAULT_REPL_SYNC_RATE);
+    printf("  --backup                   Be a primary's backup, taking its writes; other\n");
+    printf("                             servers refuse them. Not with backup_host\n");
+    printf("  --cluster <host:port,...>  Serve this node's share of the keys of a\n");
+    printf("                             cluster, answering others KV_ERROR_MOVED\n");
+    printf("  --cluster-self <host:port> This node in the --cluster list\n");
+    printf("                             (default 127.0.0.1:<port>)\n");
+    printf("  --cluster-slots            Place keys by hash slot, not on the hash ring\n");
+    printf("  --cluster-vnodes <n>       Ring points per node (default %d)\n",
+           KV_CLUSTER_VNODES);
+    printf("  --log-level <level>        debug, info, warn, error or off (default info,\n");
+    printf("                             or KV_LOG_LEVEL)\n");
+}
+
 int main(int argc, char* argv[]) {
     // Default port
     int port = 8080;
-    
-    // Parse command line arguments
-    if (argc > 1) {
-        port = atoi(argv[1]);
+
+    kv_store_options_t options;
+    kv_store_options_init(&options);
+    kv_server_options_t server_options;
+    kv_server_options_init(&server_options);
+
+    static const struct option long_options[] = {
+        {"engine",         required_argument, NULL, 'E'},
+        {"max-value-size", required_argument, NULL, 'V'},
+        {"maxmemory",      required_argument, NULL, 'X'},
+        {"fsync",          required_argument, NULL, 'F'},
+        {"fsync-interval-ms", required_argument, NULL, 'I'},
+        {"no-wal",         no_argument,       NULL, 'W'},
+        {"snapshot-interval-ms", required_argument, NULL, 'S'},
+        {"snapshot-min-changes", required_argument, NULL, 'C'},
+        {"memtable-size",  required_argument, NULL, 'M'},
+        {"block-cache-size", required_argument, NULL, 'B'},
+        {"compaction-threads", required_argument, NULL, 'T'},
+        {"reactors",       required_argument, NULL, 'R'},
+        {"shards",         required_argument, NULL, 'N'},
+        {"threaded",       no_argument,       NULL, 'P'},
+        {"io-uring",       no_argument,       NULL, 'U'},
+        {"unix",           required_argument, NULL, 'A'},
+        {"no-unix",        no_argument,       NULL, 'Z'},
+        {"no-shm",         no_argument,       NULL, 'O'},
+        {"max-connections", required_argument, NULL, 'K'},
+        {"max-inflight",   required_argument, NULL, 'Q'},
+        {"latency-budget-ms", required_argument, NULL, 'G'},
+        {"zerocopy-min",   required_argument, NULL, 'Y'},
+        {"tracking-keys",  required_argument, NULL, 'J'},
+        {"repl-backlog",   required_argument, NULL, 'b'},
+        {"repl-sync-rate", required_argument, NULL, 'r'},
+        {"backup",         no_argument,       NULL, 'a'},
+        {"cluster",        required_argument, NULL, 'c'},
+        {"cluster-self",   required_argument, NULL, 's'},
+        {"cluster-slots",  no_argument,       NULL, 'x'},
+        {"cluster-vnodes", required_argument, NULL, 'v'},
+        {"log-level",      required_argument, NULL, 'L'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    long shard_count = -1;              // Unsharded
+    const char* unix_path = NULL;       // The default for the port
+    bool unix_socket = true;
+    char default_unix_path[108];
+    char* cluster = NULL;               // Comma-separated nodes
+    const char* cluster_self = NULL;
+    char default_cluster_self[32];
+    uint8_t placement = KV_PLACEMENT_RING;
+    unsigned vnodes = KV_CLUSTER_VNODES;
+    int level = log_level_parse(getenv("KV_LOG_LEVEL"));
+    if (level >= 0) log_set_level(level);
+
+    // Parse command line options
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'E':
+                if (strcmp(optarg, "hash") == 0) {
+                    options.engine = &kv_hash_engine;
+                } else if (strcmp(optarg, "lsm") == 0) {
+                    options.engine = &kv_lsm_engine;
+                } else {
+                    fprintf(stderr, "Unknown storage engine: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'V':
+                options.max_value_length = strtoul(optarg, NULL, 10);
+                break;
+            case 'X':
+                options.max_memory = strtoull(optarg, NULL, 10);
+                break;
+            case 'F':
+                if (strcmp(optarg, "always") == 0) {
+                    options.fsync_policy = KV_FSYNC_ALWAYS;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    options.fsync_policy = KV_FSYNC_INTERVAL;
+                } else if (strcmp(optarg, "never") == 0) {
+                    options.fsync_policy = KV_FSYNC_NEVER;
+                } else {
+                    fprintf(stderr, "Unknown fsync policy: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'I':
+                options.fsync_interval_ms = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'W':
+                options.wal_enabled = false;
+                break;
+            case 'S':
+                options.snapshot_interval_ms = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                options.snapshot_min_changes = strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                options.memtable_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                options.block_cache_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                options.compaction_threads = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                server_options.reactors = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'N':
+                shard_count = strtol(optarg, NULL, 10);
+                if (shard_count < 0 || shard_count > KV_MAX_SHARDS) {
+                    fprintf(stderr, "Shards must be 0 to %d\n", KV_MAX_SHARDS);
+                    return 1;
+                }
+                break;
+            case 'P':
+                server_options.threaded = true;
+                break;
+            case 'U':
+                server_options.io_uring = true;
+                break;
+            case 'A':
+                unix_path = optarg;
+                unix_socket = true;
+                break;
+            case 'Z':
+                unix_socket = false;
+                break;
+            case 'O':
+                server_options.shm = false;
+                break;
+            case 'K':
+                server_options.max_connections = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'Q':
+                server_options.max_inflight = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                server_options.latency_budget_ms = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'Y':
+                server_options.zerocopy_min = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                server_options.tracking_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                server_options.repl_backlog = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                server_options.repl_sync_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                server_options.backup = true;
+                break;
+            case 'c':
+                cluster = optarg;
+                break;
+            case 's':
+                cluster_self = optarg;
+                break;
+            case 'x':
+                placement = KV_PLACEMENT_SLOTS;
+                break;
+            case 'v':
+                vnodes = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                if ((level = log_level_parse(optarg)) < 0) {
+                    fprintf(stderr, "Unknown log level: %s\n", optarg);
+                    return 1;
+                }
+                log_set_level(level);
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // Parse positional arguments
+    int nargs = argc - optind;
+    char** args = argv + optind;
+    if (nargs > 0) {
+        port = atoi(args[0]);
+    }
+    if (server_options.backup && nargs > 2) {
+        fprintf(stderr, "A backup server cannot have a backup of its own\n");
+        return 1;
     }
+    if (unix_socket && !unix_path) {
+        snprintf(default_unix_path, sizeof(default_unix_path), KV_UNIX_PATH_FORMAT, port);
+        unix_path = default_unix_path;
+    }
+    if (unix_socket) server_options.unix_path = unix_path;
 
     // Setup signal handling
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    printf("Starting key-value store server on port %d...\n", port);
+    log_info("Starting key-value store server on port %d...", port);
 
     // Create storage
-    kv_store_t* store = kv_store_create("store.dat");
-    if (!store) {
-        fprintf(stderr, "Failed to create storage\n");
+    kv_store_t* store = NULL;
+    kv_shards_t* shards = NULL;
+    if (shard_count >= 0) {
+        if (shard_count == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            shard_count = cpus < 1 ? 1 : cpus > KV_MAX_SHARDS ? KV_MAX_SHARDS : cpus;
+        }
+        shards = kv_shards_open("store.dat", &options, (unsigned)shard_count);
+    } else {
+        store = kv_store_create_with_options("store.dat", &options);
+    }
+    if (!store && !shards) {
+        log_error("Failed to create storage");
         return 1;
     }
 
     // Create server
-    kv_server_t* server = kv_server_create(store, port);
+    kv_server_t* server = shards
+        ? kv_server_create_sharded(shards, port, &server_options)
+        : kv_server_create_with_options(store, port, &server_options);
     if (!server) {
-        fprintf(stderr, "Failed to create server\n");
+        log_error("Failed to create server");
+        kv_shards_close(shards);
         kv_store_destroy(store);
         return 1;
     }
 
+    if (cluster) {
+        const char* nodes[KV_CLUSTER_MAX_NODES];
+        size_t count = 0;
+        char* saved;
+        for (char* node = strtok_r(cluster, ",", &saved); node && count < KV_CLUSTER_MAX_NODES;
+             node = strtok_r(NULL, ",", &saved)) {
+            nodes[count++] = node;
+        }
+        if (!cluster_self) {
+            snprintf(default_cluster_self, sizeof(default_cluster_self), "127.0.0.1:%d", port);
+            cluster_self = default_cluster_self;
+        }
+        if (!kv_server_set_cluster(server, nodes, count, cluster_self, placement, vnodes)) {
+            log_error("Failed to join the cluster");
+            kv_server_destroy(server);
+            kv_shards_close(shards);
+            kv_store_destroy(store);
+            return 1;
+        }
+    }
+
     // Optional: Setup backup server connection
-    if (argc > 3) {
-        const char* backup_host = argv[2];
-        int backup_port = atoi(argv[3]);
+    if (nargs > 2) {
+        const char* backup_host = args[1];
+        int backup_port = atoi(args[2]);
         if (!kv_server_set_backup(server, backup_host, backup_port)) {
-            printf("Warning: Failed to connect to backup server\n");
-        } else {
-            printf("Connected to backup server at %s:%d\n", backup_host, backup_port);
+            log_warn("Failed to set up the backup server");
         }
     }
 
     // Start server (this will block until server is stopped)
+    running_server = server;
     kv_server_start(server);
+    running_server = NULL;
+    log_info("Shutting down server...");
 
-    // Cleanup
+    // Cleanup; the logs go out first so the stats are not interleaved
+    kv_repl_stats_t repl;
+    bool replicated = kv_server_backup_stats(server, &repl);
     kv_server_destroy(server);
-    kv_store_destroy(store);
+    log_flush();
+    if (replicated) {
+        printf("replication: %llu records, %llu bytes, %llu batches\n",
+               (unsigned long long)repl.records, (unsigned long long)repl.offset,
+               (unsigned long long)repl.batches);
+        printf("replica syncs: %llu full (%llu bytes), %llu partial\n",
+               (unsigned long long)repl.full_syncs, (unsigned long long)repl.sync_bytes,
+               (unsigned long long)repl.partial_syncs);
+        printf("replica lag: %llu bytes, %llu ms\n",
+               (unsigned long long)repl.lag_bytes, (unsigned long long)repl.lag_ms);
+    }
+    if (shards) {
+        kv_shards_dump_stats(shards, stdout);
+        kv_shards_close(shards);
+    } else {
+        kv_store_dump_stats(store, stdout);
+        kv_store_destroy(store);
+    }
 
-    printf("Server shutdown complete\n");
+    log_info("Server shutdown complete");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,495 @@
+#include "kv_store.h"
+#include "hash.h"
+#include "log.h"
+#include "skiplist.h"
+#include <glob.h>
+
+// Fixed, so a key maps to the same shard after a restart
+#define SHARD_HASH_SEED 0x7368617264736565ull
+#define SHARD_SCAN_CHUNK 64             // Keys fetched from a shard at a time when merging
+#define SHARD_MOVE_BATCH 1024           // Keys moved per scan while rebalancing
+
+unsigned kv_shard_of(const kv_shards_t* shards, const char* key, size_t key_len) {
+    if (shards->count == 1) return 0;
+
+    kv_hash_tag(&key, &key_len);
+    uint64_t h = kv_hash(key, key_len, SHARD_HASH_SEED);
+    return (unsigned)(((__uint128_t)h * shards->count) >> 64);
+}
+
+static char* shard_path(const char* backup_file, unsigned index) {
+    size_t len = strlen(backup_file) + sizeof(".shard") + 10;
+    char* path = malloc(len);
+    if (path) snprintf(path, len, "%s.shard%u", backup_file, index);
+    return path;
+}
+
+// Whether a store left anything at path: a snapshot, WAL files or an LSM
+// directory
+static bool store_exists(const char* path) {
+    size_t len = strlen(path) + sizeof(".wal.*");
+    char* pattern = malloc(len);
+    if (!pattern) return false;
+
+    snprintf(pattern, len, "%s.lsm", path);
+    bool found = access(path, F_OK) == 0 || access(pattern, F_OK) == 0;
+    if (!found) {
+        glob_t wal;
+        snprintf(pattern, len, "%s.wal.*", path);
+        found = glob(pattern, 0, NULL, &wal) == 0;
+        globfree(&wal);
+    }
+    free(pattern);
+    return found;
+}
+
+// <backup_file>.shards records the count the keys were last placed for
+static unsigned read_placed_count(const char* backup_file) {
+    char path[4096];
+    unsigned count = 0;
+    snprintf(path, sizeof(path), "%s.shards", backup_file);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return 0;
+    if (fscanf(fp, "%u", &count) != 1) count = 0;
+    fclose(fp);
+    return count;
+}
+
+static void write_placed_count(const char* backup_file, unsigned count) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.shards", backup_file);
+    FILE* fp = fopen(path, "w");
+    if (!fp) {
+        log_warn("shard: could not record the shard count in %s", path);
+        return;
+    }
+    fprintf(fp, "%u\n", count);
+    fclose(fp);
+}
+
+typedef struct {
+    const kv_shards_t* shards;
+    unsigned self;                      // Shard the keys are in, or count for none
+    kv_batch_item_t items[SHARD_MOVE_BATCH];
+    size_t count;
+} shard_move_t;
+
+static bool collect_misplaced(void* ctx, const char* key, size_t key_len,
+                              const char* value, size_t value_len) {
+    shard_move_t* move = ctx;
+    if (kv_shard_of(move->shards, key, key_len) == move->self) return true;
+
+    char* copy = malloc(key_len + value_len + 1);
+    if (!copy) return false;
+    memcpy(copy, key, key_len);
+    memcpy(copy + key_len, value, value_len);
+    move->items[move->count++] = (kv_batch_item_t){ copy, key_len, copy + key_len, value_len };
+    return move->count < SHARD_MOVE_BATCH;
+}
+
+// Move every key of src that belongs to another shard there, TTL and all.
+// Returns the keys moved.
+static size_t move_misplaced(const kv_shards_t* shards, kv_store_t* src, unsigned self) {
+    shard_move_t* move = malloc(sizeof(*move));
+    if (!move) return 0;
+    move->shards = shards;
+    move->self = self;
+
+    size_t moved = 0;
+    char* resume = NULL;
+    size_t resume_len = 0;
+    do {
+        move->count = 0;
+        kv_store_scan(src, resume, resume_len, NULL, 0, collect_misplaced, move);
+
+        for (size_t i = 0; i < move->count; i++) {
+            const kv_batch_item_t* item = &move->items[i];
+            int64_t ttl_ms = -1;
+            // Gone if it expired since the scan saw it
+            if (kv_store_ttl(src, item->key, item->key_len, &ttl_ms) != KV_SUCCESS) continue;
+            kv_store_t* dst = kv_shard_store(shards, item->key, item->key_len);
+            kv_error_t result = kv_store_put_ttl(dst, item->key, item->key_len, item->value,
+                                                 item->value_len,
+                                                 ttl_ms < 0 ? 0 : ttl_ms > 0 ? ttl_ms : 1);
+            if (result == KV_SUCCESS) {
+                kv_store_delete(src, item->key, item->key_len);
+                moved++;
+            } else {
+                log_warn("shard: could not move key %.*s: %d", (int)item->key_len,
+                         item->key, result);
+            }
+        }
+
+        // Carry on just past the last key collected: the key plus a NUL
+        if (move->count > 0) {
+            const kv_batch_item_t* last = &move->items[move->count - 1];
+            char* next = realloc(resume, last->key_len + 1);
+            if (!next) break;
+            resume = next;
+            memcpy(resume, last->key, last->key_len);
+            resume[last->key_len] = '\0';
+            resume_len = last->key_len + 1;
+        }
+        for (size_t i = 0; i < move->count; i++) free((char*)move->items[i].key);
+    } while (move->count == SHARD_MOVE_BATCH);
+
+    free(resume);
+    free(move);
+    return moved;
+}
+
+// Empty what an unsharded store at backup_file holds into the shards
+static size_t import_unsharded(const kv_shards_t* shards, const char* backup_file,
+                               const kv_store_options_t* options) {
+    if (!store_exists(backup_file)) return 0;
+    kv_store_t* store = kv_store_create_with_options(backup_file, options);
+    if (!store) return 0;
+    size_t moved = move_misplaced(shards, store, shards->count);
+    kv_store_save(store);
+    kv_store_destroy(store);
+    return moved;
+}
+
+kv_shards_t* kv_shards_open(const char* backup_file, const kv_store_options_t* options,
+                            unsigned count) {
+    if (count == 0 || count > KV_MAX_SHARDS) return NULL;
+
+    kv_store_options_t shard_options = *options;
+    if (options->max_memory) {
+        shard_options.max_memory = options->max_memory / count ? options->max_memory / count : 1;
+    }
+    shard_options.block_cache_size = options->block_cache_size / count;
+
+    // Shards an earlier run left past count are opened too, to be emptied
+    unsigned found = 0, placed = backup_file ? read_placed_count(backup_file) : 0;
+    while (backup_file && found < KV_MAX_SHARDS) {
+        char* path = shard_path(backup_file, found);
+        bool exists = path && store_exists(path);
+        free(path);
+        if (!exists) break;
+        found++;
+    }
+    unsigned opened = found > count ? found : count;
+
+    kv_shards_t* shards = calloc(1, sizeof(*shards));
+    kv_store_t** stores = calloc(opened, sizeof(*stores));
+    if (!shards || !stores) {
+        free(shards);
+        free(stores);
+        return NULL;
+    }
+    shards->stores = stores;
+    shards->count = count;
+
+    for (unsigned i = 0; i < opened; i++) {
+        char* path = backup_file ? shard_path(backup_file, i) : NULL;
+        if (!backup_file || path) stores[i] = kv_store_create_with_options(path, &shard_options);
+        free(path);
+        if (!stores[i]) {
+            log_error("shard: failed to open shard %u", i);
+            for (unsigned j = 0; j < i; j++) kv_store_destroy(stores[j]);
+            free(stores);
+            free(shards);
+            return NULL;
+        }
+    }
+
+    size_t moved = 0;
+    if (found > 0 && placed != count) {
+        for (unsigned i = 0; i < opened; i++) moved += move_misplaced(shards, stores[i], i);
+    }
+    for (unsigned i = count; i < opened; i++) {
+        kv_store_save(stores[i]);       // Leaves it empty on disk
+        kv_store_destroy(stores[i]);
+    }
+    if (backup_file) {
+        moved += import_unsharded(shards, backup_file, options);
+        if (placed != count) write_placed_count(backup_file, count);
+    }
+    if (moved > 0) {
+        log_info("shard: moved %zu keys to their shards (%u shards, %u before)", moved,
+                 count, placed);
+    }
+    return shards;
+}
+
+void kv_shards_close(kv_shards_t* shards) {
+    if (!shards) return;
+    for (unsigned i = 0; i < shards->count; i++) kv_store_destroy(shards->stores[i]);
+    free(shards->stores);
+    free(shards);
+}
+
+// One shard's side of a merged scan: a chunk of its keys, copied
+typedef struct {
+    kv_store_t* store;
+    kv_batch_item_t items[SHARD_SCAN_CHUNK];
+    size_t count;
+    size_t next;
+    bool more;                          // The shard may hold keys past the chunk
+    bool failed;                        // A copy could not be made
+} shard_cursor_t;
+
+static bool collect_chunk(void* ctx, const char* key, size_t key_len,
+                          const char* value, size_t value_len) {
+    shard_cursor_t* cursor = ctx;
+    char* copy = malloc(key_len + value_len + 1);
+    if (!copy) {
+        cursor->failed = true;
+        return false;
+    }
+    memcpy(copy, key, key_len);
+    copy[key_len] = '\0';               // Also the start of the next chunk
+    memcpy(copy + key_len + 1, value, value_len);
+    cursor->items[cursor->count++] =
+        (kv_batch_item_t){ copy, key_len, copy + key_len + 1, value_len };
+    return cursor->count < SHARD_SCAN_CHUNK;
+}
+
+static void cursor_clear(shard_cursor_t* cursor) {
+    for (size_t i = 0; i < cursor->count; i++) free((char*)cursor->items[i].key);
+    cursor->count = cursor->next = 0;
+}
+
+// Fetch the next chunk, after the last key of the current one if any
+static kv_error_t cursor_fill(shard_cursor_t* cursor, const char* start, size_t start_len,
+                              const char* end, size_t end_len) {
+    char* last = NULL;
+    if (cursor->count > 0) {
+        last = (char*)cursor->items[cursor->count - 1].key;
+        start = last;
+        start_len = cursor->items[cursor->count - 1].key_len + 1;
+        cursor->count--;                // Freed below, once the scan has used it
+    }
+    cursor_clear(cursor);
+    kv_error_t result = kv_store_scan(cursor->store, start, start_len, end, end_len,
+                                      collect_chunk, cursor);
+    free(last);
+    cursor->more = cursor->count == SHARD_SCAN_CHUNK;
+    if (result == KV_SUCCESS && cursor->failed) result = KV_ERROR_NO_SPACE;
+    return result;
+}
+
+kv_error_t kv_shards_scan(const kv_shards_t* shards, const char* start, size_t start_len,
+                          const char* end, size_t end_len, kv_scan_fn visit, void* ctx) {
+    if (shards->count == 1) {
+        return kv_store_scan(shards->stores[0], start, start_len, end, end_len, visit, ctx);
+    }
+
+    shard_cursor_t* cursors = calloc(shards->count, sizeof(*cursors));
+    if (!cursors) return KV_ERROR_NO_SPACE;
+    kv_error_t result = KV_SUCCESS;
+    for (unsigned i = 0; i < shards->count && result == KV_SUCCESS; i++) {
+        cursors[i].store = shards->stores[i];
+        result = cursor_fill(&cursors[i], start, start_len, end, end_len);
+    }
+
+    // Visit the smallest key any shard has left, refilling a shard's chunk
+    // as it runs out
+    while (result == KV_SUCCESS) {
+        shard_cursor_t* least = NULL;
+        for (unsigned i = 0; i < shards->count; i++) {
+            shard_cursor_t* cursor = &cursors[i];
+            if (cursor->next == cursor->count) continue;
+            const kv_batch_item_t* item = &cursor->items[cursor->next];
+            if (!least || kv_key_compare(item->key, item->key_len,
+                                         least->items[least->next].key,
+                                         least->items[least->next].key_len) < 0) {
+                least = cursor;
+            }
+        }
+        if (!least) break;
+
+        const kv_batch_item_t* item = &least->items[least->next++];
+        if (!visit(ctx, item->key, item->key_len, item->value, item->value_len)) break;
+        if (least->next == least->count && least->more) {
+            result = cursor_fill(least, NULL, 0, end, end_len);
+        }
+    }
+
+    for (unsigned i = 0; i < shards->count; i++) cursor_clear(&cursors[i]);
+    free(cursors);
+    return result;
+}
+
+// A batch's items grouped by shard. Unless the batch keeps to one shard,
+// items holds them shard by shard, in batch order within each, and
+// order[k] is the batch index of items[k].
+typedef struct {
+    bool single;                        // Every item is in shard
+    unsigned shard;
+    kv_batch_item_t* items;
+    size_t* order;
+    size_t starts[KV_MAX_SHARDS + 1];   // Of each shard's run of items
+} shard_batch_t;
+
+static bool batch_split(const kv_shards_t* shards, const kv_batch_item_t* items, size_t count,
+                        shard_batch_t* batch) {
+    batch->single = true;
+    batch->shard = count > 0 ? kv_shard_of(shards, items[0].key, items[0].key_len) : 0;
+    batch->items = NULL;
+    batch->order = NULL;
+    if (shards->count == 1) return true;
+
+    unsigned* owner = malloc((count ? count : 1) * sizeof(*owner));
+    if (!owner) return false;
+    memset(batch->starts, 0, sizeof(batch->starts));
+    for (size_t i = 0; i < count; i++) {
+        owner[i] = kv_shard_of(shards, items[i].key, items[i].key_len);
+        batch->starts[owner[i] + 1]++;
+        if (owner[i] != batch->shard) batch->single = false;
+    }
+    if (batch->single) {
+        free(owner);
+        return true;
+    }
+
+    batch->items = malloc(count * sizeof(*batch->items));
+    batch->order = malloc(count * sizeof(*batch->order));
+    if (!batch->items || !batch->order) {
+        free(batch->items);
+        free(batch->order);
+        free(owner);
+        return false;
+    }
+    for (unsigned s = 0; s < shards->count; s++) batch->starts[s + 1] += batch->starts[s];
+    size_t fill[KV_MAX_SHARDS];
+    memcpy(fill, batch->starts, shards->count * sizeof(*fill));
+    for (size_t i = 0; i < count; i++) {
+        size_t at = fill[owner[i]]++;
+        batch->items[at] = items[i];
+        batch->order[at] = i;
+    }
+    free(owner);
+    return true;
+}
+
+static void batch_free(shard_batch_t* batch) {
+    free(batch->items);
+    free(batch->order);
+}
+
+typedef struct {
+    kv_error_t status;
+    char* value;
+    size_t value_len;
+} shard_value_t;
+
+typedef struct {
+    shard_value_t* values;              // In batch order
+    const size_t* order;                // Of the shard's run
+} shard_gather_t;
+
+static void gather_value(void* ctx, size_t index, kv_error_t status,
+                         const char* value, size_t value_len) {
+    shard_gather_t* gather = ctx;
+    shard_value_t* slot = &gather->values[gather->order[index]];
+    slot->status = status;
+    if (status != KV_SUCCESS) return;
+    slot->value = malloc(value_len ? value_len : 1);
+    if (!slot->value) {
+        slot->status = KV_ERROR_NO_SPACE;
+        return;
+    }
+    memcpy(slot->value, value, value_len);
+    slot->value_len = value_len;
+}
+
+kv_error_t kv_shards_mget(const kv_shards_t* shards, const kv_batch_item_t* items,
+                          size_t count, kv_mget_fn visit, void* ctx) {
+    shard_batch_t batch;
+    if (!batch_split(shards, items, count, &batch)) return KV_ERROR_NO_SPACE;
+    if (batch.single) {
+        return kv_store_mget(shards->stores[batch.shard], items, count, visit, ctx);
+    }
+
+    // Every shard answers before any value is passed on, in batch order
+    kv_error_t result = visit ? kv_store_check_batch(shards->stores[0], items, count, false)
+                              : KV_ERROR_INVALID_KEY;
+    shard_value_t* values = calloc(count, sizeof(*values));
+    if (result == KV_SUCCESS && !values) result = KV_ERROR_NO_SPACE;
+    for (unsigned s = 0; s < shards->count && result == KV_SUCCESS; s++) {
+        size_t first = batch.starts[s], n = batch.starts[s + 1] - first;
+        if (n == 0) continue;
+        shard_gather_t gather = { .values = values, .order = batch.order + first };
+        result = kv_store_mget(shards->stores[s], batch.items + first, n, gather_value, &gather);
+    }
+    for (size_t i = 0; i < count && values; i++) {
+        if (result == KV_SUCCESS) {
+            visit(ctx, i, values[i].status, values[i].value, values[i].value_len);
+        }
+        free(values[i].value);
+    }
+    free(values);
+    batch_free(&batch);
+    return result;
+}
+
+// Run a write batch shard by shard: each shard's run at once, with the
+// results put back in batch order
+static kv_error_t shards_write(const kv_shards_t* shards, const kv_batch_item_t* items,
+                               size_t count, bool values, bool atomic, kv_error_t* results) {
+    if (!results) return KV_ERROR_INVALID_KEY;
+    shard_batch_t batch;
+    kv_error_t result = batch_split(shards, items, count, &batch) ? KV_SUCCESS
+                                                                  : KV_ERROR_NO_SPACE;
+    if (result == KV_SUCCESS && batch.single) {
+        kv_store_t* store = shards->stores[batch.shard];
+        return values ? kv_store_mset(store, items, count, atomic, results)
+                      : kv_store_mdelete(store, items, count, results);
+    }
+
+    if (result == KV_SUCCESS) {
+        result = kv_store_check_batch(shards->stores[0], items, count, values);
+    }
+    if (result == KV_SUCCESS && atomic) result = KV_ERROR_INVALID_KEY;
+    kv_error_t* grouped = result == KV_SUCCESS ? malloc(count * sizeof(*grouped)) : NULL;
+    if (result == KV_SUCCESS && !grouped) result = KV_ERROR_NO_SPACE;
+    if (result != KV_SUCCESS) {
+        for (size_t i = 0; i < count; i++) results[i] = result;
+        batch_free(&batch);
+        return result;
+    }
+
+    for (unsigned s = 0; s < shards->count; s++) {
+        size_t first = batch.starts[s], n = batch.starts[s + 1] - first;
+        if (n == 0) continue;
+        if (values) {
+            kv_store_mset(shards->stores[s], batch.items + first, n, false, grouped + first);
+        } else {
+            kv_store_mdelete(shards->stores[s], batch.items + first, n, grouped + first);
+        }
+    }
+    for (size_t k = 0; k < count; k++) results[batch.order[k]] = grouped[k];
+    for (size_t i = 0; i < count && result == KV_SUCCESS; i++) result = results[i];
+    free(grouped);
+    batch_free(&batch);
+    return result;
+}
+
+kv_error_t kv_shards_mset(const kv_shards_t* shards, const kv_batch_item_t* items,
+                          size_t count, bool atomic, kv_error_t* results) {
+    return shards_write(shards, items, count, true, atomic, results);
+}
+
+kv_error_t kv_shards_mdelete(const kv_shards_t* shards, const kv_batch_item_t* items,
+                             size_t count, kv_error_t* results) {
+    return shards_write(shards, items, count, false, false, results);
+}
+
+size_t kv_shards_count(const kv_shards_t* shards) {
+    size_t keys = 0;
+    for (unsigned i = 0; i < shards->count; i++) keys += kv_store_count(shards->stores[i]);
+    return keys;
+}
+
+void kv_shards_dump_stats(const kv_shards_t* shards, FILE* out) {
+    if (shards->count == 1) {
+        kv_store_dump_stats(shards->stores[0], out);
+        return;
+    }
+    for (unsigned i = 0; i < shards->count; i++) {
+        fprintf(out, "shard %u:\n", i);
+        kv_store_dump_stats(shards->stores[i], out);
+    }
+}
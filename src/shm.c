@@ -0,0 +1,178 @@
+#define _GNU_SOURCE  // memfd_create
+#include "shm.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+size_t shm_ring_used(shm_ring_t* ring) {
+    return (size_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+                    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+size_t shm_ring_free(shm_ring_t* ring) {
+    return SHM_RING_SIZE - shm_ring_used(ring);
+}
+
+size_t shm_ring_write(shm_ring_t* ring, const void* data, size_t len) {
+    uint64_t head = ring->head;
+    size_t room = SHM_RING_SIZE - (size_t)(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if (len > room) len = room;
+    if (len == 0) return 0;
+
+    size_t at = (size_t)(head & (SHM_RING_SIZE - 1));
+    size_t first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+    memcpy(ring->data + at, data, first);
+    memcpy(ring->data, (const char*)data + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+size_t shm_ring_read(shm_ring_t* ring, void* data, size_t len) {
+    uint64_t tail = ring->tail;
+    size_t used = (size_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+    if (len > used) len = used;
+    if (len == 0) return 0;
+
+    size_t at = (size_t)(tail & (SHM_RING_SIZE - 1));
+    size_t first = len < SHM_RING_SIZE - at ? len : SHM_RING_SIZE - at;
+    memcpy(data, ring->data + at, first);
+    memcpy((char*)data + first, ring->data, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+// The fences pair with those in shm_ring_wait_*: either the sleeper sees
+// the ring move, or the other side sees its flag
+bool shm_ring_reader_asleep(shm_ring_t* ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->reader_waiting, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+}
+
+bool shm_ring_writer_asleep(shm_ring_t* ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->writer_waiting, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+bool shm_ring_wait_readable(shm_ring_t* ring) {
+    __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_ring_used(ring) == 0) return true;
+    __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+bool shm_ring_wait_writable(shm_ring_t* ring) {
+    __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_ring_free(ring) == 0) return true;
+    __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+void shm_ring_bell(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        // Already rung often enough to overflow the counter
+    }
+}
+
+shm_region_t* shm_region_create(int* memfd) {
+    *memfd = memfd_create("kv-shm", MFD_CLOEXEC);
+    if (*memfd < 0) return NULL;
+    if (ftruncate(*memfd, sizeof(shm_region_t)) < 0) {
+        int saved = errno;
+        close(*memfd);
+        errno = saved;
+        return NULL;
+    }
+    shm_region_t* region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED, *memfd, 0);
+    if (region == MAP_FAILED) {
+        int saved = errno;
+        close(*memfd);
+        errno = saved;
+        return NULL;
+    }
+    region->magic = SHM_MAGIC;
+    region->ring_size = SHM_RING_SIZE;
+    region->requests.reader_waiting = 1;  // The server starts out asleep
+    return region;
+}
+
+shm_region_t* shm_region_map(int memfd) {
+    struct stat st;
+    if (fstat(memfd, &st) < 0 || (size_t)st.st_size != sizeof(shm_region_t)) return NULL;
+    shm_region_t* region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) return NULL;
+    if (region->magic != SHM_MAGIC || region->ring_size != SHM_RING_SIZE) {
+        munmap(region, sizeof(shm_region_t));
+        return NULL;
+    }
+    return region;
+}
+
+void shm_region_unmap(shm_region_t* region) {
+    if (region) munmap(region, sizeof(shm_region_t));
+}
+
+bool shm_send_fds(int socket, const void* data, size_t len, const int* fds, int count) {
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    if (count < 1 || count > 4 || len == 0) return false;
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                          .msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+
+    // Small enough to go out whole even on a non-blocking socket that has
+    // nothing queued
+    ssize_t n;
+    do {
+        n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len;
+}
+
+int shm_recv_fds(int socket, void* data, size_t len, int* fds, int max) {
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    if (max > 4) max = 4;
+    int received = 0;
+    size_t got = 0;
+    while (got < len) {
+        struct iovec iov = { (char*)data + got, len - got };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * (size_t)i, sizeof(fd));
+                if (received < max) {
+                    fds[received++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    if (got == len) return received;
+    for (int i = 0; i < received; i++) close(fds[i]);
+    return -1;
+}
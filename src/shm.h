@@ -0,0 +1,80 @@
+// Shared-memory rings between the server and a client on the same host
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A client connected over the server's Unix socket may ask for a region
+// of shared memory (MSG_SHM_ATTACH, protocol.h). The server answers with
+// a memfd holding two byte rings, one per direction, and two eventfds:
+// the doorbell the server waits on and the one the client sleeps on. The
+// rings carry exactly the v2 frames the socket would, so from then on
+// requests and replies bypass the socket layer; the socket stays open
+// only so each side notices when the other goes away.
+//
+// Each ring has one producer and one consumer. A side about to sleep
+// raises its flag, then looks at the ring once more; the other side
+// rings the eventfd only if it finds the flag raised after moving the
+// ring, so a busy peer is never woken.
+#define SHM_RING_SIZE (1024 * 1024)     // Bytes per direction (power of two)
+#define SHM_MAGIC 0x4b56534du           // "KVSM"
+
+typedef struct {
+    uint64_t head;                      // Bytes ever written; producer only
+    uint64_t tail __attribute__((aligned(64)));  // Bytes ever read; consumer only
+    uint32_t reader_waiting __attribute__((aligned(64)));  // Ring after writing
+    uint32_t writer_waiting;            // Ring after reading: the ring was full
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shm_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;
+    shm_ring_t requests;                // Client to server
+    shm_ring_t replies;                 // Server to client
+} shm_region_t;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+// Copy in as much of data as fits, or out as much as has arrived; return
+// the bytes moved
+size_t shm_ring_write(shm_ring_t* ring, const void* data, size_t len);
+size_t shm_ring_read(shm_ring_t* ring, void* data, size_t len);
+size_t shm_ring_used(shm_ring_t* ring);
+size_t shm_ring_free(shm_ring_t* ring);
+
+// After writing: whether the reader sleeps and must be rung. After
+// reading: whether the writer waits for room, clearing its flag.
+bool shm_ring_reader_asleep(shm_ring_t* ring);
+bool shm_ring_writer_asleep(shm_ring_t* ring);
+
+// Raise a flag before sleeping. Returns false, lowering it again, if the
+// ring already changed, so there is no need to sleep.
+bool shm_ring_wait_readable(shm_ring_t* ring);
+bool shm_ring_wait_writable(shm_ring_t* ring);
+
+// Add one to an eventfd: any doorbell, shared memory's or not
+void shm_ring_bell(int fd);
+
+// A zeroed region in a new memfd, mapped. Returns NULL on failure.
+shm_region_t* shm_region_create(int* memfd);
+// Map the region a server sent; NULL unless it is one
+shm_region_t* shm_region_map(int memfd);
+void shm_region_unmap(shm_region_t* region);
+
+// Send len bytes, with count descriptors attached to the first
+bool shm_send_fds(int socket, const void* data, size_t len, const int* fds, int count);
+// Receive exactly len bytes and up to max descriptors sent with them.
+// Returns the number of descriptors, or -1.
+int shm_recv_fds(int socket, void* data, size_t len, int* fds, int max);
+
+#endif // SHM_H
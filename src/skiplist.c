@@ -0,0 +1,164 @@
+#include "skiplist.h"
+#include "epoch.h"
+#include <stdlib.h>
+
+// A node reaches level i+1 with probability 1/BRANCHING
+#define BRANCHING 4
+
+struct skiplist {
+    skiplist_node_t* head;              // Sentinel of full height, no key
+    uint32_t height;                    // Tallest node so far
+    size_t count;
+    size_t bytes;
+    uint64_t rng;                       // Only touched by writers
+};
+
+static size_t node_size(uint32_t height, size_t key_len) {
+    return sizeof(skiplist_node_t) + height * sizeof(skiplist_node_t*) + key_len;
+}
+
+static skiplist_node_t* node_create(uint32_t height, const char* key, size_t key_len) {
+    skiplist_node_t* node = malloc(node_size(height, key_len));
+    if (!node) return NULL;
+    node->value = NULL;
+    node->key_len = (uint32_t)key_len;
+    node->height = height;
+    memset(node->next, 0, height * sizeof(skiplist_node_t*));
+    if (key_len > 0) memcpy((char*)skiplist_key(node), key, key_len);
+    return node;
+}
+
+static uint32_t random_height(skiplist_t* list) {
+    uint32_t height = 1;
+    while (height < SKIPLIST_MAX_HEIGHT) {
+        // xorshift64
+        list->rng ^= list->rng << 13;
+        list->rng ^= list->rng >> 7;
+        list->rng ^= list->rng << 17;
+        if (list->rng % BRANCHING != 0) break;
+        height++;
+    }
+    return height;
+}
+
+skiplist_t* skiplist_create(void) {
+    skiplist_t* list = calloc(1, sizeof(skiplist_t));
+    if (!list) return NULL;
+
+    list->head = node_create(SKIPLIST_MAX_HEIGHT, NULL, 0);
+    if (!list->head) {
+        free(list);
+        return NULL;
+    }
+    list->height = 1;
+    list->rng = (uint64_t)(uintptr_t)list | 1;
+    return list;
+}
+
+void skiplist_destroy(skiplist_t* list, void (*free_value)(void*)) {
+    if (!list) return;
+
+    skiplist_node_t* node = list->head->next[0];
+    while (node) {
+        skiplist_node_t* next = node->next[0];
+        if (free_value && node->value) free_value(node->value);
+        free(node);
+        node = next;
+    }
+    free(list->head);
+    free(list);
+}
+
+// Last node before key on every level, and the first node >= key
+static skiplist_node_t* find_ge(skiplist_t* list, const char* key, size_t key_len,
+                                skiplist_node_t** prev) {
+    skiplist_node_t* node = list->head;
+    int level = (int)__atomic_load_n(&list->height, __ATOMIC_ACQUIRE) - 1;
+
+    for (;;) {
+        skiplist_node_t* next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+        if (next && kv_key_compare(skiplist_key(next), next->key_len, key, key_len) < 0) {
+            node = next;
+            continue;
+        }
+        if (prev) prev[level] = node;
+        if (level == 0) return next;
+        level--;
+    }
+}
+
+bool skiplist_put(skiplist_t* list, const char* key, size_t key_len,
+                  void* value, void** old) {
+    skiplist_node_t* prev[SKIPLIST_MAX_HEIGHT];
+    skiplist_node_t* node = find_ge(list, key, key_len, prev);
+
+    if (node && node->key_len == key_len && memcmp(skiplist_key(node), key, key_len) == 0) {
+        *old = __atomic_exchange_n(&node->value, value, __ATOMIC_ACQ_REL);
+        return true;
+    }
+
+    uint32_t height = random_height(list);
+    node = node_create(height, key, key_len);
+    if (!node) return false;
+    node->value = value;
+
+    if (height > list->height) {
+        for (uint32_t i = list->height; i < height; i++) prev[i] = list->head;
+        // Readers seeing the new height before the links just find NULL there
+        __atomic_store_n(&list->height, height, __ATOMIC_RELEASE);
+    }
+
+    // Link bottom-up so a node reachable on level i is reachable below it
+    for (uint32_t i = 0; i < height; i++) {
+        node->next[i] = prev[i]->next[i];
+        __atomic_store_n(&prev[i]->next[i], node, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&list->bytes, list->bytes + node_size(height, key_len), __ATOMIC_RELAXED);
+    *old = NULL;
+    return true;
+}
+
+void* skiplist_remove(skiplist_t* list, const char* key, size_t key_len) {
+    skiplist_node_t* prev[SKIPLIST_MAX_HEIGHT];
+    skiplist_node_t* node = find_ge(list, key, key_len, prev);
+
+    if (!node || node->key_len != key_len || memcmp(skiplist_key(node), key, key_len) != 0) {
+        return NULL;
+    }
+
+    // Unlink top-down. The node keeps its own links, so a reader standing
+    // on it still walks forward into the list.
+    for (int i = (int)node->height - 1; i >= 0; i--) {
+        __atomic_store_n(&prev[i]->next[i], node->next[i], __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&list->count, list->count - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&list->bytes, list->bytes - node_size(node->height, node->key_len),
+                     __ATOMIC_RELAXED);
+    void* value = node->value;
+    epoch_retire(node, free);
+    return value;
+}
+
+skiplist_node_t* skiplist_find(skiplist_t* list, const char* key, size_t key_len) {
+    skiplist_node_t* node = find_ge(list, key, key_len, NULL);
+    if (node && node->key_len == key_len && memcmp(skiplist_key(node), key, key_len) == 0) {
+        return node;
+    }
+    return NULL;
+}
+
+skiplist_node_t* skiplist_seek(skiplist_t* list, const char* key, size_t key_len) {
+    if (!key) return __atomic_load_n(&list->head->next[0], __ATOMIC_ACQUIRE);
+    return find_ge(list, key, key_len, NULL);
+}
+
+size_t skiplist_count(skiplist_t* list) {
+    return __atomic_load_n(&list->count, __ATOMIC_RELAXED);
+}
+
+size_t skiplist_bytes(skiplist_t* list) {
+    return __atomic_load_n(&list->bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+// Ordered skiplist with lock-free readers
+
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SKIPLIST_MAX_HEIGHT 20
+
+// Writers (put, remove) must be serialized by the caller. Readers take no
+// lock; if nodes or values can be freed while they look, they must be
+// inside an epoch section (epoch.h), since removal retires through it.
+typedef struct skiplist_node {
+    void* value;                        // Owned by the caller, swapped atomically
+    uint32_t key_len;
+    uint32_t height;
+    struct skiplist_node* next[];       // height links, followed by the key bytes
+} skiplist_node_t;
+
+typedef struct skiplist skiplist_t;
+
+// Byte-wise key order, a prefix sorting before any longer key
+static inline int kv_key_compare(const char* a, size_t a_len,
+                                 const char* b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static inline const char* skiplist_key(const skiplist_node_t* node) {
+    return (const char*)&node->next[node->height];
+}
+
+static inline void* skiplist_value(const skiplist_node_t* node) {
+    return __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+}
+
+static inline skiplist_node_t* skiplist_next(const skiplist_node_t* node) {
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+skiplist_t* skiplist_create(void);
+// Not safe with concurrent readers. free_value (may be NULL) gets each value.
+void skiplist_destroy(skiplist_t* list, void (*free_value)(void*));
+
+// Insert key, or replace its value. Returns false if out of memory;
+// otherwise *old is the replaced value (NULL for a new key).
+bool skiplist_put(skiplist_t* list, const char* key, size_t key_len,
+                  void* value, void** old);
+
+// Unlink key and retire its node. Returns its value, or NULL if absent.
+void* skiplist_remove(skiplist_t* list, const char* key, size_t key_len);
+
+// Node holding key, or NULL
+skiplist_node_t* skiplist_find(skiplist_t* list, const char* key, size_t key_len);
+
+// First node with a key >= key (key NULL: first node), or NULL
+skiplist_node_t* skiplist_seek(skiplist_t* list, const char* key, size_t key_len);
+
+size_t skiplist_count(skiplist_t* list);
+size_t skiplist_bytes(skiplist_t* list);  // Node memory including keys
+
+#endif // SKIPLIST_H
@@ -0,0 +1,286 @@
+#include "slab.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Chunks kept per size class in each thread's cache
+#define MAGAZINE_SIZE 32
+
+typedef struct free_chunk {
+    struct free_chunk* next;
+} free_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    size_t chunks_per_page;
+    free_chunk_t* free_list;
+    size_t free_count;
+    char* carve_ptr;                    // Unused tail of the newest page
+    size_t carve_left;                  // Chunks left there
+    size_t pages;
+} slab_class_t;
+
+// Per-thread cache of free chunks for one class. The counters are only
+// written by the owning thread and read by slab_get_stats.
+typedef struct {
+    void* items[MAGAZINE_SIZE];
+    int count;
+    long used_chunks;                   // Allocated minus freed by this thread
+    long requested_bytes;
+} magazine_t;
+
+typedef struct thread_cache {
+    magazine_t mags[SLAB_MAX_CLASSES];
+    long large_count;
+    long large_bytes;
+    struct thread_cache* prev;
+    struct thread_cache* next;
+} thread_cache_t;
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int num_classes;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Live thread caches, plus the counters of threads that have exited
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_cache_t* caches;
+static long exited_used[SLAB_MAX_CLASSES];
+static long exited_requested[SLAB_MAX_CLASSES];
+static long exited_large_count;
+static long exited_large_bytes;
+
+static pthread_key_t cache_key;
+static __thread thread_cache_t* cache;
+
+static inline void counter_add(long* counter, long delta) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+// Return n chunks from a magazine to its class
+static void magazine_flush(magazine_t* mag, slab_class_t* cls, int n) {
+    pthread_mutex_lock(&cls->lock);
+    while (n-- > 0 && mag->count > 0) {
+        free_chunk_t* chunk = mag->items[--mag->count];
+        chunk->next = cls->free_list;
+        cls->free_list = chunk;
+        cls->free_count++;
+    }
+    pthread_mutex_unlock(&cls->lock);
+}
+
+// Fill a magazine halfway from the class free list, carving new pages as needed
+static bool magazine_refill(magazine_t* mag, slab_class_t* cls) {
+    pthread_mutex_lock(&cls->lock);
+    while (mag->count < MAGAZINE_SIZE / 2) {
+        if (cls->free_list) {
+            mag->items[mag->count++] = cls->free_list;
+            cls->free_list = cls->free_list->next;
+            cls->free_count--;
+            continue;
+        }
+        if (cls->carve_left == 0) {
+            char* page = malloc(SLAB_PAGE_SIZE);
+            if (!page) break;
+            cls->carve_ptr = page;
+            cls->carve_left = cls->chunks_per_page;
+            cls->pages++;
+        }
+        mag->items[mag->count++] = cls->carve_ptr;
+        cls->carve_ptr += cls->chunk_size;
+        cls->carve_left--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    return mag->count > 0;
+}
+
+static void cache_release(void* arg) {
+    thread_cache_t* tc = arg;
+
+    pthread_mutex_lock(&caches_lock);
+    for (int i = 0; i < num_classes; i++) {
+        magazine_flush(&tc->mags[i], &classes[i], MAGAZINE_SIZE);
+        exited_used[i] += tc->mags[i].used_chunks;
+        exited_requested[i] += tc->mags[i].requested_bytes;
+    }
+    exited_large_count += tc->large_count;
+    exited_large_bytes += tc->large_bytes;
+
+    if (tc->prev) tc->prev->next = tc->next;
+    else caches = tc->next;
+    if (tc->next) tc->next->prev = tc->prev;
+    pthread_mutex_unlock(&caches_lock);
+
+    free(tc);
+}
+
+static void slab_init(void) {
+    double size = SLAB_MIN_CHUNK;
+    while (num_classes < SLAB_MAX_CLASSES - 1 && size <= SLAB_PAGE_SIZE / 2) {
+        size_t chunk = ((size_t)size + 7) & ~(size_t)7;
+        classes[num_classes].chunk_size = chunk;
+        num_classes++;
+        size = chunk * SLAB_GROWTH_FACTOR;
+    }
+    classes[num_classes++].chunk_size = SLAB_PAGE_SIZE;
+
+    for (int i = 0; i < num_classes; i++) {
+        pthread_mutex_init(&classes[i].lock, NULL);
+        classes[i].chunks_per_page = SLAB_PAGE_SIZE / classes[i].chunk_size;
+    }
+
+    pthread_key_create(&cache_key, cache_release);
+}
+
+static thread_cache_t* get_cache(void) {
+    if (cache) return cache;
+
+    thread_cache_t* tc = calloc(1, sizeof(thread_cache_t));
+    if (!tc) return NULL;
+
+    pthread_mutex_lock(&caches_lock);
+    tc->next = caches;
+    if (caches) caches->prev = tc;
+    caches = tc;
+    pthread_mutex_unlock(&caches_lock);
+
+    pthread_setspecific(cache_key, tc);
+    cache = tc;
+    return tc;
+}
+
+// Smallest class that fits size, or -1 if it needs a large allocation
+static int class_for(size_t size) {
+    int lo = 0, hi = num_classes - 1;
+    if (size > classes[hi].chunk_size) return -1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size >= size) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+size_t slab_chunk_size(size_t size) {
+    pthread_once(&init_once, slab_init);
+    int id = class_for(size);
+    return id < 0 ? size : classes[id].chunk_size;
+}
+
+void* slab_alloc(size_t size) {
+    pthread_once(&init_once, slab_init);
+
+    thread_cache_t* tc = get_cache();
+    int id = class_for(size);
+    if (id < 0) {
+        void* ptr = malloc(size);
+        if (ptr && tc) {
+            counter_add(&tc->large_count, 1);
+            counter_add(&tc->large_bytes, (long)size);
+        }
+        return ptr;
+    }
+
+    if (!tc) {
+        // No thread cache: take one chunk straight from the class
+        magazine_t tmp = { .count = 0 };
+        if (!magazine_refill(&tmp, &classes[id])) return NULL;
+        void* ptr = tmp.items[--tmp.count];
+        magazine_flush(&tmp, &classes[id], tmp.count);
+        return ptr;
+    }
+
+    magazine_t* mag = &tc->mags[id];
+    if (mag->count == 0 && !magazine_refill(mag, &classes[id])) {
+        return NULL;
+    }
+    counter_add(&mag->used_chunks, 1);
+    counter_add(&mag->requested_bytes, (long)size);
+    return mag->items[--mag->count];
+}
+
+void slab_free(void* ptr, size_t size) {
+    if (!ptr) return;
+
+    thread_cache_t* tc = get_cache();
+    int id = class_for(size);
+    if (id < 0) {
+        if (tc) {
+            counter_add(&tc->large_count, -1);
+            counter_add(&tc->large_bytes, -(long)size);
+        }
+        free(ptr);
+        return;
+    }
+
+    magazine_t* mag = tc ? &tc->mags[id] : NULL;
+    if (!mag) {
+        // No thread cache: hand the chunk straight back to its class
+        magazine_t tmp = { .items = { ptr }, .count = 1 };
+        magazine_flush(&tmp, &classes[id], 1);
+        return;
+    }
+
+    if (mag->count == MAGAZINE_SIZE) {
+        magazine_flush(mag, &classes[id], MAGAZINE_SIZE / 2);
+    }
+    mag->items[mag->count++] = ptr;
+    counter_add(&mag->used_chunks, -1);
+    counter_add(&mag->requested_bytes, -(long)size);
+}
+
+void slab_get_stats(kv_slab_stats_t* stats) {
+    pthread_once(&init_once, slab_init);
+    memset(stats, 0, sizeof(*stats));
+    stats->num_classes = num_classes;
+
+    long used[SLAB_MAX_CLASSES];
+    long requested[SLAB_MAX_CLASSES];
+    long large_count, large_bytes;
+
+    pthread_mutex_lock(&caches_lock);
+    large_count = exited_large_count;
+    large_bytes = exited_large_bytes;
+    for (int i = 0; i < num_classes; i++) {
+        used[i] = exited_used[i];
+        requested[i] = exited_requested[i];
+    }
+    for (thread_cache_t* tc = caches; tc; tc = tc->next) {
+        for (int i = 0; i < num_classes; i++) {
+            used[i] += __atomic_load_n(&tc->mags[i].used_chunks, __ATOMIC_RELAXED);
+            requested[i] += __atomic_load_n(&tc->mags[i].requested_bytes, __ATOMIC_RELAXED);
+        }
+        large_count += __atomic_load_n(&tc->large_count, __ATOMIC_RELAXED);
+        large_bytes += __atomic_load_n(&tc->large_bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    for (int i = 0; i < num_classes; i++) {
+        kv_slab_class_stats_t* cs = &stats->classes[i];
+        pthread_mutex_lock(&classes[i].lock);
+        cs->chunk_size = classes[i].chunk_size;
+        cs->pages = classes[i].pages;
+        cs->total_chunks = classes[i].pages * classes[i].chunks_per_page;
+        pthread_mutex_unlock(&classes[i].lock);
+
+        // Per-thread counters can go negative when chunks migrate between threads
+        cs->used_chunks = used[i] > 0 ? (size_t)used[i] : 0;
+        cs->requested_bytes = requested[i] > 0 ? (size_t)requested[i] : 0;
+
+        stats->pages += cs->pages;
+        stats->chunk_bytes += cs->used_chunks * cs->chunk_size;
+        stats->requested_bytes += cs->requested_bytes;
+    }
+    stats->large_count = large_count > 0 ? (size_t)large_count : 0;
+    stats->large_bytes = large_bytes > 0 ? (size_t)large_bytes : 0;
+
+    if (stats->chunk_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->requested_bytes / stats->chunk_bytes;
+    }
+    if (stats->pages > 0) {
+        stats->utilization = (double)stats->chunk_bytes /
+                             ((double)stats->pages * SLAB_PAGE_SIZE);
+    }
+}
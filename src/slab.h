@@ -0,0 +1,43 @@
+// Size-class slab allocator for store entries
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE (1024 * 1024)   // Pages are carved into equal chunks
+#define SLAB_MIN_CHUNK 48              // Smallest size class
+#define SLAB_GROWTH_FACTOR 1.25        // Ratio between consecutive classes
+#define SLAB_MAX_CLASSES 64
+
+// Allocations larger than the biggest class fall through to malloc.
+// The caller passes the same size to slab_free that it passed to slab_alloc.
+void* slab_alloc(size_t size);
+void slab_free(void* ptr, size_t size);
+
+// Bytes actually reserved for an allocation of the given size
+size_t slab_chunk_size(size_t size);
+
+typedef struct {
+    size_t chunk_size;
+    size_t pages;
+    size_t total_chunks;
+    size_t used_chunks;
+    size_t requested_bytes;             // Sum of sizes asked for by used chunks
+} kv_slab_class_stats_t;
+
+typedef struct {
+    int num_classes;
+    kv_slab_class_stats_t classes[SLAB_MAX_CLASSES];
+    size_t pages;
+    size_t chunk_bytes;                 // Bytes in chunks handed out
+    size_t requested_bytes;
+    size_t large_count;                 // Allocations above the largest class
+    size_t large_bytes;
+    double fragmentation;               // 1 - requested / chunk bytes
+    double utilization;                 // Chunk bytes / page bytes
+} kv_slab_stats_t;
+
+void slab_get_stats(kv_slab_stats_t* stats);
+
+#endif // SLAB_H
@@ -0,0 +1,376 @@
+#include "snapshot.h"
+#include "checksum.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+struct snapshotter {
+    char* path;
+    snapshot_hooks_t hooks;
+    void* ctx;
+    unsigned interval_ms;
+    uint64_t min_changes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;           // Thread: request made or stopping
+    pthread_cond_t done_cond;           // Requesters: a snapshot finished
+    uint64_t requested;                 // Tickets handed out by requests
+    uint64_t completed;                 // Last ticket served
+    bool last_ok;
+    bool stopping;
+
+    uint64_t last_changes;              // Change count covered by the last snapshot
+    snapshot_stats_t stats;
+    pthread_t thread;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t align_up(uint64_t n) {
+    return (n + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static bool put_bytes(snapshot_writer_t* writer, const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, writer->fp) != len) return false;
+    writer->offset += len;
+    return true;
+}
+
+bool snapshot_writer_begin(snapshot_writer_t* writer, FILE* fp,
+                           uint64_t hash_seed, uint64_t wal_generation) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fp = fp;
+    memcpy(writer->header.magic, SNAPSHOT_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = SNAPSHOT_VERSION;
+    writer->header.num_segments = NUM_SEGMENTS;
+    writer->header.hash_seed = hash_seed;
+    writer->header.wal_generation = wal_generation;
+
+    // Placeholder until the index is known
+    snapshot_header_t blank = { .magic = { 0 } };
+    return put_bytes(writer, &blank, sizeof(blank));
+}
+
+bool snapshot_writer_add(snapshot_writer_t* writer, int segment, uint64_t hash,
+                         const char* key, size_t key_len,
+                         const char* value, size_t value_len, uint64_t expires_at) {
+    static const char padding[SNAPSHOT_ALIGN];
+    snapshot_record_t record = {
+        .key_len = (uint32_t)key_len,
+        .value_len = (uint32_t)value_len,
+        .flags = expires_at ? SNAPSHOT_RECORD_EXPIRES : 0,
+        .hash = hash,
+    };
+    size_t expiry_len = snapshot_record_expiry_len(&record);
+    uint32_t crc = crc32c(0, (const char*)&record + sizeof(record.crc),
+                          sizeof(record) - sizeof(record.crc));
+    crc = crc32c(crc, &expires_at, expiry_len);
+    crc = crc32c(crc, key, key_len);
+    record.crc = crc32c(crc, value, value_len);
+
+    snapshot_index_entry_t* idx = &writer->index[segment];
+    if (idx->count == 0) idx->offset = writer->offset;
+
+    size_t len = sizeof(record) + expiry_len + key_len + value_len;
+    size_t padded = align_up(len);
+    if (!put_bytes(writer, &record, sizeof(record)) ||
+        !put_bytes(writer, &expires_at, expiry_len) ||
+        !put_bytes(writer, key, key_len) ||
+        !put_bytes(writer, value, value_len) ||
+        !put_bytes(writer, padding, padded - len)) {
+        return false;
+    }
+    idx->count++;
+    idx->bytes += padded;
+    writer->header.record_count++;
+    return true;
+}
+
+bool snapshot_writer_end(snapshot_writer_t* writer) {
+    snapshot_header_t* header = &writer->header;
+    header->index_offset = writer->offset;
+    if (!put_bytes(writer, writer->index, sizeof(writer->index))) return false;
+
+    uint32_t crc = crc32c(0, header, offsetof(snapshot_header_t, crc));
+    header->crc = crc32c(crc, writer->index, sizeof(writer->index));
+    return fseek(writer->fp, 0, SEEK_SET) == 0 &&
+           fwrite(header, sizeof(*header), 1, writer->fp) == 1;
+}
+
+snapshot_map_result_t snapshot_map(const char* path, snapshot_file_t* file) {
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return SNAPSHOT_MISSING;
+
+    struct stat st;
+    char magic[sizeof(((snapshot_header_t*)0)->magic)];
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header_t) ||
+        pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        close(fd);
+        return SNAPSHOT_NOT_BINARY;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Failed to map snapshot");
+        return SNAPSHOT_CORRUPT;
+    }
+    // Loader threads each read their own stretch of the file
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+
+    file->data = data;
+    file->size = (size_t)st.st_size;
+    file->header = data;
+
+    const snapshot_header_t* header = file->header;
+    size_t index_size = sizeof(snapshot_index_entry_t) * NUM_SEGMENTS;
+    if (header->version < 1 || header->version > SNAPSHOT_VERSION ||
+        header->num_segments != NUM_SEGMENTS ||
+        header->index_offset % SNAPSHOT_ALIGN != 0 ||
+        header->index_offset > file->size || file->size - header->index_offset < index_size) {
+        snapshot_unmap(file);
+        return SNAPSHOT_CORRUPT;
+    }
+    file->index = (const snapshot_index_entry_t*)(file->data + header->index_offset);
+
+    uint32_t crc = crc32c(0, header, offsetof(snapshot_header_t, crc));
+    if (crc32c(crc, file->index, index_size) != header->crc) {
+        snapshot_unmap(file);
+        return SNAPSHOT_CORRUPT;
+    }
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        const snapshot_index_entry_t* idx = &file->index[i];
+        if (idx->count > 0 &&
+            (idx->offset < sizeof(snapshot_header_t) || idx->offset % SNAPSHOT_ALIGN != 0 ||
+             idx->offset > header->index_offset ||
+             idx->bytes > header->index_offset - idx->offset)) {
+            snapshot_unmap(file);
+            return SNAPSHOT_CORRUPT;
+        }
+    }
+    return SNAPSHOT_MAPPED;
+}
+
+void snapshot_unmap(snapshot_file_t* file) {
+    if (file->data) munmap((void*)file->data, file->size);
+    memset(file, 0, sizeof(*file));
+}
+
+const snapshot_record_t* snapshot_next_record(const snapshot_file_t* file,
+                                              uint64_t* pos, uint64_t end,
+                                              bool* intact) {
+    if (end - *pos < sizeof(snapshot_record_t)) return NULL;
+
+    const snapshot_record_t* record = (const snapshot_record_t*)(file->data + *pos);
+    uint64_t len = sizeof(*record) + snapshot_record_expiry_len(record) +
+                   (uint64_t)record->key_len + record->value_len;
+    if (len > end - *pos) return NULL;
+
+    *intact = crc32c(0, (const char*)record + sizeof(record->crc),
+                     len - sizeof(record->crc)) == record->crc;
+    *pos += align_up(len);
+    if (*pos > end) *pos = end;
+    return record;
+}
+
+// A rename is only durable once the directory holding it is synced
+static void sync_parent_dir(const char* path) {
+    char* copy = strdup(path);
+    if (!copy) return;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+bool snapshot_write_file(const char* path, snapshot_write_fn write, void* ctx) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char* tmp = malloc(len);
+    if (!tmp) return false;
+    snprintf(tmp, len, "%s.tmp", path);
+
+    FILE* fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("Failed to create snapshot");
+        free(tmp);
+        return false;
+    }
+
+    bool ok = write(ctx, fp) && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(tmp, path) != 0) {
+        perror("Failed to install snapshot");
+        ok = false;
+    }
+    if (ok) {
+        sync_parent_dir(path);
+    } else {
+        unlink(tmp);
+    }
+
+    free(tmp);
+    return ok;
+}
+
+// Freeze the store just long enough to fork; the child then writes the
+// copy-on-write image it inherited while the parent keeps serving.
+static bool take_snapshot(snapshotter_t* snap) {
+    uint64_t start = now_us();
+    uint64_t generation = 0, changes = 0;
+
+    if (!snap->hooks.freeze(snap->ctx, &generation, &changes)) return false;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only this thread exists in the child, and the store's locks are
+        // all held by it: write the image and leave without cleanup
+        _exit(snapshot_write_file(snap->path, snap->hooks.write, snap->ctx) ? 0 : 1);
+    }
+    snap->hooks.thaw(snap->ctx);
+    uint64_t pause = now_us() - start;
+
+    bool ok = false;
+    if (pid < 0) {
+        perror("Failed to fork snapshot writer");
+    } else {
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    snap->hooks.finish(snap->ctx, generation, ok);
+
+    struct stat st;
+    pthread_mutex_lock(&snap->lock);
+    if (ok) {
+        snap->last_changes = changes;
+        snap->stats.snapshots++;
+        snap->stats.last_duration_ms = (now_us() - start) / 1000;
+        snap->stats.last_bytes = stat(snap->path, &st) == 0 ? (size_t)st.st_size : 0;
+    } else {
+        snap->stats.failures++;
+    }
+    snap->stats.last_pause_us = pause;
+    if (pause > snap->stats.max_pause_us) snap->stats.max_pause_us = pause;
+    pthread_mutex_unlock(&snap->lock);
+    return ok;
+}
+
+static bool store_is_dirty(snapshotter_t* snap) {
+    uint64_t changes = snap->hooks.changes(snap->ctx);
+    return changes - snap->last_changes >= snap->min_changes;
+}
+
+static void* snapshot_thread(void* arg) {
+    snapshotter_t* snap = arg;
+
+    pthread_mutex_lock(&snap->lock);
+    while (!snap->stopping) {
+        if (snap->completed == snap->requested) {
+            if (snap->interval_ms == 0) {
+                pthread_cond_wait(&snap->work_cond, &snap->lock);
+                continue;
+            }
+
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += snap->interval_ms / 1000;
+            ts.tv_nsec += (snap->interval_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            int rc = 0;
+            while (!snap->stopping && snap->completed == snap->requested && rc == 0) {
+                rc = pthread_cond_timedwait(&snap->work_cond, &snap->lock, &ts);
+            }
+            if (snap->stopping) break;
+            if (snap->completed == snap->requested && !store_is_dirty(snap)) continue;
+        }
+
+        uint64_t ticket = snap->requested;
+        pthread_mutex_unlock(&snap->lock);
+        bool ok = take_snapshot(snap);
+        pthread_mutex_lock(&snap->lock);
+
+        snap->completed = ticket;
+        snap->last_ok = ok;
+        pthread_cond_broadcast(&snap->done_cond);
+    }
+    pthread_mutex_unlock(&snap->lock);
+    return NULL;
+}
+
+snapshotter_t* snapshotter_start(const char* path, const snapshot_hooks_t* hooks,
+                                 void* ctx, unsigned interval_ms, uint64_t min_changes) {
+    snapshotter_t* snap = calloc(1, sizeof(snapshotter_t));
+    if (!snap) return NULL;
+
+    snap->path = strdup(path);
+    if (!snap->path) {
+        free(snap);
+        return NULL;
+    }
+    snap->hooks = *hooks;
+    snap->ctx = ctx;
+    snap->interval_ms = interval_ms;
+    snap->min_changes = min_changes ? min_changes : 1;
+    snap->last_changes = hooks->changes(ctx);
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_cond_init(&snap->work_cond, NULL);
+    pthread_cond_init(&snap->done_cond, NULL);
+
+    if (pthread_create(&snap->thread, NULL, snapshot_thread, snap) != 0) {
+        perror("Failed to start snapshot thread");
+        free(snap->path);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+void snapshotter_stop(snapshotter_t* snap) {
+    if (!snap) return;
+
+    pthread_mutex_lock(&snap->lock);
+    snap->stopping = true;
+    pthread_cond_signal(&snap->work_cond);
+    pthread_cond_broadcast(&snap->done_cond);
+    pthread_mutex_unlock(&snap->lock);
+    pthread_join(snap->thread, NULL);
+
+    pthread_mutex_destroy(&snap->lock);
+    pthread_cond_destroy(&snap->work_cond);
+    pthread_cond_destroy(&snap->done_cond);
+    free(snap->path);
+    free(snap);
+}
+
+bool snapshotter_request(snapshotter_t* snap, bool wait) {
+    pthread_mutex_lock(&snap->lock);
+    uint64_t ticket = ++snap->requested;
+    pthread_cond_signal(&snap->work_cond);
+    while (wait && snap->completed < ticket && !snap->stopping) {
+        pthread_cond_wait(&snap->done_cond, &snap->lock);
+    }
+    bool ok = !wait || (snap->completed >= ticket && snap->last_ok);
+    pthread_mutex_unlock(&snap->lock);
+    return ok;
+}
+
+void snapshotter_get_stats(snapshotter_t* snap, snapshot_stats_t* stats) {
+    pthread_mutex_lock(&snap->lock);
+    *stats = snap->stats;
+    pthread_mutex_unlock(&snap->lock);
+}
@@ -0,0 +1,156 @@
+// Point-in-time snapshots written in the background by a forked child
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "kv_store.h"
+
+// File layout (all integers little-endian, records 8-byte aligned):
+//
+//   header | segment 0 records | segment 1 records | ... | index
+//
+// Records are grouped by the segment their hash maps to, and the index
+// gives each segment's byte range. A loader can then mmap the file and
+// rebuild segments on separate threads without coordination. Hashes are
+// stored along with the seed they were computed under, so loading does not
+// rehash any key.
+#define SNAPSHOT_MAGIC "KVSNAP\r\n"
+#define SNAPSHOT_VERSION 2                // 2 adds key expiry; 1 is still read
+#define SNAPSHOT_ALIGN 8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_segments;              // Index entries, must match NUM_SEGMENTS
+    uint64_t hash_seed;                 // Seed of the stored hashes
+    uint64_t wal_generation;            // WAL generations <= this are included
+    uint64_t record_count;
+    uint64_t index_offset;
+    uint32_t reserved;
+    uint32_t crc;                       // CRC32C of the header before it and the index
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t offset;                    // First record of the segment
+    uint64_t count;
+    uint64_t bytes;                     // Including padding
+} snapshot_index_entry_t;
+
+#define SNAPSHOT_RECORD_EXPIRES 0x01    // An 8-byte expiry time precedes the key
+
+// Followed by the expiry if flagged, key_len key bytes, value_len value
+// bytes and zero padding
+typedef struct {
+    uint32_t crc;                       // CRC32C of everything after it, unpadded
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t flags;
+    uint64_t hash;
+} snapshot_record_t;
+
+// Streams records to a FILE*. Records must be added in segment order.
+typedef struct {
+    FILE* fp;
+    uint64_t offset;
+    snapshot_header_t header;
+    snapshot_index_entry_t index[NUM_SEGMENTS];
+} snapshot_writer_t;
+
+bool snapshot_writer_begin(snapshot_writer_t* writer, FILE* fp,
+                           uint64_t hash_seed, uint64_t wal_generation);
+// expires_at is in ms since the epoch, 0 for a key that does not expire
+bool snapshot_writer_add(snapshot_writer_t* writer, int segment, uint64_t hash,
+                         const char* key, size_t key_len,
+                         const char* value, size_t value_len, uint64_t expires_at);
+// Write the index and fill in the header
+bool snapshot_writer_end(snapshot_writer_t* writer);
+
+// A snapshot mapped read-only into memory
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    const snapshot_header_t* header;
+    const snapshot_index_entry_t* index;
+} snapshot_file_t;
+
+typedef enum {
+    SNAPSHOT_MAPPED,
+    SNAPSHOT_MISSING,                   // No file at path
+    SNAPSHOT_NOT_BINARY,                // Pre-binary (CSV) snapshot
+    SNAPSHOT_CORRUPT,                   // Bad header or index
+} snapshot_map_result_t;
+
+snapshot_map_result_t snapshot_map(const char* path, snapshot_file_t* file);
+void snapshot_unmap(snapshot_file_t* file);
+
+// Record at *pos if it fits before end, advancing *pos past it. *intact
+// tells whether its checksum matches. NULL at end or on a truncated record.
+const snapshot_record_t* snapshot_next_record(const snapshot_file_t* file,
+                                              uint64_t* pos, uint64_t end,
+                                              bool* intact);
+
+static inline size_t snapshot_record_expiry_len(const snapshot_record_t* record) {
+    return record->flags & SNAPSHOT_RECORD_EXPIRES ? sizeof(uint64_t) : 0;
+}
+
+static inline uint64_t snapshot_record_expires_at(const snapshot_record_t* record) {
+    uint64_t expires_at = 0;
+    memcpy(&expires_at, record + 1, snapshot_record_expiry_len(record));
+    return expires_at;
+}
+
+static inline const char* snapshot_record_key(const snapshot_record_t* record) {
+    return (const char*)(record + 1) + snapshot_record_expiry_len(record);
+}
+
+static inline const char* snapshot_record_value(const snapshot_record_t* record) {
+    return snapshot_record_key(record) + record->key_len;
+}
+
+// Serialize the store to fp. Returns false on a write error.
+typedef bool (*snapshot_write_fn)(void* ctx, FILE* fp);
+
+// Write a snapshot to path.tmp, fsync it and rename it over path, so a
+// crash leaves either the old or the new file but never a partial one
+bool snapshot_write_file(const char* path, snapshot_write_fn write, void* ctx);
+
+// What the snapshotter needs from the store
+typedef struct {
+    // Writes applied so far (monotonic), to skip snapshots of an idle store
+    uint64_t (*changes)(void* ctx);
+    // Block writers and start a new WAL generation. Returns the closed
+    // generation (0 without a WAL) and the change count at that instant.
+    bool (*freeze)(void* ctx, uint64_t* wal_generation, uint64_t* changes);
+    void (*thaw)(void* ctx);
+    // Runs in the child against the copy-on-write image of the frozen store
+    snapshot_write_fn write;
+    // The snapshot covering wal_generation was (ok) or was not made durable
+    void (*finish)(void* ctx, uint64_t wal_generation, bool ok);
+} snapshot_hooks_t;
+
+typedef struct snapshotter snapshotter_t;
+
+typedef struct {
+    uint64_t snapshots;
+    uint64_t failures;
+    uint64_t last_duration_ms;          // Freeze to rename of the last snapshot
+    uint64_t last_pause_us;             // Writers blocked while freezing and forking
+    uint64_t max_pause_us;
+    size_t last_bytes;                  // Size of the last snapshot file
+} snapshot_stats_t;
+
+// Start the background thread. Every interval_ms (0: only on request) it
+// takes a snapshot if at least min_changes writes happened since the last.
+snapshotter_t* snapshotter_start(const char* path, const snapshot_hooks_t* hooks,
+                                 void* ctx, unsigned interval_ms, uint64_t min_changes);
+
+// Stop the thread, waiting for a snapshot in progress
+void snapshotter_stop(snapshotter_t* snap);
+
+// Take a snapshot now. With wait, block until it is done and return
+// whether it succeeded; otherwise return immediately.
+bool snapshotter_request(snapshotter_t* snap, bool wait);
+
+void snapshotter_get_stats(snapshotter_t* snap, snapshot_stats_t* stats);
+
+#endif // SNAPSHOT_H
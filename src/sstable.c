@@ -0,0 +1,496 @@
+#include "sstable.h"
+#include "bloom.h"
+#include "checksum.h"
+#include "skiplist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_HEADER_SIZE 9            // key_len:4 value_len:4 type:1
+#define BLOCK_TRAILER_SIZE 4
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+struct sstable_builder {
+    FILE* fp;
+    char* path;
+    uint64_t offset;                    // Bytes written to fp
+    buffer_t block;                     // Data block being filled
+    buffer_t index;                     // Per-block index entries
+    buffer_t smallest;
+    buffer_t last_key;
+    uint64_t* hashes;                   // bloom_hash of every key
+    size_t num_hashes;
+    size_t hashes_cap;
+    uint64_t entries;
+};
+
+static bool buffer_append(buffer_t* buf, const void* data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + len) cap *= 2;
+        char* p = realloc(buf->data, cap);
+        if (!p) return false;
+        buf->data = p;
+        buf->cap = cap;
+    }
+    if (len > 0) memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static inline uint32_t load32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool pread_all(int fd, void* buf, size_t len, uint64_t offset) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+sstable_builder_t* sstable_builder_create(const char* path) {
+    sstable_builder_t* builder = calloc(1, sizeof(sstable_builder_t));
+    if (!builder) return NULL;
+
+    builder->path = strdup(path);
+    builder->fp = builder->path ? fopen(path, "w") : NULL;
+    if (!builder->fp) {
+        perror("Failed to create SSTable");
+        free(builder->path);
+        free(builder);
+        return NULL;
+    }
+    return builder;
+}
+
+static bool flush_block(sstable_builder_t* builder) {
+    buffer_t* block = &builder->block;
+    if (block->len == 0) return true;
+
+    uint32_t crc = crc32c(0, block->data, block->len);
+    if (!buffer_append(block, &crc, sizeof(crc)) ||
+        fwrite(block->data, 1, block->len, builder->fp) != block->len) {
+        return false;
+    }
+
+    uint32_t key_len = (uint32_t)builder->last_key.len;
+    uint32_t size = (uint32_t)block->len;
+    if (!buffer_append(&builder->index, &key_len, sizeof(key_len)) ||
+        !buffer_append(&builder->index, &builder->offset, sizeof(builder->offset)) ||
+        !buffer_append(&builder->index, &size, sizeof(size)) ||
+        !buffer_append(&builder->index, builder->last_key.data, key_len)) {
+        return false;
+    }
+
+    builder->offset += block->len;
+    block->len = 0;
+    return true;
+}
+
+bool sstable_builder_add(sstable_builder_t* builder, const char* key, size_t key_len,
+                         const char* value, size_t value_len, sstable_record_type_t type,
+                         uint64_t expires_at) {
+    if (builder->entries == 0 && !buffer_append(&builder->smallest, key, key_len)) {
+        return false;
+    }
+
+    if (builder->num_hashes == builder->hashes_cap) {
+        size_t cap = builder->hashes_cap ? builder->hashes_cap * 2 : 1024;
+        uint64_t* hashes = realloc(builder->hashes, cap * sizeof(uint64_t));
+        if (!hashes) return false;
+        builder->hashes = hashes;
+        builder->hashes_cap = cap;
+    }
+    builder->hashes[builder->num_hashes++] = bloom_hash(key, key_len);
+
+    size_t expiry_len = 0;
+    if (type == SSTABLE_VALUE && expires_at) {
+        type = SSTABLE_EXPIRING;
+        expiry_len = sizeof(expires_at);
+    }
+    uint32_t lens[2] = { (uint32_t)key_len, (uint32_t)(expiry_len + value_len) };
+    uint8_t t = (uint8_t)type;
+    if (!buffer_append(&builder->block, lens, sizeof(lens)) ||
+        !buffer_append(&builder->block, &t, sizeof(t)) ||
+        !buffer_append(&builder->block, key, key_len) ||
+        !buffer_append(&builder->block, &expires_at, expiry_len) ||
+        !buffer_append(&builder->block, value, value_len)) {
+        return false;
+    }
+
+    builder->last_key.len = 0;
+    if (!buffer_append(&builder->last_key, key, key_len)) return false;
+    builder->entries++;
+
+    return builder->block.len < SSTABLE_BLOCK_SIZE || flush_block(builder);
+}
+
+uint64_t sstable_builder_size(sstable_builder_t* builder) {
+    return builder->offset + builder->block.len;
+}
+
+uint64_t sstable_builder_entries(sstable_builder_t* builder) {
+    return builder->entries;
+}
+
+static void builder_free(sstable_builder_t* builder) {
+    free(builder->block.data);
+    free(builder->index.data);
+    free(builder->smallest.data);
+    free(builder->last_key.data);
+    free(builder->hashes);
+    free(builder->path);
+    free(builder);
+}
+
+bool sstable_builder_finish(sstable_builder_t* builder) {
+    bool ok = flush_block(builder);
+
+    // Filter, then the index with the smallest key in front
+    size_t bloom_size = bloom_filter_size(builder->num_hashes);
+    uint8_t* bloom = malloc(bloom_size);
+    buffer_t meta = { 0 };
+    uint32_t smallest_len = (uint32_t)builder->smallest.len;
+    ok = ok && bloom &&
+         buffer_append(&meta, &smallest_len, sizeof(smallest_len)) &&
+         buffer_append(&meta, builder->smallest.data, smallest_len) &&
+         buffer_append(&meta, builder->index.data, builder->index.len);
+
+    sstable_footer_t footer = { .entries = builder->entries, .version = SSTABLE_VERSION };
+    if (ok) {
+        bloom_filter_build(bloom, bloom_size, builder->hashes, builder->num_hashes);
+        footer.bloom_offset = builder->offset;
+        footer.bloom_size = bloom_size;
+        footer.index_offset = builder->offset + bloom_size;
+        footer.index_size = meta.len;
+        footer.meta_crc = crc32c(crc32c(0, bloom, bloom_size), meta.data, meta.len);
+        memcpy(footer.magic, SSTABLE_MAGIC, sizeof(footer.magic));
+
+        ok = fwrite(bloom, 1, bloom_size, builder->fp) == bloom_size &&
+             fwrite(meta.data, 1, meta.len, builder->fp) == meta.len &&
+             fwrite(&footer, sizeof(footer), 1, builder->fp) == 1 &&
+             fflush(builder->fp) == 0 && fsync(fileno(builder->fp)) == 0;
+    }
+    free(bloom);
+    free(meta.data);
+
+    ok = fclose(builder->fp) == 0 && ok;
+    if (!ok) {
+        perror("Failed to write SSTable");
+        unlink(builder->path);
+    }
+    builder_free(builder);
+    return ok;
+}
+
+void sstable_builder_abort(sstable_builder_t* builder) {
+    fclose(builder->fp);
+    unlink(builder->path);
+    builder_free(builder);
+}
+
+// Parse the index section into block handles
+static bool parse_index(sstable_t* table, size_t size) {
+    const char* p = table->index;
+    const char* end = p + size;
+
+    if (end - p < 4) return false;
+    table->smallest_len = load32(p);
+    p += 4;
+    if ((size_t)(end - p) < table->smallest_len) return false;
+    table->smallest = p;
+    p += table->smallest_len;
+
+    size_t cap = 0;
+    while (p < end) {
+        if (end - p < 16) return false;
+        sstable_block_t block = {
+            .key_len = load32(p),
+            .offset = load64(p + 4),
+            .size = load32(p + 12),
+        };
+        p += 16;
+        if ((size_t)(end - p) < block.key_len ||
+            block.size < BLOCK_TRAILER_SIZE || block.offset + block.size > table->file_size) {
+            return false;
+        }
+        block.last_key = p;
+        p += block.key_len;
+
+        if (table->num_blocks == cap) {
+            cap = cap ? cap * 2 : 64;
+            sstable_block_t* blocks = realloc(table->blocks, cap * sizeof(sstable_block_t));
+            if (!blocks) return false;
+            table->blocks = blocks;
+        }
+        table->blocks[table->num_blocks++] = block;
+    }
+    if (table->num_blocks == 0) return false;
+
+    const sstable_block_t* last = &table->blocks[table->num_blocks - 1];
+    table->largest = last->last_key;
+    table->largest_len = last->key_len;
+    return true;
+}
+
+sstable_t* sstable_open(const char* path, uint64_t number) {
+    sstable_t* table = calloc(1, sizeof(sstable_t));
+    if (!table) return NULL;
+
+    table->number = number;
+    table->path = strdup(path);
+    table->fd = table->path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (table->fd < 0) {
+        perror("Failed to open SSTable");
+        goto fail;
+    }
+
+    off_t size = lseek(table->fd, 0, SEEK_END);
+    sstable_footer_t footer;
+    if (size < (off_t)sizeof(footer) ||
+        !pread_all(table->fd, &footer, sizeof(footer), (uint64_t)size - sizeof(footer)) ||
+        memcmp(footer.magic, SSTABLE_MAGIC, sizeof(footer.magic)) != 0 ||
+        footer.version != SSTABLE_VERSION ||
+        footer.bloom_offset + footer.bloom_size != footer.index_offset ||
+        footer.index_offset + footer.index_size + sizeof(footer) != (uint64_t)size) {
+        fprintf(stderr, "Invalid SSTable %s\n", path);
+        goto fail;
+    }
+    table->file_size = (uint64_t)size;
+    table->entries = footer.entries;
+
+    table->bloom = malloc(footer.bloom_size);
+    table->index = malloc(footer.index_size);
+    table->bloom_size = footer.bloom_size;
+    if (!table->bloom || !table->index ||
+        !pread_all(table->fd, table->bloom, footer.bloom_size, footer.bloom_offset) ||
+        !pread_all(table->fd, table->index, footer.index_size, footer.index_offset) ||
+        crc32c(crc32c(0, table->bloom, footer.bloom_size), table->index,
+               footer.index_size) != footer.meta_crc ||
+        !parse_index(table, footer.index_size)) {
+        fprintf(stderr, "Corrupt SSTable index in %s\n", path);
+        goto fail;
+    }
+    posix_fadvise(table->fd, 0, 0, POSIX_FADV_RANDOM);
+    return table;
+
+fail:
+    sstable_close(table);
+    return NULL;
+}
+
+void sstable_close(sstable_t* table) {
+    if (!table) return;
+    if (table->fd >= 0) close(table->fd);
+    if (table->obsolete && unlink(table->path) != 0) {
+        perror("Failed to remove SSTable");
+    }
+    free(table->path);
+    free(table->index);
+    free(table->blocks);
+    free(table->bloom);
+    free(table);
+}
+
+// Referenced block b, from the cache or disk
+static cache_block_t* read_block(sstable_t* table, block_cache_t* cache,
+                                 uint64_t* block_reads, size_t b) {
+    const sstable_block_t* handle = &table->blocks[b];
+    cache_block_t* block = cache ? block_cache_lookup(cache, table->number, handle->offset) : NULL;
+    if (block) return block;
+
+    block = cache_block_alloc(handle->size);
+    if (!block) return NULL;
+    if (!pread_all(table->fd, block->data, handle->size, handle->offset)) {
+        perror("SSTable read failed");
+        block_cache_release(block);
+        return NULL;
+    }
+    if (block_reads) __atomic_add_fetch(block_reads, 1, __ATOMIC_RELAXED);
+
+    size_t payload = handle->size - BLOCK_TRAILER_SIZE;
+    if (crc32c(0, block->data, payload) != load32(block->data + payload)) {
+        fprintf(stderr, "Checksum mismatch in %s at offset %llu\n",
+                table->path, (unsigned long long)handle->offset);
+        block_cache_release(block);
+        return NULL;
+    }
+    if (cache) block_cache_insert(cache, table->number, handle->offset, block);
+    return block;
+}
+
+// Decode the record at *pos of a block. Returns false at the end or on a
+// malformed record (*error set). Expiring values come back as plain values
+// with their expiry split off.
+static bool parse_record(const cache_block_t* block, size_t* pos, bool* error,
+                         const char** key, uint32_t* key_len,
+                         const char** value, uint32_t* value_len, uint8_t* type,
+                         uint64_t* expires_at) {
+    size_t end = block->size - BLOCK_TRAILER_SIZE;
+    if (*pos >= end) return false;
+    if (end - *pos < RECORD_HEADER_SIZE) {
+        *error = true;
+        return false;
+    }
+    const char* p = block->data + *pos;
+    *key_len = load32(p);
+    *value_len = load32(p + 4);
+    *type = (uint8_t)p[8];
+    if ((uint64_t)*key_len + *value_len > end - *pos - RECORD_HEADER_SIZE) {
+        *error = true;
+        return false;
+    }
+    *key = p + RECORD_HEADER_SIZE;
+    *value = *key + *key_len;
+    *pos += RECORD_HEADER_SIZE + *key_len + *value_len;
+
+    *expires_at = 0;
+    if (*type == SSTABLE_EXPIRING) {
+        if (*value_len < sizeof(*expires_at)) {
+            *error = true;
+            return false;
+        }
+        *expires_at = load64(*value);
+        *value += sizeof(*expires_at);
+        *value_len -= sizeof(*expires_at);
+        *type = SSTABLE_VALUE;
+    }
+    return true;
+}
+
+// First block whose last key is >= key, or num_blocks
+static size_t find_block(const sstable_t* table, const char* key, size_t key_len) {
+    size_t lo = 0, hi = table->num_blocks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const sstable_block_t* b = &table->blocks[mid];
+        if (kv_key_compare(b->last_key, b->key_len, key, key_len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+sstable_lookup_t sstable_get(sstable_t* table, block_cache_t* cache, uint64_t* block_reads,
+                             const char* key, size_t key_len, uint64_t bloom_h,
+                             char* value, size_t value_size, size_t* value_len,
+                             uint64_t* expires_at) {
+    if (!bloom_filter_may_contain(table->bloom, table->bloom_size, bloom_h)) {
+        return SSTABLE_FILTERED;
+    }
+
+    size_t b = find_block(table, key, key_len);
+    if (b == table->num_blocks) return SSTABLE_NOT_FOUND;
+
+    cache_block_t* block = read_block(table, cache, block_reads, b);
+    if (!block) return SSTABLE_ERROR;
+
+    sstable_lookup_t result = SSTABLE_NOT_FOUND;
+    size_t pos = 0;
+    bool error = false;
+    const char *k, *v;
+    uint32_t k_len, v_len;
+    uint8_t type;
+    uint64_t expiry;
+    while (parse_record(block, &pos, &error, &k, &k_len, &v, &v_len, &type, &expiry)) {
+        int c = kv_key_compare(k, k_len, key, key_len);
+        if (c < 0) continue;
+        if (c == 0) {
+            if (type == SSTABLE_TOMBSTONE) {
+                result = SSTABLE_DELETED;
+            } else {
+                if (value_len) *value_len = v_len;
+                if (expires_at) *expires_at = expiry;
+                if (v_len <= value_size) memcpy(value, v, v_len);
+                result = SSTABLE_FOUND;
+            }
+        }
+        break;
+    }
+    if (error) result = SSTABLE_ERROR;
+
+    block_cache_release(block);
+    return result;
+}
+
+void sstable_iter_init(sstable_iter_t* it, sstable_t* table,
+                       block_cache_t* cache, uint64_t* block_reads) {
+    memset(it, 0, sizeof(*it));
+    it->table = table;
+    it->cache = cache;
+    it->block_reads = block_reads;
+}
+
+static bool iter_parse(sstable_iter_t* it) {
+    uint8_t type;
+    it->valid = parse_record(it->data, &it->pos, &it->error, &it->key, &it->key_len,
+                             &it->value, &it->value_len, &type, &it->expires_at);
+    if (it->valid) it->type = (sstable_record_type_t)type;
+    return it->valid;
+}
+
+// Load block b and step onto its first record, moving on past empty blocks
+static void iter_load(sstable_iter_t* it, size_t b) {
+    for (; b < it->table->num_blocks; b++) {
+        block_cache_release(it->data);
+        it->data = read_block(it->table, it->cache, it->block_reads, b);
+        it->block = b;
+        it->pos = 0;
+        if (!it->data) {
+            it->error = true;
+            break;
+        }
+        if (iter_parse(it) || it->error) return;
+    }
+    it->valid = false;
+    block_cache_release(it->data);
+    it->data = NULL;
+}
+
+void sstable_iter_seek(sstable_iter_t* it, const char* key, size_t key_len) {
+    it->error = false;
+    if (!key) {
+        iter_load(it, 0);
+        return;
+    }
+    iter_load(it, find_block(it->table, key, key_len));
+    while (it->valid && kv_key_compare(it->key, it->key_len, key, key_len) < 0) {
+        sstable_iter_next(it);
+    }
+}
+
+void sstable_iter_next(sstable_iter_t* it) {
+    if (!it->data) {
+        it->valid = false;
+        return;
+    }
+    if (!iter_parse(it) && !it->error) iter_load(it, it->block + 1);
+}
+
+void sstable_iter_close(sstable_iter_t* it) {
+    block_cache_release(it->data);
+    it->data = NULL;
+    it->valid = false;
+}
@@ -0,0 +1,127 @@
+// Sorted string tables: immutable files of key-ordered records
+
+#ifndef SSTABLE_H
+#define SSTABLE_H
+
+#include "block_cache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File layout:
+//
+//   data blocks | bloom filter | index | footer
+//
+// A data block holds whole records, [key_len:4][value_len:4][type:1][key][value],
+// and ends with the CRC32C of the rest of the block. The value of an
+// SSTABLE_EXPIRING record starts with its 8-byte expiry time. Blocks are cut once
+// they reach SSTABLE_BLOCK_SIZE. The index starts with the smallest key,
+// [key_len:4][key], followed by one [key_len:4][offset:8][size:4][last key]
+// entry per block, so a lookup reads the one block that can hold its key.
+#define SSTABLE_BLOCK_SIZE 4096
+#define SSTABLE_MAGIC "KVSSTBL\n"
+#define SSTABLE_VERSION 1
+
+typedef enum {
+    SSTABLE_VALUE = 1,
+    SSTABLE_TOMBSTONE = 2,              // Hides older versions of the key
+    SSTABLE_EXPIRING = 3,               // On disk only; read back as SSTABLE_VALUE
+} sstable_record_type_t;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t bloom_offset;
+    uint64_t bloom_size;
+    uint64_t entries;
+    uint32_t meta_crc;                  // CRC32C of filter and index
+    uint32_t version;
+    char magic[8];
+} sstable_footer_t;
+
+typedef struct sstable_builder sstable_builder_t;
+
+// Records must be added in strictly increasing key order. expires_at is in
+// ms since the epoch, 0 for values that never expire.
+sstable_builder_t* sstable_builder_create(const char* path);
+bool sstable_builder_add(sstable_builder_t* builder, const char* key, size_t key_len,
+                         const char* value, size_t value_len, sstable_record_type_t type,
+                         uint64_t expires_at);
+uint64_t sstable_builder_size(sstable_builder_t* builder);
+uint64_t sstable_builder_entries(sstable_builder_t* builder);
+// Write filter, index and footer, then fsync. Frees the builder either way.
+bool sstable_builder_finish(sstable_builder_t* builder);
+// Discard the file
+void sstable_builder_abort(sstable_builder_t* builder);
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;                      // Including the CRC
+    uint32_t key_len;
+    const char* last_key;               // Points into the table's index
+} sstable_block_t;
+
+typedef struct sstable {
+    uint64_t number;                    // File number, never reused
+    char* path;
+    int fd;
+    uint64_t file_size;
+    uint64_t entries;
+    char* index;
+    sstable_block_t* blocks;
+    size_t num_blocks;
+    const char* smallest;
+    uint32_t smallest_len;
+    const char* largest;
+    uint32_t largest_len;
+    uint8_t* bloom;
+    size_t bloom_size;
+    uint32_t refs;                      // Held by the engine's versions
+    bool obsolete;                      // Delete the file on close
+} sstable_t;
+
+sstable_t* sstable_open(const char* path, uint64_t number);
+void sstable_close(sstable_t* table);
+
+typedef enum {
+    SSTABLE_NOT_FOUND,
+    SSTABLE_FOUND,
+    SSTABLE_DELETED,                    // Newest record is a tombstone
+    SSTABLE_FILTERED,                   // Ruled out by the bloom filter
+    SSTABLE_ERROR,
+} sstable_lookup_t;
+
+// Point lookup. bloom_h is bloom_hash(key). Copies the value like
+// kv_store_get; *value_len and *expires_at are set even when it does not
+// fit. cache may be NULL; *block_reads counts blocks read from disk.
+sstable_lookup_t sstable_get(sstable_t* table, block_cache_t* cache, uint64_t* block_reads,
+                             const char* key, size_t key_len, uint64_t bloom_h,
+                             char* value, size_t value_size, size_t* value_len,
+                             uint64_t* expires_at);
+
+// Forward iterator over every record, tombstones included
+typedef struct {
+    sstable_t* table;
+    block_cache_t* cache;               // NULL to bypass (compaction)
+    uint64_t* block_reads;
+    size_t block;
+    cache_block_t* data;
+    size_t pos;
+    bool valid;
+    bool error;
+    const char* key;
+    uint32_t key_len;
+    const char* value;
+    uint32_t value_len;
+    sstable_record_type_t type;
+    uint64_t expires_at;
+} sstable_iter_t;
+
+void sstable_iter_init(sstable_iter_t* it, sstable_t* table,
+                       block_cache_t* cache, uint64_t* block_reads);
+// Position at the first record >= key (key NULL: first record)
+void sstable_iter_seek(sstable_iter_t* it, const char* key, size_t key_len);
+void sstable_iter_next(sstable_iter_t* it);
+void sstable_iter_close(sstable_iter_t* it);
+
+#endif // SSTABLE_H
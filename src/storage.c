@@ -1,154 +1,1652 @@
 #include "kv_store.h"
+#include "clock.h"
+#include "epoch.h"
+#include "evict.h"
+#include "hash.h"
+#include "log.h"
+#include "skiplist.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+#include "wal.h"
+#include <time.h>
+#include <sys/random.h>
 
-// Hash function for keys
-static unsigned int hash(const char* key) {
-    unsigned int hash = 0;
-    while (*key) {
-        hash = (hash * 31) + *key;
-        key++;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Control byte values. Full slots hold a 7-bit tag (0x00-0x7F), so any
+// byte with the high bit set is available for insertion.
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+#define GROUP_WIDTH  16
+
+// Resize once full + deleted slots exceed 7/8 of the table
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+// Slots moved from the old table per write while a resize is in progress
+#define MIGRATE_SLOTS_PER_OP (4 * GROUP_WIDTH)
+
+#define SEGMENT_BITS 8  // log2(NUM_SEGMENTS)
+
+// Most threads used to rebuild the index from a snapshot
+#define LOAD_MAX_THREADS 16
+// Snapshots smaller than this are loaded on the calling thread alone
+#define LOAD_PARALLEL_MIN_RECORDS 65536
+
+// The sweeper reclaims expired keys this often, at most SWEEP_SEGMENT_BUDGET
+// per segment per pass, which bounds both its CPU per pass and how long it
+// holds any one segment lock. A backlog carries over to the next pass.
+#define SWEEP_INTERVAL_MS 100
+#define SWEEP_SEGMENT_BUDGET 64
+
+static uint64_t make_seed(void) {
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed)) {
+        return seed;
+    }
+    return (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+}
+
+static inline uint8_t hash_tag(uint64_t h) {
+    return (uint8_t)(h & 0x7F);
+}
+
+static inline kv_segment_t* segment_for(kv_hash_store_t* store, uint64_t h) {
+    return &store->segments[h >> (64 - SEGMENT_BITS)];
+}
+
+// Bitmask of slots in the group at ctrl whose control byte equals tag
+static inline uint32_t group_match(const uint8_t* ctrl, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of EMPTY or DELETED slots in the group at ctrl
+static inline uint32_t group_match_available(const uint8_t* ctrl) {
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (ctrl[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline size_t entry_size(const kv_entry_t* entry) {
+    return sizeof(kv_entry_t) + entry->key_len + entry->value_len;
+}
+
+static inline const char* entry_value(const kv_entry_t* entry) {
+    return entry->data + entry->key_len;
+}
+
+static inline bool entry_matches(const kv_entry_t* entry, uint64_t h,
+                                 const char* key, size_t key_len) {
+    return entry->hash == h && entry->key_len == key_len &&
+           memcmp(entry->data, key, key_len) == 0;
+}
+
+// Expired entries stay in their table until the sweeper reclaims them, and
+// every reader skips them. Only entries with a TTL pay for the clock read.
+static inline bool entry_expired(const kv_entry_t* entry) {
+    return entry->expires_at && entry->expires_at <= clock_now_ms();
+}
+
+static kv_entry_t* entry_create(uint64_t h, const char* key, size_t key_len,
+                                const char* value, size_t value_len, uint64_t expires_at) {
+    if (key_len > MAX_KEY_LENGTH) return NULL;
+    kv_entry_t* entry = slab_alloc(sizeof(kv_entry_t) + key_len + value_len);
+    if (!entry) return NULL;
+    entry->hash = h;
+    entry->expires_at = expires_at;
+    entry->prev = entry->next = NULL;
+    entry->value_len = (uint32_t)value_len;
+    entry->refs = 1;                    // The table's, once published
+    entry->key_len = (uint16_t)key_len;
+    entry->freq = 0;
+    entry->queue = EVICT_NONE;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, value, value_len);
+    return entry;
+}
+
+static void entry_free(void* ptr) {
+    kv_entry_t* entry = ptr;
+    slab_free(entry, entry_size(entry));
+}
+
+// Drop a reference: the table's once no reader can still find the entry,
+// or a pinned value's once it is sent
+static void entry_release(void* ptr) {
+    kv_entry_t* entry = ptr;
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) entry_free(entry);
+}
+
+static kv_table_t* table_create(size_t capacity) {
+    kv_table_t* table = malloc(sizeof(kv_table_t));
+    if (!table) return NULL;
+
+    table->ctrl = malloc(capacity);
+    table->slots = calloc(capacity, sizeof(kv_entry_t*));
+    if (!table->ctrl || !table->slots) {
+        free(table->ctrl);
+        free(table->slots);
+        free(table);
+        return NULL;
+    }
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+    table->capacity = capacity;
+    table->size = 0;
+    table->tombstones = 0;
+    return table;
+}
+
+static void table_free(kv_table_t* table, bool free_entries) {
+    if (!table) return;
+    if (free_entries) {
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (!(table->ctrl[i] & 0x80)) entry_release(table->slots[i]);
+        }
+    }
+    free(table->ctrl);
+    free(table->slots);
+    free(table);
+}
+
+static void table_retire_cb(void* ptr) {
+    table_free(ptr, false);
+}
+
+// Find the slot holding key, or -1. Probes groups with triangular steps,
+// which visits every group exactly once for power-of-two sizes.
+//
+// Safe without the segment lock inside an epoch section: a control byte
+// only goes EMPTY -> tag -> DELETED -> tag, slots are published before
+// their tag, and entries are immutable once published.
+static long table_find(kv_table_t* table, uint64_t h, const char* key,
+                       size_t key_len, kv_entry_t** found) {
+    size_t group_mask = table->capacity / GROUP_WIDTH - 1;
+    size_t group = (h >> 7) & group_mask;
+    uint8_t tag = hash_tag(h);
+
+    for (size_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t* ctrl = table->ctrl + group * GROUP_WIDTH;
+        uint32_t match = group_match(ctrl, tag);
+        while (match) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+            kv_entry_t* entry = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+            if (entry && entry_matches(entry, h, key, key_len)) {
+                if (found) *found = entry;
+                return (long)slot;
+            }
+            match &= match - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return -1;
+        group = (group + step) & group_mask;
+    }
+    return -1;
+}
+
+// Insert an entry known to be absent from the table
+static void table_insert(kv_table_t* table, kv_entry_t* entry) {
+    size_t group_mask = table->capacity / GROUP_WIDTH - 1;
+    size_t group = (entry->hash >> 7) & group_mask;
+
+    for (size_t step = 1;; step++) {
+        uint32_t avail = group_match_available(table->ctrl + group * GROUP_WIDTH);
+        if (avail) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(avail);
+            if (table->ctrl[slot] == CTRL_DELETED) {
+                table->tombstones--;
+            }
+            __atomic_store_n(&table->slots[slot], entry, __ATOMIC_RELEASE);
+            __atomic_store_n(&table->ctrl[slot], hash_tag(entry->hash), __ATOMIC_RELEASE);
+            table->size++;
+            return;
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+static void table_erase(kv_table_t* table, size_t slot) {
+    __atomic_store_n(&table->ctrl[slot], CTRL_DELETED, __ATOMIC_RELAXED);
+    __atomic_store_n(&table->slots[slot], NULL, __ATOMIC_RELEASE);
+    table->size--;
+    table->tombstones++;
+}
+
+static inline bool table_needs_resize(const kv_table_t* table, size_t inserts) {
+    return (table->size + table->tombstones + inserts) * MAX_LOAD_DEN >
+           table->capacity * MAX_LOAD_NUM;
+}
+
+// Move up to max_slots entries from old_table into table. Caller holds the lock.
+static void segment_migrate(kv_segment_t* seg, size_t max_slots) {
+    kv_table_t* old = seg->old_table;
+    if (!old) return;
+
+    size_t end = seg->migrate_pos + max_slots;
+    if (end > old->capacity) end = old->capacity;
+
+    // Insert into the new table before erasing from the old one, so a
+    // reader checking old then new always finds the entry
+    for (size_t i = seg->migrate_pos; i < end; i++) {
+        if (!(old->ctrl[i] & 0x80)) {
+            table_insert(seg->table, old->slots[i]);
+            table_erase(old, i);
+        }
+    }
+    seg->migrate_pos = end;
+
+    if (seg->migrate_pos == old->capacity) {
+        __atomic_store_n(&seg->old_table, NULL, __ATOMIC_RELEASE);
+        seg->migrate_pos = 0;
+        epoch_retire(old, table_retire_cb);
+    }
+}
+
+// Make room for this many more inserts. Starts an incremental resize when
+// the current table is full; tables mostly full of tombstones are rebuilt
+// at the same size. Caller holds the lock.
+static bool segment_reserve(kv_segment_t* seg, size_t inserts) {
+    if (!table_needs_resize(seg->table, inserts)) return true;
+
+    // A resize is still draining; finish it before starting another
+    if (seg->old_table) {
+        segment_migrate(seg, seg->old_table->capacity);
+        if (!table_needs_resize(seg->table, inserts)) return true;
+    }
+
+    size_t capacity = seg->table->capacity;
+    while ((seg->table->size + inserts - 1) * 2 >= capacity * MAX_LOAD_NUM / MAX_LOAD_DEN) {
+        capacity *= 2;
+    }
+
+    kv_table_t* table = table_create(capacity);
+    if (!table) return false;
+
+    // Readers load table before old_table, so publish in the reverse order
+    seg->migrate_pos = 0;
+    __atomic_store_n(&seg->old_table, seg->table, __ATOMIC_RELEASE);
+    __atomic_store_n(&seg->table, table, __ATOMIC_RELEASE);
+    return true;
+}
+
+// The ordered index holds every key of the tables. It only changes when a
+// key is added or removed, under the key's segment lock, so overwrites
+// never touch it.
+static bool index_add(kv_hash_store_t* store, const char* key, size_t key_len) {
+    void* old;
+    pthread_mutex_lock(&store->index_lock);
+    bool ok = skiplist_put(store->index, key, key_len, NULL, &old);
+    pthread_mutex_unlock(&store->index_lock);
+    return ok;
+}
+
+static void index_remove(kv_hash_store_t* store, const char* key, size_t key_len) {
+    pthread_mutex_lock(&store->index_lock);
+    skiplist_remove(store->index, key, key_len);
+    pthread_mutex_unlock(&store->index_lock);
+}
+
+// Index every loaded entry; the parallel snapshot loader bypasses hash_put
+static bool index_rebuild(kv_hash_store_t* store) {
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        const kv_table_t* table = store->segments[i].table;
+        for (size_t s = 0; s < table->capacity; s++) {
+            if (table->ctrl[s] & 0x80) continue;
+            const kv_entry_t* entry = table->slots[s];
+            if (!index_add(store, entry->data, entry->key_len)) return false;
+        }
+    }
+    return true;
+}
+
+// Every entry with a TTL has a timer pending at or before its expiry. A
+// replacement only needs a new one if it expires sooner than what it
+// replaces; the sweeper moves a timer that fires early to the entry's new
+// time. Out of memory, the entry still reads as expired on time but is not
+// reclaimed until overwritten. Caller holds the lock.
+static void segment_schedule(kv_segment_t* seg, const kv_entry_t* old,
+                             const kv_entry_t* entry) {
+    if (!entry->expires_at) return;
+    if (old && old->expires_at && old->expires_at <= entry->expires_at) return;
+
+    if (!seg->expiry) {
+        timer_wheel_t* wheel = timer_wheel_create(clock_now_ms());
+        if (!wheel) return;
+        __atomic_store_n(&seg->expiry, wheel, __ATOMIC_RELEASE);
+    }
+    timer_wheel_add(seg->expiry, entry->expires_at, entry->data, entry->key_len);
+}
+
+// Cache mode: queue a new entry and charge it. Caller holds the lock.
+static void segment_track(kv_hash_store_t* store, kv_segment_t* seg, kv_entry_t* entry) {
+    if (!seg->evict) return;
+    evict_insert(seg->evict, entry);
+    __atomic_add_fetch(&store->memory_used, evict_charge(entry), __ATOMIC_RELAXED);
+}
+
+static void segment_track_replace(kv_hash_store_t* store, kv_segment_t* seg,
+                                  kv_entry_t* old, kv_entry_t* entry) {
+    if (!seg->evict) return;
+    evict_replace(seg->evict, old, entry);
+    __atomic_add_fetch(&store->memory_used, evict_charge(entry), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&store->memory_used, evict_charge(old), __ATOMIC_RELAXED);
+}
+
+static void segment_untrack(kv_hash_store_t* store, kv_segment_t* seg, kv_entry_t* entry) {
+    if (!seg->evict || entry->queue == EVICT_NONE) return;
+    evict_remove(seg->evict, entry);
+    __atomic_sub_fetch(&store->memory_used, evict_charge(entry), __ATOMIC_RELAXED);
+}
+
+// Evict the segment's next victim, or return false if it has none. Not
+// logged: a replayed key that was evicted is still a valid cached value,
+// and a delete that finds it gone is logged anyway (hash_delete). Caller
+// holds the lock.
+static bool segment_evict_one(kv_hash_store_t* store, kv_segment_t* seg, uint64_t now) {
+    kv_entry_t* victim = evict_next(seg->evict, now);
+    if (!victim) return false;
+
+    __atomic_sub_fetch(&store->memory_used, evict_charge(victim), __ATOMIC_RELAXED);
+
+    kv_table_t* tables[2] = { seg->table, seg->old_table };
+    for (int t = 0; t < 2; t++) {
+        kv_entry_t* found;
+        long slot = tables[t] ? table_find(tables[t], victim->hash, victim->data,
+                                           victim->key_len, &found) : -1;
+        if (slot < 0 || found != victim) continue;
+        table_erase(tables[t], (size_t)slot);
+        break;
+    }
+    index_remove(store, victim->data, victim->key_len);
+    __atomic_store_n(&seg->changes, seg->changes + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&seg->evict->evictions, seg->evict->evictions + 1, __ATOMIC_RELAXED);
+    epoch_retire(victim, entry_release);
+    return true;
+}
+
+// Make room for charge more bytes by evicting from this segment alone, so
+// a writer never waits on another segment's lock. Writes spread evenly
+// over the segments, so each gives up memory in proportion to what it
+// takes. Caller holds the lock.
+static void segment_make_room(kv_hash_store_t* store, kv_segment_t* seg, size_t charge) {
+    uint64_t now = 0;
+    while (__atomic_load_n(&store->memory_used, __ATOMIC_RELAXED) + charge >
+           store->options.max_memory) {
+        if (!now) now = clock_now_ms();
+        if (!segment_evict_one(store, seg, now)) break;
+    }
+}
+
+// Bring a store loaded from a larger snapshot or log under max_memory,
+// taking from each segment only what it holds beyond its share
+static void trim_to_max_memory(kv_hash_store_t* store) {
+    size_t share = store->options.max_memory / NUM_SEGMENTS;
+    uint64_t now = clock_now_ms();
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        kv_segment_t* seg = &store->segments[i];
+        pthread_mutex_lock(&seg->lock);
+        while (__atomic_load_n(&store->memory_used, __ATOMIC_RELAXED) >
+                   store->options.max_memory &&
+               seg->evict->small.bytes + seg->evict->main.bytes > share &&
+               segment_evict_one(store, seg, now)) {
+        }
+        pthread_mutex_unlock(&seg->lock);
+    }
+}
+
+static kv_error_t hash_put(void* engine, const char* key, size_t key_len,
+                           const char* value, size_t value_len, uint64_t expires_at);
+static kv_error_t hash_delete(void* engine, const char* key, size_t key_len);
+static kv_error_t hash_expire(void* engine, const char* key, size_t key_len,
+                              uint64_t expires_at);
+static void hash_load(kv_hash_store_t* store);
+
+// Replay callback: re-apply a logged write (the WAL is not open yet)
+static void apply_wal_record(void* ctx, wal_record_type_t type,
+                             const char* key, size_t key_len,
+                             const char* value, size_t value_len, uint64_t expires_at) {
+    kv_hash_store_t* store = ctx;
+    if (type == WAL_PUT) {
+        hash_put(store, key, key_len, value, value_len, expires_at);
+    } else if (type == WAL_EXPIRE) {
+        hash_expire(store, key, key_len, expires_at);
+    } else {
+        hash_delete(store, key, key_len);
+    }
+}
+
+// Wait for a logged write to become durable (group commit). Called after
+// the segment lock is released so one fsync can cover many writers.
+static kv_error_t wal_commit(kv_hash_store_t* store, uint64_t lsn) {
+    if (lsn && !wal_wait(store->wal, lsn)) return KV_ERROR_IO;
+    return KV_SUCCESS;
+}
+
+static uint64_t count_changes(void* ctx) {
+    kv_hash_store_t* store = ctx;
+    uint64_t changes = 0;
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        changes += __atomic_load_n(&store->segments[i].changes, __ATOMIC_RELAXED);
+    }
+    return changes;
+}
+
+// Hold every segment lock so no write is half applied, and cut the WAL at
+// that point so the snapshot covers exactly the closed generations
+static bool freeze_writes(void* ctx, uint64_t* wal_generation, uint64_t* changes) {
+    kv_hash_store_t* store = ctx;
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        pthread_mutex_lock(&store->segments[i].lock);
+    }
+
+    *wal_generation = 0;
+    if (store->wal) {
+        if (!(*wal_generation = wal_rotate(store->wal))) {
+            for (int i = NUM_SEGMENTS - 1; i >= 0; i--) {
+                pthread_mutex_unlock(&store->segments[i].lock);
+            }
+            return false;
+        }
+        store->snapshot_generation = *wal_generation;
+    }
+    *changes = count_changes(store);
+    return true;
+}
+
+static void thaw_writes(void* ctx) {
+    kv_hash_store_t* store = ctx;
+    for (int i = NUM_SEGMENTS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&store->segments[i].lock);
     }
-    return hash % TABLE_SIZE;
+}
+
+static bool write_snapshot(void* ctx, FILE* fp);
+
+static void finish_snapshot(void* ctx, uint64_t wal_generation, bool ok) {
+    kv_hash_store_t* store = ctx;
+    if (!wal_generation) return;
+    if (ok) {
+        wal_remove(store->wal_prefix, wal_generation);
+    } else {
+        // The closed generation is still the only copy of its writes
+        wal_sync_generation(store->wal_prefix, wal_generation);
+    }
+}
+
+static const snapshot_hooks_t snapshot_hooks = {
+    .changes = count_changes,
+    .freeze = freeze_writes,
+    .thaw = thaw_writes,
+    .write = write_snapshot,
+    .finish = finish_snapshot,
+};
+
+typedef struct {
+    kv_hash_store_t* store;
+    kv_segment_t* seg;
+    uint64_t now;
+    uint64_t reclaimed;
+} sweep_t;
+
+// A timer fired: reclaim its key if the entry there has expired, or move
+// the timer to the entry's later expiry. Runs under the segment lock.
+static void expire_timer(void* ctx, wheel_timer_t* timer) {
+    sweep_t* sweep = ctx;
+    kv_hash_store_t* store = sweep->store;
+    kv_segment_t* seg = sweep->seg;
+    uint64_t h = kv_hash(timer->key, timer->key_len, store->hash_seed);
+
+    kv_table_t* tables[2] = { seg->table, seg->old_table };
+    for (int t = 0; t < 2; t++) {
+        kv_entry_t* entry;
+        long slot = tables[t] ? table_find(tables[t], h, timer->key, timer->key_len, &entry) : -1;
+        if (slot < 0) continue;
+
+        if (entry->expires_at && entry->expires_at <= sweep->now) {
+            // Not logged: the WAL and snapshots carry the expiry time, so
+            // a replayed copy of the entry is already expired too
+            table_erase(tables[t], (size_t)slot);
+            index_remove(store, entry->data, entry->key_len);
+            segment_untrack(store, seg, entry);
+            epoch_retire(entry, entry_release);
+            sweep->reclaimed++;
+        } else if (entry->expires_at) {
+            timer_wheel_rearm(seg->expiry, timer, entry->expires_at);
+            return;
+        }
+        break;
+    }
+    free(timer);
+}
+
+static void sweep_expired(kv_hash_store_t* store) {
+    sweep_t sweep = { .store = store, .now = clock_now_ms() };
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        kv_segment_t* seg = &store->segments[i];
+        timer_wheel_t* wheel = __atomic_load_n(&seg->expiry, __ATOMIC_ACQUIRE);
+        if (!wheel) continue;
+
+        pthread_mutex_lock(&seg->lock);
+        sweep.seg = seg;
+        timer_wheel_expire(wheel, sweep.now, SWEEP_SEGMENT_BUDGET, expire_timer, &sweep);
+        pthread_mutex_unlock(&seg->lock);
+    }
+    if (sweep.reclaimed) __atomic_add_fetch(&store->expired, sweep.reclaimed, __ATOMIC_RELAXED);
+}
+
+static void* sweeper_thread(void* arg) {
+    kv_hash_store_t* store = arg;
+
+    pthread_mutex_lock(&store->sweep_lock);
+    while (!store->sweeper_stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SWEEP_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&store->sweep_cond, &store->sweep_lock, &ts);
+        if (store->sweeper_stopping) break;
+
+        pthread_mutex_unlock(&store->sweep_lock);
+        sweep_expired(store);
+        pthread_mutex_lock(&store->sweep_lock);
+    }
+    pthread_mutex_unlock(&store->sweep_lock);
+    return NULL;
 }
 
 // Create a new key-value store
-kv_store_t* kv_store_create(const char* backup_file) {
-    kv_store_t* store = malloc(sizeof(kv_store_t));
+static void* hash_open(const char* backup_file, const kv_store_options_t* options) {
+    kv_hash_store_t* store = malloc(sizeof(kv_hash_store_t));
     if (!store) return NULL;
 
-    // Initialize all entries as empty
-    memset(store->entries, 0, sizeof(store->entries));
-    
-    // Initialize locks
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        pthread_mutex_init(&store->locks[i], NULL);
+    store->hash_seed = make_seed();
+    store->options = *options;
+
+    // Initialize segments and their locks
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        kv_segment_t* seg = &store->segments[i];
+        pthread_mutex_init(&seg->lock, NULL);
+        seg->table = table_create(SEGMENT_INITIAL_CAPACITY);
+        seg->old_table = NULL;
+        seg->migrate_pos = 0;
+        seg->changes = 0;
+        seg->expiry = NULL;
+        seg->evict = NULL;
+        if (!seg->table) {
+            while (i-- > 0) table_free(store->segments[i].table, false);
+            free(store);
+            return NULL;
+        }
+    }
+
+    store->index = skiplist_create();
+    if (!store->index) {
+        for (int i = 0; i < NUM_SEGMENTS; i++) table_free(store->segments[i].table, false);
+        free(store);
+        return NULL;
+    }
+    pthread_mutex_init(&store->index_lock, NULL);
+
+    store->backup_file = backup_file ? strdup(backup_file) : NULL;
+    store->wal_prefix = NULL;
+    store->wal = NULL;
+    store->snapshotter = NULL;
+    store->snapshot_generation = 0;
+    store->expired = 0;
+    store->memory_used = 0;
+    store->evict_queues = NULL;
+    store->sweeper_stopping = false;
+    pthread_mutex_init(&store->sweep_lock, NULL);
+    pthread_cond_init(&store->sweep_cond, NULL);
+
+    if (options->max_memory) {
+        store->evict_queues = aligned_alloc(64, NUM_SEGMENTS * sizeof(evict_queues_t));
+        if (store->evict_queues) {
+            for (int i = 0; i < NUM_SEGMENTS; i++) {
+                evict_queues_init(&store->evict_queues[i]);
+                store->segments[i].evict = &store->evict_queues[i];
+            }
+        } else {
+            log_warn("out of memory for eviction, max_memory ignored");
+        }
+    }
+
+    // Load the last snapshot, then the writes logged since it was taken
+    hash_load(store);
+
+    if (store->backup_file && options->wal_enabled) {
+        size_t len = strlen(store->backup_file) + sizeof(".wal");
+        store->wal_prefix = malloc(len);
+        if (store->wal_prefix) {
+            snprintf(store->wal_prefix, len, "%s.wal", store->backup_file);
+            // Generations the snapshot already covers are leftovers of a
+            // crash between installing it and deleting them
+            uint64_t covered = store->snapshot_generation;
+            if (covered > 0) wal_remove(store->wal_prefix, covered);
+
+            uint64_t generation;
+            long replayed = wal_replay(store->wal_prefix, covered + 1,
+                                       apply_wal_record, store, &generation);
+            if (replayed > 0) {
+                log_info("Replayed %ld WAL records from %s.*", replayed, store->wal_prefix);
+            }
+            if (generation < covered) generation = covered;
+            // Never append behind a tail that replay may have cut off
+            store->wal = wal_open(store->wal_prefix, generation + 1,
+                                  options->fsync_policy, options->fsync_interval_ms);
+        }
+        if (!store->wal) {
+            log_warn("running without a write-ahead log");
+        }
+    }
+
+    if (store->evict_queues) trim_to_max_memory(store);
+
+    if (store->backup_file) {
+        store->snapshotter = snapshotter_start(store->backup_file, &snapshot_hooks, store,
+                                               options->snapshot_interval_ms,
+                                               options->snapshot_min_changes);
+    }
+
+    store->sweeper_started =
+        pthread_create(&store->sweeper, NULL, sweeper_thread, store) == 0;
+    if (!store->sweeper_started) {
+        log_warn("expired keys will not be reclaimed");
     }
 
-    store->backup_file = strdup(backup_file);
-    
-    // Load any existing data
-    kv_store_load(store);
-    
     return store;
 }
 
 // Destroy the store and free resources
-void kv_store_destroy(kv_store_t* store) {
-    if (!store) return;
+static void hash_close(void* engine) {
+    kv_hash_store_t* store = engine;
 
-    // Save data before destroying
-    kv_store_save(store);
+    if (store->sweeper_started) {
+        pthread_mutex_lock(&store->sweep_lock);
+        store->sweeper_stopping = true;
+        pthread_cond_signal(&store->sweep_cond);
+        pthread_mutex_unlock(&store->sweep_lock);
+        pthread_join(store->sweeper, NULL);
+    }
 
-    // Destroy locks
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        pthread_mutex_destroy(&store->locks[i]);
+    // Writers are gone, so the final snapshot is written in-process; the
+    // log is redundant once that succeeds
+    snapshotter_stop(store->snapshotter);
+    if (store->wal) store->snapshot_generation = wal_generation(store->wal);
+    wal_close(store->wal);
+    if (store->backup_file &&
+        snapshot_write_file(store->backup_file, write_snapshot, store) &&
+        store->wal_prefix) {
+        wal_remove(store->wal_prefix, UINT64_MAX);
     }
 
+    // Free tables and entries retired by this and exited threads
+    epoch_synchronize();
+
+    // Destroy tables and locks
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        kv_segment_t* seg = &store->segments[i];
+        table_free(seg->table, true);
+        table_free(seg->old_table, true);
+        timer_wheel_destroy(seg->expiry);
+        if (seg->evict) evict_queues_destroy(seg->evict);
+        pthread_mutex_destroy(&seg->lock);
+    }
+    free(store->evict_queues);
+    skiplist_destroy(store->index, NULL);
+    pthread_mutex_destroy(&store->index_lock);
+    pthread_mutex_destroy(&store->sweep_lock);
+    pthread_cond_destroy(&store->sweep_cond);
+
     free(store->backup_file);
+    free(store->wal_prefix);
     free(store);
 }
 
+// Put entry in place of any entry with its key, logging the write. On
+// success *old is the entry replaced, or NULL, for the caller to retire
+// once it has unlocked; on failure the table is unchanged. make_room is
+// false for an atomic batch, which made its room up front. Caller holds
+// the lock.
+static kv_error_t segment_put(kv_hash_store_t* store, kv_segment_t* seg, kv_entry_t* entry,
+                              bool make_room, uint64_t* lsn, kv_entry_t** old) {
+    const char* key = entry->data;
+    size_t key_len = entry->key_len;
+    *lsn = 0;
+    *old = NULL;
+
+    segment_migrate(seg, MIGRATE_SLOTS_PER_OP);
+    if (seg->evict && make_room) segment_make_room(store, seg, evict_charge(entry));
+
+    // Replace an existing entry in whichever table holds it
+    kv_table_t* tables[2] = { seg->table, seg->old_table };
+    for (int t = 0; t < 2; t++) {
+        if (!tables[t]) continue;
+        long slot = table_find(tables[t], entry->hash, key, key_len, NULL);
+        if (slot >= 0) {
+            // Logged under the segment lock so the log order matches memory
+            if (store->wal &&
+                !(*lsn = wal_append(store->wal, WAL_PUT, key, key_len, entry_value(entry),
+                                    entry->value_len, entry->expires_at))) {
+                return KV_ERROR_IO;
+            }
+            *old = tables[t]->slots[slot];
+            __atomic_store_n(&tables[t]->slots[slot], entry, __ATOMIC_RELEASE);
+            segment_schedule(seg, *old, entry);
+            segment_track_replace(store, seg, *old, entry);
+            __atomic_store_n(&seg->changes, seg->changes + 1, __ATOMIC_RELAXED);
+            return KV_SUCCESS;
+        }
+    }
+
+    if (!segment_reserve(seg, 1) || !index_add(store, key, key_len)) {
+        return KV_ERROR_NO_SPACE;
+    }
+    if (store->wal &&
+        !(*lsn = wal_append(store->wal, WAL_PUT, key, key_len, entry_value(entry),
+                            entry->value_len, entry->expires_at))) {
+        index_remove(store, key, key_len);
+        return KV_ERROR_IO;
+    }
+    table_insert(seg->table, entry);
+    segment_schedule(seg, NULL, entry);
+    segment_track(store, seg, entry);
+    __atomic_store_n(&seg->changes, seg->changes + 1, __ATOMIC_RELAXED);
+    return KV_SUCCESS;
+}
+
 // Store a key-value pair
-kv_error_t kv_store_put(kv_store_t* store, const char* key, const char* value) {
-    if (!key || strlen(key) >= MAX_KEY_SIZE) {
-        return KV_ERROR_INVALID_KEY;
+static kv_error_t hash_put(void* engine, const char* key, size_t key_len,
+                           const char* value, size_t value_len, uint64_t expires_at) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_segment_t* seg = segment_for(store, h);
+
+    kv_entry_t* entry = entry_create(h, key, key_len, value, value_len, expires_at);
+    if (!entry) return KV_ERROR_NO_SPACE;
+    if (seg->evict && evict_charge(entry) > store->options.max_memory) {
+        entry_free(entry);
+        return KV_ERROR_NO_SPACE;
     }
 
-    unsigned int index = hash(key);
-    
-    pthread_mutex_lock(&store->locks[index]);
+    uint64_t lsn;
+    kv_entry_t* old;
+    pthread_mutex_lock(&seg->lock);
+    kv_error_t result = segment_put(store, seg, entry, true, &lsn, &old);
+    pthread_mutex_unlock(&seg->lock);
+
+    if (result != KV_SUCCESS) {
+        entry_free(entry);
+        return result;
+    }
+    if (old) epoch_retire(old, entry_release);
+    return wal_commit(store, lsn);
+}
 
-    // Store the entry
-    strncpy(store->entries[index].key, key, MAX_KEY_SIZE - 1);
-    strncpy(store->entries[index].value, value, MAX_VALUE_SIZE - 1);
-    store->entries[index].is_occupied = true;
+// Entry for key, or NULL. Must be called inside an epoch section; retries
+// only if the segment was resized while probing.
+static kv_entry_t* lookup(kv_segment_t* seg, uint64_t h, const char* key, size_t key_len) {
+    for (;;) {
+        kv_table_t* table = __atomic_load_n(&seg->table, __ATOMIC_ACQUIRE);
+        kv_table_t* old = __atomic_load_n(&seg->old_table, __ATOMIC_ACQUIRE);
 
-    pthread_mutex_unlock(&store->locks[index]);
-    
-    return KV_SUCCESS;
+        kv_entry_t* entry = NULL;
+        if (!old || table_find(old, h, key, key_len, &entry) < 0) {
+            table_find(table, h, key, key_len, &entry);
+        }
+        if (entry) return entry;
+
+        // A miss is only trustworthy if no resize moved entries meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (table == __atomic_load_n(&seg->table, __ATOMIC_ACQUIRE) &&
+            old == __atomic_load_n(&seg->old_table, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+    }
+}
+
+// Cache mode bookkeeping for a read that found entry (or NULL): a relaxed
+// store to the entry and a counter shared only with readers of the same
+// segment
+static inline void segment_note_read(kv_segment_t* seg, kv_entry_t* entry) {
+    if (!seg->evict) return;
+    if (entry) evict_touch(entry);
+    __atomic_add_fetch(entry ? &seg->evict->hits : &seg->evict->misses, 1, __ATOMIC_RELAXED);
 }
 
-// Retrieve a value by key
-kv_error_t kv_store_get(kv_store_t* store, const char* key, char* value) {
-    if (!key || !value) return KV_ERROR_INVALID_KEY;
+// Retrieve a value by key. Lock-free: runs inside an epoch section.
+static kv_error_t hash_get(void* engine, const char* key, size_t key_len,
+                           char* value, size_t value_size, size_t* value_len) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_segment_t* seg = segment_for(store, h);
+    kv_error_t result = KV_ERROR_NOT_FOUND;
 
-    unsigned int index = hash(key);
-    
-    pthread_mutex_lock(&store->locks[index]);
+    epoch_enter();
 
-    if (!store->entries[index].is_occupied ||
-        strcmp(store->entries[index].key, key) != 0) {
-        pthread_mutex_unlock(&store->locks[index]);
-        return KV_ERROR_NOT_FOUND;
+    kv_entry_t* entry = lookup(seg, h, key, key_len);
+    if (entry && entry_expired(entry)) entry = NULL;
+    if (entry) {
+        if (value_len) *value_len = entry->value_len;
+        if (entry->value_len > value_size) {
+            result = KV_ERROR_NO_SPACE;
+        } else {
+            memcpy(value, entry_value(entry), entry->value_len);
+            result = KV_SUCCESS;
+        }
     }
 
-    strncpy(value, store->entries[index].value, MAX_VALUE_SIZE - 1);
-    
-    pthread_mutex_unlock(&store->locks[index]);
-    
-    return KV_SUCCESS;
+    segment_note_read(seg, entry);
+
+    epoch_exit();
+
+    return result;
+}
+
+// As hash_get, pinning the entry instead of copying the value. The epoch
+// section keeps the table's reference, so refs is above zero while it is
+// raised.
+static kv_error_t hash_get_ref(void* engine, const char* key, size_t key_len,
+                               kv_value_ref_t* ref) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_segment_t* seg = segment_for(store, h);
+
+    epoch_enter();
+    kv_entry_t* entry = lookup(seg, h, key, key_len);
+    if (entry && entry_expired(entry)) entry = NULL;
+    if (entry) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        ref->data = entry_value(entry);
+        ref->len = entry->value_len;
+        ref->pin = entry;
+        ref->release = entry_release;
+    }
+    segment_note_read(seg, entry);
+    epoch_exit();
+
+    return entry ? KV_SUCCESS : KV_ERROR_NOT_FOUND;
+}
+
+// Remove key, logging the delete. On success *old is the entry removed,
+// for the caller to retire once it has unlocked. Caller holds the lock.
+static kv_error_t segment_delete(kv_hash_store_t* store, kv_segment_t* seg, uint64_t h,
+                                 const char* key, size_t key_len,
+                                 uint64_t* lsn, kv_entry_t** old) {
+    *lsn = 0;
+    *old = NULL;
+
+    segment_migrate(seg, MIGRATE_SLOTS_PER_OP);
+
+    kv_table_t* tables[2] = { seg->table, seg->old_table };
+    for (int t = 0; t < 2; t++) {
+        if (!tables[t]) continue;
+        kv_entry_t* found;
+        long slot = table_find(tables[t], h, key, key_len, &found);
+        if (slot >= 0 && entry_expired(found)) break;  // Left to the sweeper
+        if (slot >= 0) {
+            if (store->wal &&
+                !(*lsn = wal_append(store->wal, WAL_DELETE, key, key_len, NULL, 0, 0))) {
+                return KV_ERROR_IO;
+            }
+            table_erase(tables[t], (size_t)slot);
+            index_remove(store, key, key_len);
+            segment_untrack(store, seg, found);
+            __atomic_store_n(&seg->changes, seg->changes + 1, __ATOMIC_RELAXED);
+            *old = found;
+            return KV_SUCCESS;
+        }
+    }
+
+    // In cache mode the key may have been evicted after its PUT was logged.
+    // Log the delete anyway so that replaying the log cannot bring it back.
+    if (seg->evict && store->wal &&
+        !(*lsn = wal_append(store->wal, WAL_DELETE, key, key_len, NULL, 0, 0))) {
+        return KV_ERROR_IO;
+    }
+    return KV_ERROR_NOT_FOUND;
 }
 
 // Delete a key-value pair
-kv_error_t kv_store_delete(kv_store_t* store, const char* key) {
-    if (!key) return KV_ERROR_INVALID_KEY;
+static kv_error_t hash_delete(void* engine, const char* key, size_t key_len) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_segment_t* seg = segment_for(store, h);
+
+    uint64_t lsn;
+    kv_entry_t* old;
+    pthread_mutex_lock(&seg->lock);
+    kv_error_t result = segment_delete(store, seg, h, key, key_len, &lsn, &old);
+    pthread_mutex_unlock(&seg->lock);
+
+    if (old) epoch_retire(old, entry_release);
+    if (wal_commit(store, lsn) != KV_SUCCESS) return KV_ERROR_IO;
+    return result;
+}
+
+// Give an existing key a new expiry. Entries are immutable, so the key is
+// copied into a new entry that replaces the old one.
+static kv_error_t hash_expire(void* engine, const char* key, size_t key_len,
+                              uint64_t expires_at) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_segment_t* seg = segment_for(store, h);
 
-    unsigned int index = hash(key);
-    
-    pthread_mutex_lock(&store->locks[index]);
+    pthread_mutex_lock(&seg->lock);
 
-    if (!store->entries[index].is_occupied ||
-        strcmp(store->entries[index].key, key) != 0) {
-        pthread_mutex_unlock(&store->locks[index]);
-        return KV_ERROR_NOT_FOUND;
+    segment_migrate(seg, MIGRATE_SLOTS_PER_OP);
+
+    kv_table_t* tables[2] = { seg->table, seg->old_table };
+    for (int t = 0; t < 2; t++) {
+        if (!tables[t]) continue;
+        kv_entry_t* old;
+        long slot = table_find(tables[t], h, key, key_len, &old);
+        if (slot < 0) continue;
+        if (entry_expired(old)) break;
+
+        kv_entry_t* entry = entry_create(h, key, key_len, entry_value(old), old->value_len,
+                                         expires_at);
+        if (!entry) {
+            pthread_mutex_unlock(&seg->lock);
+            return KV_ERROR_NO_SPACE;
+        }
+        uint64_t lsn = 0;
+        if (store->wal &&
+            !(lsn = wal_append(store->wal, WAL_EXPIRE, key, key_len, NULL, 0, expires_at))) {
+            pthread_mutex_unlock(&seg->lock);
+            entry_free(entry);
+            return KV_ERROR_IO;
+        }
+        __atomic_store_n(&tables[t]->slots[slot], entry, __ATOMIC_RELEASE);
+        segment_schedule(seg, old, entry);
+        segment_track_replace(store, seg, old, entry);
+        __atomic_store_n(&seg->changes, seg->changes + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&seg->lock);
+        epoch_retire(old, entry_release);
+        return wal_commit(store, lsn);
     }
 
-    store->entries[index].is_occupied = false;
-    
-    pthread_mutex_unlock(&store->locks[index]);
-    
+    pthread_mutex_unlock(&seg->lock);
+
+    return KV_ERROR_NOT_FOUND;
+}
+
+// Expiry of a key. Lock-free like hash_get.
+static kv_error_t hash_ttl(void* engine, const char* key, size_t key_len,
+                           uint64_t* expires_at) {
+    kv_hash_store_t* store = engine;
+    uint64_t h = kv_hash(key, key_len, store->hash_seed);
+    kv_error_t result = KV_ERROR_NOT_FOUND;
+
+    epoch_enter();
+    kv_entry_t* entry = lookup(segment_for(store, h), h, key, key_len);
+    if (entry && !entry_expired(entry)) {
+        *expires_at = entry->expires_at;
+        result = KV_SUCCESS;
+    }
+    epoch_exit();
+
+    return result;
+}
+
+// Walk the index and fetch each key's entry. Both are read lock-free, so
+// writers are never blocked; a key removed after the index step is skipped.
+static kv_error_t hash_scan(void* engine, const char* start, size_t start_len,
+                            const char* end, size_t end_len, kv_scan_fn visit, void* ctx) {
+    kv_hash_store_t* store = engine;
+
+    epoch_enter();
+
+    skiplist_node_t* node = skiplist_seek(store->index, start, start_len);
+    for (; node; node = skiplist_next(node)) {
+        const char* key = skiplist_key(node);
+        if (end && kv_key_compare(key, node->key_len, end, end_len) >= 0) break;
+
+        uint64_t h = kv_hash(key, node->key_len, store->hash_seed);
+        kv_entry_t* entry = lookup(segment_for(store, h), h, key, node->key_len);
+        if (entry && !entry_expired(entry) &&
+            !visit(ctx, entry->data, entry->key_len, entry_value(entry), entry->value_len)) {
+            break;
+        }
+    }
+
+    epoch_exit();
+
     return KV_SUCCESS;
 }
 
+// A key of a batch. Sorted by hash, keys come grouped by segment (the
+// hash's top bits), so writes take each segment lock once per batch.
+typedef struct {
+    uint64_t hash;
+    size_t index;                       // Of the item in the batch
+} batch_key_t;
+
+static int batch_key_compare(const void* a, const void* b) {
+    const batch_key_t* x = a;
+    const batch_key_t* y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);  // Duplicates keep their order
+}
+
+// Hash every key of a batch and prefetch what looking it up touches first:
+// its segment, then the control bytes and slots of its first probe group.
+// All of it is issued before any key is looked up, so the cache misses of
+// the batch overlap instead of coming one key at a time.
+static batch_key_t* batch_prepare(kv_hash_store_t* store, const kv_batch_item_t* items,
+                                  size_t count, bool sort) {
+    batch_key_t* keys = malloc((count ? count : 1) * sizeof(*keys));
+    if (!keys) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i].hash = kv_hash(items[i].key, items[i].key_len, store->hash_seed);
+        keys[i].index = i;
+        __builtin_prefetch(segment_for(store, keys[i].hash));
+    }
+
+    epoch_enter();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t h = keys[i].hash;
+        kv_table_t* table = __atomic_load_n(&segment_for(store, h)->table, __ATOMIC_ACQUIRE);
+        size_t group = (h >> 7) & (table->capacity / GROUP_WIDTH - 1);
+        __builtin_prefetch(table->ctrl + group * GROUP_WIDTH);
+        __builtin_prefetch(table->slots + group * GROUP_WIDTH);
+    }
+    epoch_exit();
+
+    if (sort) qsort(keys, count, sizeof(*keys), batch_key_compare);
+    return keys;
+}
+
+// Keys at [start, end) of a sorted batch share the segment of keys[start]
+static size_t batch_group_end(kv_hash_store_t* store, const batch_key_t* keys,
+                              size_t start, size_t count) {
+    kv_segment_t* seg = segment_for(store, keys[start].hash);
+    size_t end = start + 1;
+    while (end < count && segment_for(store, keys[end].hash) == seg) end++;
+    return end;
+}
+
+// An atomic batch holds the locks of all its segments, taken in ascending
+// order like freeze_writes does
+static void batch_lock(kv_hash_store_t* store, const batch_key_t* keys, size_t count) {
+    for (size_t k = 0; k < count; k = batch_group_end(store, keys, k, count)) {
+        pthread_mutex_lock(&segment_for(store, keys[k].hash)->lock);
+    }
+}
+
+static void batch_unlock(kv_hash_store_t* store, const batch_key_t* keys, size_t count) {
+    for (size_t k = 0; k < count; k = batch_group_end(store, keys, k, count)) {
+        pthread_mutex_unlock(&segment_for(store, keys[k].hash)->lock);
+    }
+}
+
+// In cache mode, make room for all of an atomic batch's entries by
+// evicting from its segments in turn, as segment_make_room does for one
+// put, so that none is evicted while it applies: that could take a key
+// the batch already wrote. False if the batch alone is over max_memory.
+static bool batch_make_room(kv_hash_store_t* store, const batch_key_t* keys,
+                            kv_entry_t* const* entries, size_t count) {
+    size_t charge = 0;
+    for (size_t k = 0; k < count; k++) charge += evict_charge(entries[k]);
+    if (charge > store->options.max_memory) return false;
+
+    uint64_t now = clock_now_ms();
+    bool evicted = true;
+    while (evicted) {
+        evicted = false;
+        for (size_t k = 0; k < count; k = batch_group_end(store, keys, k, count)) {
+            if (__atomic_load_n(&store->memory_used, __ATOMIC_RELAXED) + charge <=
+                store->options.max_memory) {
+                return true;
+            }
+            evicted |= segment_evict_one(store, segment_for(store, keys[k].hash), now);
+        }
+    }
+    return true;
+}
+
+// For an atomic batch, under all its locks: take the memory its new keys
+// need, cache room, table slots and index nodes, before any is applied,
+// so none of its puts can run out or evict another. False, having added
+// none, if some cannot be had.
+static bool batch_reserve(kv_hash_store_t* store, const kv_batch_item_t* items,
+                          const batch_key_t* keys, kv_entry_t* const* entries,
+                          size_t count) {
+    // Evicting first, so the lookups below see what is left
+    if (store->evict_queues && !batch_make_room(store, keys, entries, count)) return false;
+
+    bool* added = calloc(count ? count : 1, sizeof(*added));
+    bool ok = added != NULL;
+    for (size_t k = 0; ok && k < count;) {
+        kv_segment_t* seg = segment_for(store, keys[k].hash);
+        size_t end = batch_group_end(store, keys, k, count);
+        size_t inserts = 0;
+        for (; ok && k < end; k++) {
+            const kv_batch_item_t* item = &items[keys[k].index];
+            if (lookup(seg, keys[k].hash, item->key, item->key_len)) continue;
+            inserts++;
+            ok = added[k] = index_add(store, item->key, item->key_len);
+        }
+        // Entries still in an old table would move into the reserved room
+        if (ok && inserts > 0 && seg->old_table) {
+            segment_migrate(seg, seg->old_table->capacity);
+        }
+        ok = ok && segment_reserve(seg, inserts);
+    }
+    for (size_t k = 0; !ok && added && k < count; k++) {
+        const kv_batch_item_t* item = &items[keys[k].index];
+        if (added[k]) index_remove(store, item->key, item->key_len);
+    }
+    free(added);
+    return ok;
+}
+
+// Wait for the batch's last log record, which covers all before it
+static void batch_commit(kv_hash_store_t* store, uint64_t lsn, kv_error_t* results,
+                         size_t count) {
+    if (wal_commit(store, lsn) == KV_SUCCESS) return;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] == KV_SUCCESS) results[i] = KV_ERROR_IO;
+    }
+}
+
+// Lock-free like hash_get, one epoch section for the whole batch
+static kv_error_t hash_mget(void* engine, const kv_batch_item_t* items, size_t count,
+                            kv_mget_fn visit, void* ctx) {
+    kv_hash_store_t* store = engine;
+    batch_key_t* keys = batch_prepare(store, items, count, false);
+    if (!keys) return KV_ERROR_NO_SPACE;
+
+    epoch_enter();
+    for (size_t i = 0; i < count; i++) {
+        kv_segment_t* seg = segment_for(store, keys[i].hash);
+        kv_entry_t* entry = lookup(seg, keys[i].hash, items[i].key, items[i].key_len);
+        if (entry && entry_expired(entry)) entry = NULL;
+        segment_note_read(seg, entry);
+        if (entry) {
+            visit(ctx, i, KV_SUCCESS, entry_value(entry), entry->value_len);
+        } else {
+            visit(ctx, i, KV_ERROR_NOT_FOUND, NULL, 0);
+        }
+    }
+    epoch_exit();
+
+    free(keys);
+    return KV_SUCCESS;
+}
+
+// Entries are allocated before any lock is taken, then applied a segment
+// at a time (an atomic batch reserving the rest of its memory first), and
+// the batch waits once for the log
+static void hash_mput(void* engine, const kv_batch_item_t* items, size_t count,
+                      bool atomic, kv_error_t* results) {
+    kv_hash_store_t* store = engine;
+    batch_key_t* keys = batch_prepare(store, items, count, true);
+    kv_entry_t** entries = calloc(count ? count : 1, sizeof(*entries));
+    bool complete = keys && entries;
+
+    for (size_t k = 0; complete && k < count; k++) {
+        const kv_batch_item_t* item = &items[keys[k].index];
+        kv_entry_t* entry = entry_create(keys[k].hash, item->key, item->key_len,
+                                         item->value, item->value_len, 0);
+        if (entry && store->evict_queues && evict_charge(entry) > store->options.max_memory) {
+            entry_free(entry);
+            entry = NULL;
+        }
+        entries[k] = entry;
+        results[keys[k].index] = entry ? KV_SUCCESS : KV_ERROR_NO_SPACE;
+        if (!entry && atomic) complete = false;
+    }
+    if (complete && atomic) {
+        batch_lock(store, keys, count);
+        complete = batch_reserve(store, items, keys, entries, count);
+        if (!complete) batch_unlock(store, keys, count);
+    }
+    if (!complete) {
+        for (size_t k = 0; entries && k < count; k++) {
+            if (entries[k]) entry_free(entries[k]);
+        }
+        for (size_t i = 0; i < count; i++) results[i] = KV_ERROR_NO_SPACE;
+        free(entries);
+        free(keys);
+        return;
+    }
+
+    uint64_t last_lsn = 0;
+    for (size_t k = 0; k < count;) {
+        kv_segment_t* seg = segment_for(store, keys[k].hash);
+        size_t end = batch_group_end(store, keys, k, count);
+        if (!atomic) pthread_mutex_lock(&seg->lock);
+        for (; k < end; k++) {
+            if (!entries[k]) continue;
+            uint64_t lsn;
+            kv_entry_t* old;
+            kv_error_t result = segment_put(store, seg, entries[k], !atomic, &lsn, &old);
+            results[keys[k].index] = result;
+            if (result != KV_SUCCESS) entry_free(entries[k]);
+            if (old) epoch_retire(old, entry_release);
+            if (lsn) last_lsn = lsn;
+        }
+        if (!atomic) pthread_mutex_unlock(&seg->lock);
+    }
+    if (atomic) batch_unlock(store, keys, count);
+
+    batch_commit(store, last_lsn, results, count);
+    free(entries);
+    free(keys);
+}
+
+static void hash_mdelete(void* engine, const kv_batch_item_t* items, size_t count,
+                         kv_error_t* results) {
+    kv_hash_store_t* store = engine;
+    batch_key_t* keys = batch_prepare(store, items, count, true);
+    if (!keys) {
+        for (size_t i = 0; i < count; i++) results[i] = KV_ERROR_NO_SPACE;
+        return;
+    }
+
+    uint64_t last_lsn = 0;
+    for (size_t k = 0; k < count;) {
+        kv_segment_t* seg = segment_for(store, keys[k].hash);
+        size_t end = batch_group_end(store, keys, k, count);
+        pthread_mutex_lock(&seg->lock);
+        for (; k < end; k++) {
+            const kv_batch_item_t* item = &items[keys[k].index];
+            uint64_t lsn;
+            kv_entry_t* old;
+            results[keys[k].index] = segment_delete(store, seg, keys[k].hash, item->key,
+                                                    item->key_len, &lsn, &old);
+            if (old) epoch_retire(old, entry_release);
+            if (lsn) last_lsn = lsn;
+        }
+        pthread_mutex_unlock(&seg->lock);
+    }
+
+    batch_commit(store, last_lsn, results, count);
+    free(keys);
+}
+
+// Number of keys currently stored, counting expired ones not yet reclaimed
+static size_t hash_count(void* engine) {
+    kv_hash_store_t* store = engine;
+    size_t count = 0;
+    for (int i = 0; i < NUM_SEGMENTS; i++) {
+        kv_segment_t* seg = &store->segments[i];
+        pthread_mutex_lock(&seg->lock);
+        count += seg->table->size;
+        if (seg->old_table) count += seg->old_table->size;
+        pthread_mutex_unlock(&seg->lock);
+    }
+    return count;
+}
+
+static bool save_table(snapshot_writer_t* writer, int segment, const kv_table_t* table,
+                       uint64_t now) {
+    if (!table) return true;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (!(table->ctrl[i] & 0x80)) {
+            const kv_entry_t* entry = table->slots[i];
+            if (entry->expires_at && entry->expires_at <= now) continue;
+            if (!snapshot_writer_add(writer, segment, entry->hash,
+                                     entry->data, entry->key_len,
+                                     entry_value(entry), entry->value_len,
+                                     entry->expires_at)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Snapshot writer. Takes no locks: it runs either in the forked child,
+// whose copy of every segment lock is held by the frozen parent thread, or
+// at destroy time when no writers are left.
+static bool write_snapshot(void* ctx, FILE* fp) {
+    kv_hash_store_t* store = ctx;
+    snapshot_writer_t* writer = malloc(sizeof(snapshot_writer_t));
+    if (!writer) return false;
+
+    uint64_t now = clock_now_ms();
+    bool ok = snapshot_writer_begin(writer, fp, store->hash_seed,
+                                    store->snapshot_generation);
+    for (int i = 0; ok && i < NUM_SEGMENTS; i++) {
+        ok = save_table(writer, i, store->segments[i].table, now) &&
+             save_table(writer, i, store->segments[i].old_table, now);
+    }
+    ok = ok && snapshot_writer_end(writer);
+
+    free(writer);
+    return ok;
+}
+
 // Save store to disk
-void kv_store_save(kv_store_t* store) {
-    if (!store || !store->backup_file) return;
+static bool hash_save(void* engine, bool wait) {
+    kv_hash_store_t* store = engine;
+    return store->snapshotter && snapshotter_request(store->snapshotter, wait);
+}
 
-    FILE* fp = fopen(store->backup_file, "w");
-    if (!fp) return;
+// Smallest table that holds count entries below the load limit
+static size_t table_capacity_for(uint64_t count) {
+    size_t capacity = SEGMENT_INITIAL_CAPACITY;
+    while ((count + 1) * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM) capacity *= 2;
+    return capacity;
+}
+
+typedef struct {
+    kv_hash_store_t* store;
+    const snapshot_file_t* file;
+    int next_segment;                   // Claimed by loader threads in turn
+    uint64_t loaded;
+    uint64_t corrupt;
+    bool failed;
+} snapshot_load_t;
+
+// Rebuild whole segments straight from the mapped file. Each segment is
+// owned by one thread and the store is not yet shared, so no locks.
+static void* load_segments(void* arg) {
+    snapshot_load_t* load = arg;
+    kv_hash_store_t* store = load->store;
+    uint64_t loaded = 0, corrupt = 0;
+    uint64_t now = clock_now_ms();
+    bool failed = false;
+    int i;
+
+    while (!failed &&
+           (i = __atomic_fetch_add(&load->next_segment, 1, __ATOMIC_RELAXED)) < NUM_SEGMENTS) {
+        const snapshot_index_entry_t* idx = &load->file->index[i];
+        kv_segment_t* seg = &store->segments[i];
+        if (idx->count == 0) continue;
+
+        kv_table_t* table = table_create(table_capacity_for(idx->count));
+        if (!table) {
+            failed = true;
+            break;
+        }
+        table_free(seg->table, false);
+        seg->table = table;
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        if (store->entries[i].is_occupied) {
-            fprintf(fp, "%s,%s\n", 
-                store->entries[i].key, 
-                store->entries[i].value);
+        uint64_t pos = idx->offset, end = idx->offset + idx->bytes;
+        const snapshot_record_t* record;
+        bool intact;
+        while ((record = snapshot_next_record(load->file, &pos, end, &intact))) {
+            if (!intact || record->key_len > MAX_KEY_LENGTH ||
+                segment_for(store, record->hash) != seg ||
+                table->size == idx->count) {
+                corrupt++;
+                continue;
+            }
+            uint64_t expires_at = snapshot_record_expires_at(record);
+            if (expires_at && expires_at <= now) continue;
+            kv_entry_t* entry = entry_create(record->hash, snapshot_record_key(record),
+                                             record->key_len, snapshot_record_value(record),
+                                             record->value_len, expires_at);
+            if (!entry) {
+                failed = true;
+                break;
+            }
+            table_insert(table, entry);
+            segment_schedule(seg, NULL, entry);
+            segment_track(store, seg, entry);
+            loaded++;
         }
+        if (pos < end) corrupt++;       // Truncated record ends the segment
     }
 
-    fclose(fp);
+    __atomic_fetch_add(&load->loaded, loaded, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&load->corrupt, corrupt, __ATOMIC_RELAXED);
+    if (failed) __atomic_store_n(&load->failed, true, __ATOMIC_RELAXED);
+    return NULL;
 }
 
-// Load store from disk
-void kv_store_load(kv_store_t* store) {
-    if (!store || !store->backup_file) return;
+static int load_thread_count(uint64_t records) {
+    if (records < LOAD_PARALLEL_MIN_RECORDS) return 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    return cpus > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : (int)cpus;
+}
+
+static void load_binary(kv_hash_store_t* store, const snapshot_file_t* file) {
+    const snapshot_header_t* header = file->header;
+
+    // A store that already has data must merge through the normal path
+    if (hash_count(store) > 0) {
+        for (int i = 0; i < NUM_SEGMENTS; i++) {
+            uint64_t pos = file->index[i].offset;
+            uint64_t end = pos + file->index[i].bytes;
+            const snapshot_record_t* record;
+            bool intact;
+            while ((record = snapshot_next_record(file, &pos, end, &intact))) {
+                if (!intact) continue;
+                hash_put(store, snapshot_record_key(record), record->key_len,
+                         snapshot_record_value(record), record->value_len,
+                         snapshot_record_expires_at(record));
+            }
+        }
+        return;
+    }
+
+    struct timespec start, done;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Adopting the snapshot's seed keeps every stored hash valid
+    store->hash_seed = header->hash_seed;
+    store->snapshot_generation = header->wal_generation;
+
+    snapshot_load_t load = { .store = store, .file = file };
+    int nthreads = load_thread_count(header->record_count);
+    pthread_t threads[LOAD_MAX_THREADS];
+    int started = 0;
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, load_segments, &load) == 0) {
+        started++;
+    }
+    load_segments(&load);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    if (!load.failed && !index_rebuild(store)) load.failed = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    long ms = (done.tv_sec - start.tv_sec) * 1000 + (done.tv_nsec - start.tv_nsec) / 1000000;
+    log_info("Loaded %llu keys from %s in %ld ms (%d thread%s)",
+             (unsigned long long)load.loaded, store->backup_file, ms, started + 1,
+             started > 0 ? "s" : "");
+    if (load.corrupt > 0) {
+        log_warn("skipped %llu corrupt snapshot records",
+                 (unsigned long long)load.corrupt);
+    }
+    if (load.failed) {
+        log_warn("out of memory loading %s", store->backup_file);
+    }
+}
 
+// Snapshots written before the binary format: one key,value per line
+static void load_csv(kv_hash_store_t* store) {
     FILE* fp = fopen(store->backup_file, "r");
     if (!fp) return;
 
-    char line[MAX_KEY_SIZE + MAX_VALUE_SIZE + 2];
-    while (fgets(line, sizeof(line), fp)) {
-        char key[MAX_KEY_SIZE];
-        char value[MAX_VALUE_SIZE];
-        
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_size, fp)) > 0) {
+        if (line[line_len - 1] == '\n') line[--line_len] = '\0';  // Remove newline
+
         char* comma = strchr(line, ',');
         if (comma) {
-            *comma = '\0';
-            strncpy(key, line, MAX_KEY_SIZE - 1);
-            strncpy(value, comma + 1, MAX_VALUE_SIZE - 1);
-            value[strcspn(value, "\n")] = 0;  // Remove newline
-            
-            kv_store_put(store, key, value);
+            size_t key_len = (size_t)(comma - line);
+            hash_put(store, line, key_len,
+                     comma + 1, (size_t)line_len - key_len - 1, 0);
         }
     }
 
+    free(line);
     fclose(fp);
-}
\ No newline at end of file
+}
+
+// Load store from disk
+static void hash_load(kv_hash_store_t* store) {
+    if (!store->backup_file) return;
+
+    snapshot_file_t file;
+    switch (snapshot_map(store->backup_file, &file)) {
+        case SNAPSHOT_MAPPED:
+            load_binary(store, &file);
+            snapshot_unmap(&file);
+            break;
+        case SNAPSHOT_NOT_BINARY:
+            load_csv(store);
+            break;
+        case SNAPSHOT_CORRUPT: {
+            // Move it aside so the next snapshot does not overwrite it
+            size_t len = strlen(store->backup_file) + sizeof(".damaged");
+            char* aside = malloc(len);
+            if (aside) {
+                snprintf(aside, len, "%s.damaged", store->backup_file);
+                rename(store->backup_file, aside);
+            }
+            log_warn("%s is damaged, moved to %s",
+                     store->backup_file, aside ? aside : "nowhere");
+            free(aside);
+            break;
+        }
+        case SNAPSHOT_MISSING:
+            break;
+    }
+}
+
+static void hash_get_stats(void* engine, kv_store_stats_t* stats) {
+    kv_hash_store_t* store = engine;
+    kv_slab_stats_t slab;
+    slab_get_stats(&slab);
+
+    stats->keys = hash_count(store);
+    stats->slab_pages = slab.pages;
+    stats->slab_chunk_bytes = slab.chunk_bytes;
+    stats->slab_requested_bytes = slab.requested_bytes;
+    stats->large_entries = slab.large_count;
+    stats->large_bytes = slab.large_bytes;
+    stats->fragmentation = slab.fragmentation;
+    stats->slab_utilization = slab.utilization;
+    stats->expired_keys = __atomic_load_n(&store->expired, __ATOMIC_RELAXED);
+
+    if (store->evict_queues) {
+        stats->max_memory = store->options.max_memory;
+        stats->memory_used = __atomic_load_n(&store->memory_used, __ATOMIC_RELAXED);
+        for (int i = 0; i < NUM_SEGMENTS; i++) {
+            const evict_queues_t* queues = &store->evict_queues[i];
+            stats->cache_hits += __atomic_load_n(&queues->hits, __ATOMIC_RELAXED);
+            stats->cache_misses += __atomic_load_n(&queues->misses, __ATOMIC_RELAXED);
+            stats->evictions += __atomic_load_n(&queues->evictions, __ATOMIC_RELAXED);
+        }
+        uint64_t lookups = stats->cache_hits + stats->cache_misses;
+        stats->hit_ratio = lookups ? (double)stats->cache_hits / lookups : 0;
+    }
+
+    if (store->wal) {
+        wal_stats_t wal;
+        wal_get_stats(store->wal, &wal);
+        stats->wal_records = wal.records;
+        stats->wal_bytes = wal.bytes;
+        stats->wal_batches = wal.batches;
+        stats->wal_fsyncs = wal.fsyncs;
+    }
+
+    if (store->snapshotter) {
+        snapshot_stats_t snap;
+        snapshotter_get_stats(store->snapshotter, &snap);
+        stats->snapshots = snap.snapshots;
+        stats->snapshot_failures = snap.failures;
+        stats->snapshot_last_ms = snap.last_duration_ms;
+        stats->snapshot_last_pause_us = snap.last_pause_us;
+        stats->snapshot_max_pause_us = snap.max_pause_us;
+        stats->snapshot_bytes = snap.last_bytes;
+    }
+}
+
+static void hash_dump_stats(void* engine, FILE* out) {
+    kv_hash_store_t* store = engine;
+    kv_store_stats_t stats = { 0 };
+    kv_slab_stats_t slab;
+    hash_get_stats(store, &stats);
+    slab_get_stats(&slab);
+
+    fprintf(out, "keys: %zu\n", stats.keys);
+    fprintf(out, "slab pages: %zu (%zu bytes)\n",
+            stats.slab_pages, stats.slab_pages * (size_t)SLAB_PAGE_SIZE);
+    fprintf(out, "slab chunk bytes: %zu, requested: %zu\n",
+            stats.slab_chunk_bytes, stats.slab_requested_bytes);
+    fprintf(out, "fragmentation: %.1f%%, slab utilization: %.1f%%\n",
+            stats.fragmentation * 100, stats.slab_utilization * 100);
+    fprintf(out, "large entries: %zu (%zu bytes)\n",
+            stats.large_entries, stats.large_bytes);
+    fprintf(out, "expired keys reclaimed: %llu\n", (unsigned long long)stats.expired_keys);
+    if (store->evict_queues) {
+        fprintf(out, "cache memory: %zu of %zu bytes, %llu evictions\n",
+                stats.memory_used, stats.max_memory, (unsigned long long)stats.evictions);
+        fprintf(out, "cache hits: %llu, misses: %llu, hit ratio: %.1f%%\n",
+                (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses,
+                stats.hit_ratio * 100);
+    }
+    if (store->wal) {
+        fprintf(out, "wal: %llu records, %llu bytes, %llu writes, %llu fsyncs\n",
+                (unsigned long long)stats.wal_records,
+                (unsigned long long)stats.wal_bytes,
+                (unsigned long long)stats.wal_batches,
+                (unsigned long long)stats.wal_fsyncs);
+    }
+    if (store->snapshotter) {
+        fprintf(out, "snapshots: %llu (%llu failed), last %llu ms, %zu bytes\n",
+                (unsigned long long)stats.snapshots,
+                (unsigned long long)stats.snapshot_failures,
+                (unsigned long long)stats.snapshot_last_ms,
+                stats.snapshot_bytes);
+        fprintf(out, "snapshot writer pause: last %llu us, max %llu us\n",
+                (unsigned long long)stats.snapshot_last_pause_us,
+                (unsigned long long)stats.snapshot_max_pause_us);
+    }
+
+    for (int i = 0; i < slab.num_classes; i++) {
+        const kv_slab_class_stats_t* cs = &slab.classes[i];
+        if (cs->pages == 0) continue;
+        fprintf(out, "  class %2d: chunk %7zu, pages %4zu, used %8zu/%8zu\n",
+                i, cs->chunk_size, cs->pages, cs->used_chunks, cs->total_chunks);
+    }
+}
+
+const kv_engine_ops_t kv_hash_engine = {
+    .name = "hash",
+    .open = hash_open,
+    .close = hash_close,
+    .put = hash_put,
+    .get = hash_get,
+    .get_ref = hash_get_ref,
+    .delete = hash_delete,
+    .expire = hash_expire,
+    .ttl = hash_ttl,
+    .scan = hash_scan,
+    .mget = hash_mget,
+    .mput = hash_mput,
+    .mdelete = hash_mdelete,
+    .count = hash_count,
+    .save = hash_save,
+    .get_stats = hash_get_stats,
+    .dump_stats = hash_dump_stats,
+};
@@ -0,0 +1,120 @@
+#include "timer_wheel.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define HORIZON_TICKS ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+timer_wheel_t* timer_wheel_create(uint64_t now_ms) {
+    timer_wheel_t* wheel = calloc(1, sizeof(timer_wheel_t));
+    if (wheel) wheel->tick = now_ms / TIMER_TICK_MS;
+    return wheel;
+}
+
+static void free_list(wheel_timer_t* timer) {
+    while (timer) {
+        wheel_timer_t* next = timer->next;
+        free(timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+    if (!wheel) return;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) free_list(wheel->slots[level][slot]);
+    }
+    free_list(wheel->due);
+    free(wheel);
+}
+
+// File the timer under the lowest level whose span covers its distance.
+// Its slot is taken from the absolute tick, so it is cascaded down exactly
+// when the level below has turned far enough to hold it.
+static void place(timer_wheel_t* wheel, wheel_timer_t* timer) {
+    uint64_t tick = timer->expires_at / TIMER_TICK_MS;
+    if (tick < wheel->tick) tick = wheel->tick;
+    uint64_t delta = tick - wheel->tick;
+    if (delta >= HORIZON_TICKS) tick = wheel->tick + HORIZON_TICKS - 1;
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_LEVEL_BITS * (level + 1))) level++;
+
+    wheel_timer_t** slot = &wheel->slots[level][(tick >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK];
+    timer->next = *slot;
+    *slot = timer;
+}
+
+bool timer_wheel_add(timer_wheel_t* wheel, uint64_t expires_at,
+                     const char* key, size_t key_len) {
+    wheel_timer_t* timer = malloc(sizeof(wheel_timer_t) + key_len);
+    if (!timer) return false;
+    timer->expires_at = expires_at;
+    timer->key_len = (uint32_t)key_len;
+    memcpy(timer->key, key, key_len);
+    place(wheel, timer);
+    wheel->count++;
+    return true;
+}
+
+void timer_wheel_rearm(timer_wheel_t* wheel, wheel_timer_t* timer, uint64_t expires_at) {
+    timer->expires_at = expires_at;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+// Run one tick: when level 0 wraps, pull the next slot of each higher
+// level down (stopping at the first that has not wrapped too), then move
+// this tick's slot to the due list
+static void step(timer_wheel_t* wheel) {
+    size_t index = wheel->tick & SLOT_MASK;
+    if (index == 0) {
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            size_t slot = (wheel->tick >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+            wheel_timer_t* timer = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            while (timer) {
+                wheel_timer_t* next = timer->next;
+                place(wheel, timer);
+                timer = next;
+            }
+            if (slot != 0) break;
+        }
+    }
+
+    wheel_timer_t* timer = wheel->slots[0][index];
+    wheel->slots[0][index] = NULL;
+    while (timer) {
+        wheel_timer_t* next = timer->next;
+        timer->next = wheel->due;
+        wheel->due = timer;
+        timer = next;
+    }
+    wheel->tick++;
+}
+
+// A tick only runs once it is wholly in the past, so every timer handed
+// out has expires_at < now_ms
+size_t timer_wheel_expire(timer_wheel_t* wheel, uint64_t now_ms, size_t budget,
+                          timer_expire_fn expire, void* ctx) {
+    uint64_t now_tick = now_ms / TIMER_TICK_MS;
+    size_t handed = 0;
+
+    for (;;) {
+        while (wheel->due && handed < budget) {
+            wheel_timer_t* timer = wheel->due;
+            wheel->due = timer->next;
+            wheel->count--;
+            handed++;
+            expire(ctx, timer);
+        }
+        if (handed >= budget || wheel->tick >= now_tick) break;
+        if (wheel->count == 0) {
+            // Nothing to find in the ticks in between
+            wheel->tick = now_tick;
+            break;
+        }
+        step(wheel);
+    }
+    return handed;
+}
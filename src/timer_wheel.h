@@ -0,0 +1,58 @@
+// Hierarchical timing wheel of key expirations
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Time advances in ticks of TIMER_TICK_MS. Level 0 has one slot per tick;
+// each slot of level n spans a whole turn of level n - 1. With 4 levels of
+// 64 slots and 10 ms ticks the wheel reaches about 46 hours ahead; later
+// timers wait in the last level and are placed again as it turns.
+//
+// Adding a timer and expiring one are O(1); a timer is cascaded down at
+// most once per level. The wheel has no lock of its own: the owner
+// serializes every call.
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+// A timer names the key it may expire. It holds a copy of the key rather
+// than the entry, which can be replaced or freed while the timer waits.
+typedef struct wheel_timer {
+    struct wheel_timer* next;
+    uint64_t expires_at;                // Milliseconds since the epoch
+    uint32_t key_len;
+    char key[];
+} wheel_timer_t;
+
+typedef struct timer_wheel {
+    uint64_t tick;                      // Next tick to run; earlier ones are done
+    size_t count;                       // Timers in slots or due
+    wheel_timer_t* due;                 // Expired, not yet handed out
+    wheel_timer_t* slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_t;
+
+timer_wheel_t* timer_wheel_create(uint64_t now_ms);
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+// Schedule key for expires_at. Returns false if out of memory.
+bool timer_wheel_add(timer_wheel_t* wheel, uint64_t expires_at,
+                     const char* key, size_t key_len);
+
+// Put a timer handed out by timer_wheel_expire back for a new time
+void timer_wheel_rearm(timer_wheel_t* wheel, wheel_timer_t* timer, uint64_t expires_at);
+
+// Called for each timer whose time has passed. The callback owns the
+// timer: it frees it or hands it back with timer_wheel_rearm.
+typedef void (*timer_expire_fn)(void* ctx, wheel_timer_t* timer);
+
+// Run the wheel up to now_ms, handing out at most budget expired timers.
+// The rest stay due for the next call. Returns the number handed out.
+size_t timer_wheel_expire(timer_wheel_t* wheel, uint64_t now_ms, size_t budget,
+                          timer_expire_fn expire, void* ctx);
+
+#endif // TIMER_WHEEL_H
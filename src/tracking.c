@@ -0,0 +1,436 @@
+#include "tracking.h"
+#include "hash.h"
+#include "log.h"
+#include "protocol.h"
+#include "shm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define TRACKING_SEED 0x7472616b6b657973ull
+#define TRACKING_INITIAL_BUCKETS 64     // Per stripe
+
+typedef struct {
+    const char* at;                     // In the subscriber's copy of the request
+    size_t len;
+} tracking_prefix_t;
+
+struct tracking_sub {
+    kv_tracking_t* tracking;
+    tracking_inbox_t* inbox;
+    void* owner;                        // Owner's thread only; NULL once unsubscribed
+    unsigned refs;                      // The owner's, the table's and the inbox's
+    bool gone;                          // Unsubscribed; readers lists drop it
+    pthread_mutex_t lock;               // Guards the rest
+    bool queued;                        // In the inbox
+    bool overflowed;                    // pending is one frame invalidating everything
+    conn_buf_t pending;
+    struct tracking_sub* next_queued;
+    tracking_prefix_t* prefixes;        // Broadcast mode, else NULL
+    size_t prefix_count;
+    char* prefix_data;
+};
+
+typedef struct tracked_key {
+    struct tracked_key* next;           // In its bucket
+    uint64_t hash;
+    tracking_sub_t** readers;
+    size_t reader_count;
+    size_t reader_size;
+    size_t key_len;
+    char key[];
+} tracked_key_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    tracked_key_t** buckets;
+    size_t bucket_count;                // Power of two
+    size_t count;
+    size_t cursor;                      // Where the search for a key to forget starts
+} __attribute__((aligned(64))) tracking_stripe_t;
+
+struct kv_tracking {
+    tracking_stripe_t stripes[TRACKING_STRIPES];
+    size_t stripe_keys;                 // Most keys a stripe holds
+    unsigned readers;                   // Subscribers tracking the keys they read
+    unsigned broadcasts;                // And by prefix, in broadcasters
+    pthread_rwlock_t broadcast_lock;
+    tracking_sub_t** broadcasters;
+    size_t broadcaster_size;
+    uint64_t pushed;
+    uint64_t forgotten;
+};
+
+static void sub_release(tracking_sub_t* sub) {
+    if (__atomic_sub_fetch(&sub->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    pthread_mutex_destroy(&sub->lock);
+    conn_buf_free(&sub->pending);
+    free(sub->prefixes);
+    free(sub->prefix_data);
+    free(sub);
+}
+
+static bool append_push(conn_buf_t* out, const char* key, size_t key_len) {
+    if (!conn_buf_reserve(out, KV_FRAME_HEADER_SIZE + key_len)) return false;
+    kv_frame_t frame = { .code = MSG_INVALIDATE, .key_len = (uint16_t)key_len };
+    kv_frame_encode(out->data + out->len, &frame);
+    if (key_len) memcpy(out->data + out->len + KV_FRAME_HEADER_SIZE, key, key_len);
+    out->len += KV_FRAME_HEADER_SIZE + key_len;
+    return true;
+}
+
+// Tell the subscriber key may have changed (key_len 0: anything may have)
+// and make sure its owner hears of it
+static void push(kv_tracking_t* tracking, tracking_sub_t* sub, const char* key, size_t key_len) {
+    pthread_mutex_lock(&sub->lock);
+    if (!sub->gone && !sub->overflowed) {
+        if (sub->pending.len + KV_FRAME_HEADER_SIZE + key_len > TRACKING_MAX_PENDING ||
+            !append_push(&sub->pending, key, key_len)) {
+            sub->pending.len = 0;
+            sub->overflowed = true;
+            append_push(&sub->pending, NULL, 0);
+        }
+        __atomic_add_fetch(&tracking->pushed, 1, __ATOMIC_RELAXED);
+
+        if (!sub->queued) {
+            sub->queued = true;
+            __atomic_add_fetch(&sub->refs, 1, __ATOMIC_RELAXED);
+            tracking_inbox_t* inbox = sub->inbox;
+            pthread_mutex_lock(&inbox->lock);
+            bool ring = !inbox->head;
+            sub->next_queued = inbox->head;
+            inbox->head = sub;
+            pthread_mutex_unlock(&inbox->lock);
+            if (ring) shm_ring_bell(inbox->bell);
+        }
+    }
+    pthread_mutex_unlock(&sub->lock);
+}
+
+// Tell a key's readers and free it, outside its stripe's lock
+static void tracked_key_notify(kv_tracking_t* tracking, tracked_key_t* tracked) {
+    for (size_t i = 0; i < tracked->reader_count; i++) {
+        push(tracking, tracked->readers[i], tracked->key, tracked->key_len);
+        sub_release(tracked->readers[i]);
+    }
+    free(tracked->readers);
+    free(tracked);
+}
+
+static tracking_stripe_t* stripe_of(kv_tracking_t* tracking, uint64_t hash) {
+    return &tracking->stripes[hash >> 58];  // 64 stripes
+}
+
+static tracked_key_t** stripe_find(tracking_stripe_t* stripe, uint64_t hash,
+                                   const char* key, size_t key_len) {
+    tracked_key_t** link = &stripe->buckets[hash & (stripe->bucket_count - 1)];
+    while (*link && ((*link)->hash != hash || (*link)->key_len != key_len ||
+                     memcmp((*link)->key, key, key_len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Unlink some key to make room, starting where the last search stopped
+static tracked_key_t* stripe_forget(tracking_stripe_t* stripe) {
+    for (size_t i = 0; i < stripe->bucket_count; i++) {
+        size_t bucket = (stripe->cursor + i) & (stripe->bucket_count - 1);
+        tracked_key_t* tracked = stripe->buckets[bucket];
+        if (tracked) {
+            stripe->buckets[bucket] = tracked->next;
+            stripe->cursor = bucket + 1;
+            stripe->count--;
+            return tracked;
+        }
+    }
+    return NULL;
+}
+
+kv_tracking_t* tracking_create(size_t max_keys) {
+    kv_tracking_t* tracking;
+    if (posix_memalign((void**)&tracking, 64, sizeof(*tracking)) != 0) return NULL;
+    memset(tracking, 0, sizeof(*tracking));
+    tracking->stripe_keys = max_keys / TRACKING_STRIPES ? max_keys / TRACKING_STRIPES : 1;
+    pthread_rwlock_init(&tracking->broadcast_lock, NULL);
+    for (unsigned i = 0; i < TRACKING_STRIPES; i++) {
+        tracking_stripe_t* stripe = &tracking->stripes[i];
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->bucket_count = TRACKING_INITIAL_BUCKETS;
+        stripe->buckets = calloc(stripe->bucket_count, sizeof(*stripe->buckets));
+        if (!stripe->buckets) {
+            tracking_destroy(tracking);
+            return NULL;
+        }
+    }
+    return tracking;
+}
+
+void tracking_destroy(kv_tracking_t* tracking) {
+    if (!tracking) return;
+    for (unsigned i = 0; i < TRACKING_STRIPES; i++) {
+        tracking_stripe_t* stripe = &tracking->stripes[i];
+        for (size_t b = 0; stripe->buckets && b < stripe->bucket_count; b++) {
+            while (stripe->buckets[b]) {
+                tracked_key_t* tracked = stripe->buckets[b];
+                stripe->buckets[b] = tracked->next;
+                for (size_t r = 0; r < tracked->reader_count; r++) {
+                    sub_release(tracked->readers[r]);
+                }
+                free(tracked->readers);
+                free(tracked);
+            }
+        }
+        free(stripe->buckets);
+        pthread_mutex_destroy(&stripe->lock);
+    }
+    pthread_rwlock_destroy(&tracking->broadcast_lock);
+    free(tracking->broadcasters);
+    free(tracking);
+}
+
+void tracking_written(void* ctx, const char* key, size_t key_len) {
+    kv_tracking_t* tracking = ctx;
+    if (__atomic_load_n(&tracking->readers, __ATOMIC_SEQ_CST) > 0) {
+        uint64_t hash = kv_hash(key, key_len, TRACKING_SEED);
+        tracking_stripe_t* stripe = stripe_of(tracking, hash);
+        pthread_mutex_lock(&stripe->lock);
+        tracked_key_t** link = stripe_find(stripe, hash, key, key_len);
+        tracked_key_t* tracked = *link;
+        if (tracked) {
+            *link = tracked->next;
+            stripe->count--;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        if (tracked) tracked_key_notify(tracking, tracked);
+    }
+
+    if (__atomic_load_n(&tracking->broadcasts, __ATOMIC_SEQ_CST) > 0) {
+        pthread_rwlock_rdlock(&tracking->broadcast_lock);
+        for (unsigned i = 0; i < tracking->broadcasts; i++) {
+            tracking_sub_t* sub = tracking->broadcasters[i];
+            for (size_t p = 0; p < sub->prefix_count; p++) {
+                const tracking_prefix_t* prefix = &sub->prefixes[p];
+                if (prefix->len <= key_len && memcmp(prefix->at, key, prefix->len) == 0) {
+                    push(tracking, sub, key, key_len);
+                    break;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&tracking->broadcast_lock);
+    }
+}
+
+void tracking_stats(kv_tracking_t* tracking, uint64_t* pushed, uint64_t* forgotten) {
+    *pushed = __atomic_load_n(&tracking->pushed, __ATOMIC_RELAXED);
+    *forgotten = __atomic_load_n(&tracking->forgotten, __ATOMIC_RELAXED);
+}
+
+bool tracking_inbox_init(tracking_inbox_t* inbox) {
+    inbox->head = NULL;
+    inbox->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox->bell < 0) return false;
+    pthread_mutex_init(&inbox->lock, NULL);
+    return true;
+}
+
+void tracking_inbox_destroy(tracking_inbox_t* inbox) {
+    if (inbox->bell < 0) return;
+    while (inbox->head) {
+        tracking_sub_t* sub = inbox->head;
+        inbox->head = sub->next_queued;
+        sub_release(sub);
+    }
+    close(inbox->bell);
+    inbox->bell = -1;
+    pthread_mutex_destroy(&inbox->lock);
+}
+
+void tracking_inbox_drain(tracking_inbox_t* inbox,
+                          void (*send)(void* ctx, void* owner, tracking_sub_t* sub),
+                          void* ctx) {
+    uint64_t rung;
+    if (read(inbox->bell, &rung, sizeof(rung)) < 0) {
+        // Rung again after this read, so taken below or next time round
+    }
+    pthread_mutex_lock(&inbox->lock);
+    tracking_sub_t* sub = inbox->head;
+    inbox->head = NULL;
+    pthread_mutex_unlock(&inbox->lock);
+
+    while (sub) {
+        tracking_sub_t* next = sub->next_queued;
+        if (sub->owner) send(ctx, sub->owner, sub);
+        sub_release(sub);
+        sub = next;
+    }
+}
+
+// Copy the prefixes of a broadcast MSG_TRACK, laid out as MDELETE items
+static bool parse_prefixes(tracking_sub_t* sub, const char* value, size_t len) {
+    size_t count = 0;
+    for (size_t at = 0; at < len; count++) {
+        if (len - at < sizeof(uint16_t) || count == KV_CACHE_MAX_PREFIXES) return false;
+        size_t prefix_len = kv_get_u16(value + at);
+        if (len - at - sizeof(uint16_t) < prefix_len) return false;
+        at += sizeof(uint16_t) + prefix_len;
+    }
+    if (count == 0) return false;
+
+    sub->prefix_data = malloc(len);
+    sub->prefixes = malloc(count * sizeof(*sub->prefixes));
+    if (!sub->prefix_data || !sub->prefixes) return false;
+    memcpy(sub->prefix_data, value, len);
+    const char* at = sub->prefix_data;
+    for (size_t i = 0; i < count; i++) {
+        sub->prefixes[i].len = kv_get_u16(at);
+        sub->prefixes[i].at = at + sizeof(uint16_t);
+        at += sizeof(uint16_t) + sub->prefixes[i].len;
+    }
+    sub->prefix_count = count;
+    return true;
+}
+
+tracking_sub_t* tracking_subscribe(kv_tracking_t* tracking, tracking_inbox_t* inbox,
+                                   void* owner, uint8_t flags, const char* value, size_t len) {
+    tracking_sub_t* sub = calloc(1, sizeof(tracking_sub_t));
+    if (!sub) return NULL;
+    sub->tracking = tracking;
+    sub->inbox = inbox;
+    sub->owner = owner;
+    sub->refs = 1;
+    pthread_mutex_init(&sub->lock, NULL);
+
+    bool broadcast = flags & KV_FRAME_BCAST;
+    if (broadcast && !parse_prefixes(sub, value, len)) {
+        sub_release(sub);
+        return NULL;
+    }
+    if (!broadcast) {
+        __atomic_add_fetch(&tracking->readers, 1, __ATOMIC_SEQ_CST);
+        return sub;
+    }
+
+    pthread_rwlock_wrlock(&tracking->broadcast_lock);
+    bool added = false;
+    if (tracking->broadcasts < tracking->broadcaster_size) {
+        added = true;
+    } else {
+        size_t size = tracking->broadcaster_size ? tracking->broadcaster_size * 2 : 16;
+        tracking_sub_t** grown = realloc(tracking->broadcasters, size * sizeof(*grown));
+        if (grown) {
+            tracking->broadcasters = grown;
+            tracking->broadcaster_size = size;
+            added = true;
+        }
+    }
+    if (added) {
+        tracking->broadcasters[tracking->broadcasts] = sub;
+        __atomic_add_fetch(&tracking->broadcasts, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_rwlock_unlock(&tracking->broadcast_lock);
+    if (!added) {
+        sub_release(sub);
+        return NULL;
+    }
+    return sub;
+}
+
+void tracking_unsubscribe(tracking_sub_t* sub) {
+    kv_tracking_t* tracking = sub->tracking;
+    pthread_mutex_lock(&sub->lock);
+    sub->gone = true;
+    pthread_mutex_unlock(&sub->lock);
+    sub->owner = NULL;
+
+    if (sub->prefixes) {
+        pthread_rwlock_wrlock(&tracking->broadcast_lock);
+        for (unsigned i = 0; i < tracking->broadcasts; i++) {
+            if (tracking->broadcasters[i] == sub) {
+                tracking->broadcasters[i] = tracking->broadcasters[tracking->broadcasts - 1];
+                __atomic_sub_fetch(&tracking->broadcasts, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&tracking->broadcast_lock);
+    } else {
+        __atomic_sub_fetch(&tracking->readers, 1, __ATOMIC_SEQ_CST);
+    }
+    sub_release(sub);
+}
+
+void tracking_read(tracking_sub_t* sub, const char* key, size_t key_len) {
+    if (sub->prefixes) return;
+    kv_tracking_t* tracking = sub->tracking;
+    uint64_t hash = kv_hash(key, key_len, TRACKING_SEED);
+    tracking_stripe_t* stripe = stripe_of(tracking, hash);
+    tracked_key_t* forgotten = NULL;
+    bool tracked_ok = true;
+
+    pthread_mutex_lock(&stripe->lock);
+    tracked_key_t* tracked = *stripe_find(stripe, hash, key, key_len);
+    if (!tracked) {
+        if (stripe->count >= tracking->stripe_keys) {
+            forgotten = stripe_forget(stripe);
+            if (forgotten) __atomic_add_fetch(&tracking->forgotten, 1, __ATOMIC_RELAXED);
+        }
+        if (stripe->count >= stripe->bucket_count) {
+            KV_BUCKETS_GROW(stripe->buckets, stripe->bucket_count, tracked_key_t, next);
+        }
+        tracked = malloc(sizeof(tracked_key_t) + key_len);
+        if (tracked) {
+            memset(tracked, 0, sizeof(*tracked));
+            tracked->hash = hash;
+            tracked->key_len = key_len;
+            memcpy(tracked->key, key, key_len);
+            tracked->next = stripe->buckets[hash & (stripe->bucket_count - 1)];
+            stripe->buckets[hash & (stripe->bucket_count - 1)] = tracked;
+            stripe->count++;
+        }
+    }
+
+    // Readers that have gone are dropped on the way
+    bool known = false;
+    for (size_t i = 0; tracked && i < tracked->reader_count && !known; ) {
+        tracking_sub_t* reader = tracked->readers[i];
+        if (reader == sub) {
+            known = true;
+        } else if (__atomic_load_n(&reader->gone, __ATOMIC_RELAXED)) {
+            tracked->readers[i] = tracked->readers[--tracked->reader_count];
+            sub_release(reader);
+        } else {
+            i++;
+        }
+    }
+    if (tracked && !known) {
+        if (tracked->reader_count == tracked->reader_size) {
+            size_t size = tracked->reader_size ? tracked->reader_size * 2 : 2;
+            tracking_sub_t** grown = realloc(tracked->readers, size * sizeof(*grown));
+            if (grown) {
+                tracked->readers = grown;
+                tracked->reader_size = size;
+            }
+        }
+        if (tracked->reader_count < tracked->reader_size) {
+            tracked->readers[tracked->reader_count++] = sub;
+            __atomic_add_fetch(&sub->refs, 1, __ATOMIC_RELAXED);
+        } else {
+            tracked_ok = false;
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (forgotten) tracked_key_notify(tracking, forgotten);
+    // Untracked, the value read must not be cached: say so straight away
+    if (!tracked || !tracked_ok) push(tracking, sub, key, key_len);
+}
+
+bool tracking_take(tracking_sub_t* sub, conn_buf_t* out) {
+    pthread_mutex_lock(&sub->lock);
+    bool ok = conn_buf_append(out, sub->pending.data, sub->pending.len);
+    sub->pending.len = 0;
+    sub->overflowed = false;
+    sub->queued = false;
+    pthread_mutex_unlock(&sub->lock);
+    return ok;
+}
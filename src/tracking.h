@@ -0,0 +1,62 @@
+// Which connections to tell about writes, for clients' near caches
+
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include "request.h"
+
+// A connection that sent MSG_TRACK is subscribed. By default each GET it
+// makes records it as a reader of the key, in a table of at most max_keys
+// keys split over TRACKING_STRIPES locks. The next write to the key sends
+// every reader one MSG_INVALIDATE and forgets them, so a client hears
+// about a key once per read. A full stripe forgets a key to make room,
+// telling its readers as if it had been written. In broadcast mode a
+// subscriber names prefixes instead and hears about every write under
+// them; each write then checks every broadcast subscriber.
+//
+// Writes happen on any thread. A subscriber's frames collect in its
+// pending buffer, and the first one queues it in the inbox of the thread
+// owning its connection, which sends them from there. Pending frames past
+// TRACKING_MAX_PENDING bytes give way to one invalidating everything.
+#define TRACKING_STRIPES 64
+#define TRACKING_MAX_PENDING (256 * 1024)
+
+typedef struct kv_tracking kv_tracking_t;
+typedef struct tracking_sub tracking_sub_t;
+
+// Subscribers with frames to send, for the thread that owns their
+// connections
+typedef struct {
+    pthread_mutex_t lock;
+    tracking_sub_t* head;
+    int bell;                           // eventfd, rung as head is set
+} tracking_inbox_t;
+
+kv_tracking_t* tracking_create(size_t max_keys);
+// Once every subscriber is gone
+void tracking_destroy(kv_tracking_t* tracking);
+// kv_store_watch callback, with the tracking as ctx
+void tracking_written(void* ctx, const char* key, size_t key_len);
+// Invalidations sent, and keys forgotten to make room
+void tracking_stats(kv_tracking_t* tracking, uint64_t* pushed, uint64_t* forgotten);
+
+bool tracking_inbox_init(tracking_inbox_t* inbox);
+void tracking_inbox_destroy(tracking_inbox_t* inbox);
+// Hand each subscriber queued since the last call, and still subscribed,
+// to send with its owner; send passes it to tracking_take
+void tracking_inbox_drain(tracking_inbox_t* inbox,
+                          void (*send)(void* ctx, void* owner, tracking_sub_t* sub),
+                          void* ctx);
+
+// Subscribe the connection owner, a MSG_TRACK with flags and value of len
+// bytes. NULL if the prefixes are malformed or out of memory.
+tracking_sub_t* tracking_subscribe(kv_tracking_t* tracking, tracking_inbox_t* inbox,
+                                   void* owner, uint8_t flags, const char* value, size_t len);
+// On the owner's thread; nothing is queued for it afterwards
+void tracking_unsubscribe(tracking_sub_t* sub);
+// A GET of key by the subscriber, noted before it runs
+void tracking_read(tracking_sub_t* sub, const char* key, size_t key_len);
+// Move the pending frames to out. False if out could not grow.
+bool tracking_take(tracking_sub_t* sub, conn_buf_t* out);
+
+#endif // TRACKING_H
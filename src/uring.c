@@ -0,0 +1,539 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "log.h"
+#include "reactor.h"
+#include "request.h"
+#include <errno.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// What a completion is for, in the low bits of its user_data; the rest is
+// the connection, if there is one
+enum {
+    OP_ACCEPT = 0,
+    OP_WAKE = 1,
+    OP_CANCEL = 2,
+    OP_RECV = 3,
+    OP_SEND = 4,
+    OP_ACCEPT_UNIX = 5,                 // On the server's Unix socket
+};
+#define OP_MASK 7
+#define BUFFER_GROUP 0
+
+typedef struct uconn {
+    int fd;
+    bool recv_armed;                    // Multishot recv in flight
+    bool send_armed;                    // SEND of sending in flight
+    bool paused;                        // Recv cancelled while replies pile up
+    bool closing;                       // Freed once nothing is in flight
+    uint8_t version;                    // Wire protocol, 0 until negotiated
+    conn_buf_t in;                      // Start of a request cut short
+    conn_buf_t sending;                 // What the SEND in flight refers to
+    size_t sent;                        // Bytes of sending already taken
+    conn_buf_t out;                     // Replies queued behind it
+    struct uconn* prev;                 // The ring's connections
+    struct uconn* next;
+} uconn_t;
+
+typedef struct {
+    kv_server_t* server;
+    int fd;
+    void* ring_map;                     // SQ and CQ rings, one mapping
+    size_t ring_map_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;                  // SQEs queued, published on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* buf_ring; // Receive buffers offered to the kernel
+    char* buffers;                      // URING_BUFFERS of URING_BUFFER_SIZE
+    uint16_t buf_tail;
+    int listen_fd;
+    bool own_listener;
+    pthread_t thread;
+    uconn_t* conns;
+    size_t connections;
+    uint64_t requests;
+    uint64_t syscalls;
+} uring_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Submit every queued SQE and, with wait, block for at least one
+// completion. Returns 0 or -errno.
+static int ring_enter(uring_t* ring, bool wait) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned pending = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && !wait) return 0;
+
+    ring->syscalls++;
+    if (sys_io_uring_enter(ring->fd, pending, wait ? 1 : 0,
+                           wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Next free SQE, zeroed, or NULL if the kernel cannot take any more yet
+static struct io_uring_sqe* ring_sqe(uring_t* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        ring_enter(ring, false);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Offer buffer bid to the kernel again
+static void buffer_recycle(uring_t* ring, unsigned bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Accept on the ring's listener, or with op OP_ACCEPT_UNIX on the Unix
+// socket
+static bool arm_accept(uring_t* ring, uint64_t op) {
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == OP_ACCEPT_UNIX ? ring->server->unix_socket : ring->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = op;
+    return true;
+}
+
+static bool arm_wake(uring_t* ring) {
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->server->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_WAKE;
+    return true;
+}
+
+static bool conn_arm_recv(uring_t* ring, uconn_t* conn) {
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+    conn->recv_armed = true;
+    return true;
+}
+
+static bool conn_arm_send(uring_t* ring, uconn_t* conn) {
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->sending.data + conn->sent);
+    sqe->len = (uint32_t)(conn->sending.len - conn->sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+    conn->send_armed = true;
+    return true;
+}
+
+// Stop the recv until the replies drain. If it completes before the
+// cancel arrives, or the cancel finds a newer recv at the same address,
+// the ECANCELED recv is simply re-armed.
+static void conn_pause(uring_t* ring, uconn_t* conn) {
+    struct io_uring_sqe* sqe = ring_sqe(ring);
+    if (!sqe) return;                   // Read on; try again with the next reply
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+    conn->paused = true;
+}
+
+// Shut the socket down so whatever is in flight completes; the connection
+// is freed by conn_release once it has
+static void conn_close(uring_t* ring, uconn_t* conn) {
+    if (conn->closing) return;
+    conn->closing = true;
+    shutdown(conn->fd, SHUT_RDWR);
+    ring->syscalls++;
+    log_debug("Client disconnected");
+}
+
+static void conn_release(uring_t* ring, uconn_t* conn) {
+    if (!conn->closing || conn->recv_armed || conn->send_armed) return;
+    close(conn->fd);
+    ring->syscalls++;
+    reactor_release(ring->server);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        ring->conns = conn->next;
+    }
+    if (conn->next) conn->next->prev = conn->prev;
+    ring->connections--;
+    conn_buf_free(&conn->in);
+    conn_buf_free(&conn->sending);
+    conn_buf_free(&conn->out);
+    free(conn);
+}
+
+// Start sending the queued replies if no SEND is in flight, and pause
+// reading while too many are unsent
+static bool conn_send(uring_t* ring, uconn_t* conn) {
+    if (!conn->send_armed && conn->out.len > 0) {
+        conn_buf_t sending = conn->sending;
+        conn->sending = conn->out;
+        conn->out = sending;
+        conn->out.len = 0;
+        conn->sent = 0;
+        if (!conn_arm_send(ring, conn)) return false;
+    }
+    size_t pending = conn->sending.len - conn->sent + conn->out.len;
+    if (pending >= REACTOR_MAX_PENDING && conn->recv_armed && !conn->paused) {
+        conn_pause(ring, conn);
+    }
+    return true;
+}
+
+static bool conn_received(uring_t* ring, uconn_t* conn, const char* data, size_t len) {
+    // As in reactor.c, requests run straight from the receive buffer and
+    // only one cut short is copied to the connection
+    if (conn->in.len > 0) {
+        if (!conn_buf_append(&conn->in, data, len)) return false;
+        data = conn->in.data;
+        len = conn->in.len;
+    }
+
+    ssize_t used = request_process(&ring->server->shards, NULL, NULL, &conn->version, data, len,
+                                   &conn->out, &ring->requests);
+    if (used < 0) return false;
+
+    if (conn->in.len > 0) {
+        conn_buf_consume(&conn->in, (size_t)used);
+        if (conn->in.len == 0) conn_buf_free(&conn->in);
+    } else if ((size_t)used < len &&
+               !conn_buf_append(&conn->in, data + used, len - (size_t)used)) {
+        return false;
+    }
+    return conn_send(ring, conn);
+}
+
+static void on_recv(uring_t* ring, uconn_t* conn, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) conn->recv_armed = false;
+
+    if (cqe->res > 0) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char* data = ring->buffers + (size_t)bid * URING_BUFFER_SIZE;
+        bool ok = conn->closing || conn_received(ring, conn, data, (size_t)cqe->res);
+        buffer_recycle(ring, bid);
+        if (!ok) conn_close(ring, conn);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        conn_close(ring, conn);         // End of stream or an error
+    }
+
+    // Out of buffers, cancelled by a stale pause, or ended for its own reasons
+    if (!conn->recv_armed && !conn->closing && !conn->paused &&
+        !conn_arm_recv(ring, conn)) {
+        conn_close(ring, conn);
+    }
+    conn_release(ring, conn);
+}
+
+static void on_send(uring_t* ring, uconn_t* conn, const struct io_uring_cqe* cqe) {
+    conn->send_armed = false;
+    if (cqe->res < 0) {
+        conn_close(ring, conn);
+    } else if (!conn->closing) {
+        conn->sent += (size_t)cqe->res;
+        bool ok;
+        if (conn->sent < conn->sending.len) {
+            ok = conn_arm_send(ring, conn);
+        } else {
+            conn->sending.len = 0;
+            conn->sent = 0;
+            ok = conn_send(ring, conn);
+            if (conn->sending.len == 0) {
+                conn_buf_free(&conn->sending);
+                conn_buf_free(&conn->out);
+            }
+        }
+
+        size_t pending = conn->sending.len - conn->sent + conn->out.len;
+        if (ok && conn->paused && pending < REACTOR_MAX_PENDING) {
+            conn->paused = false;
+            if (!conn->recv_armed) ok = conn_arm_recv(ring, conn);
+        }
+        if (!ok) conn_close(ring, conn);
+    }
+    conn_release(ring, conn);
+}
+
+static void on_accept(uring_t* ring, const struct io_uring_cqe* cqe) {
+    bool local = (cqe->user_data & OP_MASK) == OP_ACCEPT_UNIX;
+    if (!(cqe->flags & IORING_CQE_F_MORE) && ring->server->is_running &&
+        !arm_accept(ring, cqe->user_data & OP_MASK)) {
+        log_error("Failed to re-arm accept");
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            log_error("Accept failed: %s", strerror(errno));
+        }
+        return;
+    }
+
+    int fd = cqe->res;
+    if (!reactor_admit(ring->server)) {
+        close(fd);
+        ring->syscalls++;
+        return;
+    }
+    int opt = 1;
+    if (!local) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        ring->syscalls++;
+    }
+
+    uconn_t* conn = calloc(1, sizeof(uconn_t));
+    if (!conn) {
+        log_error("Failed to register connection: %s", strerror(errno));
+        close(fd);
+        reactor_release(ring->server);
+        return;
+    }
+    conn->fd = fd;
+    conn->next = ring->conns;
+    if (ring->conns) ring->conns->prev = conn;
+    ring->conns = conn;
+    ring->connections++;
+    if (!conn_arm_recv(ring, conn)) {
+        log_error("Failed to register connection: %s", strerror(errno));
+        conn_close(ring, conn);
+        conn_release(ring, conn);
+        return;
+    }
+
+    if (local) {
+        log_debug("New connection on %s", ring->server->unix_path);
+        return;
+    }
+    if (!log_enabled(LOG_DEBUG)) return;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    ring->syscalls++;
+    if (getpeername(fd, (struct sockaddr*)&addr, &addr_len) == 0) {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        log_debug("New connection from %s:%d", client_ip, ntohs(addr.sin_port));
+    }
+}
+
+static void* uring_loop(void* arg) {
+    uring_t* ring = arg;
+    kv_server_t* server = ring->server;
+
+    while (server->is_running) {
+        // The one syscall per batch: submit what the last batch queued and
+        // wait for the next
+        int err = ring_enter(ring, true);
+        if (err < 0 && err != -EINTR && err != -EAGAIN && err != -EBUSY) {
+            errno = -err;
+            log_error("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            uconn_t* conn = (uconn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+            switch (cqe->user_data & OP_MASK) {
+                case OP_ACCEPT_UNIX:
+                case OP_ACCEPT: on_accept(ring, cqe); break;
+                case OP_RECV:   on_recv(ring, conn, cqe); break;
+                case OP_SEND:   on_send(ring, conn, cqe); break;
+                default:        break;  // Wake-ups and cancels; the loop condition decides
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Create the ring and register its receive buffers. Fails on kernels
+// without io_uring, or too old for provided buffer rings.
+static bool ring_setup(uring_t* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        params.flags &= ~IORING_SETUP_COOP_TASKRUN;  // Before 5.19
+        ring->fd = sys_io_uring_setup(URING_SQ_ENTRIES, &params);
+    }
+    if (ring->fd < 0) return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED) {
+        ring->ring_map = NULL;
+        return false;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return false;
+    }
+
+    char* map = ring->ring_map;
+    ring->sq_head = (unsigned*)(map + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    unsigned* sq_array = (unsigned*)(map + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) sq_array[i] = i;
+    ring->cq_head = (unsigned*)(map + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(map + params.cq_off.cqes);
+
+    // The buffer ring must be page aligned, so it gets a mapping of its own
+    ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return false;
+    }
+    ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (!ring->buffers) return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+    for (unsigned i = 0; i < URING_BUFFERS; i++) buffer_recycle(ring, i);
+    return true;
+}
+
+static bool uring_init(uring_t* ring, kv_server_t* server, bool first) {
+    memset(ring, 0, sizeof(*ring));
+    ring->server = server;
+    ring->listen_fd = -1;
+    if (!ring_setup(ring)) return false;
+
+    // Rings past the first get their own listener when they can
+    if (first || !server->reuseport ||
+        (ring->listen_fd = reactor_listen(server->port, true)) < 0) {
+        ring->listen_fd = server->socket;
+    } else {
+        ring->own_listener = true;
+    }
+    return arm_accept(ring, OP_ACCEPT) &&
+           (server->unix_socket < 0 || arm_accept(ring, OP_ACCEPT_UNIX)) && arm_wake(ring);
+}
+
+static void uring_cleanup(uring_t* ring) {
+    // Closing the ring cancels everything in flight
+    if (ring->fd >= 0) close(ring->fd);
+    while (ring->conns) {
+        uconn_t* conn = ring->conns;
+        conn->closing = true;
+        conn->recv_armed = conn->send_armed = false;
+        conn_release(ring, conn);
+    }
+    if (ring->own_listener) close(ring->listen_fd);
+    if (ring->ring_map) munmap(ring->ring_map, ring->ring_map_size);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(ring->buffers);
+}
+
+bool uring_run(kv_server_t* server) {
+    unsigned count = server->options.reactors;
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    uring_t* rings = calloc(count, sizeof(uring_t));
+    if (!rings) return false;
+
+    unsigned ready = 0;
+    while (ready < count && uring_init(&rings[ready], server, ready == 0)) ready++;
+    if (ready < count) {
+        if (ready == 0) log_error("io_uring unavailable: %s", strerror(errno));
+        uring_cleanup(&rings[ready]);
+        if (ready == 0) {
+            free(rings);
+            return false;
+        }
+        log_warn("running %u of %u io_uring loops", ready, count);
+    }
+    log_info("Serving with %u io_uring loop%s%s", ready, ready > 1 ? "s" : "",
+             server->reuseport && ready > 1 ? " (SO_REUSEPORT)" : "");
+
+    unsigned started = 1;
+    while (started < ready &&
+           pthread_create(&rings[started].thread, NULL, uring_loop, &rings[started]) == 0) {
+        started++;
+    }
+    // A listener nobody accepts on would strand the connections sent to it
+    for (unsigned i = started; i < ready; i++) uring_cleanup(&rings[i]);
+    ready = started;
+
+    uring_loop(&rings[0]);
+    for (unsigned i = 1; i < started; i++) pthread_join(rings[i].thread, NULL);
+
+    uint64_t requests = 0, syscalls = 0;
+    for (unsigned i = 0; i < ready; i++) {
+        requests += rings[i].requests;
+        syscalls += rings[i].syscalls;
+        uring_cleanup(&rings[i]);
+    }
+    reactor_report("io_uring", requests, syscalls);
+    free(rings);
+    return true;
+}
@@ -0,0 +1,26 @@
+// Event-driven connection handling with io_uring
+
+#ifndef URING_H
+#define URING_H
+
+#include "kv_store.h"
+
+// The same reactor layout as reactor.h, one thread per ring, each with its
+// own listener and connections, but the kernel does the waiting and the
+// I/O. A multishot accept delivers every new connection and a multishot
+// recv per connection delivers its data into buffers the kernel picks
+// from a ring the reactor registered, so nothing is re-armed per read.
+// Replies are sent with one SEND in flight per connection; every SQE
+// queued while handling a batch of completions is submitted by the same
+// io_uring_enter that waits for the next batch.
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 128               // Provided receive buffers per ring (power of two)
+#define URING_BUFFER_SIZE (16 * 1024)
+
+// Run server->options.reactors io_uring reactors (the first on the calling
+// thread) until the server is stopped. Returns false without serving if
+// the kernel lacks io_uring or any of the features above (Linux 6.0+).
+bool uring_run(kv_server_t* server);
+
+#endif // URING_H
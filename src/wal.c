@@ -0,0 +1,553 @@
+#include "wal.h"
+#include "checksum.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define WAL_INITIAL_BUFFER (64 * 1024)
+#define WAL_MAX_BUFFER (64 * 1024 * 1024)  // Appenders wait beyond this
+
+struct wal {
+    int fd;
+    char* prefix;
+    uint64_t generation;                // Suffix of the file being appended to
+    kv_fsync_policy_t policy;
+    unsigned fsync_interval_ms;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;           // Writer: records queued or stopping
+    pthread_cond_t durable_cond;        // Appenders: synced_lsn advanced
+    pthread_cond_t space_cond;          // Appenders: buffer drained
+
+    // Appenders fill buf while the writer thread writes out flush_buf
+    char* buf;
+    size_t len;
+    size_t cap;
+    char* flush_buf;
+    size_t flush_cap;
+
+    uint64_t next_lsn;                  // Last LSN handed out
+    uint64_t written_lsn;               // Last LSN handed to write()
+    uint64_t synced_lsn;                // Last LSN durable under the policy
+    bool writing;                       // Writer thread owns flush_buf
+    bool stopping;
+    bool failed;
+
+    wal_stats_t stats;
+    pthread_t thread;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+char* wal_path(const char* prefix, uint64_t generation) {
+    size_t len = strlen(prefix) + 32;
+    char* path = malloc(len);
+    if (path) snprintf(path, len, "%s.%06llu", prefix, (unsigned long long)generation);
+    return path;
+}
+
+static int open_generation(const char* prefix, uint64_t generation) {
+    char* path = wal_path(prefix, generation);
+    if (!path) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    return fd;
+}
+
+static bool buffer_reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) return true;
+    size_t new_cap = *cap ? *cap : WAL_INITIAL_BUFFER;
+    while (new_cap < need) new_cap *= 2;
+    char* p = realloc(*buf, new_cap);
+    if (!p) return false;
+    *buf = p;
+    *cap = new_cap;
+    return true;
+}
+
+// Writer thread: drains the append buffer with one write() per batch, so a
+// single fsync covers every record queued while the previous one ran.
+static void* wal_writer(void* arg) {
+    wal_t* wal = arg;
+    uint64_t last_sync = now_ms();
+
+    pthread_mutex_lock(&wal->lock);
+    for (;;) {
+        while (wal->len == 0 && !wal->stopping) {
+            bool unsynced = wal->synced_lsn < wal->written_lsn;
+            if (wal->policy == KV_FSYNC_INTERVAL && unsynced) {
+                uint64_t deadline = last_sync + wal->fsync_interval_ms;
+                if (now_ms() >= deadline) break;
+
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                uint64_t wait_ms = deadline - now_ms();
+                ts.tv_sec += wait_ms / 1000;
+                ts.tv_nsec += (wait_ms % 1000) * 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&wal->work_cond, &wal->lock, &ts);
+            } else {
+                pthread_cond_wait(&wal->work_cond, &wal->lock);
+            }
+        }
+        if (wal->len == 0 && wal->stopping &&
+            (wal->policy != KV_FSYNC_INTERVAL || wal->synced_lsn == wal->written_lsn)) {
+            break;
+        }
+
+        // Take the whole pending batch
+        char* batch = wal->buf;
+        size_t batch_len = wal->len;
+        uint64_t batch_lsn = wal->next_lsn;
+        wal->buf = wal->flush_buf;
+        wal->flush_buf = batch;
+        size_t cap = wal->cap;
+        wal->cap = wal->flush_cap;
+        wal->flush_cap = cap;
+        wal->len = 0;
+        wal->writing = true;
+        bool stopping = wal->stopping;
+        pthread_cond_broadcast(&wal->space_cond);
+        pthread_mutex_unlock(&wal->lock);
+
+        bool ok = batch_len == 0 || write_all(wal->fd, batch, batch_len);
+        bool sync = wal->policy == KV_FSYNC_ALWAYS ||
+                    (wal->policy == KV_FSYNC_INTERVAL &&
+                     (stopping || now_ms() >= last_sync + wal->fsync_interval_ms));
+        if (ok && sync) {
+            ok = fdatasync(wal->fd) == 0;
+            last_sync = now_ms();
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        wal->writing = false;
+        if (!ok) {
+            perror("WAL write failed");
+            wal->failed = true;
+        }
+        if (batch_len > 0) {
+            wal->stats.batches++;
+            wal->stats.bytes += batch_len;
+        }
+        if (sync) wal->stats.fsyncs++;
+        wal->written_lsn = batch_lsn;
+        if (sync || wal->policy == KV_FSYNC_NEVER) {
+            wal->synced_lsn = batch_lsn;
+        }
+        pthread_cond_broadcast(&wal->durable_cond);
+        pthread_cond_broadcast(&wal->space_cond);
+        if (wal->failed) break;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+wal_t* wal_open(const char* prefix, uint64_t generation,
+                kv_fsync_policy_t policy, unsigned fsync_interval_ms) {
+    wal_t* wal = calloc(1, sizeof(wal_t));
+    if (!wal) return NULL;
+
+    wal->prefix = strdup(prefix);
+    wal->generation = generation;
+    wal->fd = wal->prefix ? open_generation(prefix, generation) : -1;
+    if (wal->fd < 0) {
+        perror("Failed to open WAL");
+        free(wal->prefix);
+        free(wal);
+        return NULL;
+    }
+
+    wal->policy = policy;
+    wal->fsync_interval_ms = fsync_interval_ms ? fsync_interval_ms : 1;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->work_cond, NULL);
+    pthread_cond_init(&wal->durable_cond, NULL);
+    pthread_cond_init(&wal->space_cond, NULL);
+
+    if (pthread_create(&wal->thread, NULL, wal_writer, wal) != 0) {
+        perror("Failed to start WAL writer");
+        close(wal->fd);
+        free(wal->prefix);
+        free(wal);
+        return NULL;
+    }
+    return wal;
+}
+
+void wal_close(wal_t* wal) {
+    if (!wal) return;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->stopping = true;
+    pthread_cond_signal(&wal->work_cond);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->thread, NULL);
+
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->work_cond);
+    pthread_cond_destroy(&wal->durable_cond);
+    pthread_cond_destroy(&wal->space_cond);
+    free(wal->buf);
+    free(wal->flush_buf);
+    free(wal->prefix);
+    free(wal);
+}
+
+// Plain puts and deletes keep the original record layout
+static size_t expiry_size(wal_record_type_t type, uint64_t expires_at) {
+    return expires_at || type == WAL_EXPIRE ? sizeof(expires_at) : 0;
+}
+
+size_t wal_record_size(wal_record_type_t type, size_t key_len, size_t value_len,
+                       uint64_t expires_at) {
+    return sizeof(wal_record_header_t) + expiry_size(type, expires_at) + key_len + value_len;
+}
+
+static wal_record_header_t record_header(wal_record_type_t type, const char* key,
+                                         size_t key_len, const char* value, size_t value_len,
+                                         uint64_t expires_at) {
+    wal_record_header_t header = {
+        .type = (uint8_t)type,
+        .key_len = (uint32_t)key_len,
+        .value_len = (uint32_t)value_len,
+    };
+    size_t expiry_len = expiry_size(type, expires_at);
+    if (expiry_len) header.flags |= WAL_HAS_EXPIRY;
+    size_t header_rest = sizeof(header) - sizeof(header.crc);
+    uint32_t crc = crc32c(0, (const char*)&header + sizeof(header.crc), header_rest);
+    if (expiry_len) crc = crc32c(crc, &expires_at, expiry_len);
+    crc = crc32c(crc, key, key_len);
+    if (value_len) crc = crc32c(crc, value, value_len);
+    header.crc = crc;
+    return header;
+}
+
+static void record_copy(char* out, const wal_record_header_t* header, const char* key,
+                        const char* value, uint64_t expires_at) {
+    size_t expiry_len = header->flags & WAL_HAS_EXPIRY ? sizeof(expires_at) : 0;
+    memcpy(out, header, sizeof(*header));
+    out += sizeof(*header);
+    memcpy(out, &expires_at, expiry_len);
+    memcpy(out + expiry_len, key, header->key_len);
+    if (header->value_len) memcpy(out + expiry_len + header->key_len, value, header->value_len);
+}
+
+void wal_record_encode(char* out, wal_record_type_t type, const char* key, size_t key_len,
+                       const char* value, size_t value_len, uint64_t expires_at) {
+    wal_record_header_t header = record_header(type, key, key_len, value, value_len,
+                                               expires_at);
+    record_copy(out, &header, key, value, expires_at);
+}
+
+ssize_t wal_record_decode(const char* data, size_t len, wal_record_t* record) {
+    wal_record_header_t header;
+    if (len < sizeof(header)) return 0;
+    memcpy(&header, data, sizeof(header));
+    size_t expiry_len = header.flags & WAL_HAS_EXPIRY ? sizeof(uint64_t) : 0;
+    size_t body_len = expiry_len + (size_t)header.key_len + header.value_len;
+    if (len - sizeof(header) < body_len) return 0;
+
+    const char* body = data + sizeof(header);
+    size_t header_rest = sizeof(header) - sizeof(header.crc);
+    uint32_t crc = crc32c(0, (const char*)&header + sizeof(header.crc), header_rest);
+    if (crc32c(crc, body, body_len) != header.crc || header.type < WAL_PUT ||
+        header.type > WAL_EXPIRE || (header.type == WAL_EXPIRE && !expiry_len)) {
+        return -1;
+    }
+    record->type = (wal_record_type_t)header.type;
+    record->expires_at = 0;
+    if (expiry_len) memcpy(&record->expires_at, body, expiry_len);
+    record->key = body + expiry_len;
+    record->key_len = header.key_len;
+    record->value = record->key + header.key_len;
+    record->value_len = header.value_len;
+    return (ssize_t)(sizeof(header) + body_len);
+}
+
+uint64_t wal_append(wal_t* wal, wal_record_type_t type,
+                    const char* key, size_t key_len,
+                    const char* value, size_t value_len, uint64_t expires_at) {
+    wal_record_header_t header = record_header(type, key, key_len, value, value_len,
+                                               expires_at);
+    size_t record_len = wal_record_size(type, key_len, value_len, expires_at);
+
+    pthread_mutex_lock(&wal->lock);
+    while (!wal->failed && wal->len > 0 && wal->len + record_len > WAL_MAX_BUFFER) {
+        pthread_cond_wait(&wal->space_cond, &wal->lock);
+    }
+    if (wal->failed || !buffer_reserve(&wal->buf, &wal->cap, wal->len + record_len)) {
+        pthread_mutex_unlock(&wal->lock);
+        return 0;
+    }
+
+    record_copy(wal->buf + wal->len, &header, key, value, expires_at);
+    wal->len += record_len;
+    wal->stats.records++;
+
+    uint64_t lsn = ++wal->next_lsn;
+    if (!wal->writing) pthread_cond_signal(&wal->work_cond);
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// The thread's put-off wait, between wal_defer and wal_wait_deferred
+static __thread struct {
+    bool on;
+    wal_t* wal;
+    uint64_t lsn;
+} deferred;
+
+static bool wait_durable(wal_t* wal, uint64_t lsn) {
+    if (wal->policy != KV_FSYNC_ALWAYS) return true;
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->synced_lsn < lsn && !wal->failed) {
+        pthread_cond_wait(&wal->durable_cond, &wal->lock);
+    }
+    bool ok = wal->synced_lsn >= lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+bool wal_wait(wal_t* wal, uint64_t lsn) {
+    // Another log's records are waited for at once
+    if (!deferred.on || (deferred.wal && deferred.wal != wal)) return wait_durable(wal, lsn);
+    deferred.wal = wal;
+    if (lsn > deferred.lsn) deferred.lsn = lsn;
+    return true;
+}
+
+void wal_defer(void) {
+    deferred.on = true;
+}
+
+bool wal_wait_deferred(void) {
+    bool ok = !deferred.wal || wait_durable(deferred.wal, deferred.lsn);
+    deferred.on = false;
+    deferred.wal = NULL;
+    deferred.lsn = 0;
+    return ok;
+}
+
+uint64_t wal_rotate(wal_t* wal) {
+    pthread_mutex_lock(&wal->lock);
+    // Let the writer get everything queued so far into the current file
+    while ((wal->len > 0 || wal->writing) && !wal->failed) {
+        pthread_cond_signal(&wal->work_cond);
+        pthread_cond_wait(&wal->durable_cond, &wal->lock);
+    }
+
+    uint64_t closed = 0;
+    int fd = wal->failed ? -1 : open_generation(wal->prefix, wal->generation + 1);
+    if (fd >= 0) {
+        close(wal->fd);
+        wal->fd = fd;
+        closed = wal->generation++;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return closed;
+}
+
+uint64_t wal_generation(wal_t* wal) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t generation = wal->generation;
+    pthread_mutex_unlock(&wal->lock);
+    return generation;
+}
+
+bool wal_sync_generation(const char* prefix, uint64_t generation) {
+    char* path = wal_path(prefix, generation);
+    if (!path) return false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) return false;
+    bool ok = fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+void wal_get_stats(wal_t* wal, wal_stats_t* stats) {
+    pthread_mutex_lock(&wal->lock);
+    *stats = wal->stats;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+static long replay_file(const char* path, wal_apply_fn apply, void* ctx) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    FILE* fp = fdopen(fd, "r");
+    if (!fp) {
+        close(fd);
+        return -1;
+    }
+
+    long applied = 0;
+    off_t offset = 0;
+    char* body = NULL;
+    size_t body_cap = 0;
+
+    for (;;) {
+        wal_record_header_t header;
+        if (fread(&header, sizeof(header), 1, fp) != 1) break;
+
+        size_t expiry_len = header.flags & WAL_HAS_EXPIRY ? sizeof(uint64_t) : 0;
+        size_t body_len = expiry_len + header.key_len + header.value_len;
+        if ((off_t)(offset + sizeof(header) + body_len) > st.st_size) break;
+        if (body_len > body_cap) {
+            char* p = realloc(body, body_len);
+            if (!p) break;
+            body = p;
+            body_cap = body_len;
+        }
+        if (body_len && fread(body, body_len, 1, fp) != 1) break;
+
+        size_t header_rest = sizeof(header) - sizeof(header.crc);
+        uint32_t crc = crc32c(0, (const char*)&header + sizeof(header.crc), header_rest);
+        crc = crc32c(crc, body, body_len);
+        if (crc != header.crc || header.type < WAL_PUT || header.type > WAL_EXPIRE ||
+            (header.type == WAL_EXPIRE && !expiry_len)) {
+            break;
+        }
+
+        uint64_t expires_at = 0;
+        if (expiry_len) memcpy(&expires_at, body, expiry_len);
+        const char* key = body + expiry_len;
+        apply(ctx, (wal_record_type_t)header.type,
+              key, header.key_len,
+              key + header.key_len, header.value_len, expires_at);
+        applied++;
+        offset += sizeof(header) + body_len;
+    }
+
+    // Cut off a torn or corrupt tail so new records follow intact ones
+    if (offset < st.st_size) {
+        fprintf(stderr, "WAL %s: discarding %lld bytes of damaged tail\n",
+                path, (long long)(st.st_size - offset));
+        if (ftruncate(fd, offset) != 0) {
+            perror("Failed to truncate WAL");
+        }
+    }
+
+    free(body);
+    fclose(fp);
+    return applied;
+}
+
+// Generations of prefix present on disk, ascending. Returns the count.
+static size_t list_generations(const char* prefix, uint64_t** out) {
+    *out = NULL;
+    char* dir_copy = strdup(prefix);
+    char* base_copy = strdup(prefix);
+    if (!dir_copy || !base_copy) {
+        free(dir_copy);
+        free(base_copy);
+        return 0;
+    }
+    const char* base = basename(base_copy);
+    size_t base_len = strlen(base);
+
+    DIR* dir = opendir(dirname(dir_copy));
+    size_t count = 0, cap = 0;
+    struct dirent* de;
+    while (dir && (de = readdir(dir))) {
+        const char* name = de->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.') continue;
+
+        char* end;
+        unsigned long long gen = strtoull(name + base_len + 1, &end, 10);
+        if (end == name + base_len + 1 || *end != '\0') continue;
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 8;
+            uint64_t* p = realloc(*out, cap * sizeof(uint64_t));
+            if (!p) break;
+            *out = p;
+        }
+        (*out)[count++] = gen;
+    }
+    if (dir) closedir(dir);
+    free(dir_copy);
+    free(base_copy);
+
+    // Insertion sort: there are only ever a handful of generations
+    for (size_t i = 1; i < count; i++) {
+        uint64_t gen = (*out)[i];
+        size_t j = i;
+        while (j > 0 && (*out)[j - 1] > gen) {
+            (*out)[j] = (*out)[j - 1];
+            j--;
+        }
+        (*out)[j] = gen;
+    }
+    return count;
+}
+
+long wal_replay(const char* prefix, uint64_t first_generation,
+                wal_apply_fn apply, void* ctx, uint64_t* last_generation) {
+    uint64_t* gens;
+    size_t count = list_generations(prefix, &gens);
+    long applied = 0;
+
+    *last_generation = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (gens[i] < first_generation) continue;
+        char* path = wal_path(prefix, gens[i]);
+        if (!path) break;
+        long n = replay_file(path, apply, ctx);
+        free(path);
+        if (n < 0) {
+            applied = -1;
+            break;
+        }
+        applied += n;
+        *last_generation = gens[i];
+    }
+
+    free(gens);
+    return applied;
+}
+
+void wal_remove(const char* prefix, uint64_t through_generation) {
+    uint64_t* gens;
+    size_t count = list_generations(prefix, &gens);
+
+    for (size_t i = 0; i < count && gens[i] <= through_generation; i++) {
+        char* path = wal_path(prefix, gens[i]);
+        if (path && unlink(path) != 0 && errno != ENOENT) {
+            perror("Failed to remove WAL file");
+        }
+        free(path);
+    }
+    free(gens);
+}
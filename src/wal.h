@@ -0,0 +1,107 @@
+// Append-only write-ahead log with group commit
+
+#ifndef WAL_H
+#define WAL_H
+
+#include "kv_store.h"
+
+// Record types
+typedef enum {
+    WAL_PUT = 1,
+    WAL_DELETE = 2,
+    WAL_EXPIRE = 3,                     // Set (or with 0, clear) a key's expiry
+} wal_record_type_t;
+
+// Header flags
+#define WAL_HAS_EXPIRY 0x01             // An 8-byte expiry time follows the header
+
+// On-disk record header, followed by the expiry if flagged, then key_len
+// key bytes and value_len value bytes
+typedef struct {
+    uint32_t crc;                       // CRC32C of everything after this field
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint32_t key_len;
+    uint32_t value_len;
+} wal_record_header_t;
+
+// A record as laid out in the log, which replication ships as is
+typedef struct {
+    wal_record_type_t type;
+    const char* key;                    // Point into the encoded record
+    size_t key_len;
+    const char* value;
+    size_t value_len;
+    uint64_t expires_at;
+} wal_record_t;
+
+size_t wal_record_size(wal_record_type_t type, size_t key_len, size_t value_len,
+                       uint64_t expires_at);
+// Lay out a record of wal_record_size bytes at out
+void wal_record_encode(char* out, wal_record_type_t type, const char* key, size_t key_len,
+                       const char* value, size_t value_len, uint64_t expires_at);
+// Parse the record at the start of data. Returns its size, 0 if data ends
+// before it does, or -1 if it is corrupt.
+ssize_t wal_record_decode(const char* data, size_t len, wal_record_t* record);
+
+typedef struct wal wal_t;
+
+// A log is a series of files <prefix>.<generation>, e.g. store.dat.wal.000003.
+// Only the newest generation is appended to; older ones are replayed first.
+char* wal_path(const char* prefix, uint64_t generation);
+
+// Open (or create) a generation for appending and start the writer thread
+wal_t* wal_open(const char* prefix, uint64_t generation,
+                kv_fsync_policy_t policy, unsigned fsync_interval_ms);
+
+// Flush and fsync outstanding records, stop the writer thread and close
+void wal_close(wal_t* wal);
+
+// Queue a record. expires_at is the key's expiry in ms since the epoch, 0
+// for none. Returns its log sequence number, or 0 if the log has failed.
+// Records appear in the file in the order their LSNs were assigned.
+uint64_t wal_append(wal_t* wal, wal_record_type_t type,
+                    const char* key, size_t key_len,
+                    const char* value, size_t value_len, uint64_t expires_at);
+
+// Block until the record with this LSN is durable under the log's fsync
+// policy. Returns false if the log failed before it got there.
+bool wal_wait(wal_t* wal, uint64_t lsn);
+
+// Put off this thread's wal_wait calls, which only note their LSN until
+// wal_wait_deferred waits for the last, once the caller has let go of the
+// locks it held around the writes. False if the log failed.
+void wal_defer(void);
+bool wal_wait_deferred(void);
+
+// Write out everything queued so far and continue in the next generation.
+// Returns the generation that was closed, or 0 on failure. The closed file
+// is not fsynced; use wal_sync_generation outside any latency-critical path.
+uint64_t wal_rotate(wal_t* wal);
+uint64_t wal_generation(wal_t* wal);
+bool wal_sync_generation(const char* prefix, uint64_t generation);
+
+// Delete every generation up to and including through_generation
+void wal_remove(const char* prefix, uint64_t through_generation);
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t batches;                   // write() calls by the writer thread
+    uint64_t fsyncs;
+} wal_stats_t;
+
+void wal_get_stats(wal_t* wal, wal_stats_t* stats);
+
+// Apply every intact record of each generation >= first_generation, oldest
+// first. A torn or corrupt tail is cut off. Returns the number of records
+// applied (or -1 if a file could not be read) and the newest generation
+// replayed (0 if none).
+typedef void (*wal_apply_fn)(void* ctx, wal_record_type_t type,
+                             const char* key, size_t key_len,
+                             const char* value, size_t value_len, uint64_t expires_at);
+long wal_replay(const char* prefix, uint64_t first_generation,
+                wal_apply_fn apply, void* ctx, uint64_t* last_generation);
+
+#endif // WAL_H